@@ -9,7 +9,11 @@
 
 #include "munix.h"
 #include "mufs.h"
+#include "mucache.h"
+#include "mudcache.h"
+#include "muicache.h"
 #include "muerrno.h"
+#include "muusers.h"
 
 #define BUFFER_LENGTH 1024
 
@@ -19,6 +23,18 @@ main (int argc, char* argv[])
     char buffer[BUFFER_LENGTH];
     char userName[BUFFER_LENGTH];
     char groupName[BUFFER_LENGTH];
+    if (argc == 3)
+    {
+        if (loadUserTables (argv[1], argv[2]) < 0)
+        {
+            exit (EXIT_FAILURE);
+        }
+    }
+    else if (argc != 1)
+    {
+        fprintf (stderr, "Usage: %s [passwdFile groupFile]\n", argv[0]);
+        exit (EXIT_FAILURE);
+    }
     printf ("Disk name: ");
     fgets (buffer, BUFFER_LENGTH, stdin);
     buffer[strlen (buffer) - 1] = '\0';
@@ -89,6 +105,45 @@ main (int argc, char* argv[])
                     }
                 }
             }
+            else if (strcmp (command, "creat") == 0 || strcmp (command, "mucreat") == 0)
+            {
+                char* name = strtok (NULL, " ");
+                char* option = strtok (NULL, " ");
+                if (name == NULL)
+                {
+                    printf ("No file name provided.\n");
+                }
+                else
+                {
+                    // "creat NAME -z" makes a compressed file.
+                    int mode = MU_S_IRUSR | MU_S_IWUSR | MU_S_IRGRP;
+                    if (option != NULL && strcmp (option, "-z") == 0)
+                    {
+                        mode |= MU_S_COMPRESSED;
+                    }
+                    int fd = mucreat (name, mode);
+                    if (fd < 0)
+                    {
+                        printf ("Could not create file: %d\n", muerrno);
+                    }
+                    else
+                    {
+                        printf ("Created file has descriptor %d\n", fd);
+                    }
+                }
+            }
+            else if (strcmp (command, "unlink") == 0 || strcmp (command, "muunlink") == 0 || strcmp (command, "rm") == 0)
+            {
+                char* name = strtok (NULL, " ");
+                if (name == NULL)
+                {
+                    printf ("No file name provided.\n");
+                }
+                else if (muunlink (name) < 0)
+                {
+                    printf ("Could not remove file: %d\n", muerrno);
+                }
+            }
             else if (strcmp (command, "close") == 0 || strcmp (command, "muclose") == 0)
             {
                 char* token = strtok (NULL, " ");
@@ -171,6 +226,138 @@ main (int argc, char* argv[])
             {
                 muls ();
             }
+            else if (strcmp (command, "sync") == 0)
+            {
+                mufs_sync ();
+            }
+            else if (strcmp (command, "fsync") == 0 || strcmp (command, "mufsync") == 0)
+            {
+                char* token = strtok (NULL, " ");
+                if (token == NULL)
+                {
+                    printf ("No file descriptor provided.\n");
+                }
+                else if (mufsync (atoi (token)) < 0)
+                {
+                    printf ("Could not sync file: %d\n", muerrno);
+                }
+                else
+                {
+                    printf ("Synced file.\n");
+                }
+            }
+            else if (strcmp (command, "fallocate") == 0 || strcmp (command, "mufallocate") == 0)
+            {
+                char* file = strtok (NULL, " ");
+                char* length = strtok (NULL, " ");
+                if (file == NULL || length == NULL)
+                {
+                    printf ("No file descriptor or length provided.\n");
+                }
+                else if (mufallocate (atoi (file), strtoul (length, NULL, 10)) < 0)
+                {
+                    printf ("Could not allocate space for file: %d\n", muerrno);
+                }
+                else
+                {
+                    printf ("Allocated space for file.\n");
+                }
+            }
+            else if (strcmp (command, "seek") == 0 || strcmp (command, "museek") == 0)
+            {
+                char* file = strtok (NULL, " ");
+                char* offset = strtok (NULL, " ");
+                if (file == NULL || offset == NULL)
+                {
+                    printf ("No file descriptor or offset provided.\n");
+                }
+                else if (museek (atoi (file), strtoul (offset, NULL, 10)) < 0)
+                {
+                    printf ("Could not seek in file: %d\n", muerrno);
+                }
+                else
+                {
+                    printf ("Moved file pointer.\n");
+                }
+            }
+            else if (strcmp (command, "copy") == 0 || strcmp (command, "mucopy") == 0)
+            {
+                char* source = strtok (NULL, " ");
+                char* destination = strtok (NULL, " ");
+                char* number = strtok (NULL, " ");
+                if (source == NULL || destination == NULL || number == NULL)
+                {
+                    printf ("No file descriptors or number of bytes provided.\n");
+                }
+                else
+                {
+                    int bytes = mucopy (atoi (source), atoi (destination), atoi (number));
+                    if (bytes < 0)
+                    {
+                        printf ("Could not copy file: %d\n", muerrno);
+                    }
+                    else
+                    {
+                        printf ("Copied %d bytes.\n", bytes);
+                    }
+                }
+            }
+            else if (strcmp (command, "dedup") == 0 || strcmp (command, "mudedup") == 0)
+            {
+                char* token = strtok (NULL, " ");
+                if (token == NULL || (strcmp (token, "on") != 0 && strcmp (token, "off") != 0))
+                {
+                    printf ("Say on or off.\n");
+                }
+                else
+                {
+                    mudedup (strcmp (token, "on") == 0);
+                    printf ("Deduplication is %s.\n", token);
+                }
+            }
+            else if (strcmp (command, "fstats") == 0 || strcmp (command, "mufstats") == 0)
+            {
+                char* token = strtok (NULL, " ");
+                struct muFileStats fileStats;
+                if (token == NULL)
+                {
+                    printf ("No file descriptor provided.\n");
+                }
+                else if (mufstats (atoi (token), &fileStats) < 0)
+                {
+                    printf ("Could not get file statistics: %d\n", muerrno);
+                }
+                else
+                {
+                    printf ("%lu reads of %lu bytes, %lu writes of %lu bytes, %lu syscalls, %lu direct blocks, %lu prefetched blocks, %lu hole blocks, %lu units expanded, %lu units stored, %lu shared blocks, %lu unshared blocks, %lu copied blocks\n",
+                            (unsigned long)fileStats.readCalls, (unsigned long)fileStats.bytesRead,
+                            (unsigned long)fileStats.writeCalls, (unsigned long)fileStats.bytesWritten,
+                            (unsigned long)fileStats.syscalls, (unsigned long)fileStats.directBlocks,
+                            (unsigned long)fileStats.prefetchedBlocks, (unsigned long)fileStats.holeBlocks,
+                            (unsigned long)fileStats.unitsExpanded, (unsigned long)fileStats.unitsStored,
+                            (unsigned long)fileStats.sharedBlocks, (unsigned long)fileStats.unsharedBlocks,
+                            (unsigned long)fileStats.copiedBlocks);
+                }
+            }
+            else if (strcmp (command, "stats") == 0)
+            {
+                struct blockCacheStats stats;
+                getBlockCacheStats (&stats);
+                printf ("Block cache: %lu hits, %lu misses, %lu evictions, %lu write-backs, %lu flushed in %lu writes\n",
+                        (unsigned long)stats.hits, (unsigned long)stats.misses,
+                        (unsigned long)stats.evictions, (unsigned long)stats.writeBacks,
+                        (unsigned long)stats.flushedBlocks, (unsigned long)stats.flushWrites);
+                struct dcacheStats names;
+                getDcacheStats (&names);
+                printf ("Directory cache: %lu hits, %lu negative hits, %lu misses, %lu builds, %lu evictions\n",
+                        (unsigned long)names.hits, (unsigned long)names.negativeHits, (unsigned long)names.misses,
+                        (unsigned long)names.builds, (unsigned long)names.evictions);
+                struct icacheStats iNodes;
+                getIcacheStats (&iNodes);
+                printf ("Inode cache: %lu hits, %lu misses, %lu write-backs, %lu evictions\n",
+                        (unsigned long)iNodes.hits, (unsigned long)iNodes.misses,
+                        (unsigned long)iNodes.writeBacks, (unsigned long)iNodes.evictions);
+            }
             else {
                 printf ("Unknown command %s\n", command);
             }
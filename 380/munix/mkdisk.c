@@ -3,28 +3,96 @@
 // A program that generates an example MUFS disk file.
 // Part of CSCI380 munix lab.
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mufs.h"
+#include "mubitmap.h"
+#include "mucompress.h"
+#include "mudindex.h"
+#include "mufile.h"
+#include "mujournal.h"
 #include "muusers.h"
 
 #define DEFAULT_DISK_NAME "disk0.dat"
+// The name of every directory in the chain made by --depth.
+#define DEEP_DIRECTORY_NAME "deep"
 
+// Extra room left in an image sized for a host directory, so that it can still be used.
+#define SPARE_INODES 64
+#define SPARE_BLOCKS 1024
+
+// A file or directory found under the host directory given to -d.
+struct hostEntry
+{
+    // Where it is on the host, and its name in the image.
+    char* hostPath;
+    char name[MAX_NAME_LENGTH];
+    // The position of its directory in the host tree, or -1 for the top directory.
+    int32_t parent;
+    int isDirectory;
+    // Its permission bits, and for a file the number of bytes to copy.
+    uint32_t mode;
+    uint32_t size;
+    // For a directory, the number of entries it will hold (not counting . and ..).
+    uint32_t childCount;
+    // Where it ends up in the image.
+    int iNodeNumber;
+    uint32_t firstBlock;
+};
+
+// Everything found under the host directory, in breadth-first order, so that every
+//   directory comes before what it contains.
+struct hostTree
+{
+    struct hostEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    // The number of inodes the tree needs, and the bytes of file contents and
+    //   directory entries it holds.
+    uint32_t iNodesNeeded;
+    uint64_t bytesNeeded;
+};
+
+// The work shared by the threads that copy file contents into the image.
+struct copyJob
+{
+    struct entireFileSystem* fs;
+    struct hostTree* tree;
+    // The position in the tree of the next entry to be looked at.
+    uint32_t next;
+};
+
+// The disk image being built.  It is mapped straight from the output file, so that
+//   only the blocks that are actually touched take up memory even on very large images.
 struct entireFileSystem
 {
-    char superblock[BLOCK_SIZE];
-    char freeBlockMap[BLOCK_SIZE];
-    struct iNode iNodes[INODE_COUNT];
-    char dataBlocks[BLOCK_COUNT - FIRSTDATABLOCK_NUMBER][BLOCK_SIZE];
+    // The whole image, BLOCK_COUNT * BLOCK_SIZE bytes.
+    char* image;
+    // Pointers to the metadata regions within image.
+    struct superBlock* superblock;
+    char* freeBlockMap;
+    struct iNode* iNodes;
 };
 
+void
+parseSize (const char* option, const char* value, uint32_t* result);
+
 void
 format (struct entireFileSystem* fs);
 
+void
+createExampleFiles (struct entireFileSystem* fs);
+
 void
 createDirectory (struct entireFileSystem* fs, int parentINodeNum, char* name, int userId, int groupId, int mode);
 
@@ -43,53 +111,299 @@ findINode (struct entireFileSystem* fs, int currentINodeNumber, const char* name
 void
 createFile (struct entireFileSystem* fs, int parentINodeNum, char* name, int userId, int groupId, int mode, char* text, int size);
 
+char*
+blockData (struct entireFileSystem* fs, int blockNumber);
+
+int
+lookUpFileBlock (struct entireFileSystem* fs, int iNodeNumber, int blockIndex);
+
+void
+mapFileBlock (struct entireFileSystem* fs, int iNodeNumber, int blockIndex, int blockNumber);
+
+uint32_t
+countFileBlocks (struct entireFileSystem* fs, int iNodeNumber);
+
+void
+reserveDirectoryBlocks (struct entireFileSystem* fs, int iNodeNumber, uint32_t entryCount);
+
+void
+startIndexing (struct entireFileSystem* fs, int dirINode);
+
+void
+indexDirEntry (struct entireFileSystem* fs, int dirINode, uint32_t entryIndex, const struct dirEntry* entry);
+
+void
+scanHostTree (const char* hostDir, struct hostTree* tree);
+
+void
+addHostEntry (struct hostTree* tree, const char* hostPath, const char* name, int32_t parent, const struct stat* info);
+
+uint32_t
+journalSizeFor (uint32_t blockSize, uint32_t blockCount, uint32_t journalBlocks);
+
+void
+sizeForHostTree (const struct hostTree* tree, uint32_t blockSize, uint32_t journalBlocks, uint32_t depth,
+                 uint32_t* blockCount, uint32_t* iNodeCount);
+
+void
+buildFromHostTree (struct entireFileSystem* fs, struct hostTree* tree, int threadCount);
+
+void*
+copyHostFiles (void* argument);
+
+void
+punchZeroBlocks (struct entireFileSystem* fs, const struct hostTree* tree);
+
+uint32_t
+packUnitWithin (const char* data, uint32_t blockCount, char* stored, uint32_t* packedUnits);
+
+// Where the search for an available inode starts, since inodes are only ever taken.
+uint32_t iNodeHint = 0;
+
+// Tracks which blocks are in use while the filesystem is being built.
+struct blockBitmap allocator;
+
+// Whether to write a VERSION11 image with a packed free block bitmap.
+int useBitmap = 0;
+
+// Whether to write a VERSION20 image whose inodes hold extents (implies useBitmap).
+int useExtents = 0;
+
+// Whether to write a VERSION21 image that keeps small files in their inodes (implies useExtents).
+int useInline = 0;
+
+// Whether to write a VERSION22 image whose large directories have hash indexes (implies useInline).
+int useDirIndex = 0;
+
+// Whether to write a VERSION23 image whose regular files are compressed (implies useDirIndex).
+int useCompression = 0;
+
+// Whether to write a VERSION24 image with a block share table, so that mudedup can share
+//   the blocks that files have in common (implies useDirIndex).
+int useSharing = 0;
+
+// Whether to give the image a metadata journal sized to suit it (--journal), unless
+//   --journal-blocks gives its size.
+int useJournal = 0;
+
 int
 main (int argc, char* argv[])
 {
     char* diskName = DEFAULT_DISK_NAME;
-    if (argc == 2)
+    uint32_t blockSize = DEFAULT_BLOCK_SIZE;
+    uint32_t blockCount = DEFAULT_BLOCK_COUNT;
+    uint32_t iNodeCount = DEFAULT_INODE_COUNT;
+    uint32_t journalBlocks = 0;
+    uint32_t depth = 0;
+    const char* hostDir = NULL;
+    uint32_t threadCount = (uint32_t)sysconf (_SC_NPROCESSORS_ONLN);
+    int sizeGiven = 0;
+    for (int argIndex = 1; argIndex < argc; ++argIndex)
     {
-        diskName = argv[1];
+        if (strcmp (argv[argIndex], "--bitmap") == 0)
+        {
+            useBitmap = 1;
+        }
+        else if (strcmp (argv[argIndex], "--extents") == 0)
+        {
+            useBitmap = 1;
+            useExtents = 1;
+        }
+        else if (strcmp (argv[argIndex], "--inline") == 0)
+        {
+            useBitmap = 1;
+            useExtents = 1;
+            useInline = 1;
+        }
+        else if (strcmp (argv[argIndex], "--dir-index") == 0)
+        {
+            useBitmap = 1;
+            useExtents = 1;
+            useInline = 1;
+            useDirIndex = 1;
+        }
+        else if (strcmp (argv[argIndex], "--compress") == 0)
+        {
+            useBitmap = 1;
+            useExtents = 1;
+            useInline = 1;
+            useDirIndex = 1;
+            useCompression = 1;
+        }
+        else if (strcmp (argv[argIndex], "--dedup") == 0)
+        {
+            useBitmap = 1;
+            useExtents = 1;
+            useInline = 1;
+            useDirIndex = 1;
+            useSharing = 1;
+        }
+        else if (strcmp (argv[argIndex], "--block-size") == 0 && argIndex + 1 < argc)
+        {
+            parseSize (argv[argIndex], argv[argIndex + 1], &blockSize);
+            ++argIndex;
+        }
+        else if (strcmp (argv[argIndex], "--blocks") == 0 && argIndex + 1 < argc)
+        {
+            parseSize (argv[argIndex], argv[argIndex + 1], &blockCount);
+            sizeGiven = 1;
+            ++argIndex;
+        }
+        else if (strcmp (argv[argIndex], "--inodes") == 0 && argIndex + 1 < argc)
+        {
+            parseSize (argv[argIndex], argv[argIndex + 1], &iNodeCount);
+            sizeGiven = 1;
+            ++argIndex;
+        }
+        else if (strcmp (argv[argIndex], "--journal") == 0)
+        {
+            useJournal = 1;
+        }
+        else if (strcmp (argv[argIndex], "--journal-blocks") == 0 && argIndex + 1 < argc)
+        {
+            parseSize (argv[argIndex], argv[argIndex + 1], &journalBlocks);
+            ++argIndex;
+        }
+        else if (strcmp (argv[argIndex], "--depth") == 0 && argIndex + 1 < argc)
+        {
+            parseSize (argv[argIndex], argv[argIndex + 1], &depth);
+            ++argIndex;
+        }
+        else if (strcmp (argv[argIndex], "-d") == 0 && argIndex + 1 < argc)
+        {
+            hostDir = argv[argIndex + 1];
+            ++argIndex;
+        }
+        else if (strcmp (argv[argIndex], "--threads") == 0 && argIndex + 1 < argc)
+        {
+            parseSize (argv[argIndex], argv[argIndex + 1], &threadCount);
+            ++argIndex;
+        }
+        else
+        {
+            diskName = argv[argIndex];
+        }
+    }
+    // A host directory is copied in as it is, so the image is made as big as it needs to be
+    //   unless a size was given.
+    struct hostTree tree;
+    memset (&tree, 0, sizeof (tree));
+    if (hostDir != NULL)
+    {
+        scanHostTree (hostDir, &tree);
+        if (!sizeGiven)
+        {
+            sizeForHostTree (&tree, blockSize, journalBlocks, depth, &blockCount, &iNodeCount);
+        }
+    }
+    journalBlocks = journalSizeFor (blockSize, blockCount, journalBlocks);
+    if (setGeometry (blockSize, blockCount, iNodeCount, journalBlocks, useBitmap, useSharing) != 0)
+    {
+        fprintf (stderr, "Cannot make a filesystem of %u blocks of %u bytes with %u inodes and a journal of %u blocks\n",
+                 blockCount, blockSize, iNodeCount, journalBlocks);
+        exit (EXIT_FAILURE);
     }
 
+    // Size the image up front and map it; the pages that are never written stay holes.
+    int fd = open (diskName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    size_t imageLength = (size_t)BLOCK_COUNT * BLOCK_SIZE;
+    if (fd < 0 || ftruncate (fd, imageLength) != 0)
+    {
+        fprintf (stderr, "Could not create %s\n", diskName);
+        exit (EXIT_FAILURE);
+    }
     struct entireFileSystem fs;
+    fs.image = mmap (NULL, imageLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fs.image == MAP_FAILED)
+    {
+        fprintf (stderr, "Could not map %s into memory\n", diskName);
+        exit (EXIT_FAILURE);
+    }
     format (&fs);
 
-    createDirectory (&fs, 0, "java", lookUpUserNumber ("hogg"), lookUpGroupNumber ("162"), MU_S_DIREC | MU_S_IRWXU | MU_S_IRGRP | MU_S_IXGRP);
-    createFile (&fs, 1, "foo.txt", lookUpUserNumber ("hogg"), lookUpGroupNumber ("162"), MU_S_IRUSR | MU_S_IWUSR | MU_S_IRGRP, "abcde", 2074);
-    createFile (&fs, 1, "bar.java", lookUpUserNumber ("cain"), lookUpGroupNumber ("162"), S_IRUSR | S_IWUSR | S_IRGRP, "qwer", 513);
+    if (hostDir != NULL)
+    {
+        buildFromHostTree (&fs, &tree, threadCount);
+    }
+    else
+    {
+        createExampleFiles (&fs);
+    }
 
-    createDirectory (&fs, 0, "c++", lookUpUserNumber ("zoppetti"), lookUpGroupNumber ("362"), MU_S_DIREC | MU_S_IRUSR | MU_S_IWUSR | MU_S_IXUSR | MU_S_IRGRP | MU_S_IXGRP | MU_S_IXGRP);
-    createDirectory (&fs, 4, "labs", lookUpUserNumber ("zoppetti"), lookUpGroupNumber ("362"), MU_S_DIREC | MU_S_IRUSR | MU_S_IWUSR | MU_S_IXUSR | MU_S_IRGRP | MU_S_IXGRP | MU_S_IXGRP);
-    createDirectory (&fs, 4, "slides", lookUpUserNumber ("xie"), lookUpGroupNumber ("362"), MU_S_DIREC | MU_S_IRUSR | MU_S_IXUSR);
-    createFile (&fs, 4, "something.cpp", lookUpUserNumber ("hogg"), lookUpGroupNumber ("362"), MU_S_REGLR | MU_S_IRUSR | MU_S_IRGRP, "zxcvbn", 54);
-    createFile (&fs, 5, "handout.tar", lookUpUserNumber ("zoppetti"), lookUpGroupNumber ("362"), MU_S_REGLR | MU_S_IWUSR, "123", 54321);
-    createFile (&fs, 6, "heaps.pdf", lookUpUserNumber ("xie"), lookUpGroupNumber ("362"), MU_S_REGLR | MU_S_IRUSR | MU_S_IWUSR | MU_S_IRGRP | MU_S_IROTH, "987654321", 24);
+    // A chain of nested directories (deep/deep/...), for benchmarks of deep walks.
+    int parentINodeNum = 0;
+    for (uint32_t level = 0; level < depth; ++level)
+    {
+        if (findAvailableINode (&fs) < 0)
+        {
+            fprintf (stderr, "There are not enough inodes for a depth of %u\n", depth);
+            exit (EXIT_FAILURE);
+        }
+        createDirectory (&fs, parentINodeNum, DEEP_DIRECTORY_NAME, lookUpUserNumber ("root"), lookUpGroupNumber ("admin"),
+                         MU_S_DIREC | MU_S_IRWXU | MU_S_IRWXG | MU_S_IROTH | MU_S_IXOTH);
+        parentINodeNum = findINode (&fs, parentINodeNum, DEEP_DIRECTORY_NAME);
+    }
+
+    // Record which blocks ended up in use.
+    if (useBitmap)
+    {
+        storeBitmapToBits (&allocator, (uint8_t*)fs.freeBlockMap);
+    }
+    else
+    {
+        storeBitmapToBytes (&allocator, fs.freeBlockMap);
+    }
+    destroyBitmap (&allocator);
 
-    // Set up basic filesystem data.
-    int fd = open (diskName, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    write (fd, &fs, BLOCK_COUNT * BLOCK_SIZE);
+    // Write the filesystem out.
+    if (msync (fs.image, imageLength, MS_SYNC) != 0 || munmap (fs.image, imageLength) != 0)
+    {
+        fprintf (stderr, "Could not write %s\n", diskName);
+        exit (EXIT_FAILURE);
+    }
     close (fd);
 }
 
+void
+parseSize (const char* option, const char* value, uint32_t* result)
+{
+    char* end;
+    unsigned long parsed = strtoul (value, &end, 10);
+    if (*end != '\0' || parsed == 0 || parsed > UINT32_MAX)
+    {
+        fprintf (stderr, "Invalid value %s for %s\n", value, option);
+        exit (EXIT_FAILURE);
+    }
+    *result = parsed;
+}
+
 void
 format (struct entireFileSystem* fs)
 {
-    // Clear out everything.
-    assert (sizeof (struct entireFileSystem) == BLOCK_COUNT * BLOCK_SIZE);
-    memset (fs, 0, BLOCK_COUNT * BLOCK_SIZE);
+    // The image starts out as all zeros, so only the non-zero parts need filling in.
+    fs->superblock = (struct superBlock*)fs->image;
+    fs->freeBlockMap = fs->image + (size_t)FREEBLOCKMAP_NUMBER * BLOCK_SIZE;
+    fs->iNodes = (struct iNode*)(fs->image + (size_t)FIRSTINODEBLOCK_NUMBER * BLOCK_SIZE);
 
     // Set superblock contents.
-    strcpy (fs->superblock, VERSION10);
+    strcpy (fs->superblock->identifier, useSharing ? VERSION24 : useCompression ? VERSION23 : useDirIndex ? VERSION22 : useInline ? VERSION21 : useExtents ? VERSION20 : useBitmap ? VERSION11 : VERSION10);
+    fs->superblock->geometry = GEOMETRY;
+
+    // Start with an empty journal, if there is one.
+    if (JOURNAL_BLOCKS != 0)
+    {
+        formatJournalHeader ((struct journalHeader*)(fs->image + (size_t)FIRSTJOURNALBLOCK_NUMBER * BLOCK_SIZE));
+    }
 
     // Set all data blocks free, all others used.
-    for (int blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
+    initBitmap (&allocator, BLOCK_COUNT);
+    for (uint32_t blockNum = 0; blockNum < FIRSTDATABLOCK_NUMBER; ++blockNum)
     {
-        fs->freeBlockMap[blockNum] = (blockNum < FIRSTDATABLOCK_NUMBER ? BLOCK_USED : BLOCK_AVAILABLE);
+        markBitmapBlockUsed (&allocator, blockNum);
     }
 
     // Set every inode to available.
-    for (int iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
     {
         fs->iNodes[iNodeNumber].mode = MU_S_AVAIL;
     }
@@ -98,6 +412,22 @@ format (struct entireFileSystem* fs)
     createDirectory (fs, -1, "", lookUpUserNumber ("root"), lookUpGroupNumber ("admin"), MU_S_DIREC | MU_S_IRWXU | MU_S_IRWXG | MU_S_IROTH | MU_S_IXOTH);
 }
 
+// Fills the image with the files that the lab's examples expect.
+void
+createExampleFiles (struct entireFileSystem* fs)
+{
+    createDirectory (fs, 0, "java", lookUpUserNumber ("hogg"), lookUpGroupNumber ("162"), MU_S_DIREC | MU_S_IRWXU | MU_S_IRGRP | MU_S_IXGRP);
+    createFile (fs, 1, "foo.txt", lookUpUserNumber ("hogg"), lookUpGroupNumber ("162"), MU_S_IRUSR | MU_S_IWUSR | MU_S_IRGRP, "abcde", 2074);
+    createFile (fs, 1, "bar.java", lookUpUserNumber ("cain"), lookUpGroupNumber ("162"), S_IRUSR | S_IWUSR | S_IRGRP, "qwer", 513);
+
+    createDirectory (fs, 0, "c++", lookUpUserNumber ("zoppetti"), lookUpGroupNumber ("362"), MU_S_DIREC | MU_S_IRUSR | MU_S_IWUSR | MU_S_IXUSR | MU_S_IRGRP | MU_S_IXGRP | MU_S_IXGRP);
+    createDirectory (fs, 4, "labs", lookUpUserNumber ("zoppetti"), lookUpGroupNumber ("362"), MU_S_DIREC | MU_S_IRUSR | MU_S_IWUSR | MU_S_IXUSR | MU_S_IRGRP | MU_S_IXGRP | MU_S_IXGRP);
+    createDirectory (fs, 4, "slides", lookUpUserNumber ("xie"), lookUpGroupNumber ("362"), MU_S_DIREC | MU_S_IRUSR | MU_S_IXUSR);
+    createFile (fs, 4, "something.cpp", lookUpUserNumber ("hogg"), lookUpGroupNumber ("362"), MU_S_REGLR | MU_S_IRUSR | MU_S_IRGRP, "zxcvbn", 54);
+    createFile (fs, 5, "handout.tar", lookUpUserNumber ("zoppetti"), lookUpGroupNumber ("362"), MU_S_REGLR | MU_S_IWUSR, "123", 54321);
+    createFile (fs, 6, "heaps.pdf", lookUpUserNumber ("xie"), lookUpGroupNumber ("362"), MU_S_REGLR | MU_S_IRUSR | MU_S_IWUSR | MU_S_IRGRP | MU_S_IROTH, "987654321", 24);
+}
+
 void
 createDirectory (struct entireFileSystem* fs, int parentINodeNum, char* name, int userId, int groupId, int mode)
 {
@@ -121,10 +451,11 @@ createDirectory (struct entireFileSystem* fs, int parentINodeNum, char* name, in
 int
 findAvailableINode (struct entireFileSystem* fs)
 {
-    for (int iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    for (uint32_t iNodeNumber = iNodeHint; iNodeNumber < INODE_COUNT; ++iNodeNumber)
     {
         if (fs->iNodes[iNodeNumber].mode & MU_S_AVAIL)
         {
+            iNodeHint = iNodeNumber;
             return iNodeNumber;
         }
     }
@@ -134,29 +465,38 @@ findAvailableINode (struct entireFileSystem* fs)
 void
 createLink (struct entireFileSystem* fs, int dirINode, int contentINode, const char* name)
 {
-    assert (0 <= dirINode && dirINode < INODE_COUNT);
-    assert (0 <= contentINode && contentINode < INODE_COUNT);
+    assert (0 <= dirINode && (uint32_t)dirINode < INODE_COUNT);
+    assert (0 <= contentINode && (uint32_t)contentINode < INODE_COUNT);
     assert (fs->iNodes[dirINode].mode & MU_S_DIREC);
 
+    // A directory whose first block is full gets an index, as it would from munix.
+    if (useDirIndex && fs->iNodes[dirINode].size == BLOCK_SIZE && (fs->iNodes[dirINode].mode & MU_S_INDEXED) == 0)
+    {
+        startIndexing (fs, dirINode);
+    }
+
     int offsetInBlock = fs->iNodes[dirINode].size % BLOCK_SIZE;
     int blockIndex = fs->iNodes[dirINode].size / BLOCK_SIZE;
 
-    // Allocate additional data block for directory if needed.
-    if (offsetInBlock == 0)
+    // Allocate additional data block for directory if needed (and not reserved already).
+    if (offsetInBlock == 0 && (uint32_t)blockIndex >= countFileBlocks (fs, dirINode))
     {
         int nextBlockNumber = findAvailableDataBlock (fs);
-        fs->freeBlockMap[nextBlockNumber] = BLOCK_USED;    
-        fs->iNodes[dirINode].directBlocks[blockIndex] = nextBlockNumber;
+        mapFileBlock (fs, dirINode, blockIndex, nextBlockNumber);
     }
 
     // Write new directory entry.
-    int blockNumber = fs->iNodes[dirINode].directBlocks[blockIndex];
-    char* pointer = fs->dataBlocks[blockNumber - FIRSTDATABLOCK_NUMBER] + offsetInBlock;
+    int blockNumber = lookUpFileBlock (fs, dirINode, blockIndex);
+    char* pointer = blockData (fs, blockNumber) + offsetInBlock;
     struct dirEntry entry;
     entry.iNodeNumber = contentINode;
     memset (entry.name, 0, MAX_NAME_LENGTH);
     strncpy (entry.name, name, MAX_NAME_LENGTH - 1);
     memcpy (pointer, &entry, DIR_ENTRY_LENGTH);
+    if (fs->iNodes[dirINode].mode & MU_S_INDEXED)
+    {
+        indexDirEntry (fs, dirINode, fs->iNodes[dirINode].size / DIR_ENTRY_LENGTH, &entry);
+    }
 
     // Update inodes.
     fs->iNodes[dirINode].size += DIR_ENTRY_LENGTH;
@@ -166,20 +506,14 @@ createLink (struct entireFileSystem* fs, int dirINode, int contentINode, const c
 int
 findAvailableDataBlock (struct entireFileSystem* fs)
 {
-    for (int blockNumber = FIRSTDATABLOCK_NUMBER; blockNumber < BLOCK_COUNT; ++blockNumber)
-    {
-        if (fs->freeBlockMap[blockNumber] == BLOCK_AVAILABLE)
-        {
-            return blockNumber;
-        }
-    }
-    return -1;
+    // Marks the block used as well, so callers need not touch the map themselves.
+    return allocateBitmapBlock (&allocator);
 }
 
 int
 findINode (struct entireFileSystem* fs, int currentINodeNumber, const char* name)
 {
-    assert (0 <= currentINodeNumber && currentINodeNumber < INODE_COUNT);
+    assert (0 <= currentINodeNumber && (uint32_t)currentINodeNumber < INODE_COUNT);
     if (name == NULL || strcmp (name, "") == 0)
     {
         return currentINodeNumber;
@@ -201,12 +535,13 @@ findINode (struct entireFileSystem* fs, int currentINodeNumber, const char* name
         memset (buffer, 0, MAX_NAME_LENGTH);
         strncpy (buffer, start, finish - start);
     }
-    int totalBytesRead = 0;
-    for (int blockIndex = 0; blockIndex < (fs->iNodes[currentINodeNumber].size + BLOCK_SIZE - 1) / BLOCK_SIZE; ++blockIndex)
+    // The root block of an index holds no entries.
+    int totalBytesRead = firstEntryIndex (&fs->iNodes[currentINodeNumber]) * DIR_ENTRY_LENGTH;
+    for (int blockIndex = totalBytesRead / BLOCK_SIZE; blockIndex < (fs->iNodes[currentINodeNumber].size + BLOCK_SIZE - 1) / BLOCK_SIZE; ++blockIndex)
     {
         int thisBlockBytesRead = 0;
-        int blockNum = fs->iNodes[currentINodeNumber].directBlocks[blockIndex];
-        struct dirEntry* entry = (struct dirEntry*)fs->dataBlocks[blockNum];
+        int blockNum = lookUpFileBlock (fs, currentINodeNumber, blockIndex);
+        struct dirEntry* entry = (struct dirEntry*)blockData (fs, blockNum);
         while (totalBytesRead < fs->iNodes[currentINodeNumber].size && thisBlockBytesRead < BLOCK_SIZE)
         {
             if (strcmp (entry->name, buffer) == 0)
@@ -219,6 +554,7 @@ findINode (struct entireFileSystem* fs, int currentINodeNumber, const char* name
         }
     }
     assert (0);
+    return -1;
 }
 
 void
@@ -226,6 +562,12 @@ createFile (struct entireFileSystem* fs, int parentINodeNum, char* name, int use
 {
     assert ((mode & MU_S_DIREC) == 0);
     assert ((mode & MU_S_AVAIL) == 0);
+    if (!useExtents && size > MAX_FILE_SIZE)
+    {
+        // Anything longer would run past the end of directBlocks into the next inode.
+        fprintf (stderr, "Truncating %s from %d to %u bytes\n", name, size, MAX_FILE_SIZE);
+        size = MAX_FILE_SIZE;
+    }
     int chosenINodeNum = findAvailableINode (fs);
     fs->iNodes[chosenINodeNum].userOwner = userId;
     fs->iNodes[chosenINodeNum].groupOwner = groupId;
@@ -233,23 +575,712 @@ createFile (struct entireFileSystem* fs, int parentINodeNum, char* name, int use
     fs->iNodes[chosenINodeNum].size = size;
     fs->iNodes[chosenINodeNum].mode = mode | MU_S_REGLR;
 
-    int blockIndex = 0;
-    int blockNum = 0;
-    int blockPos = 0;
-    for (int printed = 0; printed < size; ++printed)
+    // The text is repeated to fill the file; an empty text leaves it all zeros.
+    size_t textLength = strlen (text);
+    if (useInline && size <= INLINE_DATA_SIZE)
+    {
+        fs->iNodes[chosenINodeNum].mode |= MU_S_INLINE;
+        for (int printed = 0; printed < size && textLength > 0; ++printed)
+        {
+            fs->iNodes[chosenINodeNum].inlineData[printed] = *(text + printed % textLength);
+        }
+        createLink (fs, parentINodeNum, chosenINodeNum, name);
+        return;
+    }
+    if (useCompression)
+    {
+        // Each unit takes only the blocks it packs into, followed by a hole.
+        fs->iNodes[chosenINodeNum].mode |= MU_S_COMPRESSED;
+        size_t unitBytes = (size_t)COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE;
+        char* unit = malloc (2 * unitBytes);
+        if (unit == NULL)
+        {
+            fprintf (stderr, "Could not allocate a unit for %s\n", name);
+            exit (EXIT_FAILURE);
+        }
+        char* stored = unit + unitBytes;
+        uint32_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t packedUnits = 0;
+        for (uint32_t first = 0; first < blocks; first += COMPRESSION_UNIT_BLOCKS)
+        {
+            uint32_t blockCount = (blocks - first < COMPRESSION_UNIT_BLOCKS ? blocks - first : COMPRESSION_UNIT_BLOCKS);
+            uint32_t unitStart = first * BLOCK_SIZE;
+            uint32_t span = ((uint32_t)size - unitStart < blockCount * BLOCK_SIZE ? (uint32_t)size - unitStart : blockCount * BLOCK_SIZE);
+            memset (unit, 0, unitBytes);
+            for (uint32_t unitPos = 0; unitPos < span && textLength > 0; ++unitPos)
+            {
+                unit[unitPos] = *(text + (unitStart + unitPos) % textLength);
+            }
+            uint32_t storedBlocks = packUnitWithin (unit, blockCount, stored, &packedUnits);
+            const char* source = (storedBlocks == blockCount ? unit : stored);
+            for (uint32_t blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+            {
+                int blockNum = 0;
+                if (blockIndex < storedBlocks)
+                {
+                    blockNum = findAvailableDataBlock (fs);
+                    memcpy (blockData (fs, blockNum), source + (size_t)blockIndex * BLOCK_SIZE, BLOCK_SIZE);
+                }
+                mapFileBlock (fs, chosenINodeNum, first + blockIndex, blockNum);
+            }
+        }
+        free (unit);
+        createLink (fs, parentINodeNum, chosenINodeNum, name);
+        return;
+    }
+
+    char* contents = malloc (BLOCK_SIZE);
+    if (contents == NULL)
+    {
+        fprintf (stderr, "Could not allocate a block for %s\n", name);
+        exit (EXIT_FAILURE);
+    }
+    for (int blockIndex = 0; blockIndex * BLOCK_SIZE < (uint32_t)size; ++blockIndex)
     {
-        if (printed % BLOCK_SIZE == 0)
+        int blockStart = blockIndex * BLOCK_SIZE;
+        int span = (size - blockStart < (int)BLOCK_SIZE ? size - blockStart : (int)BLOCK_SIZE);
+        memset (contents, 0, BLOCK_SIZE);
+        int empty = 1;
+        for (int blockPos = 0; blockPos < span && textLength > 0; ++blockPos)
         {
-            int nextBlockNumber = findAvailableDataBlock (fs);
-            fs->freeBlockMap[nextBlockNumber] = BLOCK_USED;    
-            fs->iNodes[chosenINodeNum].directBlocks[blockIndex] = nextBlockNumber;
-            blockNum = nextBlockNumber;
-            blockPos = 0;
-            ++blockIndex;
+            contents[blockPos] = *(text + (blockStart + blockPos) % textLength);
+            empty &= (contents[blockPos] == '\0');
         }
-        fs->dataBlocks[blockNum - FIRSTDATABLOCK_NUMBER][blockPos] = *(text + printed % strlen (text));
-        ++blockPos;
-    }   
+        // A block of nothing but zeros becomes a hole, which takes no space.
+        if (empty)
+        {
+            mapFileBlock (fs, chosenINodeNum, blockIndex, 0);
+            continue;
+        }
+        int blockNum = findAvailableDataBlock (fs);
+        mapFileBlock (fs, chosenINodeNum, blockIndex, blockNum);
+        memcpy (blockData (fs, blockNum), contents, span);
+    }
+    free (contents);
 
     createLink (fs, parentINodeNum, chosenINodeNum, name);
-}
\ No newline at end of file
+}
+
+char*
+blockData (struct entireFileSystem* fs, int blockNumber)
+{
+    assert (FIRSTDATABLOCK_NUMBER <= (uint32_t)blockNumber && (uint32_t)blockNumber < BLOCK_COUNT);
+    return fs->image + (size_t)blockNumber * BLOCK_SIZE;
+}
+
+int
+lookUpFileBlock (struct entireFileSystem* fs, int iNodeNumber, int blockIndex)
+{
+    struct iNode* node = &fs->iNodes[iNodeNumber];
+    if (!useExtents)
+    {
+        assert (blockIndex < NUM_DIRECT_BLOCKS);
+        return node->directBlocks[blockIndex];
+    }
+    struct extent* indirect = NULL;
+    if (node->indirectExtentBlock != 0)
+    {
+        indirect = (struct extent*)blockData (fs, node->indirectExtentBlock);
+    }
+    return findExtentBlock (node, indirect, blockIndex, NULL);
+}
+
+void
+mapFileBlock (struct entireFileSystem* fs, int iNodeNumber, int blockIndex, int blockNumber)
+{
+    struct iNode* node = &fs->iNodes[iNodeNumber];
+    if (!useExtents)
+    {
+        assert (blockIndex < NUM_DIRECT_BLOCKS);
+        node->directBlocks[blockIndex] = blockNumber;
+        return;
+    }
+    struct extent* indirect = NULL;
+    if (node->indirectExtentBlock != 0)
+    {
+        indirect = (struct extent*)blockData (fs, node->indirectExtentBlock);
+    }
+    int result = appendExtentBlock (node, indirect, blockNumber);
+    if (result == EXTENT_NEEDS_INDIRECT)
+    {
+        node->indirectExtentBlock = findAvailableDataBlock (fs);
+        indirect = (struct extent*)blockData (fs, node->indirectExtentBlock);
+        result = appendExtentBlock (node, indirect, blockNumber);
+    }
+    assert (result == 0);
+}
+
+// Returns the number of data blocks mapped by a file's inode so far.
+uint32_t
+countFileBlocks (struct entireFileSystem* fs, int iNodeNumber)
+{
+    struct iNode* node = &fs->iNodes[iNodeNumber];
+    uint32_t count = 0;
+    if (!useExtents)
+    {
+        // Block 0 is the superblock, so a zero marks the end of the map.
+        while (count < NUM_DIRECT_BLOCKS && node->directBlocks[count] != 0)
+        {
+            ++count;
+        }
+        return count;
+    }
+    const struct extent* indirect = NULL;
+    if (node->indirectExtentBlock != 0)
+    {
+        indirect = (const struct extent*)blockData (fs, node->indirectExtentBlock);
+    }
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        count += (position < NUM_INODE_EXTENTS ? node->extents[position].length
+                  : indirect[position - NUM_INODE_EXTENTS].length);
+    }
+    return count;
+}
+
+// Gives a directory all the blocks it will need for entryCount entries at once, as one
+//   run where possible, so that it does not end up scattered among the files it holds.
+void
+reserveDirectoryBlocks (struct entireFileSystem* fs, int iNodeNumber, uint32_t entryCount)
+{
+    uint32_t needed = ((uint64_t)entryCount * DIR_ENTRY_LENGTH + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // The root of its index will take the place of the first block of entries.
+    if (useDirIndex && entryCount > DIR_ENTRIES_PER_BLOCK)
+    {
+        ++needed;
+    }
+    uint32_t mapped = countFileBlocks (fs, iNodeNumber);
+    if (needed <= mapped)
+    {
+        return;
+    }
+    int firstBlock = allocateBitmapRun (&allocator, needed - mapped);
+    if (firstBlock < 0)
+    {
+        fprintf (stderr, "There is no room for a directory of %u entries\n", entryCount);
+        exit (EXIT_FAILURE);
+    }
+    for (uint32_t blockIndex = mapped; blockIndex < needed; ++blockIndex)
+    {
+        mapFileBlock (fs, iNodeNumber, blockIndex, firstBlock + blockIndex - mapped);
+    }
+}
+
+// Gives a directory whose first block is full a hash index: the entries move to block 1
+//   (which may have been reserved already), and block 0 becomes the root of the index.
+void
+startIndexing (struct entireFileSystem* fs, int dirINode)
+{
+    struct iNode* node = &fs->iNodes[dirINode];
+    if (countFileBlocks (fs, dirINode) < 2)
+    {
+        mapFileBlock (fs, dirINode, 1, findAvailableDataBlock (fs));
+    }
+    int leafBlock = findAvailableDataBlock (fs);
+    char* root = blockData (fs, lookUpFileBlock (fs, dirINode, 0));
+    const struct dirEntry* entries = (const struct dirEntry*)blockData (fs, lookUpFileBlock (fs, dirINode, 1));
+    memcpy ((char*)entries, root, BLOCK_SIZE);
+    startDirIndex ((struct dirIndexRoot*)root, (struct dirIndexLeaf*)blockData (fs, leafBlock), leafBlock);
+    node->mode |= MU_S_INDEXED;
+    node->size = 2 * BLOCK_SIZE;
+    for (uint32_t position = 0; position < DIR_ENTRIES_PER_BLOCK && (node->mode & MU_S_INDEXED); ++position)
+    {
+        if (entries[position].name[0] != '\0')
+        {
+            indexDirEntry (fs, dirINode, DIR_ENTRIES_PER_BLOCK + position, &entries[position]);
+        }
+    }
+}
+
+// Adds a record for a new entry to a directory's index, splitting a full leaf, giving a
+//   full root a level of nodes, and splitting a full node.  An index that cannot take any
+//   more is thrown away, leaving its root block as holes.
+void
+indexDirEntry (struct entireFileSystem* fs, int dirINode, uint32_t entryIndex, const struct dirEntry* entry)
+{
+    struct dirIndexRoot* root = (struct dirIndexRoot*)blockData (fs, lookUpFileBlock (fs, dirINode, 0));
+    uint32_t hash = hashEntryName (entry->name);
+    uint32_t rootRange = findIndexRange (root, hash);
+    struct dirIndexRoot* parent = root;
+    if (root->depth == 1)
+    {
+        parent = (struct dirIndexRoot*)blockData (fs, root->ranges[rootRange].block);
+    }
+    struct dirIndexLeaf* leaf = (struct dirIndexLeaf*)blockData (fs, parent->ranges[findIndexRange (parent, hash)].block);
+    if (addIndexRecord (leaf, entryIndex, entry) == 0)
+    {
+        return;
+    }
+    if (parent->rangeCount == DIR_INDEX_MAX_RANGES && root->depth == 0)
+    {
+        int nodeBlock = findAvailableDataBlock (fs);
+        if (nodeBlock >= 0)
+        {
+            parent = (struct dirIndexRoot*)blockData (fs, nodeBlock);
+            deepenDirIndex (root, parent, nodeBlock);
+            rootRange = 0;
+        }
+    }
+    if (parent->rangeCount == DIR_INDEX_MAX_RANGES && root->depth == 1)
+    {
+        int newNodeBlock = findAvailableDataBlock (fs);
+        if (newNodeBlock >= 0
+            && splitIndexNode (root, rootRange, parent, (struct dirIndexRoot*)blockData (fs, newNodeBlock), newNodeBlock) == 0)
+        {
+            parent = (struct dirIndexRoot*)blockData (fs, root->ranges[findIndexRange (root, hash)].block);
+        }
+        else if (newNodeBlock >= 0)
+        {
+            markBitmapBlockAvailable (&allocator, newNodeBlock);
+        }
+    }
+    int newLeafBlock = findAvailableDataBlock (fs);
+    if (newLeafBlock >= 0
+        && splitIndexLeaf (parent, findIndexRange (parent, hash), leaf,
+                           (struct dirIndexLeaf*)blockData (fs, newLeafBlock), newLeafBlock) == 0)
+    {
+        addIndexRecord ((struct dirIndexLeaf*)blockData (fs, parent->ranges[findIndexRange (parent, hash)].block),
+                        entryIndex, entry);
+        return;
+    }
+
+    if (newLeafBlock >= 0)
+    {
+        markBitmapBlockAvailable (&allocator, newLeafBlock);
+    }
+    for (rootRange = 0; rootRange < root->rangeCount; ++rootRange)
+    {
+        uint32_t block = root->ranges[rootRange].block;
+        const struct dirIndexRoot* node = (const struct dirIndexRoot*)blockData (fs, block);
+        for (uint32_t range = 0; root->depth == 1 && range < node->rangeCount; ++range)
+        {
+            memset (blockData (fs, node->ranges[range].block), 0, BLOCK_SIZE);
+            markBitmapBlockAvailable (&allocator, node->ranges[range].block);
+        }
+        memset (blockData (fs, block), 0, BLOCK_SIZE);
+        markBitmapBlockAvailable (&allocator, block);
+    }
+    memset (root, 0, BLOCK_SIZE);
+    fs->iNodes[dirINode].mode &= ~MU_S_INDEXED;
+}
+
+// Finds everything under a host directory, breadth first, and works out how many
+//   inodes and blocks it will take.
+// Entries that cannot be copied (links, devices, names that are too long, files that are
+//   too large) are skipped with a warning.
+void
+scanHostTree (const char* hostDir, struct hostTree* tree)
+{
+    struct stat info;
+    if (stat (hostDir, &info) != 0 || !S_ISDIR (info.st_mode))
+    {
+        fprintf (stderr, "%s is not a directory\n", hostDir);
+        exit (EXIT_FAILURE);
+    }
+    addHostEntry (tree, hostDir, "", -1, &info);
+    // The tree grows while it is walked, which makes the walk breadth first.
+    for (uint32_t position = 0; position < tree->count; ++position)
+    {
+        if (!tree->entries[position].isDirectory)
+        {
+            continue;
+        }
+        const char* dirPath = tree->entries[position].hostPath;
+        DIR* dir = opendir (dirPath);
+        if (dir == NULL)
+        {
+            fprintf (stderr, "Could not read directory %s\n", dirPath);
+            exit (EXIT_FAILURE);
+        }
+        struct dirent* child;
+        while ((child = readdir (dir)) != NULL)
+        {
+            if (strcmp (child->d_name, ".") == 0 || strcmp (child->d_name, "..") == 0)
+            {
+                continue;
+            }
+            char* childPath = malloc (strlen (dirPath) + strlen (child->d_name) + 2);
+            if (childPath == NULL)
+            {
+                fprintf (stderr, "Could not allocate memory for the host tree\n");
+                exit (EXIT_FAILURE);
+            }
+            sprintf (childPath, "%s/%s", dirPath, child->d_name);
+            if (strlen (child->d_name) >= MAX_NAME_LENGTH)
+            {
+                fprintf (stderr, "Skipping %s: its name is too long\n", childPath);
+            }
+            else if (lstat (childPath, &info) != 0 || !(S_ISDIR (info.st_mode) || S_ISREG (info.st_mode)))
+            {
+                fprintf (stderr, "Skipping %s: it is not a regular file or directory\n", childPath);
+            }
+            else if (S_ISREG (info.st_mode) && (uint64_t)info.st_size > MAX_EXTENT_FILE_SIZE)
+            {
+                fprintf (stderr, "Skipping %s: it is too large\n", childPath);
+            }
+            else
+            {
+                addHostEntry (tree, childPath, child->d_name, position, &info);
+                ++tree->entries[position].childCount;
+            }
+            free (childPath);
+        }
+        closedir (dir);
+    }
+
+    tree->iNodesNeeded = tree->count;
+    tree->bytesNeeded = 0;
+    for (uint32_t position = 0; position < tree->count; ++position)
+    {
+        const struct hostEntry* entry = &tree->entries[position];
+        uint64_t bytes = (entry->isDirectory ? (uint64_t)(entry->childCount + 2) * DIR_ENTRY_LENGTH : entry->size);
+        // An index takes a root block, leaves that are at worst half full, and once the
+        //   root fills, nodes that are at worst half full of ranges for the leaves.
+        if (useDirIndex && entry->isDirectory && entry->childCount + 2 > DIR_ENTRIES_PER_BLOCK)
+        {
+            uint64_t leafBytes = (uint64_t)(entry->childCount + 2) * DIR_INDEX_RECORD_LENGTH * 2;
+            bytes += leafBytes + leafBytes * 2 / DIR_INDEX_MAX_RANGES + 2 * BLOCK_SIZE;
+        }
+        tree->bytesNeeded += bytes;
+    }
+}
+
+// Adds one file or directory to the host tree.
+void
+addHostEntry (struct hostTree* tree, const char* hostPath, const char* name, int32_t parent, const struct stat* info)
+{
+    if (tree->count == tree->capacity)
+    {
+        tree->capacity = (tree->capacity == 0 ? 64 : tree->capacity * 2);
+        tree->entries = realloc (tree->entries, tree->capacity * sizeof (struct hostEntry));
+        if (tree->entries == NULL)
+        {
+            fprintf (stderr, "Could not allocate memory for the host tree\n");
+            exit (EXIT_FAILURE);
+        }
+    }
+    struct hostEntry* entry = &tree->entries[tree->count++];
+    memset (entry, 0, sizeof (struct hostEntry));
+    entry->hostPath = strdup (hostPath);
+    strcpy (entry->name, name);
+    entry->parent = parent;
+    entry->isDirectory = S_ISDIR (info->st_mode);
+    // MUFS permission bits have the same values as the host's.
+    entry->mode = info->st_mode & (MU_S_IRWXU | MU_S_IRWXG | MU_S_IRWXO);
+    entry->size = (entry->isDirectory ? 0 : (uint32_t)info->st_size);
+    entry->iNodeNumber = -1;
+}
+
+// Picks the size of an image's journal.
+// Params:
+//   blockSize - The size of each block.
+//   blockCount - The number of blocks in the image.
+//   journalBlocks - The size given with --journal-blocks, or 0 if none was.
+// Returns:
+//   journalBlocks if it is not 0, or else for --journal DEFAULT_JOURNAL_BLOCKS or the
+//   smallest journal that the image's free block map and share table allow, whichever is
+//   larger, or else 0 for no journal.
+uint32_t
+journalSizeFor (uint32_t blockSize, uint32_t blockCount, uint32_t journalBlocks)
+{
+    if (journalBlocks != 0 || !useJournal)
+    {
+        return journalBlocks;
+    }
+    uint32_t minimum = minimumJournalBlocks (blockSize, blockCount, useBitmap, useSharing);
+    return (minimum > DEFAULT_JOURNAL_BLOCKS ? minimum : DEFAULT_JOURNAL_BLOCKS);
+}
+
+// Picks a block count and inode count big enough for a host tree, leaving some to spare.
+void
+sizeForHostTree (const struct hostTree* tree, uint32_t blockSize, uint32_t journalBlocks, uint32_t depth,
+                 uint32_t* blockCount, uint32_t* iNodeCount)
+{
+    uint64_t inodes = (uint64_t)tree->iNodesNeeded + depth + SPARE_INODES;
+    // Each entry rounds up to whole blocks, which adds at most one block per entry.
+    uint64_t dataBlocks = tree->bytesNeeded / blockSize + tree->count + depth + SPARE_BLOCKS;
+    if (inodes < *iNodeCount)
+    {
+        inodes = *iNodeCount;
+    }
+    // The metadata grows with the block count, so grow the image until the data fits.
+    uint64_t blocks = dataBlocks;
+    while (1)
+    {
+        if (blocks > MAX_BLOCK_COUNT || inodes > UINT32_MAX
+            || setGeometry (blockSize, blocks, inodes, journalSizeFor (blockSize, blocks, journalBlocks), useBitmap,
+                            useSharing) != 0)
+        {
+            fprintf (stderr, "The host directory is too large for a filesystem\n");
+            exit (EXIT_FAILURE);
+        }
+        if (BLOCK_COUNT - FIRSTDATABLOCK_NUMBER >= dataBlocks)
+        {
+            break;
+        }
+        blocks += dataBlocks - (BLOCK_COUNT - FIRSTDATABLOCK_NUMBER);
+    }
+    *blockCount = blocks;
+    *iNodeCount = inodes;
+}
+
+// Creates every directory and file of a host tree in the image, with each file in one run
+//   of blocks, and then copies the contents of the files in with threadCount threads.
+void
+buildFromHostTree (struct entireFileSystem* fs, struct hostTree* tree, int threadCount)
+{
+    int userId = lookUpUserNumber ("root");
+    int groupId = lookUpGroupNumber ("admin");
+    for (uint32_t position = 0; position < tree->count; ++position)
+    {
+        struct hostEntry* entry = &tree->entries[position];
+        if (entry->isDirectory && !useExtents
+            && (uint64_t)(entry->childCount + 2) * DIR_ENTRY_LENGTH > MAX_FILE_SIZE)
+        {
+            fprintf (stderr, "%s has too many entries; try --extents\n", entry->hostPath);
+            exit (EXIT_FAILURE);
+        }
+        if (position == 0)
+        {
+            // The top directory becomes the root, which format has made already.
+            entry->iNodeNumber = 0;
+            reserveDirectoryBlocks (fs, 0, entry->childCount + 2);
+            continue;
+        }
+        int parentINodeNum = tree->entries[entry->parent].iNodeNumber;
+        int iNodeNumber = findAvailableINode (fs);
+        if (iNodeNumber < 0)
+        {
+            fprintf (stderr, "There are not enough inodes for %s\n", entry->hostPath);
+            exit (EXIT_FAILURE);
+        }
+        entry->iNodeNumber = iNodeNumber;
+        if (entry->isDirectory)
+        {
+            createDirectory (fs, parentINodeNum, entry->name, userId, groupId, MU_S_DIREC | entry->mode);
+            reserveDirectoryBlocks (fs, iNodeNumber, entry->childCount + 2);
+            continue;
+        }
+
+        if (!useExtents && entry->size > MAX_FILE_SIZE)
+        {
+            fprintf (stderr, "Truncating %s from %u to %u bytes\n", entry->hostPath, entry->size, MAX_FILE_SIZE);
+            entry->size = MAX_FILE_SIZE;
+        }
+        struct iNode* node = &fs->iNodes[iNodeNumber];
+        node->userOwner = userId;
+        node->groupOwner = groupId;
+        node->linkCount = 0;
+        node->size = entry->size;
+        node->mode = MU_S_REGLR | entry->mode;
+        uint32_t blocks = (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (useInline && entry->size <= INLINE_DATA_SIZE)
+        {
+            node->mode |= MU_S_INLINE;
+        }
+        else if (blocks > 0)
+        {
+            int firstBlock = allocateBitmapRun (&allocator, blocks);
+            if (firstBlock < 0)
+            {
+                fprintf (stderr, "There is no room for %s\n", entry->hostPath);
+                exit (EXIT_FAILURE);
+            }
+            entry->firstBlock = firstBlock;
+            if (useCompression)
+            {
+                node->mode |= MU_S_COMPRESSED;
+            }
+            for (uint32_t blockIndex = 0; blockIndex < blocks; ++blockIndex)
+            {
+                mapFileBlock (fs, iNodeNumber, blockIndex, firstBlock + blockIndex);
+            }
+        }
+        createLink (fs, parentINodeNum, iNodeNumber, entry->name);
+    }
+
+    struct copyJob job = { fs, tree, 0 };
+    if (threadCount < 1)
+    {
+        threadCount = 1;
+    }
+    pthread_t* threads = malloc (threadCount * sizeof (pthread_t));
+    if (threads == NULL)
+    {
+        fprintf (stderr, "Could not allocate %d threads\n", threadCount);
+        exit (EXIT_FAILURE);
+    }
+    for (int index = 0; index < threadCount; ++index)
+    {
+        if (pthread_create (&threads[index], NULL, copyHostFiles, &job) != 0)
+        {
+            fprintf (stderr, "Could not start thread %d\n", index);
+            exit (EXIT_FAILURE);
+        }
+    }
+    for (int index = 0; index < threadCount; ++index)
+    {
+        pthread_join (threads[index], NULL);
+    }
+    free (threads);
+    punchZeroBlocks (fs, tree);
+
+    for (uint32_t position = 0; position < tree->count; ++position)
+    {
+        free (tree->entries[position].hostPath);
+    }
+    free (tree->entries);
+    printf ("Copied %u entries from the host directory into %u blocks of %u bytes\n", tree->count, BLOCK_COUNT, BLOCK_SIZE);
+}
+
+// The body of a copying thread: takes files one at a time and reads each one straight into
+//   its run of blocks in the mapped image, in a single pass.
+// The runs were handed out in tree order, so the image is filled (and later written
+//   out by msync) mostly from front to back.
+void*
+copyHostFiles (void* argument)
+{
+    struct copyJob* job = argument;
+    while (1)
+    {
+        uint32_t position = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+        if (position >= job->tree->count)
+        {
+            return NULL;
+        }
+        struct hostEntry* entry = &job->tree->entries[position];
+        if (entry->isDirectory || entry->size == 0)
+        {
+            continue;
+        }
+        int fd = open (entry->hostPath, O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf (stderr, "Could not open %s; leaving it zero-filled\n", entry->hostPath);
+            continue;
+        }
+        struct iNode* node = &job->fs->iNodes[entry->iNodeNumber];
+        char* destination = ((node->mode & MU_S_INLINE) ? node->inlineData : blockData (job->fs, entry->firstBlock));
+        uint32_t copied = 0;
+        while (copied < entry->size)
+        {
+            ssize_t count = read (fd, destination + copied, entry->size - copied);
+            if (count <= 0)
+            {
+                fprintf (stderr, "%s shrank while being copied; the rest is zero-filled\n", entry->hostPath);
+                break;
+            }
+            copied += count;
+        }
+        close (fd);
+    }
+}
+
+// Turns the blocks of copied files that came out all zeros into holes, giving the blocks
+//   back so that a mostly-empty file takes only the space its data needs.
+// Each file was given a single run of blocks, so a file with any such block simply has
+//   its block map rebuilt.  A compressed file instead has each unit packed into the start
+//   of its own blocks, and gives back the rest of them.
+void
+punchZeroBlocks (struct entireFileSystem* fs, const struct hostTree* tree)
+{
+    char* stored = malloc ((size_t)COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE);
+    if (stored == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for a unit of %u blocks\n", COMPRESSION_UNIT_BLOCKS);
+        exit (EXIT_FAILURE);
+    }
+    for (uint32_t position = 0; position < tree->count; ++position)
+    {
+        const struct hostEntry* entry = &tree->entries[position];
+        struct iNode* node = &fs->iNodes[entry->iNodeNumber];
+        if (entry->isDirectory || entry->size == 0 || (node->mode & MU_S_INLINE))
+        {
+            continue;
+        }
+        uint32_t blocks = (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (node->mode & MU_S_COMPRESSED)
+        {
+            memset (node->directBlocks, 0, INLINE_DATA_SIZE);
+            uint32_t packedUnits = 0;
+            for (uint32_t first = 0; first < blocks; first += COMPRESSION_UNIT_BLOCKS)
+            {
+                uint32_t blockCount = (blocks - first < COMPRESSION_UNIT_BLOCKS ? blocks - first : COMPRESSION_UNIT_BLOCKS);
+                char* data = blockData (fs, entry->firstBlock + first);
+                uint32_t storedBlocks = packUnitWithin (data, blockCount, stored, &packedUnits);
+                if (storedBlocks < blockCount)
+                {
+                    memcpy (data, stored, (size_t)storedBlocks * BLOCK_SIZE);
+                }
+                for (uint32_t blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+                {
+                    uint32_t blockNum = entry->firstBlock + first + blockIndex;
+                    if (blockIndex >= storedBlocks)
+                    {
+                        markBitmapBlockAvailable (&allocator, blockNum);
+                        blockNum = 0;
+                    }
+                    mapFileBlock (fs, entry->iNodeNumber, first + blockIndex, blockNum);
+                }
+            }
+            continue;
+        }
+        char* isZero = calloc (blocks, 1);
+        if (isZero == NULL)
+        {
+            fprintf (stderr, "Could not allocate memory for %u blocks\n", blocks);
+            exit (EXIT_FAILURE);
+        }
+        uint32_t zeroBlocks = 0;
+        for (uint32_t blockIndex = 0; blockIndex < blocks; ++blockIndex)
+        {
+            const char* contents = blockData (fs, entry->firstBlock + blockIndex);
+            uint32_t blockPos = 0;
+            while (blockPos < BLOCK_SIZE && contents[blockPos] == '\0')
+            {
+                ++blockPos;
+            }
+            isZero[blockIndex] = (blockPos == BLOCK_SIZE);
+            zeroBlocks += isZero[blockIndex];
+        }
+        if (zeroBlocks > 0)
+        {
+            memset (node->directBlocks, 0, INLINE_DATA_SIZE);
+            for (uint32_t blockIndex = 0; blockIndex < blocks; ++blockIndex)
+            {
+                uint32_t blockNum = entry->firstBlock + blockIndex;
+                if (isZero[blockIndex])
+                {
+                    markBitmapBlockAvailable (&allocator, blockNum);
+                    blockNum = 0;
+                }
+                mapFileBlock (fs, entry->iNodeNumber, blockIndex, blockNum);
+            }
+        }
+        free (isZero);
+    }
+    free (stored);
+}
+
+// Decides how a unit of a compressed file is stored, as packUnit does, except that once a
+//   file has packed so many units that another might take it past MAX_EXTENTS, the rest
+//   are stored as they are.  A packed unit (its data, then a hole) and the run of units
+//   stored as they are before it cost at most three extents.
+// Params:
+//   data - The unit's blocks.
+//   blockCount - The number of blocks in the unit.
+//   stored - Receives the packed form, as for packUnit.
+//   packedUnits - The number of units of the file packed so far, which is kept up to date.
+// Returns:
+//   The number of data blocks the unit needs, as for packUnit.
+uint32_t
+packUnitWithin (const char* data, uint32_t blockCount, char* stored, uint32_t* packedUnits)
+{
+    if (3 * (*packedUnits + 1) + 1 > MAX_EXTENTS)
+    {
+        return blockCount;
+    }
+    uint32_t storedBlocks = packUnit (data, blockCount, stored);
+    *packedUnits += (storedBlocks < blockCount);
+    return storedBlocks;
+}
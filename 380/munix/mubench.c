@@ -0,0 +1,870 @@
+// File: mubench.c
+// Author: Matt Shenk
+// A benchmark that runs parameterized workloads against copies of a freshly made
+//   disk image and reports throughput, latency percentiles and system calls per
+//   operation, optionally appending the results to a CSV file.
+// Part of munix lab in CSCI380.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "munix.h"
+#include "mufs.h"
+#include "mufile.h"
+#include "mucache.h"
+
+#define DEFAULT_FILES 100
+#define DEFAULT_FILE_SIZE (64 * 1024)
+#define DEFAULT_IO_SIZE 4096
+#define DEFAULT_OPERATIONS 1000
+#define NAME_LENGTH 64
+#define COPY_BUFFER_BYTES (1024 * 1024)
+// The directory chain made by mkdisk --depth.
+#define DEEP_DIRECTORY_NAME "deep"
+#define SEQUENTIAL_FILE_NAME "sequential.dat"
+#define COPY_FILE_NAME "copy.dat"
+#define RANDOM_FILE_NAME "random.dat"
+// How many files the interleave workload grows at once, which must leave room in the
+//   open file table.
+#define INTERLEAVED_FILES 8
+#define CSV_HEADER "workload,backend,files,file_size,io_size,operations,seconds,ops_per_sec,bytes_per_sec," \
+                   "p50_us,p90_us,p99_us,max_us,syscalls_per_op\n"
+
+// The parameters shared by every workload.
+struct benchConfig
+{
+    // The pristine image, and the copy of it that each workload runs against.
+    const char* imageName;
+    char workingName[NAME_LENGTH + 16];
+    int backend;
+    const char* backendName;
+    // How many files the file-based workloads use, and how big they are.
+    uint32_t files;
+    uint32_t fileSize;
+    // The size of each muread / muwrite.
+    uint32_t ioSize;
+    // How many operations the random, walk and listing workloads perform.
+    uint32_t operations;
+    unsigned int seed;
+    // When the block cache's flusher thread writes dirty blocks back (0 bytes for never).
+    uint32_t flushBytes;
+    uint32_t flushAgeMs;
+    // The blocks a growing file sets aside (see mureserve), or -1 for munix's default.
+    int64_t reserveBlocks;
+};
+
+// The measurements taken during one workload.
+struct benchResult
+{
+    uint64_t operations;
+    uint64_t bytes;
+    uint64_t syscalls;
+    double seconds;
+    // The latency of each operation, in seconds.
+    double* latencies;
+    uint64_t capacity;
+};
+
+// One workload: an untimed preparation step and a timed run.
+struct workload
+{
+    const char* name;
+    void (*prepare) (const struct benchConfig* config);
+    void (*run) (const struct benchConfig* config, struct benchResult* result);
+};
+
+void
+prepareNothing (const struct benchConfig* config);
+
+void
+prepareEmptyFiles (const struct benchConfig* config);
+
+void
+prepareRandomFile (const struct benchConfig* config);
+
+void
+prepareSequentialFile (const struct benchConfig* config);
+
+void
+runCreate (const struct benchConfig* config, struct benchResult* result);
+
+void
+runDelete (const struct benchConfig* config, struct benchResult* result);
+
+void
+runSequentialWrite (const struct benchConfig* config, struct benchResult* result);
+
+void
+runSequentialRead (const struct benchConfig* config, struct benchResult* result);
+
+void
+runCopy (const struct benchConfig* config, struct benchResult* result);
+
+void
+runRandomRead (const struct benchConfig* config, struct benchResult* result);
+
+void
+runRandomWrite (const struct benchConfig* config, struct benchResult* result);
+
+void
+runInterleavedWrite (const struct benchConfig* config, struct benchResult* result);
+
+void
+runDirectoryWalk (const struct benchConfig* config, struct benchResult* result);
+
+void
+runPathWalk (const struct benchConfig* config, struct benchResult* result);
+
+void
+runListing (const struct benchConfig* config, struct benchResult* result);
+
+const struct workload WORKLOADS[] =
+{
+    { "create", prepareNothing, runCreate },
+    { "delete", prepareEmptyFiles, runDelete },
+    { "seqwrite", prepareNothing, runSequentialWrite },
+    { "seqread", prepareSequentialFile, runSequentialRead },
+    { "copy", prepareSequentialFile, runCopy },
+    { "randread", prepareRandomFile, runRandomRead },
+    { "randwrite", prepareRandomFile, runRandomWrite },
+    { "interleave", prepareNothing, runInterleavedWrite },
+    { "cdwalk", prepareNothing, runDirectoryWalk },
+    { "pathwalk", prepareNothing, runPathWalk },
+    { "ls", prepareEmptyFiles, runListing },
+};
+#define WORKLOAD_COUNT (sizeof (WORKLOADS) / sizeof (WORKLOADS[0]))
+
+void
+runWorkload (struct benchConfig* config, const struct workload* workload, FILE* csv);
+
+void
+copyImage (const char* from, const char* to);
+
+uint32_t
+createFilledFile (const char* name, uint32_t size, uint32_t ioSize);
+
+uint32_t
+randomFileSize (const struct benchConfig* config);
+
+void
+fileName (uint32_t index, char* name);
+
+double
+startOperation ();
+
+void
+finishOperation (struct benchResult* result, double start, uint64_t bytes);
+
+int
+compareLatencies (const void* left, const void* right);
+
+double
+percentile (const struct benchResult* result, double fraction);
+
+void
+fail (const char* what);
+
+double
+now ();
+
+void
+usage (const char* program);
+
+int
+main (int argc, char* argv[])
+{
+    struct benchConfig config;
+    memset (&config, 0, sizeof (config));
+    config.backend = MUFS_BACKEND_FD;
+    config.backendName = "fd";
+    config.files = DEFAULT_FILES;
+    config.fileSize = DEFAULT_FILE_SIZE;
+    config.ioSize = DEFAULT_IO_SIZE;
+    config.operations = DEFAULT_OPERATIONS;
+    config.seed = 380;
+    config.flushBytes = 0;
+    config.flushAgeMs = 0;
+    config.reserveBlocks = -1;
+    const char* only = NULL;
+    const char* csvName = NULL;
+    for (int argIndex = 1; argIndex < argc; ++argIndex)
+    {
+        const char* option = argv[argIndex];
+        const char* value = (argIndex + 1 < argc ? argv[argIndex + 1] : NULL);
+        if (strcmp (option, "--workload") == 0 && value != NULL)
+        {
+            only = value;
+        }
+        else if (strcmp (option, "--files") == 0 && value != NULL)
+        {
+            config.files = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--file-size") == 0 && value != NULL)
+        {
+            config.fileSize = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--io-size") == 0 && value != NULL)
+        {
+            config.ioSize = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--ops") == 0 && value != NULL)
+        {
+            config.operations = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--seed") == 0 && value != NULL)
+        {
+            config.seed = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--flush-bytes") == 0 && value != NULL)
+        {
+            config.flushBytes = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--flush-age") == 0 && value != NULL)
+        {
+            config.flushAgeMs = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--reserve") == 0 && value != NULL)
+        {
+            config.reserveBlocks = strtoul (value, NULL, 10);
+        }
+        else if (strcmp (option, "--csv") == 0 && value != NULL)
+        {
+            csvName = value;
+        }
+        else if (strcmp (option, "--backend") == 0 && value != NULL)
+        {
+            config.backendName = value;
+            if (strcmp (value, "fd") == 0)
+            {
+                config.backend = MUFS_BACKEND_FD;
+            }
+            else if (strcmp (value, "mmap") == 0)
+            {
+                config.backend = MUFS_BACKEND_MMAP;
+            }
+            else if (strcmp (value, "uring") == 0)
+            {
+                config.backend = MUFS_BACKEND_URING;
+            }
+            else
+            {
+                usage (argv[0]);
+            }
+        }
+        else if (option[0] != '-' && config.imageName == NULL)
+        {
+            config.imageName = option;
+            continue;
+        }
+        else
+        {
+            usage (argv[0]);
+        }
+        ++argIndex;
+    }
+    if (config.imageName == NULL || strlen (config.imageName) > NAME_LENGTH || config.files == 0
+        || config.ioSize == 0 || config.operations == 0)
+    {
+        usage (argv[0]);
+    }
+    snprintf (config.workingName, sizeof (config.workingName), "%s.bench", config.imageName);
+
+    FILE* csv = NULL;
+    if (csvName != NULL)
+    {
+        csv = fopen (csvName, "a");
+        if (csv == NULL)
+        {
+            fprintf (stderr, "Could not open %s\n", csvName);
+            exit (EXIT_FAILURE);
+        }
+        if (ftell (csv) == 0)
+        {
+            fputs (CSV_HEADER, csv);
+        }
+    }
+
+    printf ("%-10s %8s %10s %12s %10s %10s %10s %10s %10s\n", "workload", "ops", "seconds", "ops/sec",
+            "MB/sec", "p50 us", "p99 us", "max us", "sys/op");
+    int ran = 0;
+    for (size_t index = 0; index < WORKLOAD_COUNT; ++index)
+    {
+        if (only == NULL || strcmp (only, WORKLOADS[index].name) == 0)
+        {
+            runWorkload (&config, &WORKLOADS[index], csv);
+            ran = 1;
+        }
+    }
+    if (!ran)
+    {
+        fprintf (stderr, "There is no workload named %s\n", only);
+        exit (EXIT_FAILURE);
+    }
+    if (csv != NULL)
+    {
+        fclose (csv);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Runs one workload against a fresh copy of the image and reports its results.
+void
+runWorkload (struct benchConfig* config, const struct workload* workload, FILE* csv)
+{
+    copyImage (config->imageName, config->workingName);
+    selectBackend (config->backend);
+    configureFlusher (config->flushBytes, config->flushAgeMs);
+    if (config->reserveBlocks >= 0)
+    {
+        mureserve (config->reserveBlocks);
+    }
+    setup (config->workingName);
+    if (muinit ("root", "admin") < 0)
+    {
+        fail ("log in as root");
+    }
+    srand (config->seed);
+    workload->prepare (config);
+    mufs_sync ();
+
+    struct benchResult result;
+    memset (&result, 0, sizeof (result));
+    uint64_t syscallsBefore = getSyscallCount ();
+    double start = now ();
+    workload->run (config, &result);
+    // Making the work durable is part of its cost, though not of any one operation.
+    mufs_sync ();
+    result.seconds = now () - start;
+    result.syscalls = getSyscallCount () - syscallsBefore;
+    teardown ();
+    unlink (config->workingName);
+
+    qsort (result.latencies, result.operations, sizeof (double), compareLatencies);
+    double opsPerSecond = result.operations / result.seconds;
+    double bytesPerSecond = result.bytes / result.seconds;
+    double syscallsPerOp = (result.operations > 0 ? (double)result.syscalls / result.operations : 0);
+    printf ("%-10s %8lu %10.4f %12.0f %10.2f %10.1f %10.1f %10.1f %10.2f\n", workload->name,
+            (unsigned long)result.operations, result.seconds, opsPerSecond, bytesPerSecond / (1024 * 1024),
+            percentile (&result, 0.5) * 1e6, percentile (&result, 0.99) * 1e6, percentile (&result, 1) * 1e6,
+            syscallsPerOp);
+    if (csv != NULL)
+    {
+        fprintf (csv, "%s,%s,%u,%u,%u,%lu,%.6f,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f,%.3f\n", workload->name,
+                 config->backendName, config->files, config->fileSize, config->ioSize,
+                 (unsigned long)result.operations, result.seconds, opsPerSecond, bytesPerSecond,
+                 percentile (&result, 0.5) * 1e6, percentile (&result, 0.9) * 1e6,
+                 percentile (&result, 0.99) * 1e6, percentile (&result, 1) * 1e6, syscallsPerOp);
+    }
+    free (result.latencies);
+}
+
+//// Preparation steps ///////////////////////////////////////////
+
+void
+prepareNothing (const struct benchConfig* config)
+{
+}
+
+// Creates config->files empty files.
+void
+prepareEmptyFiles (const struct benchConfig* config)
+{
+    char name[NAME_LENGTH];
+    for (uint32_t index = 0; index < config->files; ++index)
+    {
+        fileName (index, name);
+        createFilledFile (name, 0, config->ioSize);
+    }
+}
+
+// Creates the file that the random workloads read and write (see randomFileSize).
+void
+prepareRandomFile (const struct benchConfig* config)
+{
+    if (createFilledFile (RANDOM_FILE_NAME, randomFileSize (config), config->ioSize)
+        < randomFileSize (config))
+    {
+        fail ("fill the random file (is the image big enough?)");
+    }
+}
+
+// Creates the file that the sequential read workload reads.
+void
+prepareSequentialFile (const struct benchConfig* config)
+{
+    createFilledFile (SEQUENTIAL_FILE_NAME, config->fileSize, config->ioSize);
+}
+
+//// Workloads ///////////////////////////////////////////////////
+
+// Creates config->files empty files; each mucreat + muclose is one operation.
+void
+runCreate (const struct benchConfig* config, struct benchResult* result)
+{
+    char name[NAME_LENGTH];
+    for (uint32_t index = 0; index < config->files; ++index)
+    {
+        fileName (index, name);
+        double start = startOperation ();
+        int fd = mucreat (name, MU_S_IRUSR | MU_S_IWUSR);
+        if (fd < 0 || muclose (fd) < 0)
+        {
+            fail ("create a file (is the image big enough?)");
+        }
+        finishOperation (result, start, 0);
+    }
+}
+
+// Removes the files made by prepareEmptyFiles; each muunlink is one operation.
+void
+runDelete (const struct benchConfig* config, struct benchResult* result)
+{
+    char name[NAME_LENGTH];
+    for (uint32_t index = 0; index < config->files; ++index)
+    {
+        fileName (index, name);
+        double start = startOperation ();
+        if (muunlink (name) < 0)
+        {
+            fail ("remove a file");
+        }
+        finishOperation (result, start, 0);
+    }
+}
+
+// Writes one file of config->fileSize bytes; each muwrite is one operation.
+void
+runSequentialWrite (const struct benchConfig* config, struct benchResult* result)
+{
+    char* buffer = calloc (1, config->ioSize);
+    int fd = mucreat (SEQUENTIAL_FILE_NAME, MU_S_IRUSR | MU_S_IWUSR);
+    if (buffer == NULL || fd < 0)
+    {
+        fail ("create the sequential file");
+    }
+    uint32_t written = 0;
+    while (written < config->fileSize)
+    {
+        uint32_t length = (config->fileSize - written < config->ioSize ? config->fileSize - written : config->ioSize);
+        double start = startOperation ();
+        int count = muwrite (fd, buffer, length);
+        finishOperation (result, start, (count > 0 ? count : 0));
+        if (count < (int)length)
+        {
+            // The file has reached the largest size this image allows.
+            break;
+        }
+        written += count;
+    }
+    muclose (fd);
+    free (buffer);
+}
+
+// Reads the file made by prepareSequentialFile from start to end; each muread is one operation.
+void
+runSequentialRead (const struct benchConfig* config, struct benchResult* result)
+{
+    char* buffer = malloc (config->ioSize);
+    int fd = muopen (SEQUENTIAL_FILE_NAME, MU_O_RDONLY);
+    if (buffer == NULL || fd < 0)
+    {
+        fail ("open the sequential file");
+    }
+    while (1)
+    {
+        double start = startOperation ();
+        int count = muread (fd, buffer, config->ioSize);
+        if (count <= 0)
+        {
+            break;
+        }
+        finishOperation (result, start, count);
+    }
+    muclose (fd);
+    free (buffer);
+}
+
+// Copies the file made by prepareSequentialFile into a new file with mucopy; each mucopy
+//   of config->ioSize bytes is one operation.
+void
+runCopy (const struct benchConfig* config, struct benchResult* result)
+{
+    int srcFd = muopen (SEQUENTIAL_FILE_NAME, MU_O_RDONLY);
+    int dstFd = mucreat (COPY_FILE_NAME, MU_S_IRUSR | MU_S_IWUSR);
+    if (srcFd < 0 || dstFd < 0)
+    {
+        fail ("open the sequential file and create its copy");
+    }
+    while (1)
+    {
+        double start = startOperation ();
+        int count = mucopy (srcFd, dstFd, config->ioSize);
+        if (count <= 0)
+        {
+            break;
+        }
+        finishOperation (result, start, count);
+    }
+    muclose (dstFd);
+    muclose (srcFd);
+}
+
+// Reads config->ioSize bytes at a time from randomly chosen places in the file made by
+//   prepareRandomFile, each a multiple of config->ioSize from the start.
+// Each museek + muread is one operation.
+void
+runRandomRead (const struct benchConfig* config, struct benchResult* result)
+{
+    char* buffer = malloc (config->ioSize);
+    uint32_t places = randomFileSize (config) / config->ioSize;
+    int fd = muopen (RANDOM_FILE_NAME, MU_O_RDONLY);
+    if (buffer == NULL || fd < 0 || places == 0)
+    {
+        fail ("open the random file (is it smaller than the I/O size?)");
+    }
+    for (uint32_t operation = 0; operation < config->operations; ++operation)
+    {
+        uint32_t offset = (uint32_t)(rand () % places) * config->ioSize;
+        double start = startOperation ();
+        int count = (museek (fd, offset) < 0 ? -1 : muread (fd, buffer, config->ioSize));
+        if (count < 0)
+        {
+            fail ("read the random file");
+        }
+        finishOperation (result, start, count);
+    }
+    if (muclose (fd) < 0)
+    {
+        fail ("close the random file");
+    }
+    free (buffer);
+}
+
+// Overwrites config->ioSize bytes at a time at randomly chosen places in the file made by
+//   prepareRandomFile, as runRandomRead reads them.
+// Each museek + muwrite is one operation.
+void
+runRandomWrite (const struct benchConfig* config, struct benchResult* result)
+{
+    char* buffer = calloc (1, config->ioSize);
+    uint32_t places = randomFileSize (config) / config->ioSize;
+    int fd = muopen (RANDOM_FILE_NAME, MU_O_WRONLY);
+    if (buffer == NULL || fd < 0 || places == 0)
+    {
+        fail ("open the random file (is it smaller than the I/O size?)");
+    }
+    for (uint32_t operation = 0; operation < config->operations; ++operation)
+    {
+        uint32_t offset = (uint32_t)(rand () % places) * config->ioSize;
+        double start = startOperation ();
+        int count = (museek (fd, offset) < 0 ? -1 : muwrite (fd, buffer, config->ioSize));
+        if (count < 0)
+        {
+            fail ("write the random file");
+        }
+        finishOperation (result, start, count);
+    }
+    if (muclose (fd) < 0)
+    {
+        fail ("close the random file");
+    }
+    free (buffer);
+}
+
+// Grows INTERLEAVED_FILES files of config->fileSize bytes at once, taking turns, which
+//   is what fragments files that allocate one block at a time; each muwrite is one operation.
+void
+runInterleavedWrite (const struct benchConfig* config, struct benchResult* result)
+{
+    char* buffer = calloc (1, config->ioSize);
+    char name[NAME_LENGTH];
+    int fds[INTERLEAVED_FILES];
+    for (uint32_t index = 0; index < INTERLEAVED_FILES; ++index)
+    {
+        fileName (index, name);
+        fds[index] = mucreat (name, MU_S_IRUSR | MU_S_IWUSR);
+        if (buffer == NULL || fds[index] < 0)
+        {
+            fail ("create the interleaved files");
+        }
+    }
+    for (uint32_t written = 0; written < config->fileSize; written += config->ioSize)
+    {
+        uint32_t length = (config->fileSize - written < config->ioSize ? config->fileSize - written : config->ioSize);
+        for (uint32_t index = 0; index < INTERLEAVED_FILES; ++index)
+        {
+            double start = startOperation ();
+            int count = muwrite (fds[index], buffer, length);
+            if (count < (int)length)
+            {
+                fail ("write an interleaved file (is the image big enough?)");
+            }
+            finishOperation (result, start, count);
+        }
+    }
+    for (uint32_t index = 0; index < INTERLEAVED_FILES; ++index)
+    {
+        muclose (fds[index]);
+    }
+    free (buffer);
+}
+
+// Walks down the chain of directories made by mkdisk --depth and back up again,
+//   repeatedly; each mucd is one operation.
+void
+runDirectoryWalk (const struct benchConfig* config, struct benchResult* result)
+{
+    while (result->operations < config->operations)
+    {
+        uint32_t depth = 0;
+        while (1)
+        {
+            double start = startOperation ();
+            if (mucd (DEEP_DIRECTORY_NAME) < 0)
+            {
+                break;
+            }
+            finishOperation (result, start, 0);
+            ++depth;
+        }
+        if (depth == 0)
+        {
+            fprintf (stderr, "The image has no %s directory; make it with mkdisk --depth N\n", DEEP_DIRECTORY_NAME);
+            exit (EXIT_FAILURE);
+        }
+        for (uint32_t level = 0; level < depth; ++level)
+        {
+            double start = startOperation ();
+            if (mucd ("..") < 0)
+            {
+                fail ("walk back up");
+            }
+            finishOperation (result, start, 0);
+        }
+    }
+}
+
+// Changes straight to the bottom of the chain of directories made by mkdisk --depth with
+//   one absolute path, then back to the root, repeatedly; each walk down is one operation.
+void
+runPathWalk (const struct benchConfig* config, struct benchResult* result)
+{
+    // Find out how deep the chain goes, one component at a time.
+    uint32_t depth = 0;
+    while (mucd (DEEP_DIRECTORY_NAME) == 0)
+    {
+        ++depth;
+    }
+    if (depth == 0)
+    {
+        fprintf (stderr, "The image has no %s directory; make it with mkdisk --depth N\n", DEEP_DIRECTORY_NAME);
+        exit (EXIT_FAILURE);
+    }
+    char* path = malloc ((size_t)depth * (strlen (DEEP_DIRECTORY_NAME) + 1) + 1);
+    if (path == NULL)
+    {
+        fail ("allocate a path");
+    }
+    path[0] = '\0';
+    for (uint32_t level = 0; level < depth; ++level)
+    {
+        strcat (path, "/" DEEP_DIRECTORY_NAME);
+    }
+
+    while (result->operations < config->operations)
+    {
+        if (mucd ("/") < 0)
+        {
+            fail ("go back to the root");
+        }
+        double start = startOperation ();
+        if (mucd (path) < 0)
+        {
+            fail ("walk the path");
+        }
+        finishOperation (result, start, 0);
+    }
+    free (path);
+}
+
+// Lists a directory holding the files made by prepareEmptyFiles; each muls is one operation.
+// Its output is thrown away.
+void
+runListing (const struct benchConfig* config, struct benchResult* result)
+{
+    fflush (stdout);
+    int savedOutput = dup (STDOUT_FILENO);
+    int nowhere = open ("/dev/null", O_WRONLY);
+    if (savedOutput < 0 || nowhere < 0 || dup2 (nowhere, STDOUT_FILENO) < 0)
+    {
+        fail ("redirect the listing");
+    }
+    for (uint32_t operation = 0; operation < config->operations; ++operation)
+    {
+        double start = startOperation ();
+        muls ();
+        fflush (stdout);
+        finishOperation (result, start, 0);
+    }
+    dup2 (savedOutput, STDOUT_FILENO);
+    close (savedOutput);
+    close (nowhere);
+}
+
+//// Helper functions //////////////////////////////////////////
+
+// Copies a disk image, so that every workload starts from the same state.
+void
+copyImage (const char* from, const char* to)
+{
+    int source = open (from, O_RDONLY);
+    int destination = open (to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    char* buffer = malloc (COPY_BUFFER_BYTES);
+    if (source < 0 || destination < 0 || buffer == NULL)
+    {
+        fprintf (stderr, "Could not copy %s to %s\n", from, to);
+        exit (EXIT_FAILURE);
+    }
+    ssize_t count;
+    while ((count = read (source, buffer, COPY_BUFFER_BYTES)) > 0)
+    {
+        if (write (destination, buffer, count) != count)
+        {
+            fprintf (stderr, "Could not write %s\n", to);
+            exit (EXIT_FAILURE);
+        }
+    }
+    free (buffer);
+    close (source);
+    close (destination);
+}
+
+// Creates a file holding size bytes (or as many as the filesystem allows).
+// Returns:
+//   The number of bytes written.
+uint32_t
+createFilledFile (const char* name, uint32_t size, uint32_t ioSize)
+{
+    int fd = mucreat (name, MU_S_IRUSR | MU_S_IWUSR);
+    char* buffer = calloc (1, ioSize);
+    if (fd < 0 || buffer == NULL)
+    {
+        fail ("create a file (is the image big enough?)");
+    }
+    uint32_t written = 0;
+    while (written < size)
+    {
+        uint32_t length = (size - written < ioSize ? size - written : ioSize);
+        int count = muwrite (fd, buffer, length);
+        if (count <= 0)
+        {
+            break;
+        }
+        written += count;
+    }
+    muclose (fd);
+    free (buffer);
+    return written;
+}
+
+// Returns the size of the file that the random workloads use: as much as config->files
+//   files of config->fileSize bytes would hold, or as much as one file can.
+uint32_t
+randomFileSize (const struct benchConfig* config)
+{
+    uint64_t size = (uint64_t)config->files * config->fileSize;
+    return (size < maxFileSize () ? (uint32_t)size : maxFileSize ());
+}
+
+// Builds the name of one of the benchmark's files.
+void
+fileName (uint32_t index, char* name)
+{
+    snprintf (name, NAME_LENGTH, "bench%u", index);
+}
+
+// Returns the time at which an operation starts.
+double
+startOperation ()
+{
+    return now ();
+}
+
+// Records that an operation that started at start has finished, having moved bytes bytes.
+void
+finishOperation (struct benchResult* result, double start, uint64_t bytes)
+{
+    double latency = now () - start;
+    if (result->operations == result->capacity)
+    {
+        result->capacity = (result->capacity == 0 ? 1024 : result->capacity * 2);
+        result->latencies = realloc (result->latencies, result->capacity * sizeof (double));
+        if (result->latencies == NULL)
+        {
+            fail ("record latencies");
+        }
+    }
+    result->latencies[result->operations++] = latency;
+    result->bytes += bytes;
+}
+
+int
+compareLatencies (const void* left, const void* right)
+{
+    double leftLatency = *(const double*)left;
+    double rightLatency = *(const double*)right;
+    return (leftLatency > rightLatency) - (leftLatency < rightLatency);
+}
+
+// Returns the latency below which a fraction of the (sorted) operations fall.
+double
+percentile (const struct benchResult* result, double fraction)
+{
+    if (result->operations == 0)
+    {
+        return 0;
+    }
+    return result->latencies[(uint64_t)(fraction * (result->operations - 1))];
+}
+
+// Stops the benchmark because a call failed.
+void
+fail (const char* what)
+{
+    fprintf (stderr, "Could not %s: %d\n", what, muerrno);
+    exit (EXIT_FAILURE);
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void
+usage (const char* program)
+{
+    fprintf (stderr, "Usage: %s [options] image\n", program);
+    fprintf (stderr, "  --workload NAME     run only one of create, delete, seqwrite, seqread, copy,\n");
+    fprintf (stderr, "                      randread, randwrite, interleave, cdwalk, pathwalk, ls (default: all)\n");
+    fprintf (stderr, "  --files N           files used by the file workloads; randread and randwrite\n"
+             "                      use one file as big as all of them (default %d)\n", DEFAULT_FILES);
+    fprintf (stderr, "  --file-size BYTES   size of those files (default %d)\n", DEFAULT_FILE_SIZE);
+    fprintf (stderr, "  --io-size BYTES     bytes per muread / muwrite / mucopy (default %d)\n", DEFAULT_IO_SIZE);
+    fprintf (stderr, "  --ops N             operations for randread, randwrite, cdwalk, pathwalk, ls (default %d)\n", DEFAULT_OPERATIONS);
+    fprintf (stderr, "  --backend NAME      fd, mmap or uring (default fd)\n");
+    fprintf (stderr, "  --flush-bytes N     start the cache flusher once N bytes are dirty (default off)\n");
+    fprintf (stderr, "  --flush-age MS      have the flusher also write blocks dirty for MS milliseconds\n");
+    fprintf (stderr, "  --reserve N         blocks a growing file sets aside for itself (see mureserve)\n");
+    fprintf (stderr, "  --seed N            seed for the random workloads\n");
+    fprintf (stderr, "  --csv FILE          append one line per workload to FILE\n");
+    fprintf (stderr, "Each workload runs on a fresh copy of image; cdwalk and pathwalk need mkdisk --depth N.\n");
+    exit (EXIT_FAILURE);
+}
@@ -0,0 +1,249 @@
+// File: mubitmap.c
+// Author: Matt Shenk
+// Implementation of an in-memory bitmap of used / available blocks.
+// Free blocks are found by inverting a whole 64-bit word and counting its trailing zeros.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mubitmap.h"
+
+#define BITS_PER_WORD 64
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Returns the number of the first block at or after start whose bit equals used,
+//   or blockCount if there is none before the end of the bitmap.
+static uint32_t
+findNextBit (const struct blockBitmap* bitmap, uint32_t start, int used)
+{
+    if (start >= bitmap->blockCount)
+    {
+        return bitmap->blockCount;
+    }
+    uint32_t wordIndex = start / BITS_PER_WORD;
+    uint64_t word = (used ? bitmap->words[wordIndex] : ~bitmap->words[wordIndex]);
+    // Ignore the blocks in this word that come before start.
+    word &= ~UINT64_C (0) << (start % BITS_PER_WORD);
+    while (word == 0)
+    {
+        if (++wordIndex == bitmap->wordCount)
+        {
+            return bitmap->blockCount;
+        }
+        word = (used ? bitmap->words[wordIndex] : ~bitmap->words[wordIndex]);
+    }
+    uint32_t found = wordIndex * BITS_PER_WORD + __builtin_ctzll (word);
+    return (found < bitmap->blockCount ? found : bitmap->blockCount);
+}
+
+// Marks blocks [first, first + count) as used.
+static void
+markRunUsed (struct blockBitmap* bitmap, uint32_t first, uint32_t count)
+{
+    for (uint32_t blockNum = first; blockNum < first + count; ++blockNum)
+    {
+        markBitmapBlockUsed (bitmap, blockNum);
+    }
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+void
+initBitmap (struct blockBitmap* bitmap, uint32_t blockCount)
+{
+    bitmap->blockCount = blockCount;
+    bitmap->wordCount = (blockCount + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    bitmap->words = calloc (bitmap->wordCount, sizeof (uint64_t));
+    if (bitmap->words == NULL)
+    {
+        fprintf (stderr, "Could not allocate a bitmap of %u blocks\n", blockCount);
+        exit (EXIT_FAILURE);
+    }
+    // Bits past the last block are permanently "used" so that scans never return them.
+    uint32_t tailBits = blockCount % BITS_PER_WORD;
+    if (tailBits != 0)
+    {
+        bitmap->words[bitmap->wordCount - 1] = ~UINT64_C (0) << tailBits;
+    }
+    bitmap->freeCount = blockCount;
+    bitmap->nextFit = 0;
+}
+
+void
+destroyBitmap (struct blockBitmap* bitmap)
+{
+    free (bitmap->words);
+    bitmap->words = NULL;
+    bitmap->blockCount = 0;
+    bitmap->wordCount = 0;
+    bitmap->freeCount = 0;
+}
+
+int
+isBitmapBlockUsed (const struct blockBitmap* bitmap, uint32_t blockNum)
+{
+    assert (blockNum < bitmap->blockCount);
+    return (bitmap->words[blockNum / BITS_PER_WORD] >> (blockNum % BITS_PER_WORD)) & 1;
+}
+
+void
+markBitmapBlockUsed (struct blockBitmap* bitmap, uint32_t blockNum)
+{
+    if (!isBitmapBlockUsed (bitmap, blockNum))
+    {
+        bitmap->words[blockNum / BITS_PER_WORD] |= UINT64_C (1) << (blockNum % BITS_PER_WORD);
+        --bitmap->freeCount;
+    }
+}
+
+void
+markBitmapBlockAvailable (struct blockBitmap* bitmap, uint32_t blockNum)
+{
+    if (isBitmapBlockUsed (bitmap, blockNum))
+    {
+        bitmap->words[blockNum / BITS_PER_WORD] &= ~(UINT64_C (1) << (blockNum % BITS_PER_WORD));
+        ++bitmap->freeCount;
+    }
+}
+
+int
+allocateBitmapBlock (struct blockBitmap* bitmap)
+{
+    if (bitmap->freeCount == 0)
+    {
+        return -1;
+    }
+    uint32_t found = findNextBit (bitmap, bitmap->nextFit, 0);
+    if (found == bitmap->blockCount)
+    {
+        found = findNextBit (bitmap, 0, 0);
+    }
+    assert (found < bitmap->blockCount);
+    markBitmapBlockUsed (bitmap, found);
+    bitmap->nextFit = found + 1;
+    return found;
+}
+
+int
+allocateBitmapRun (struct blockBitmap* bitmap, uint32_t count)
+{
+    if (count == 0 || count > bitmap->freeCount)
+    {
+        return -1;
+    }
+    // Search from the cursor to the end, then from the start up to the cursor.
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        uint32_t position = (pass == 0 ? bitmap->nextFit : 0);
+        uint32_t limit = (pass == 0 ? bitmap->blockCount : bitmap->nextFit);
+        while (position < limit)
+        {
+            uint32_t runStart = findNextBit (bitmap, position, 0);
+            if (runStart >= limit)
+            {
+                break;
+            }
+            uint32_t runEnd = findNextBit (bitmap, runStart, 1);
+            if (runEnd - runStart >= count)
+            {
+                markRunUsed (bitmap, runStart, count);
+                bitmap->nextFit = runStart + count;
+                return runStart;
+            }
+            position = runEnd;
+        }
+    }
+    return -1;
+}
+
+uint32_t
+allocateBitmapRunAt (struct blockBitmap* bitmap, uint32_t blockNum, uint32_t maxCount)
+{
+    uint32_t runEnd = findNextBit (bitmap, blockNum, 1);
+    if (runEnd <= blockNum)
+    {
+        return 0;
+    }
+    uint32_t count = (runEnd - blockNum < maxCount ? runEnd - blockNum : maxCount);
+    markRunUsed (bitmap, blockNum, count);
+    return count;
+}
+
+void
+loadBitmapFromBytes (struct blockBitmap* bitmap, const char* isUsed)
+{
+    for (uint32_t blockNum = 0; blockNum < bitmap->blockCount; ++blockNum)
+    {
+        if (isUsed[blockNum] == BLOCK_USED)
+        {
+            markBitmapBlockUsed (bitmap, blockNum);
+        }
+        else
+        {
+            markBitmapBlockAvailable (bitmap, blockNum);
+        }
+    }
+}
+
+void
+storeBitmapToBytes (const struct blockBitmap* bitmap, char* isUsed)
+{
+    for (uint32_t blockNum = 0; blockNum < bitmap->blockCount; ++blockNum)
+    {
+        isUsed[blockNum] = (isBitmapBlockUsed (bitmap, blockNum) ? BLOCK_USED : BLOCK_AVAILABLE);
+    }
+}
+
+void
+loadBitmapFromBits (struct blockBitmap* bitmap, const uint8_t* bits)
+{
+    for (uint32_t wordIndex = 0; wordIndex < bitmap->wordCount; ++wordIndex)
+    {
+        uint64_t word = 0;
+        for (uint32_t byte = 0; byte < 8; ++byte)
+        {
+            uint32_t byteIndex = wordIndex * 8 + byte;
+            if (byteIndex * 8 < bitmap->blockCount)
+            {
+                word |= (uint64_t)bits[byteIndex] << (8 * byte);
+            }
+        }
+        bitmap->words[wordIndex] = word;
+    }
+    // Restore the permanently-used padding bits and recount.
+    uint32_t tailBits = bitmap->blockCount % BITS_PER_WORD;
+    if (tailBits != 0)
+    {
+        bitmap->words[bitmap->wordCount - 1] |= ~UINT64_C (0) << tailBits;
+    }
+    bitmap->freeCount = 0;
+    for (uint32_t wordIndex = 0; wordIndex < bitmap->wordCount; ++wordIndex)
+    {
+        bitmap->freeCount += BITS_PER_WORD - __builtin_popcountll (bitmap->words[wordIndex]);
+    }
+    bitmap->nextFit = 0;
+}
+
+void
+storeBitmapToBits (const struct blockBitmap* bitmap, uint8_t* bits)
+{
+    uint32_t byteCount = (bitmap->blockCount + 7) / 8;
+    for (uint32_t byteIndex = 0; byteIndex < byteCount; ++byteIndex)
+    {
+        bits[byteIndex] = (uint8_t)(bitmap->words[byteIndex / 8] >> (8 * (byteIndex % 8)));
+    }
+    // Bits past the last block are written as available so that the format does not depend on padding.
+    if (bitmap->blockCount % 8 != 0)
+    {
+        bits[byteCount - 1] &= (uint8_t)((1u << (bitmap->blockCount % 8)) - 1);
+    }
+}
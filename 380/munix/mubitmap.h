@@ -0,0 +1,93 @@
+// File: mubitmap.h
+// Author: Matt Shenk
+// Interface of an in-memory bitmap of used / available blocks.
+// One bit is kept per block (1 for used, 0 for available), scanned 64 blocks at a time.
+// Part of munix lab in CSCI380.
+
+#ifndef MUBITMAP_H
+#define MUBITMAP_H
+
+#include <stdint.h>
+
+// A bitmap covering every block of a filesystem.
+struct blockBitmap
+{
+    // The bits, least significant bit of word 0 being block 0.
+    uint64_t* words;
+    // The number of blocks that the bitmap describes.
+    uint32_t blockCount;
+    // The number of 64-bit words in the words array.
+    uint32_t wordCount;
+    // The number of blocks that are currently available.
+    uint32_t freeCount;
+    // Where the next search for a free block starts (next-fit).
+    uint32_t nextFit;
+};
+
+
+// Creates a bitmap with every block available.
+void
+initBitmap (struct blockBitmap* bitmap, uint32_t blockCount);
+
+
+// Releases the memory held by a bitmap.
+void
+destroyBitmap (struct blockBitmap* bitmap);
+
+
+// Returns 1 if a block is marked used, 0 otherwise.
+int
+isBitmapBlockUsed (const struct blockBitmap* bitmap, uint32_t blockNum);
+
+
+// Marks a single block as used.
+void
+markBitmapBlockUsed (struct blockBitmap* bitmap, uint32_t blockNum);
+
+
+// Marks a single block as available.
+void
+markBitmapBlockAvailable (struct blockBitmap* bitmap, uint32_t blockNum);
+
+
+// Finds an available block at or after the next-fit cursor (wrapping around), marks it used.
+// Returns:
+//   The number of the block, or -1 if every block is used.
+int
+allocateBitmapBlock (struct blockBitmap* bitmap);
+
+
+// Finds count consecutive available blocks, marks them used.
+// Returns:
+//   The number of the first block in the run, or -1 if there is no run that long.
+int
+allocateBitmapRun (struct blockBitmap* bitmap, uint32_t count);
+
+
+// Marks as used the available blocks that start at blockNum, up to maxCount of them.
+// Returns:
+//   The number of blocks marked, which is 0 if blockNum is used or past the end.
+uint32_t
+allocateBitmapRunAt (struct blockBitmap* bitmap, uint32_t blockNum, uint32_t maxCount);
+
+
+// Fills the bitmap from an array with one byte per block (BLOCK_USED / BLOCK_AVAILABLE).
+void
+loadBitmapFromBytes (struct blockBitmap* bitmap, const char* isUsed);
+
+
+// Fills an array with one byte per block (BLOCK_USED / BLOCK_AVAILABLE) from the bitmap.
+void
+storeBitmapToBytes (const struct blockBitmap* bitmap, char* isUsed);
+
+
+// Fills the bitmap from its packed on-disk form (bit blockNum % 8 of byte blockNum / 8).
+void
+loadBitmapFromBits (struct blockBitmap* bitmap, const uint8_t* bits);
+
+
+// Fills a buffer of (blockCount + 7) / 8 bytes with the packed on-disk form of the bitmap.
+void
+storeBitmapToBits (const struct blockBitmap* bitmap, uint8_t* bits);
+
+#endif//MUBITMAP_H
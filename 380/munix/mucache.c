@@ -0,0 +1,738 @@
+// File: mucache.c
+// Author: Matt Shenk
+// Implementation of a write-back block cache for MUFS data blocks.
+// Blocks are found through a small chained hash table and evicted in either
+//   least-recently-used order or by a CLOCK sweep.  An optional flusher thread writes
+//   dirty blocks back in the background so that evictions seldom have to.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "mufs.h"
+#include "mucache.h"
+
+#define NO_SLOT UINT32_MAX
+// The most blocks written by one vectored write, which is Linux's IOV_MAX.
+#define MAX_RUN_BLOCKS 1024
+// How often the flusher looks for old dirty blocks when no age limit is configured.
+#define IDLE_FLUSH_INTERVAL_MS 1000
+
+// Bookkeeping for one cached block.
+struct cacheSlot
+{
+    // The number of the block held in this slot.
+    uint32_t blockNum;
+    // Whether or not this slot holds a block at all.
+    int valid;
+    // Whether or not the cached copy is newer than the disk.
+    int dirty;
+    // Set on every use, cleared by the CLOCK hand.
+    int referenced;
+    // Whether or not the flusher is writing this slot to disk right now; such slots are
+    //   never evicted.
+    int flushing;
+    // Bumped on every write to the slot, so the flusher can tell if it changed mid-write.
+    uint32_t generation;
+    // When the slot last went from clean to dirty, in nanoseconds on the monotonic clock.
+    uint64_t dirtiedAt;
+    // Neighbours in the LRU list (most recently used at the head).
+    uint32_t newer;
+    uint32_t older;
+    // The next slot in the same hash bucket.
+    uint32_t hashNext;
+};
+
+// The requested configuration, applied by the next openBlockCache.
+static uint32_t configuredCapacity = DEFAULT_CACHE_BLOCKS;
+static int configuredPolicy = MU_CACHE_LRU;
+
+// The live cache.
+static uint32_t capacity = 0;
+static int policy = MU_CACHE_LRU;
+static struct cacheSlot* slots = NULL;
+static char* data = NULL;
+static uint32_t* buckets = NULL;
+static uint32_t bucketMask = 0;
+static uint32_t lruHead = NO_SLOT;
+static uint32_t lruTail = NO_SLOT;
+static uint32_t clockHand = 0;
+static uint32_t slotsInUse = 0;
+
+static struct blockCacheStats stats;
+
+// The number of valid slots that are dirty.
+static uint32_t dirtySlots = 0;
+
+// The requested flusher configuration, applied by the next openBlockCache.
+static uint32_t configuredDirtyBytes = 0;
+static uint32_t configuredDirtyAgeMs = 0;
+
+// The live flusher, if it is running: it starts a batch once dirtyLimit slots are dirty,
+//   or once a slot has been dirty for dirtyAge nanoseconds (if that is not 0).
+static int flusherRunning = 0;
+static pthread_t flusherThread;
+static uint32_t dirtyLimit = 0;
+static uint64_t dirtyAge = 0;
+static uint32_t waitMs = 0;
+// The slots of the batch being written, and the generation each had when it was chosen.
+//   A batch holds at most half the cache, so that eviction can always find a slot that
+//   is not being flushed.
+static uint32_t maxBatch = 0;
+static uint32_t* batch = NULL;
+static uint32_t* batchGenerations = NULL;
+
+// Room for the vector of one write of consecutive slots.
+static struct iovec* vectors = NULL;
+
+// Held by the flusher for the whole of a batch, including the write itself, so that
+//   taking it waits for any write in progress.  Taken before diskLock, never after.
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects flusherWakeup and flusherStop, and goes with flusherSignal.
+static pthread_mutex_t flusherStateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherSignal = PTHREAD_COND_INITIALIZER;
+static int flusherWakeup = 0;
+static int flusherStop = 0;
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+static uint32_t
+bucketOf (uint32_t blockNum)
+{
+    // Knuth's multiplicative hash spreads consecutive block numbers across buckets.
+    return (blockNum * 2654435761u) & bucketMask;
+}
+
+static char*
+slotData (uint32_t slot)
+{
+    return data + (size_t)slot * BLOCK_SIZE;
+}
+
+static uint32_t
+findSlot (uint32_t blockNum)
+{
+    for (uint32_t slot = buckets[bucketOf (blockNum)]; slot != NO_SLOT; slot = slots[slot].hashNext)
+    {
+        if (slots[slot].blockNum == blockNum)
+        {
+            return slot;
+        }
+    }
+    return NO_SLOT;
+}
+
+static void
+unhashSlot (uint32_t slot)
+{
+    uint32_t* link = &buckets[bucketOf (slots[slot].blockNum)];
+    while (*link != slot)
+    {
+        assert (*link != NO_SLOT);
+        link = &slots[*link].hashNext;
+    }
+    *link = slots[slot].hashNext;
+}
+
+static void
+unlinkLRU (uint32_t slot)
+{
+    if (slots[slot].newer != NO_SLOT) { slots[slots[slot].newer].older = slots[slot].older; }
+    else { lruHead = slots[slot].older; }
+    if (slots[slot].older != NO_SLOT) { slots[slots[slot].older].newer = slots[slot].newer; }
+    else { lruTail = slots[slot].newer; }
+}
+
+static void
+pushLRU (uint32_t slot)
+{
+    slots[slot].newer = NO_SLOT;
+    slots[slot].older = lruHead;
+    if (lruHead != NO_SLOT) { slots[lruHead].newer = slot; }
+    lruHead = slot;
+    if (lruTail == NO_SLOT) { lruTail = slot; }
+}
+
+// Records a use of a slot for the replacement policy.
+static void
+touchSlot (uint32_t slot)
+{
+    if (policy == MU_CACHE_LRU)
+    {
+        unlinkLRU (slot);
+        pushLRU (slot);
+    }
+    slots[slot].referenced = 1;
+}
+
+static uint64_t
+monotonicNow ()
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Records that a slot has changes that are not on disk, waking the flusher if that
+//   takes the cache to its dirty limit.
+static void
+markSlotDirty (uint32_t slot)
+{
+    ++slots[slot].generation;
+    if (slots[slot].dirty)
+    {
+        return;
+    }
+    slots[slot].dirty = 1;
+    slots[slot].dirtiedAt = monotonicNow ();
+    if (++dirtySlots == dirtyLimit && flusherRunning)
+    {
+        pthread_mutex_lock (&flusherStateLock);
+        flusherWakeup = 1;
+        pthread_cond_signal (&flusherSignal);
+        pthread_mutex_unlock (&flusherStateLock);
+    }
+}
+
+static void
+markSlotClean (uint32_t slot)
+{
+    if (slots[slot].dirty)
+    {
+        slots[slot].dirty = 0;
+        --dirtySlots;
+    }
+}
+
+static void
+writeBackSlot (uint32_t slot)
+{
+    if (slots[slot].valid && slots[slot].dirty)
+    {
+        assert (!slots[slot].flushing);
+        writeDataBlockToDisk (slots[slot].blockNum, slotData (slot));
+        markSlotClean (slot);
+        ++stats.writeBacks;
+    }
+}
+
+// Picks a slot to hold a new block, writing back and evicting its old contents if needed.
+static uint32_t
+chooseVictim ()
+{
+    uint32_t victim;
+    if (slotsInUse < capacity)
+    {
+        victim = slotsInUse++;
+    }
+    else if (policy == MU_CACHE_LRU)
+    {
+        victim = lruTail;
+        while (slots[victim].flushing)
+        {
+            victim = slots[victim].newer;
+        }
+    }
+    else
+    {
+        while (slots[clockHand].referenced || slots[clockHand].flushing)
+        {
+            slots[clockHand].referenced = 0;
+            clockHand = (clockHand + 1) % capacity;
+        }
+        victim = clockHand;
+        clockHand = (clockHand + 1) % capacity;
+    }
+
+    if (slots[victim].valid)
+    {
+        writeBackSlot (victim);
+        unhashSlot (victim);
+        if (policy == MU_CACHE_LRU) { unlinkLRU (victim); }
+        slots[victim].valid = 0;
+        ++stats.evictions;
+    }
+    return victim;
+}
+
+// Makes a slot hold blockNum, optionally filling it from disk.
+static uint32_t
+installBlock (uint32_t blockNum, int loadFromDisk)
+{
+    uint32_t slot = chooseVictim ();
+    if (loadFromDisk)
+    {
+        readDataBlockFromDisk (blockNum, slotData (slot));
+    }
+    slots[slot].blockNum = blockNum;
+    slots[slot].valid = 1;
+    slots[slot].dirty = 0;
+    slots[slot].referenced = 1;
+    slots[slot].flushing = 0;
+    uint32_t bucket = bucketOf (blockNum);
+    slots[slot].hashNext = buckets[bucket];
+    buckets[bucket] = slot;
+    if (policy == MU_CACHE_LRU) { pushLRU (slot); }
+    return slot;
+}
+
+
+static int
+compareSlotBlocks (const void* left, const void* right)
+{
+    uint32_t leftBlock = slots[*(const uint32_t*)left].blockNum;
+    uint32_t rightBlock = slots[*(const uint32_t*)right].blockNum;
+    return (leftBlock > rightBlock) - (leftBlock < rightBlock);
+}
+
+// Writes sorted slots back to disk with one vectored write for each run of consecutive
+//   blocks.  The caller need not hold diskLock, as long as the slots cannot be evicted.
+// Returns:
+//   The number of writes made.
+static uint64_t
+writeSortedSlots (const uint32_t* order, uint32_t count)
+{
+    uint64_t writes = 0;
+    uint32_t first = 0;
+    while (first < count)
+    {
+        uint32_t length = 1;
+        while (first + length < count && length < MAX_RUN_BLOCKS
+               && slots[order[first + length]].blockNum == slots[order[first]].blockNum + length)
+        {
+            ++length;
+        }
+        for (uint32_t index = 0; index < length; ++index)
+        {
+            vectors[index].iov_base = slotData (order[first + index]);
+            vectors[index].iov_len = BLOCK_SIZE;
+        }
+        writeDataRunToDisk (slots[order[first]].blockNum, length, vectors);
+        ++writes;
+        first += length;
+    }
+    return writes;
+}
+
+// Chooses the dirty slots that the flusher should write next: all of them (up to a batch)
+//   if the cache is at its dirty limit, otherwise only those that are old enough.
+// The caller must hold diskLock.
+// Returns:
+//   The number of slots placed in batch, sorted by block number.
+static uint32_t
+chooseFlushBatch ()
+{
+    int overLimit = (dirtySlots >= dirtyLimit);
+    uint64_t now = monotonicNow ();
+    uint32_t count = 0;
+    for (uint32_t slot = 0; slot < slotsInUse && count < maxBatch; ++slot)
+    {
+        if (slots[slot].valid && slots[slot].dirty && !slots[slot].flushing
+            && (overLimit || (dirtyAge != 0 && now - slots[slot].dirtiedAt >= dirtyAge)))
+        {
+            batch[count++] = slot;
+        }
+    }
+    qsort (batch, count, sizeof (uint32_t), compareSlotBlocks);
+    return count;
+}
+
+// Writes one batch of dirty slots back to disk.  The write itself happens without
+//   diskLock, so writers can keep using the cache meanwhile; a slot that they change
+//   during the write simply stays dirty.
+// Returns:
+//   The number of slots written.
+static uint32_t
+flushBatch ()
+{
+    pthread_mutex_lock (&flushLock);
+    lockBlockCache ();
+    uint32_t count = chooseFlushBatch ();
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        slots[batch[index]].flushing = 1;
+        batchGenerations[index] = slots[batch[index]].generation;
+    }
+    unlockBlockCache ();
+
+    uint64_t writes = writeSortedSlots (batch, count);
+
+    lockBlockCache ();
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        uint32_t slot = batch[index];
+        slots[slot].flushing = 0;
+        if (slots[slot].generation == batchGenerations[index])
+        {
+            markSlotClean (slot);
+        }
+    }
+    stats.flushedBlocks += count;
+    stats.flushWrites += writes;
+    unlockBlockCache ();
+    pthread_mutex_unlock (&flushLock);
+    return count;
+}
+
+// The body of the flusher thread: sleeps until the cache reaches its dirty limit or a
+//   block may have grown old, then writes batches until there is nothing left to do.
+static void*
+runFlusher (void* unused)
+{
+    (void)unused;
+    pthread_mutex_lock (&flusherStateLock);
+    while (!flusherStop)
+    {
+        if (!flusherWakeup)
+        {
+            struct timespec until;
+            clock_gettime (CLOCK_REALTIME, &until);
+            until.tv_sec += waitMs / 1000;
+            until.tv_nsec += (long)(waitMs % 1000) * 1000000;
+            if (until.tv_nsec >= 1000000000)
+            {
+                ++until.tv_sec;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait (&flusherSignal, &flusherStateLock, &until);
+        }
+        flusherWakeup = 0;
+        if (flusherStop)
+        {
+            break;
+        }
+        pthread_mutex_unlock (&flusherStateLock);
+        while (flushBatch () == maxBatch)
+        {
+        }
+        pthread_mutex_lock (&flusherStateLock);
+    }
+    pthread_mutex_unlock (&flusherStateLock);
+    return NULL;
+}
+
+// Starts the flusher thread for the cache that has just been opened, if one is configured.
+static void
+startFlusher ()
+{
+    // With fewer than two slots a batch could tie up the whole cache.
+    if (configuredDirtyBytes == 0 || capacity < 2)
+    {
+        return;
+    }
+    dirtyLimit = (configuredDirtyBytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (dirtyLimit > capacity)
+    {
+        dirtyLimit = capacity;
+    }
+    dirtyAge = (uint64_t)configuredDirtyAgeMs * 1000000;
+    waitMs = (configuredDirtyAgeMs == 0 ? IDLE_FLUSH_INTERVAL_MS
+              : configuredDirtyAgeMs / 2 > 0 ? configuredDirtyAgeMs / 2 : 1);
+    maxBatch = capacity / 2;
+    batch = malloc (maxBatch * sizeof (uint32_t));
+    batchGenerations = malloc (maxBatch * sizeof (uint32_t));
+    if (batch == NULL || batchGenerations == NULL)
+    {
+        fprintf (stderr, "Could not allocate the flusher's batch of %u blocks\n", maxBatch);
+        exit (EXIT_FAILURE);
+    }
+    flusherStop = 0;
+    flusherWakeup = 0;
+    if (pthread_create (&flusherThread, NULL, runFlusher, NULL) != 0)
+    {
+        fprintf (stderr, "Could not start the flusher thread\n");
+        exit (EXIT_FAILURE);
+    }
+    flusherRunning = 1;
+}
+
+// Stops the flusher thread, if it is running, once its current batch is done.
+static void
+stopFlusher ()
+{
+    if (!flusherRunning)
+    {
+        return;
+    }
+    pthread_mutex_lock (&flusherStateLock);
+    flusherStop = 1;
+    pthread_cond_signal (&flusherSignal);
+    pthread_mutex_unlock (&flusherStateLock);
+    pthread_join (flusherThread, NULL);
+    flusherRunning = 0;
+    dirtyLimit = 0;
+    free (batch);
+    free (batchGenerations);
+    batch = NULL;
+    batchGenerations = NULL;
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+void
+configureBlockCache (uint32_t newCapacity, int newPolicy)
+{
+    assert (slots == NULL);
+    assert (newPolicy == MU_CACHE_LRU || newPolicy == MU_CACHE_CLOCK);
+    configuredCapacity = newCapacity;
+    configuredPolicy = newPolicy;
+}
+
+void
+configureFlusher (uint32_t dirtyBytes, uint32_t dirtyAgeMs)
+{
+    assert (slots == NULL);
+    configuredDirtyBytes = dirtyBytes;
+    configuredDirtyAgeMs = dirtyAgeMs;
+}
+
+void
+getBlockCacheStats (struct blockCacheStats* out)
+{
+    *out = stats;
+}
+
+void
+resetBlockCacheStats ()
+{
+    memset (&stats, 0, sizeof (stats));
+}
+
+void
+openBlockCache ()
+{
+    assert (slots == NULL);
+    capacity = configuredCapacity;
+    policy = configuredPolicy;
+    if (capacity == 0)
+    {
+        return;
+    }
+
+    uint32_t bucketCount = 1;
+    while (bucketCount < capacity * 2)
+    {
+        bucketCount <<= 1;
+    }
+    bucketMask = bucketCount - 1;
+
+    slots = calloc (capacity, sizeof (struct cacheSlot));
+    data = malloc ((size_t)capacity * BLOCK_SIZE);
+    buckets = malloc (bucketCount * sizeof (uint32_t));
+    vectors = malloc ((capacity < MAX_RUN_BLOCKS ? capacity : MAX_RUN_BLOCKS) * sizeof (struct iovec));
+    if (slots == NULL || data == NULL || buckets == NULL || vectors == NULL)
+    {
+        fprintf (stderr, "Could not allocate a block cache of %u blocks\n", capacity);
+        exit (EXIT_FAILURE);
+    }
+    for (uint32_t bucket = 0; bucket < bucketCount; ++bucket)
+    {
+        buckets[bucket] = NO_SLOT;
+    }
+    lruHead = lruTail = NO_SLOT;
+    clockHand = 0;
+    slotsInUse = 0;
+    dirtySlots = 0;
+    startFlusher ();
+}
+
+void
+closeBlockCache ()
+{
+    if (slots == NULL)
+    {
+        return;
+    }
+    stopFlusher ();
+    flushBlockCache ();
+    free (slots);
+    free (data);
+    free (buckets);
+    free (vectors);
+    slots = NULL;
+    data = NULL;
+    buckets = NULL;
+    vectors = NULL;
+    capacity = 0;
+}
+
+int
+isBlockCacheEnabled ()
+{
+    return slots != NULL;
+}
+
+void
+cacheReadBlock (uint32_t blockNum, char* buffer)
+{
+    uint32_t slot = findSlot (blockNum);
+    if (slot == NO_SLOT)
+    {
+        ++stats.misses;
+        slot = installBlock (blockNum, 1);
+    }
+    else
+    {
+        ++stats.hits;
+        touchSlot (slot);
+    }
+    memcpy (buffer, slotData (slot), BLOCK_SIZE);
+}
+
+void
+cacheWriteBlock (uint32_t blockNum, const char* buffer)
+{
+    uint32_t slot = findSlot (blockNum);
+    if (slot == NO_SLOT)
+    {
+        // The whole block is being replaced, so there is no need to read the old contents.
+        ++stats.misses;
+        slot = installBlock (blockNum, 0);
+    }
+    else
+    {
+        ++stats.hits;
+        touchSlot (slot);
+    }
+    memcpy (slotData (slot), buffer, BLOCK_SIZE);
+    markSlotDirty (slot);
+}
+
+int
+cachePeekBlock (uint32_t blockNum, char* buffer)
+{
+    uint32_t slot = findSlot (blockNum);
+    if (slot == NO_SLOT)
+    {
+        return 0;
+    }
+    memcpy (buffer, slotData (slot), BLOCK_SIZE);
+    return 1;
+}
+
+int
+cacheHasBlock (uint32_t blockNum)
+{
+    return isBlockCacheEnabled () && findSlot (blockNum) != NO_SLOT;
+}
+
+int
+cacheHasDirtyBlock (uint32_t blockNum)
+{
+    if (!isBlockCacheEnabled ())
+    {
+        return 0;
+    }
+    uint32_t slot = findSlot (blockNum);
+    return slot != NO_SLOT && slots[slot].dirty;
+}
+
+int
+cacheFillBlock (uint32_t blockNum, const char* buffer)
+{
+    if (findSlot (blockNum) != NO_SLOT)
+    {
+        return 0;
+    }
+    uint32_t slot = installBlock (blockNum, 0);
+    memcpy (slotData (slot), buffer, BLOCK_SIZE);
+    // Prefetched blocks have not been used yet, so let CLOCK evict them first if they never are.
+    slots[slot].referenced = 0;
+    return 1;
+}
+
+void
+cacheRefreshBlock (uint32_t blockNum, const char* buffer)
+{
+    uint32_t slot = findSlot (blockNum);
+    if (slot != NO_SLOT)
+    {
+        assert (!slots[slot].flushing);
+        memcpy (slotData (slot), buffer, BLOCK_SIZE);
+        markSlotClean (slot);
+    }
+}
+
+void
+flushBlockCache ()
+{
+    if (slots == NULL)
+    {
+        return;
+    }
+    cacheWriteBackRange (0, UINT32_MAX);
+}
+
+void
+lockFlusher ()
+{
+    pthread_mutex_lock (&flushLock);
+}
+
+void
+unlockFlusher ()
+{
+    pthread_mutex_unlock (&flushLock);
+}
+
+int
+cacheIsFlushing (uint32_t firstBlock, uint32_t count)
+{
+    if (!isBlockCacheEnabled () || !flusherRunning)
+    {
+        return 0;
+    }
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        uint32_t slot = findSlot (firstBlock + index);
+        if (slot != NO_SLOT && slots[slot].flushing)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+cacheWriteBackRange (uint32_t firstBlock, uint32_t count)
+{
+    if (slots == NULL)
+    {
+        return;
+    }
+    // Write dirty blocks in ascending block order so the disk sees one forward sweep, and
+    //   consecutive blocks go out in a single write.
+    uint32_t* order = malloc (capacity * sizeof (uint32_t));
+    if (order == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory to flush the block cache\n");
+        exit (EXIT_FAILURE);
+    }
+    uint32_t dirtyCount = 0;
+    for (uint32_t slot = 0; slot < slotsInUse; ++slot)
+    {
+        if (slots[slot].valid && slots[slot].dirty && slots[slot].blockNum - firstBlock < count)
+        {
+            assert (!slots[slot].flushing);
+            order[dirtyCount++] = slot;
+        }
+    }
+    qsort (order, dirtyCount, sizeof (uint32_t), compareSlotBlocks);
+    writeSortedSlots (order, dirtyCount);
+    for (uint32_t index = 0; index < dirtyCount; ++index)
+    {
+        markSlotClean (order[index]);
+    }
+    stats.writeBacks += dirtyCount;
+    free (order);
+}
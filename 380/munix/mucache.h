@@ -0,0 +1,163 @@
+// File: mucache.h
+// Author: Matt Shenk
+// Interface of the in-process block cache that sits behind the MUFS data block API.
+// Part of munix lab in CSCI380.
+
+#ifndef MUCACHE_H
+#define MUCACHE_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define MU_CACHE_LRU 1
+#define MU_CACHE_CLOCK 2
+#define DEFAULT_CACHE_BLOCKS 64
+
+// Counters describing how well the block cache is working.
+struct blockCacheStats
+{
+    // The number of block reads / writes that found the block already cached.
+    uint64_t hits;
+    // The number of block reads / writes that had to bring the block into the cache.
+    uint64_t misses;
+    // The number of blocks that were pushed out of the cache to make room for others.
+    uint64_t evictions;
+    // The number of dirty blocks that were written back to disk by evictions and syncs.
+    uint64_t writeBacks;
+    // The number of dirty blocks that the flusher thread wrote back to disk.
+    uint64_t flushedBlocks;
+    // The number of writes the flusher made for them; consecutive blocks share one write.
+    uint64_t flushWrites;
+};
+
+
+// Chooses the size (in blocks) and replacement policy of the cache.
+// Must be called before setup.  A capacity of 0 disables caching entirely.
+// Params:
+//   capacity - The number of blocks the cache may hold.
+//   policy - Either MU_CACHE_LRU or MU_CACHE_CLOCK.
+void
+configureBlockCache (uint32_t capacity, int policy);
+
+
+// Chooses when a background flusher thread writes dirty blocks back to disk, so that
+//   evictions seldom have to.  Must be called before setup; the flusher is off by default.
+// Each batch is written in block order, with consecutive blocks sharing one write.
+// Params:
+//   dirtyBytes - Start writing once this much of the cache is dirty; 0 turns the flusher off.
+//   dirtyAgeMs - Also write any block that has been dirty this long; 0 for no age limit.
+void
+configureFlusher (uint32_t dirtyBytes, uint32_t dirtyAgeMs);
+
+
+// Copies the current cache counters into stats.
+void
+getBlockCacheStats (struct blockCacheStats* stats);
+
+
+// Sets all of the cache counters back to zero.
+void
+resetBlockCacheStats ();
+
+
+//// Used by mufs.c only ///////////////////////////////////////
+
+
+// Allocates the cache according to the most recent configuration.
+void
+openBlockCache ();
+
+
+// Writes back any dirty blocks and releases the cache.
+void
+closeBlockCache ();
+
+
+// Returns 1 if the cache is holding any blocks, 0 if caching is disabled.
+int
+isBlockCacheEnabled ();
+
+
+// Copies a block into buffer, reading it from disk only if it is not cached.
+void
+cacheReadBlock (uint32_t blockNum, char* buffer);
+
+
+// Copies buffer into the cached copy of a block and marks it dirty.
+void
+cacheWriteBlock (uint32_t blockNum, const char* buffer);
+
+
+// Copies the cached copy of a block into buffer, if the block is cached.
+// Returns 1 if it was cached, 0 (leaving buffer alone) otherwise.
+int
+cachePeekBlock (uint32_t blockNum, char* buffer);
+
+
+// Returns 1 if a block is cached, 0 otherwise.
+int
+cacheHasBlock (uint32_t blockNum);
+
+
+// Returns 1 if a block is cached with changes that have not been written to disk, 0 otherwise.
+int
+cacheHasDirtyBlock (uint32_t blockNum);
+
+
+// Adds a block that has just been read from disk to the cache, unless it is already cached.
+// Returns 1 if the block was added, 0 if it was already cached.
+int
+cacheFillBlock (uint32_t blockNum, const char* buffer);
+
+
+// Replaces the cached copy of a block (if any) with data that has just been written to disk.
+void
+cacheRefreshBlock (uint32_t blockNum, const char* buffer);
+
+
+// Writes every dirty block back to disk, leaving them cached.
+// The caller must hold the flusher lock (see lockFlusher).
+void
+flushBlockCache ();
+
+
+// Takes / releases the lock that the flusher holds while writing a batch, which waits
+//   for any batch in progress.  It must be taken before diskLock, never while holding it.
+void
+lockFlusher ();
+
+void
+unlockFlusher ();
+
+
+// Returns 1 if the flusher is writing the cached copy of any block in a range right now,
+//   in which case the blocks must not be changed until it is done; 0 otherwise.
+int
+cacheIsFlushing (uint32_t firstBlock, uint32_t count);
+
+
+// Writes back the dirty cached blocks in a range, leaving them cached.
+// The caller must hold the flusher lock.
+void
+cacheWriteBackRange (uint32_t firstBlock, uint32_t count);
+
+
+// The functions the cache uses to reach the disk.  Provided by mufs.c.
+void
+readDataBlockFromDisk (uint32_t blockNum, char* buffer);
+
+void
+writeDataBlockToDisk (uint32_t blockNum, const char* buffer);
+
+// Writes count consecutive blocks starting at firstBlock, one vector entry per block.
+void
+writeDataRunToDisk (uint32_t firstBlock, uint32_t count, const struct iovec* vectors);
+
+// Take / release diskLock, which the flusher thread needs around its use of the cache.
+void
+lockBlockCache ();
+
+void
+unlockBlockCache ();
+
+#endif//MUCACHE_H
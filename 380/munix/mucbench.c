@@ -0,0 +1,251 @@
+// File: mucbench.c
+// Author: Matt Shenk
+// A benchmark of compressed files: writes a set of files of text-like data, reads them
+//   back with a cold block cache, and removes them, once as plain files and once as
+//   compressed ones, reporting the blocks each set takes (the compression ratio) and the
+//   read and write throughput.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "munix.h"
+#include "mufs.h"
+
+#define DEFAULT_FILES 16
+#define DEFAULT_FILE_KB 128
+#define IO_BYTES (64 * 1024)
+#define NAME_LENGTH 32
+
+// The results of one run of the workload.
+struct benchResult
+{
+    uint64_t bytes;
+    uint32_t blocksUsed;
+    double writeSeconds;
+    double readSeconds;
+    uint64_t unitsStored;
+    uint64_t unitsExpanded;
+};
+
+void
+runWorkload (const char* diskName, int compressed, uint32_t files, uint32_t fileBytes, struct benchResult* result);
+
+void
+fillText (char* buffer, uint32_t length, uint32_t seed);
+
+uint32_t
+countUsedBlocks ();
+
+void
+report (const char* mode, const struct benchResult* result, const struct benchResult* plain);
+
+double
+now ();
+
+int
+main (int argc, char* argv[])
+{
+    if (argc < 2 || argc > 4)
+    {
+        fprintf (stderr, "Usage: %s diskName [files] [fileKB]\n", argv[0]);
+        fprintf (stderr, "The disk should be made with mkdisk --compress, with room for the files\n");
+        fprintf (stderr, "  uncompressed (mkdisk --compress --blocks 4096 for the defaults of %d files of %d KB).\n",
+                 DEFAULT_FILES, DEFAULT_FILE_KB);
+        exit (EXIT_FAILURE);
+    }
+    long files = (argc > 2 ? atol (argv[2]) : DEFAULT_FILES);
+    long fileKB = (argc > 3 ? atol (argv[3]) : DEFAULT_FILE_KB);
+    if (files < 1 || fileKB < 1 || fileKB > 1024 * 1024)
+    {
+        fprintf (stderr, "There must be at least 1 file, of 1 KB to 1 GB\n");
+        exit (EXIT_FAILURE);
+    }
+
+    struct benchResult plain;
+    struct benchResult compressed;
+    runWorkload (argv[1], 0, files, fileKB * 1024, &plain);
+    runWorkload (argv[1], 1, files, fileKB * 1024, &compressed);
+
+    printf ("%ld files of %ld KB of text\n", files, fileKB);
+    printf ("%-12s %10s %8s %12s %12s\n", "mode", "blocks", "ratio", "write MB/s", "read MB/s");
+    report ("plain", &plain, &plain);
+    report ("compressed", &compressed, &plain);
+    printf ("Compressed files stored %lu units and expanded %lu\n",
+            (unsigned long)compressed.unitsStored, (unsigned long)compressed.unitsExpanded);
+    return EXIT_SUCCESS;
+}
+
+// Writes the files, then reads them back and checks them after reloading the disk (so
+//   that nothing is read from the block cache), then removes them.
+// Params:
+//   diskName - The disk image, which must be VERSION23.
+//   compressed - 1 to create compressed files, 0 for plain ones.
+//   files - How many files to write.
+//   fileBytes - The size of each file.
+//   result - Receives the measurements.
+void
+runWorkload (const char* diskName, int compressed, uint32_t files, uint32_t fileBytes, struct benchResult* result)
+{
+    memset (result, 0, sizeof (*result));
+    char* expected = malloc (IO_BYTES);
+    char* buffer = malloc (IO_BYTES);
+    if (expected == NULL || buffer == NULL)
+    {
+        fprintf (stderr, "Could not allocate buffers of %d bytes\n", IO_BYTES);
+        exit (EXIT_FAILURE);
+    }
+    char name[NAME_LENGTH];
+
+    setup (diskName);
+    if (!usesCompression ())
+    {
+        fprintf (stderr, "%s cannot hold compressed files; make it with mkdisk --compress\n", diskName);
+        exit (EXIT_FAILURE);
+    }
+    if (muinit ("root", "admin") < 0)
+    {
+        fprintf (stderr, "Could not log in as root: %d\n", muerrno);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t usedBefore = countUsedBlocks ();
+    int mode = MU_S_IRUSR | MU_S_IWUSR | (compressed ? MU_S_COMPRESSED : 0);
+    double start = now ();
+    for (uint32_t index = 0; index < files; ++index)
+    {
+        snprintf (name, NAME_LENGTH, "cbench%u", index);
+        int fd = mucreat (name, mode);
+        if (fd < 0)
+        {
+            fprintf (stderr, "Could not create %s: %d\n", name, muerrno);
+            exit (EXIT_FAILURE);
+        }
+        for (uint32_t offset = 0; offset < fileBytes; offset += IO_BYTES)
+        {
+            uint32_t count = (fileBytes - offset < IO_BYTES ? fileBytes - offset : IO_BYTES);
+            fillText (buffer, count, index * (fileBytes / IO_BYTES + 1) + offset / IO_BYTES);
+            if (muwrite (fd, buffer, count) != (int)count)
+            {
+                fprintf (stderr, "Could not write %s (is the disk big enough?): %d\n", name, muerrno);
+                exit (EXIT_FAILURE);
+            }
+        }
+        struct muFileStats stats;
+        mufstats (fd, &stats);
+        result->unitsStored += stats.unitsStored;
+        muclose (fd);
+    }
+    mufs_sync ();
+    result->writeSeconds = now () - start;
+    result->bytes = (uint64_t)files * fileBytes;
+    result->blocksUsed = countUsedBlocks () - usedBefore;
+    teardown ();
+
+    setup (diskName);
+    muinit ("root", "admin");
+    start = now ();
+    for (uint32_t index = 0; index < files; ++index)
+    {
+        snprintf (name, NAME_LENGTH, "cbench%u", index);
+        int fd = muopen (name, MU_O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf (stderr, "Could not open %s: %d\n", name, muerrno);
+            exit (EXIT_FAILURE);
+        }
+        for (uint32_t offset = 0; offset < fileBytes; offset += IO_BYTES)
+        {
+            uint32_t count = (fileBytes - offset < IO_BYTES ? fileBytes - offset : IO_BYTES);
+            fillText (expected, count, index * (fileBytes / IO_BYTES + 1) + offset / IO_BYTES);
+            if (muread (fd, buffer, count) != (int)count || memcmp (buffer, expected, count) != 0)
+            {
+                fprintf (stderr, "%s did not read back as written\n", name);
+                exit (EXIT_FAILURE);
+            }
+        }
+        struct muFileStats stats;
+        mufstats (fd, &stats);
+        result->unitsExpanded += stats.unitsExpanded;
+        muclose (fd);
+    }
+    result->readSeconds = now () - start;
+
+    for (uint32_t index = 0; index < files; ++index)
+    {
+        snprintf (name, NAME_LENGTH, "cbench%u", index);
+        muunlink (name);
+    }
+    mufs_sync ();
+    teardown ();
+    free (buffer);
+    free (expected);
+}
+
+// Fills a buffer with words picked by a simple generator, so that the data compresses
+//   about as well as prose and the same seed always gives the same bytes.
+void
+fillText (char* buffer, uint32_t length, uint32_t seed)
+{
+    static const char* words[] = { "the", "block", "of", "a", "file", "is", "written", "to", "disk", "and",
+                                   "read", "back", "from", "cache", "when", "inode", "map", "holds", "data",
+                                   "directory", "entry", "name", "unit", "compressed", "free", "bitmap" };
+    const uint32_t wordCount = sizeof (words) / sizeof (words[0]);
+    uint32_t state = seed * 2654435761u + 1;
+    uint32_t position = 0;
+    while (position < length)
+    {
+        state = state * 1103515245u + 12345u;
+        const char* word = words[(state >> 16) % wordCount];
+        while (*word != '\0' && position < length)
+        {
+            buffer[position++] = *word++;
+        }
+        if (position < length)
+        {
+            buffer[position++] = ((state >> 8) % 16 == 0 ? '\n' : ' ');
+        }
+    }
+}
+
+// Returns the number of blocks that the free block map has in use.
+uint32_t
+countUsedBlocks ()
+{
+    char* isUsed = malloc (BLOCK_COUNT);
+    if (isUsed == NULL)
+    {
+        fprintf (stderr, "Could not allocate a free block map of %u bytes\n", BLOCK_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readFreeBlockMap (isUsed);
+    uint32_t used = 0;
+    for (uint32_t blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
+    {
+        used += (isUsed[blockNum] == BLOCK_USED);
+    }
+    free (isUsed);
+    return used;
+}
+
+// Prints one line of results, with the ratio of the blocks plain files took to the blocks
+//   these files took.
+void
+report (const char* mode, const struct benchResult* result, const struct benchResult* plain)
+{
+    double megabytes = result->bytes / (1024.0 * 1024.0);
+    double ratio = (result->blocksUsed > 0 ? (double)plain->blocksUsed / result->blocksUsed : 0);
+    printf ("%-12s %10u %8.2f %12.1f %12.1f\n", mode, result->blocksUsed, ratio,
+            result->writeSeconds > 0 ? megabytes / result->writeSeconds : 0,
+            result->readSeconds > 0 ? megabytes / result->readSeconds : 0);
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
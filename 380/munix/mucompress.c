@@ -0,0 +1,298 @@
+// File: mucompress.c
+// Author: Matt Shenk
+// Implementation of the block compression of compressed files.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mucompress.h"
+
+// The shortest copy of earlier bytes worth encoding, and the furthest back one can reach.
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// Each sequence starts with a token: the count of bytes copied as they are in the high
+//   4 bits and the length of the copy less LZ_MIN_MATCH in the low 4, either of which is
+//   continued in bytes of its own when it reaches LZ_LENGTH_MASK.
+#define LZ_LENGTH_MASK 15
+#define LZ_HASH_BITS 12
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Returns the hash of the 4 bytes at a position, which picks its slot in the table of
+//   where each hash was last seen.
+static uint32_t
+hashFour (const unsigned char* position)
+{
+    uint32_t value;
+    memcpy (&value, position, sizeof (value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Appends a length that did not fit in its token: 255 for every 255 of it, then the rest.
+static uint32_t
+putLength (unsigned char* output, uint32_t outPos, uint32_t rest)
+{
+    while (rest >= 255)
+    {
+        output[outPos++] = 255;
+        rest -= 255;
+    }
+    output[outPos++] = rest;
+    return outPos;
+}
+
+// Reads a length continued past its token, adding it to value.
+// Returns:
+//   0 on success, or -1 if the input ends first.
+static int
+getLength (const unsigned char* input, uint32_t length, uint32_t* inPos, uint32_t* value)
+{
+    unsigned char part;
+    do
+    {
+        if (*inPos >= length)
+        {
+            return -1;
+        }
+        part = input[(*inPos)++];
+        *value += part;
+    } while (part == 255);
+    return 0;
+}
+
+// Appends one sequence: literalLength bytes as they are, then (unless matchLength is 0,
+//   which only the last sequence has) a copy of matchLength bytes from offset back.
+// Returns:
+//   1 on success, or 0 if the sequence might not fit in capacity.
+static int
+putSequence (unsigned char* output, uint32_t capacity, uint32_t* outPos, const unsigned char* literals,
+             uint32_t literalLength, uint32_t offset, uint32_t matchLength)
+{
+    uint32_t matchCode = (matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0);
+    uint64_t needed = 1 + literalLength / 255 + 1 + literalLength + 2 + matchCode / 255 + 1;
+    if (*outPos + needed > capacity)
+    {
+        return 0;
+    }
+    uint32_t position = *outPos;
+    output[position++] = ((literalLength < LZ_LENGTH_MASK ? literalLength : LZ_LENGTH_MASK) << 4)
+                         | (matchCode < LZ_LENGTH_MASK ? matchCode : LZ_LENGTH_MASK);
+    if (literalLength >= LZ_LENGTH_MASK)
+    {
+        position = putLength (output, position, literalLength - LZ_LENGTH_MASK);
+    }
+    memcpy (output + position, literals, literalLength);
+    position += literalLength;
+    if (matchLength > 0)
+    {
+        output[position++] = offset & 0xff;
+        output[position++] = offset >> 8;
+        if (matchCode >= LZ_LENGTH_MASK)
+        {
+            position = putLength (output, position, matchCode - LZ_LENGTH_MASK);
+        }
+    }
+    *outPos = position;
+    return 1;
+}
+
+// Returns 1 if a block holds nothing but zeros, 0 otherwise.
+static int
+isZeroBlock (const char* block)
+{
+    for (uint32_t position = 0; position < BLOCK_SIZE; ++position)
+    {
+        if (block[position] != '\0')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+//// The codec /////////////////////////////////////////////////
+
+
+uint32_t
+lzCompress (const char* input, uint32_t length, char* output, uint32_t capacity)
+{
+    assert (length <= MAX_BLOCK_SIZE);
+    const unsigned char* in = (const unsigned char*)input;
+    unsigned char* out = (unsigned char*)output;
+    // Where each hash was last seen; a position of 0 is never taken for a match of itself.
+    uint16_t lastSeen[1 << LZ_HASH_BITS];
+    memset (lastSeen, 0, sizeof (lastSeen));
+    uint32_t outPos = 0;
+    uint32_t anchor = 0;
+    uint32_t position = 0;
+    while (position + LZ_MIN_MATCH <= length)
+    {
+        uint32_t hash = hashFour (in + position);
+        uint32_t candidate = lastSeen[hash];
+        lastSeen[hash] = position;
+        if (candidate >= position || position - candidate > LZ_MAX_OFFSET
+            || memcmp (in + candidate, in + position, LZ_MIN_MATCH) != 0)
+        {
+            ++position;
+            continue;
+        }
+        uint32_t matchLength = LZ_MIN_MATCH;
+        while (position + matchLength < length && in[candidate + matchLength] == in[position + matchLength])
+        {
+            ++matchLength;
+        }
+        if (!putSequence (out, capacity, &outPos, in + anchor, position - anchor, position - candidate, matchLength))
+        {
+            return 0;
+        }
+        position += matchLength;
+        anchor = position;
+    }
+    if (!putSequence (out, capacity, &outPos, in + anchor, length - anchor, 0, 0))
+    {
+        return 0;
+    }
+    return outPos;
+}
+
+int
+lzExpand (const char* input, uint32_t length, char* output, uint32_t capacity)
+{
+    const unsigned char* in = (const unsigned char*)input;
+    unsigned char* out = (unsigned char*)output;
+    uint32_t inPos = 0;
+    uint32_t outPos = 0;
+    while (inPos < length)
+    {
+        unsigned char token = in[inPos++];
+        uint32_t literalLength = token >> 4;
+        if (literalLength == LZ_LENGTH_MASK && getLength (in, length, &inPos, &literalLength) < 0)
+        {
+            return -1;
+        }
+        if (literalLength > length - inPos || literalLength > capacity - outPos)
+        {
+            return -1;
+        }
+        memcpy (out + outPos, in + inPos, literalLength);
+        inPos += literalLength;
+        outPos += literalLength;
+        // Only the last sequence ends without a copy.
+        if (inPos == length)
+        {
+            break;
+        }
+        if (length - inPos < 2)
+        {
+            return -1;
+        }
+        uint32_t offset = in[inPos] | (in[inPos + 1] << 8);
+        inPos += 2;
+        uint32_t matchLength = token & LZ_LENGTH_MASK;
+        if (matchLength == LZ_LENGTH_MASK && getLength (in, length, &inPos, &matchLength) < 0)
+        {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > outPos || matchLength > capacity - outPos)
+        {
+            return -1;
+        }
+        // The copy may overlap what it produces, so it goes a byte at a time.
+        for (uint32_t index = 0; index < matchLength; ++index)
+        {
+            out[outPos + index] = out[outPos - offset + index];
+        }
+        outPos += matchLength;
+    }
+    return outPos;
+}
+
+
+//// Units of blocks ///////////////////////////////////////////
+
+
+uint32_t
+packUnit (const char* data, uint32_t blockCount, char* stored)
+{
+    assert (0 < blockCount && blockCount <= COMPRESSION_UNIT_BLOCKS);
+    struct compressedUnit header;
+    memset (&header, 0, sizeof (header));
+    // Packing is only worth it if it saves a block.
+    uint32_t limit = (blockCount - 1) * BLOCK_SIZE;
+    uint32_t used = sizeof (header);
+    int allZeros = 1;
+    for (uint32_t blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+    {
+        const char* block = data + (size_t)blockIndex * BLOCK_SIZE;
+        if (isZeroBlock (block))
+        {
+            continue;
+        }
+        allZeros = 0;
+        if (used >= limit)
+        {
+            return blockCount;
+        }
+        // A compressed form must be shorter than the block to be told apart from it.
+        uint32_t room = limit - used;
+        uint32_t length = lzCompress (block, BLOCK_SIZE, stored + used, (room < BLOCK_SIZE ? room : BLOCK_SIZE - 1));
+        if (length == 0)
+        {
+            if (room < BLOCK_SIZE)
+            {
+                return blockCount;
+            }
+            memcpy (stored + used, block, BLOCK_SIZE);
+            length = BLOCK_SIZE;
+        }
+        header.blockLengths[blockIndex] = length;
+        used += length;
+    }
+    if (allZeros)
+    {
+        return 0;
+    }
+    memcpy (stored, &header, sizeof (header));
+    uint32_t storedBlocks = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset (stored + used, 0, (size_t)storedBlocks * BLOCK_SIZE - used);
+    return storedBlocks;
+}
+
+int
+unpackUnit (const char* stored, uint32_t storedBlocks, uint32_t blockCount, char* data)
+{
+    assert (0 < blockCount && blockCount <= COMPRESSION_UNIT_BLOCKS);
+    struct compressedUnit header;
+    memcpy (&header, stored, sizeof (header));
+    uint32_t available = storedBlocks * BLOCK_SIZE;
+    uint32_t used = sizeof (header);
+    for (uint32_t blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+    {
+        char* block = data + (size_t)blockIndex * BLOCK_SIZE;
+        uint32_t length = header.blockLengths[blockIndex];
+        if (length > BLOCK_SIZE || length > available - used)
+        {
+            return -1;
+        }
+        if (length == 0)
+        {
+            memset (block, 0, BLOCK_SIZE);
+        }
+        else if (length == BLOCK_SIZE)
+        {
+            memcpy (block, stored + used, BLOCK_SIZE);
+        }
+        else if (lzExpand (stored + used, length, block, BLOCK_SIZE) != (int)BLOCK_SIZE)
+        {
+            return -1;
+        }
+        used += length;
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+// File: mucompress.h
+// Author: Matt Shenk
+// Interface for the block compression of compressed files on VERSION23 images (see
+//   struct compressedUnit in mufs.h): a small LZ77 codec of our own, and the packing of a
+//   unit of blocks into the fewest blocks that will hold it.
+// None of these functions read or write the disk, so they work the same on a loaded
+//   filesystem and on an image that mkdisk is building.
+// Part of munix lab in CSCI380.
+
+#ifndef MUCOMPRESS_H
+#define MUCOMPRESS_H
+
+#include <stdint.h>
+
+#include "mufs.h"
+
+
+// Compresses bytes.  The compressed form is a series of sequences, each made of some
+//   bytes copied as they are followed by a copy of at least 4 earlier bytes, found
+//   through a hash of the 4 bytes at each position (in the style of LZ4).
+// Params:
+//   input - The bytes to compress.
+//   length - The number of bytes, at most MAX_BLOCK_SIZE.
+//   output - Receives the compressed form.
+//   capacity - The most bytes that output can take.
+// Returns:
+//   The length of the compressed form, or 0 if it does not fit in capacity.
+uint32_t
+lzCompress (const char* input, uint32_t length, char* output, uint32_t capacity);
+
+
+// Expands bytes compressed by lzCompress.
+// Params:
+//   input - The compressed form.
+//   length - Its length.
+//   output - Receives the bytes.
+//   capacity - The most bytes that output can take.
+// Returns:
+//   The number of bytes expanded, or -1 if input is damaged or expands past capacity.
+int
+lzExpand (const char* input, uint32_t length, char* output, uint32_t capacity);
+
+
+// Packs a unit of blocks for storing (see struct compressedUnit).
+// Params:
+//   data - The unit's blocks, blockCount * BLOCK_SIZE bytes.
+//   blockCount - The number of blocks in the unit, from 1 to COMPRESSION_UNIT_BLOCKS.
+//   stored - Receives the compressed form, padded with zeros to whole blocks, when there
+//     is one; it needs room for COMPRESSION_UNIT_BLOCKS blocks.
+// Returns:
+//   The number of data blocks the unit needs: 0 if it is all zeros, blockCount if it is
+//   to be stored as it is, and otherwise fewer, in which case stored holds them.
+uint32_t
+packUnit (const char* data, uint32_t blockCount, char* stored);
+
+
+// Expands a compressed unit.
+// Params:
+//   stored - The unit's data blocks, which start with a struct compressedUnit.
+//   storedBlocks - The number of data blocks in stored.
+//   blockCount - The number of blocks in the unit.
+//   data - Receives the unit's blocks, blockCount * BLOCK_SIZE bytes.
+// Returns:
+//   0 on success, or -1 if the stored form is damaged.
+int
+unpackUnit (const char* stored, uint32_t storedBlocks, uint32_t blockCount, char* data);
+
+#endif//MUCOMPRESS_H
@@ -0,0 +1,298 @@
+// File: mudbench.c
+// Author: Matt Shenk
+// A benchmark of inline deduplication: writes a set of files in which groups of files hold
+//   the same data (as copies or backups of one file would, each with a header of its
+//   own), reads them back with a cold block cache, rewrites part of one file of each
+//   group, and removes them, once with every block written and once with mudedup on,
+//   reporting the blocks each set takes (the deduplication ratio) and the read, write and
+//   rewrite throughput.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "munix.h"
+#include "mufs.h"
+
+#define DEFAULT_FILES 16
+#define DEFAULT_FILE_KB 128
+#define DEFAULT_COPIES 4
+#define IO_BYTES (64 * 1024)
+#define NAME_LENGTH 32
+
+// The results of one run of the workload.
+struct benchResult
+{
+    uint64_t bytes;
+    uint32_t blocksUsed;
+    double writeSeconds;
+    double readSeconds;
+    uint64_t rewriteBytes;
+    double rewriteSeconds;
+    uint64_t sharedBlocks;
+    uint64_t unsharedBlocks;
+};
+
+void
+runWorkload (const char* diskName, int dedup, uint32_t files, uint32_t fileBytes, uint32_t copies,
+             struct benchResult* result);
+
+void
+checkFiles (uint32_t files, uint32_t fileBytes, uint32_t copies, uint32_t rewriteOffset, char* buffer, char* expected);
+
+void
+fillChunk (char* buffer, uint32_t length, uint32_t file, uint32_t offset, uint32_t copies);
+
+uint32_t
+countUsedBlocks ();
+
+void
+report (const char* mode, const struct benchResult* result, const struct benchResult* plain);
+
+double
+now ();
+
+int
+main (int argc, char* argv[])
+{
+    if (argc < 2 || argc > 5)
+    {
+        fprintf (stderr, "Usage: %s diskName [files] [fileKB] [copies]\n", argv[0]);
+        fprintf (stderr, "Each group of copies files holds the same data but for its first block.\n");
+        fprintf (stderr, "The disk should be made with mkdisk --dedup, with room for every file\n");
+        fprintf (stderr, "  (mkdisk --dedup --blocks 4096 for the defaults of %d files of %d KB).\n",
+                 DEFAULT_FILES, DEFAULT_FILE_KB);
+        exit (EXIT_FAILURE);
+    }
+    long files = (argc > 2 ? atol (argv[2]) : DEFAULT_FILES);
+    long fileKB = (argc > 3 ? atol (argv[3]) : DEFAULT_FILE_KB);
+    long copies = (argc > 4 ? atol (argv[4]) : DEFAULT_COPIES);
+    if (files < 1 || fileKB < 1 || fileKB > 1024 * 1024 || copies < 1)
+    {
+        fprintf (stderr, "There must be at least 1 file, of 1 KB to 1 GB, and at least 1 copy of each\n");
+        exit (EXIT_FAILURE);
+    }
+
+    struct benchResult plain;
+    struct benchResult deduplicated;
+    runWorkload (argv[1], 0, files, fileKB * 1024, copies, &plain);
+    runWorkload (argv[1], 1, files, fileKB * 1024, copies, &deduplicated);
+
+    printf ("%ld files of %ld KB, %ld copies of each\n", files, fileKB, copies);
+    printf ("%-12s %10s %8s %12s %12s %12s\n", "mode", "blocks", "ratio", "write MB/s", "read MB/s", "rewrite MB/s");
+    report ("plain", &plain, &plain);
+    report ("dedup", &deduplicated, &plain);
+    printf ("Dedup shared %lu blocks as they were written; rewriting gave %lu shared blocks data blocks of their own\n",
+            (unsigned long)deduplicated.sharedBlocks, (unsigned long)deduplicated.unsharedBlocks);
+    return EXIT_SUCCESS;
+}
+
+// Writes the files, then reads them back and checks them after reloading the disk (so
+//   that nothing is read from the block cache), rewrites a chunk in the middle of the first
+//   file of each group and checks every file again, then removes them.
+// Params:
+//   diskName - The disk image, which must be VERSION24.
+//   dedup - 1 to write with mudedup on, 0 to write every block.
+//   files - How many files to write.
+//   fileBytes - The size of each file.
+//   copies - How many files hold the same data.
+//   result - Receives the measurements.
+void
+runWorkload (const char* diskName, int dedup, uint32_t files, uint32_t fileBytes, uint32_t copies,
+             struct benchResult* result)
+{
+    memset (result, 0, sizeof (*result));
+    char* expected = malloc (IO_BYTES);
+    char* buffer = malloc (IO_BYTES);
+    if (expected == NULL || buffer == NULL)
+    {
+        fprintf (stderr, "Could not allocate buffers of %d bytes\n", IO_BYTES);
+        exit (EXIT_FAILURE);
+    }
+    char name[NAME_LENGTH];
+
+    setup (diskName);
+    if (!usesSharedBlocks ())
+    {
+        fprintf (stderr, "%s cannot share blocks; make it with mkdisk --dedup\n", diskName);
+        exit (EXIT_FAILURE);
+    }
+    if (muinit ("root", "admin") < 0)
+    {
+        fprintf (stderr, "Could not log in as root: %d\n", muerrno);
+        exit (EXIT_FAILURE);
+    }
+    mudedup (dedup);
+    uint32_t usedBefore = countUsedBlocks ();
+    double start = now ();
+    for (uint32_t index = 0; index < files; ++index)
+    {
+        snprintf (name, NAME_LENGTH, "dbench%u", index);
+        int fd = mucreat (name, MU_S_IRUSR | MU_S_IWUSR);
+        if (fd < 0)
+        {
+            fprintf (stderr, "Could not create %s: %d\n", name, muerrno);
+            exit (EXIT_FAILURE);
+        }
+        for (uint32_t offset = 0; offset < fileBytes; offset += IO_BYTES)
+        {
+            uint32_t count = (fileBytes - offset < IO_BYTES ? fileBytes - offset : IO_BYTES);
+            fillChunk (buffer, count, index, offset, copies);
+            if (muwrite (fd, buffer, count) != (int)count)
+            {
+                fprintf (stderr, "Could not write %s (is the disk big enough?): %d\n", name, muerrno);
+                exit (EXIT_FAILURE);
+            }
+        }
+        struct muFileStats stats;
+        mufstats (fd, &stats);
+        result->sharedBlocks += stats.sharedBlocks;
+        muclose (fd);
+    }
+    mufs_sync ();
+    result->writeSeconds = now () - start;
+    result->bytes = (uint64_t)files * fileBytes;
+    result->blocksUsed = countUsedBlocks () - usedBefore;
+    teardown ();
+
+    setup (diskName);
+    muinit ("root", "admin");
+    start = now ();
+    checkFiles (files, fileBytes, copies, fileBytes, buffer, expected);
+    result->readSeconds = now () - start;
+
+    // The rewritten chunk gets data of its own, so the blocks it shared with the group's
+    //   other files need data blocks of their own first, and those files must keep theirs.
+    uint32_t rewriteOffset = (fileBytes / 2) / IO_BYTES * IO_BYTES;
+    uint32_t rewriteBytes = (fileBytes - rewriteOffset < IO_BYTES ? fileBytes - rewriteOffset : IO_BYTES);
+    start = now ();
+    for (uint32_t index = 0; index < files; index += copies)
+    {
+        snprintf (name, NAME_LENGTH, "dbench%u", index);
+        int fd = muopen (name, MU_O_WRONLY);
+        fillChunk (buffer, rewriteBytes, index, rewriteOffset, 1);
+        if (fd < 0 || museek (fd, rewriteOffset) < 0 || muwrite (fd, buffer, rewriteBytes) != (int)rewriteBytes)
+        {
+            fprintf (stderr, "Could not rewrite %s: %d\n", name, muerrno);
+            exit (EXIT_FAILURE);
+        }
+        struct muFileStats stats;
+        mufstats (fd, &stats);
+        result->unsharedBlocks += stats.unsharedBlocks;
+        result->rewriteBytes += rewriteBytes;
+        muclose (fd);
+    }
+    mufs_sync ();
+    result->rewriteSeconds = now () - start;
+    checkFiles (files, fileBytes, copies, rewriteOffset, buffer, expected);
+
+    for (uint32_t index = 0; index < files; ++index)
+    {
+        snprintf (name, NAME_LENGTH, "dbench%u", index);
+        muunlink (name);
+    }
+    mufs_sync ();
+    teardown ();
+    free (buffer);
+    free (expected);
+}
+
+// Reads every file back and checks that it holds what was written.
+// Params:
+//   files, fileBytes, copies - As for runWorkload.
+//   rewriteOffset - Where the chunk that the first file of each group has rewritten
+//     starts, a multiple of IO_BYTES, or fileBytes if none has been.
+//   buffer, expected - Buffers of IO_BYTES bytes.
+void
+checkFiles (uint32_t files, uint32_t fileBytes, uint32_t copies, uint32_t rewriteOffset, char* buffer, char* expected)
+{
+    char name[NAME_LENGTH];
+    for (uint32_t index = 0; index < files; ++index)
+    {
+        snprintf (name, NAME_LENGTH, "dbench%u", index);
+        int fd = muopen (name, MU_O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf (stderr, "Could not open %s: %d\n", name, muerrno);
+            exit (EXIT_FAILURE);
+        }
+        for (uint32_t offset = 0; offset < fileBytes; offset += IO_BYTES)
+        {
+            uint32_t count = (fileBytes - offset < IO_BYTES ? fileBytes - offset : IO_BYTES);
+            int rewritten = (offset == rewriteOffset && index % copies == 0);
+            fillChunk (expected, count, index, offset, rewritten ? 1 : copies);
+            if (muread (fd, buffer, count) != (int)count || memcmp (buffer, expected, count) != 0)
+            {
+                fprintf (stderr, "%s did not read back as written\n", name);
+                exit (EXIT_FAILURE);
+            }
+        }
+        muclose (fd);
+    }
+}
+
+// Fills a buffer with part of a file's data.  Every file in a group of copies holds the
+//   same data but for its first block, and no two blocks of that data are the same.
+// Params:
+//   buffer - The buffer to fill.
+//   length - The number of bytes, a multiple of 8.
+//   file - The file's number.
+//   offset - Where in the file the data goes, a multiple of 8.
+//   copies - How many files hold the same data (1 for data of the file's own).
+void
+fillChunk (char* buffer, uint32_t length, uint32_t file, uint32_t offset, uint32_t copies)
+{
+    uint32_t group = file / copies;
+    for (uint32_t position = 0; position < length; position += sizeof (uint64_t))
+    {
+        uint64_t place = offset + position;
+        uint64_t seed = (place < BLOCK_SIZE || copies == 1 ? file + 0x100000000ull : group);
+        uint64_t word = (seed * 0x9E3779B97F4A7C15ull) ^ (place * 0xC2B2AE3D27D4EB4Full);
+        word ^= word >> 29;
+        memcpy (buffer + position, &word, sizeof (word));
+    }
+}
+
+// Returns the number of blocks that the free block map has in use.
+uint32_t
+countUsedBlocks ()
+{
+    char* isUsed = malloc (BLOCK_COUNT);
+    if (isUsed == NULL)
+    {
+        fprintf (stderr, "Could not allocate a free block map of %u bytes\n", BLOCK_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readFreeBlockMap (isUsed);
+    uint32_t used = 0;
+    for (uint32_t blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
+    {
+        used += (isUsed[blockNum] == BLOCK_USED);
+    }
+    free (isUsed);
+    return used;
+}
+
+// Prints one line of results, with the ratio of the blocks plain files took to the blocks
+//   these files took.
+void
+report (const char* mode, const struct benchResult* result, const struct benchResult* plain)
+{
+    double megabytes = result->bytes / (1024.0 * 1024.0);
+    double ratio = (result->blocksUsed > 0 ? (double)plain->blocksUsed / result->blocksUsed : 0);
+    printf ("%-12s %10u %8.2f %12.1f %12.1f %12.1f\n", mode, result->blocksUsed, ratio,
+            result->writeSeconds > 0 ? megabytes / result->writeSeconds : 0,
+            result->readSeconds > 0 ? megabytes / result->readSeconds : 0,
+            result->rewriteSeconds > 0 ? result->rewriteBytes / (1024.0 * 1024.0) / result->rewriteSeconds : 0);
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
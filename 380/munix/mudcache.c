@@ -0,0 +1,331 @@
+// File: mudcache.c
+// Author: Matt Shenk
+// Implementation of the directory entry cache used by munix for name lookups.
+// Every cached directory has an open-addressing hash table of its entries, and the
+//   least-recently-used directory is dropped when the cache is full.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mudcache.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_DELETED 2
+#define INITIAL_SLOTS 64
+// The inode number of a name that a partial index knows does not exist.
+#define ABSENT_INODE ((uint32_t)DCACHE_NOT_FOUND)
+
+// One name in a directory's index.
+struct dcacheSlot
+{
+    char name[MAX_NAME_LENGTH];
+    uint32_t iNodeNumber;
+    int state;
+};
+
+// The index of one directory.
+struct directoryIndex
+{
+    // The inode number of the directory, only meaningful if valid.
+    uint32_t dirINodeNumber;
+    int valid;
+    // Whether the index holds only the names looked up so far, rather than every entry.
+    int partial;
+    // When the index was last used, for choosing what to evict.
+    uint64_t lastUse;
+    // The hash table, with capacity always a power of two.
+    struct dcacheSlot* slots;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t deleted;
+};
+
+static struct directoryIndex directories[DCACHE_MAX_DIRECTORIES];
+static uint64_t useCounter = 0;
+static struct dcacheStats stats;
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// FNV-1a hash of a directory entry name.
+static uint32_t
+hashName (const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (int index = 0; index < MAX_NAME_LENGTH && name[index] != '\0'; ++index)
+    {
+        hash ^= (uint8_t)name[index];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct directoryIndex*
+findDirectory (uint32_t dirINodeNumber)
+{
+    for (int index = 0; index < DCACHE_MAX_DIRECTORIES; ++index)
+    {
+        if (directories[index].valid && directories[index].dirINodeNumber == dirINodeNumber)
+        {
+            directories[index].lastUse = ++useCounter;
+            return &directories[index];
+        }
+    }
+    return NULL;
+}
+
+static void
+releaseDirectory (struct directoryIndex* directory)
+{
+    free (directory->slots);
+    memset (directory, 0, sizeof (struct directoryIndex));
+}
+
+static struct dcacheSlot*
+allocateSlots (uint32_t capacity)
+{
+    struct dcacheSlot* slots = calloc (capacity, sizeof (struct dcacheSlot));
+    if (slots == NULL)
+    {
+        fprintf (stderr, "Could not allocate a directory index of %u entries\n", capacity);
+        exit (EXIT_FAILURE);
+    }
+    return slots;
+}
+
+// Returns the slot holding name, or NULL if the name is not in the index.
+static struct dcacheSlot*
+findSlot (struct directoryIndex* directory, const char* name)
+{
+    uint32_t mask = directory->capacity - 1;
+    for (uint32_t probe = hashName (name) & mask; directory->slots[probe].state != SLOT_EMPTY; probe = (probe + 1) & mask)
+    {
+        if (directory->slots[probe].state == SLOT_USED && strncmp (directory->slots[probe].name, name, MAX_NAME_LENGTH) == 0)
+        {
+            return &directory->slots[probe];
+        }
+    }
+    return NULL;
+}
+
+// Places a name known not to be in the index into the first free slot of its probe sequence.
+static void
+insertSlot (struct directoryIndex* directory, const char* name, uint32_t iNodeNumber)
+{
+    uint32_t mask = directory->capacity - 1;
+    uint32_t probe = hashName (name) & mask;
+    while (directory->slots[probe].state == SLOT_USED)
+    {
+        probe = (probe + 1) & mask;
+    }
+    if (directory->slots[probe].state == SLOT_DELETED)
+    {
+        --directory->deleted;
+    }
+    // Names are always shorter than MAX_NAME_LENGTH (see walkPath).
+    memset (directory->slots[probe].name, 0, MAX_NAME_LENGTH);
+    strncpy (directory->slots[probe].name, name, MAX_NAME_LENGTH - 1);
+    directory->slots[probe].iNodeNumber = iNodeNumber;
+    directory->slots[probe].state = SLOT_USED;
+    ++directory->used;
+}
+
+// Starts a new, empty index for a directory, evicting the least recently used directory
+//   if the cache is full.
+static void
+beginDirectory (uint32_t dirINodeNumber, int partial)
+{
+    dcacheInvalidate (dirINodeNumber);
+    struct directoryIndex* victim = &directories[0];
+    for (int index = 0; index < DCACHE_MAX_DIRECTORIES; ++index)
+    {
+        if (!directories[index].valid)
+        {
+            victim = &directories[index];
+            break;
+        }
+        if (directories[index].lastUse < victim->lastUse)
+        {
+            victim = &directories[index];
+        }
+    }
+    if (victim->valid)
+    {
+        releaseDirectory (victim);
+        ++stats.evictions;
+    }
+    victim->dirINodeNumber = dirINodeNumber;
+    victim->valid = 1;
+    victim->partial = partial;
+    victim->lastUse = ++useCounter;
+    victim->capacity = INITIAL_SLOTS;
+    victim->slots = allocateSlots (INITIAL_SLOTS);
+    ++stats.builds;
+}
+
+// Rebuilds the table so that it is at most half full, discarding deleted markers.
+static void
+rehash (struct directoryIndex* directory)
+{
+    uint32_t oldCapacity = directory->capacity;
+    struct dcacheSlot* oldSlots = directory->slots;
+    while ((directory->used + 1) * 2 > directory->capacity)
+    {
+        directory->capacity *= 2;
+    }
+    directory->slots = allocateSlots (directory->capacity);
+    directory->used = 0;
+    directory->deleted = 0;
+    for (uint32_t index = 0; index < oldCapacity; ++index)
+    {
+        if (oldSlots[index].state == SLOT_USED)
+        {
+            insertSlot (directory, oldSlots[index].name, oldSlots[index].iNodeNumber);
+        }
+    }
+    free (oldSlots);
+}
+
+// Records a name's inode number (or ABSENT_INODE) in a directory's index.
+static void
+addName (struct directoryIndex* directory, const char* name, uint32_t iNodeNumber)
+{
+    struct dcacheSlot* slot = findSlot (directory, name);
+    if (slot != NULL)
+    {
+        slot->iNodeNumber = iNodeNumber;
+        return;
+    }
+    // A partial index would otherwise grow with every name ever looked up.
+    if (directory->partial && directory->used >= DCACHE_MAX_PARTIAL_NAMES)
+    {
+        memset (directory->slots, 0, (size_t)directory->capacity * sizeof (struct dcacheSlot));
+        directory->used = 0;
+        directory->deleted = 0;
+    }
+    if ((directory->used + directory->deleted + 1) * 2 > directory->capacity)
+    {
+        rehash (directory);
+    }
+    insertSlot (directory, name, iNodeNumber);
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+int
+dcacheLookup (uint32_t dirINodeNumber, const char* name)
+{
+    struct directoryIndex* directory = findDirectory (dirINodeNumber);
+    if (directory == NULL)
+    {
+        ++stats.misses;
+        return DCACHE_NOT_CACHED;
+    }
+    struct dcacheSlot* slot = findSlot (directory, name);
+    if (slot == NULL && directory->partial)
+    {
+        ++stats.misses;
+        return DCACHE_NOT_CACHED;
+    }
+    if (slot == NULL || slot->iNodeNumber == ABSENT_INODE)
+    {
+        ++stats.negativeHits;
+        return DCACHE_NOT_FOUND;
+    }
+    ++stats.hits;
+    return slot->iNodeNumber;
+}
+
+void
+dcacheBeginDirectory (uint32_t dirINodeNumber)
+{
+    beginDirectory (dirINodeNumber, 0);
+}
+
+void
+dcacheBeginPartialDirectory (uint32_t dirINodeNumber)
+{
+    if (findDirectory (dirINodeNumber) == NULL)
+    {
+        beginDirectory (dirINodeNumber, 1);
+    }
+}
+
+void
+dcacheAdd (uint32_t dirINodeNumber, const char* name, uint32_t iNodeNumber)
+{
+    struct directoryIndex* directory = findDirectory (dirINodeNumber);
+    if (directory != NULL)
+    {
+        addName (directory, name, iNodeNumber);
+    }
+}
+
+void
+dcacheAddAbsent (uint32_t dirINodeNumber, const char* name)
+{
+    struct directoryIndex* directory = findDirectory (dirINodeNumber);
+    if (directory != NULL && directory->partial)
+    {
+        addName (directory, name, ABSENT_INODE);
+    }
+}
+
+void
+dcacheRemove (uint32_t dirINodeNumber, const char* name)
+{
+    struct directoryIndex* directory = findDirectory (dirINodeNumber);
+    if (directory == NULL)
+    {
+        return;
+    }
+    struct dcacheSlot* slot = findSlot (directory, name);
+    if (slot != NULL && directory->partial)
+    {
+        // The name is now known not to exist.
+        slot->iNodeNumber = ABSENT_INODE;
+    }
+    else if (slot != NULL)
+    {
+        slot->state = SLOT_DELETED;
+        --directory->used;
+        ++directory->deleted;
+    }
+}
+
+void
+dcacheInvalidate (uint32_t dirINodeNumber)
+{
+    for (int index = 0; index < DCACHE_MAX_DIRECTORIES; ++index)
+    {
+        if (directories[index].valid && directories[index].dirINodeNumber == dirINodeNumber)
+        {
+            releaseDirectory (&directories[index]);
+        }
+    }
+}
+
+void
+dcacheClear ()
+{
+    for (int index = 0; index < DCACHE_MAX_DIRECTORIES; ++index)
+    {
+        if (directories[index].valid)
+        {
+            releaseDirectory (&directories[index]);
+        }
+    }
+}
+
+void
+getDcacheStats (struct dcacheStats* out)
+{
+    *out = stats;
+}
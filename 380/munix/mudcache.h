@@ -0,0 +1,90 @@
+// File: mudcache.h
+// Author: Matt Shenk
+// Interface of the directory entry cache used by munix for name lookups.
+// Each cached directory gets a complete hash index from entry name to inode number,
+//   so a name that is absent from the index is known not to exist (a negative hit).
+// A directory too big to read in whole (one with an index on disk) gets a partial index
+//   instead, holding just the names looked up in it, including those found not to exist.
+// Part of munix lab in CSCI380.
+
+#ifndef MUDCACHE_H
+#define MUDCACHE_H
+
+#include <stdint.h>
+
+#define DCACHE_NOT_FOUND -1
+#define DCACHE_NOT_CACHED -2
+#define DCACHE_MAX_DIRECTORIES 16
+// How many names a partial index holds before it is emptied and starts again.
+#define DCACHE_MAX_PARTIAL_NAMES 4096
+
+// Counters describing how well the directory entry cache is working.
+struct dcacheStats
+{
+    // Lookups answered with an inode number.
+    uint64_t hits;
+    // Lookups answered with "no such entry".
+    uint64_t negativeHits;
+    // Lookups in a directory that was not indexed, or of a name a partial index does not hold.
+    uint64_t misses;
+    // Directory indexes that were built.
+    uint64_t builds;
+    // Directory indexes that were thrown away to make room for others.
+    uint64_t evictions;
+};
+
+
+// Looks up a name in a directory's index.
+// Returns:
+//   The inode number of the entry, DCACHE_NOT_FOUND if the directory is indexed and
+//   has no such entry, or DCACHE_NOT_CACHED if the directory is not indexed (or has a
+//   partial index that does not know of the name).
+int
+dcacheLookup (uint32_t dirINodeNumber, const char* name);
+
+
+// Starts a new, empty index for a directory, evicting another directory if necessary.
+// The caller is expected to follow up with dcacheAdd for every entry in the directory.
+void
+dcacheBeginDirectory (uint32_t dirINodeNumber);
+
+
+// Starts a new, empty partial index for a directory, evicting another directory if
+//   necessary, unless the directory already has an index.
+// The caller is expected to follow up with dcacheAdd or dcacheAddAbsent for each name it
+//   looks up in the directory.
+void
+dcacheBeginPartialDirectory (uint32_t dirINodeNumber);
+
+
+// Records that a directory contains an entry.  Does nothing if the directory is not indexed.
+void
+dcacheAdd (uint32_t dirINodeNumber, const char* name, uint32_t iNodeNumber);
+
+
+// Records that a directory has no entry with a name.  Does nothing unless the directory
+//   has a partial index (a complete index already knows).
+void
+dcacheAddAbsent (uint32_t dirINodeNumber, const char* name);
+
+
+// Records that a directory no longer contains an entry.  Does nothing if the directory is not indexed.
+void
+dcacheRemove (uint32_t dirINodeNumber, const char* name);
+
+
+// Throws away the index of one directory.
+void
+dcacheInvalidate (uint32_t dirINodeNumber);
+
+
+// Throws away every index.
+void
+dcacheClear ();
+
+
+// Copies the current cache counters into stats.
+void
+getDcacheStats (struct dcacheStats* stats);
+
+#endif//MUDCACHE_H
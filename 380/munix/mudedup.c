@@ -0,0 +1,290 @@
+// File: mudedup.c
+// Author: Matt Shenk
+// Offline deduplication of MUFS images that can share blocks (VERSION24).  It reads every
+//   data block of every regular file, and when one holds the same data as a block it has
+//   already seen, maps the file to that block instead and releases its own copy.  The
+//   blocks are shared by reference count (see VERSION24 in mufs.h), so writing either
+//   file later gives it a copy of its own again.  It reports the blocks saved.
+// Compressed and inline files are left alone, and the image must not be in use.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mufs.h"
+#include "mufile.h"
+#include "muhash.h"
+
+// The longest run of blocks that is moved to shared blocks at once.
+#define MAX_SHARED_RUN 64
+
+// Totals over every file checked.
+struct dedupTotals
+{
+    uint32_t files;
+    uint32_t changedFiles;
+    uint64_t blocksRead;
+    uint64_t sharedBlocks;
+};
+
+int
+isShareable (const struct iNode* node);
+
+uint32_t
+dedupFile (uint32_t iNodeNumber, struct iNode* node, struct blockIndex* index, char* block, char* stored,
+           struct dedupTotals* totals);
+
+uint32_t
+matchingRun (const struct iNode* node, uint32_t blockIndex, uint32_t mapped, uint32_t target,
+             const struct blockIndex* index, char* block, char* stored, uint32_t* oldBlocks,
+             struct dedupTotals* totals);
+
+int
+holdsSameData (uint32_t blockNum, const char* block, char* stored);
+
+uint32_t
+countUsedBlocks ();
+
+double
+now ();
+
+int
+main (int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf (stderr, "Usage: %s diskName\n", argv[0]);
+        fprintf (stderr, "The disk should be made with mkdisk --dedup, and not be in use.\n");
+        exit (EXIT_FAILURE);
+    }
+
+    double start = now ();
+    setup (argv[1]);
+    if (!usesSharedBlocks ())
+    {
+        fprintf (stderr, "%s cannot share blocks; make it with mkdisk --dedup\n", argv[1]);
+        teardown ();
+        exit (EXIT_FAILURE);
+    }
+    struct iNode* iNodes = malloc ((size_t)INODE_COUNT * sizeof (struct iNode));
+    char* block = malloc (BLOCK_SIZE);
+    char* stored = malloc (BLOCK_SIZE);
+    if (iNodes == NULL || block == NULL || stored == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u inodes\n", INODE_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readINodeTable (iNodes);
+    uint32_t usedBefore = countUsedBlocks ();
+
+    // Room for every block in use, so that no block is forgotten.
+    struct blockIndex index;
+    initBlockIndex (&index, usedBefore);
+    struct dedupTotals totals;
+    memset (&totals, 0, sizeof (totals));
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    {
+        if (!isShareable (&iNodes[iNodeNumber]))
+        {
+            continue;
+        }
+        ++totals.files;
+        if (dedupFile (iNodeNumber, &iNodes[iNodeNumber], &index, block, stored, &totals) > 0)
+        {
+            writeINode (iNodeNumber, &iNodes[iNodeNumber]);
+            ++totals.changedFiles;
+        }
+    }
+    mufs_sync ();
+    uint32_t usedAfter = countUsedBlocks ();
+    double seconds = now () - start;
+
+    uint32_t saved = usedBefore - usedAfter;
+    printf ("%u files checked (%lu blocks), %u changed: %lu blocks now share a data block\n",
+            totals.files, (unsigned long)totals.blocksRead, totals.changedFiles, (unsigned long)totals.sharedBlocks);
+    printf ("Blocks in use: %u before, %u after; saved %u blocks (%lu KB, %.1f%%) in %.2f seconds\n",
+            usedBefore, usedAfter, saved, (unsigned long)((uint64_t)saved * BLOCK_SIZE / 1024),
+            usedBefore > 0 ? 100.0 * saved / usedBefore : 0, seconds);
+
+    destroyBlockIndex (&index);
+    free (stored);
+    free (block);
+    free (iNodes);
+    teardown ();
+    return EXIT_SUCCESS;
+}
+
+// Returns 1 if a file's data blocks may be shared: it is a regular file that is neither
+//   inline nor compressed (whose units are rewritten as they change).
+int
+isShareable (const struct iNode* node)
+{
+    return (node->mode & MU_S_AVAIL) == 0 && (node->mode & MU_S_REGLR) != 0
+           && (node->mode & (MU_S_INLINE | MU_S_COMPRESSED)) == 0;
+}
+
+// Maps each block of a file whose data a block already seen holds to that block, and adds
+//   the rest to the index.
+// Params:
+//   iNodeNumber - The number of the file's inode.
+//   node - The file's inode, which is only changed in memory.
+//   index - The blocks seen so far.
+//   block, stored - Buffers of BLOCK_SIZE bytes.
+//   totals - The totals to add to.
+// Returns:
+//   The number of blocks of the file that now share a data block.
+uint32_t
+dedupFile (uint32_t iNodeNumber, struct iNode* node, struct blockIndex* index, char* block, char* stored,
+           struct dedupTotals* totals)
+{
+    uint32_t mapped = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t shared = 0;
+    uint32_t blockIndex = 0;
+    while (blockIndex < mapped)
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+        if (blockNum == 0)
+        {
+            blockIndex += runLength;
+            continue;
+        }
+        readDataBlock (blockNum, block);
+        ++totals->blocksRead;
+        uint64_t hash = hashBlock (block);
+        const struct indexedBlock* found = findIndexedBlock (index, hash);
+        if (found != NULL && found->blockNum == blockNum)
+        {
+            // Already shared with the block seen before.
+            ++blockIndex;
+            continue;
+        }
+
+        uint32_t oldBlocks[MAX_SHARED_RUN];
+        uint32_t length = 0;
+        uint32_t target = (found != NULL ? found->blockNum : 0);
+        if (target != 0 && holdsSameData (target, block, stored))
+        {
+            oldBlocks[0] = blockNum;
+            length = 1 + matchingRun (node, blockIndex + 1, mapped, target + 1, index, block, stored, oldBlocks + 1, totals);
+            // A block can only have so many references.
+            for (uint32_t offset = 0; offset < length; ++offset)
+            {
+                if (getBlockShares (target + offset) >= MAX_BLOCK_SHARES)
+                {
+                    length = offset;
+                }
+            }
+        }
+        if (length == 0)
+        {
+            // New data, or a block that only has the same hash as one seen before.
+            struct indexedBlock seen = { hash, blockNum, iNodeNumber, blockIndex, 0 };
+            addIndexedBlock (index, &seen);
+            ++blockIndex;
+            continue;
+        }
+
+        struct extent run = { target, length };
+        if (remapFileBlocks (node, blockIndex, length, &run, 1) < 0)
+        {
+            // The file cannot be split into any more extents, so keep its own copy.
+            ++blockIndex;
+            continue;
+        }
+        // Take the new references before dropping the old ones, which may be among them.
+        for (uint32_t offset = 0; offset < length; ++offset)
+        {
+            shareBlock (target + offset);
+        }
+        for (uint32_t offset = 0; offset < length; ++offset)
+        {
+            releaseBlock (oldBlocks[offset]);
+        }
+        shared += length;
+        totals->sharedBlocks += length;
+        blockIndex += length;
+    }
+    return shared;
+}
+
+// Counts how many blocks of a file, from one on, hold the same data as the consecutive
+//   blocks from a target on, which the index must know of (and so are in use).
+// Params:
+//   node - The file's inode.
+//   blockIndex - The first block of the file to compare.
+//   mapped - The number of blocks the file maps.
+//   target - The first data block to compare it with.
+//   index - The blocks seen so far.
+//   block, stored - Buffers of BLOCK_SIZE bytes.
+//   oldBlocks - Receives the data blocks the matching blocks are stored in now, room for
+//     MAX_SHARED_RUN - 1 of them.
+//   totals - The totals to add to.
+// Returns:
+//   The number of blocks that match, up to MAX_SHARED_RUN - 1.
+uint32_t
+matchingRun (const struct iNode* node, uint32_t blockIndex, uint32_t mapped, uint32_t target,
+             const struct blockIndex* index, char* block, char* stored, uint32_t* oldBlocks,
+             struct dedupTotals* totals)
+{
+    uint32_t length = 0;
+    while (length < MAX_SHARED_RUN - 1 && blockIndex + length < mapped && target + length < BLOCK_COUNT)
+    {
+        uint32_t blockNum = getFileBlock (node, blockIndex + length, NULL);
+        if (blockNum == 0 || blockNum == target + length)
+        {
+            break;
+        }
+        readDataBlock (blockNum, block);
+        ++totals->blocksRead;
+        const struct indexedBlock* found = findIndexedBlock (index, hashBlock (block));
+        if (found == NULL || found->blockNum != target + length || !holdsSameData (target + length, block, stored))
+        {
+            // The block is read again as the start of the next run.
+            --totals->blocksRead;
+            break;
+        }
+        oldBlocks[length++] = blockNum;
+    }
+    return length;
+}
+
+// Returns 1 if a data block holds the given data, since blocks with the same hash are
+//   only likely to.
+int
+holdsSameData (uint32_t blockNum, const char* block, char* stored)
+{
+    readDataBlock (blockNum, stored);
+    return memcmp (stored, block, BLOCK_SIZE) == 0;
+}
+
+// Returns the number of blocks that the free block map has in use.
+uint32_t
+countUsedBlocks ()
+{
+    char* isUsed = malloc (BLOCK_COUNT);
+    if (isUsed == NULL)
+    {
+        fprintf (stderr, "Could not allocate a free block map of %u bytes\n", BLOCK_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readFreeBlockMap (isUsed);
+    uint32_t used = 0;
+    for (uint32_t blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
+    {
+        used += (isUsed[blockNum] == BLOCK_USED);
+    }
+    free (isUsed);
+    return used;
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
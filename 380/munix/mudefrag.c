@@ -0,0 +1,347 @@
+// File: mudefrag.c
+// Author: Matt Shenk
+// An online defragmenter for MUFS images.  It finds the files stored in more than one
+//   extent and moves them, worst first, into single runs of free blocks through mudefrag,
+//   so the filesystem stays usable while it works.  It stops when its time budget runs
+//   out; since contiguous files are skipped, running it again carries on where it stopped.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "munix.h"
+#include "mufs.h"
+#include "mufile.h"
+#include "mudindex.h"
+
+#define ROOT_INODE_NUMBER 0
+#define DEFAULT_BUDGET_MS 10000
+#define DEFAULT_MIN_EXTENTS 2
+#define READ_BUFFER_BYTES (1024 * 1024)
+
+// A file that is due to be moved, and the path that leads to it.
+struct fragmentedFile
+{
+    char* path;
+    uint32_t extents;
+    uint32_t blocks;
+};
+
+// A directory waiting to be walked, and the path that leads to it.
+struct pendingDirectory
+{
+    uint32_t iNodeNumber;
+    char* path;
+};
+
+// The cost of reading a set of files from start to end.
+struct readResult
+{
+    uint64_t bytes;
+    uint64_t syscalls;
+    double seconds;
+};
+
+uint32_t
+findFragmentedFiles (uint32_t minExtents, struct fragmentedFile** files);
+
+uint32_t
+countExtents (const struct iNode* node);
+
+int
+compareFragmentedFiles (const void* first, const void* second);
+
+void
+readFiles (const struct fragmentedFile* files, uint32_t fileCount, struct readResult* result);
+
+void
+reportReads (const char* when, const struct readResult* result);
+
+char*
+joinPath (const char* dirPath, const char* name, int isDirectory);
+
+double
+now ();
+
+int
+main (int argc, char* argv[])
+{
+    long budgetMs = DEFAULT_BUDGET_MS;
+    long minExtents = DEFAULT_MIN_EXTENTS;
+    int argIndex = 1;
+    while (argIndex + 1 < argc && strncmp (argv[argIndex], "--", 2) == 0)
+    {
+        if (strcmp (argv[argIndex], "--budget") == 0)
+        {
+            budgetMs = atol (argv[argIndex + 1]);
+        }
+        else if (strcmp (argv[argIndex], "--min-extents") == 0)
+        {
+            minExtents = atol (argv[argIndex + 1]);
+        }
+        else
+        {
+            break;
+        }
+        argIndex += 2;
+    }
+    if (argIndex + 1 != argc || budgetMs <= 0 || minExtents < 2)
+    {
+        fprintf (stderr, "Usage: %s [--budget MS] [--min-extents N] diskName\n", argv[0]);
+        fprintf (stderr, "  --budget MS       stop moving files after MS milliseconds (default %d)\n", DEFAULT_BUDGET_MS);
+        fprintf (stderr, "  --min-extents N   move only files in at least N extents (default %d)\n", DEFAULT_MIN_EXTENTS);
+        exit (EXIT_FAILURE);
+    }
+
+    setup (argv[argIndex]);
+    if (muinit ("root", "admin") < 0)
+    {
+        fprintf (stderr, "Could not log in as root: %d\n", muerrno);
+        exit (EXIT_FAILURE);
+    }
+    struct fragmentedFile* files;
+    uint32_t fileCount = findFragmentedFiles (minExtents, &files);
+    uint64_t extentsBefore = 0;
+    for (uint32_t index = 0; index < fileCount; ++index)
+    {
+        extentsBefore += files[index].extents;
+    }
+    printf ("%u files in at least %ld extents, %lu extents in all\n", fileCount, minExtents, (unsigned long)extentsBefore);
+    if (fileCount == 0)
+    {
+        free (files);
+        teardown ();
+        return EXIT_SUCCESS;
+    }
+    struct readResult before;
+    readFiles (files, fileCount, &before);
+    reportReads ("before", &before);
+
+    uint32_t moved = 0;
+    uint32_t busy = 0;
+    uint32_t noSpace = 0;
+    uint32_t attempted = 0;
+    double deadline = now () + budgetMs / 1000.0;
+    while (attempted < fileCount && now () < deadline)
+    {
+        const struct fragmentedFile* file = &files[attempted++];
+        int result = mudefrag (file->path);
+        if (result > 0)
+        {
+            ++moved;
+            printf ("moved %s (%u extents, %u blocks)\n", file->path, file->extents, file->blocks);
+        }
+        else if (result < 0 && muerrno == MU_E_BUSY)
+        {
+            ++busy;
+        }
+        else if (result < 0 && muerrno == MU_E_NO_SPACE)
+        {
+            ++noSpace;
+        }
+        else if (result < 0)
+        {
+            fprintf (stderr, "Could not move %s: %d\n", file->path, muerrno);
+        }
+    }
+    mufs_sync ();
+
+    printf ("moved %u of %u files (%u open, %u with no run of free blocks long enough, %u left for the next run)\n",
+            moved, fileCount, busy, noSpace, fileCount - attempted);
+    struct fragmentedFile* remaining;
+    uint32_t remainingCount = findFragmentedFiles (minExtents, &remaining);
+    uint64_t extentsAfter = 0;
+    for (uint32_t index = 0; index < remainingCount; ++index)
+    {
+        extentsAfter += remaining[index].extents;
+        free (remaining[index].path);
+    }
+    free (remaining);
+    printf ("%u files still in at least %ld extents, %lu extents in all\n", remainingCount, minExtents, (unsigned long)extentsAfter);
+    struct readResult after;
+    readFiles (files, fileCount, &after);
+    reportReads ("after", &after);
+
+    for (uint32_t index = 0; index < fileCount; ++index)
+    {
+        free (files[index].path);
+    }
+    free (files);
+    teardown ();
+    return EXIT_SUCCESS;
+}
+
+// Walks every directory from the root for regular files in at least minExtents extents.
+// Params:
+//   minExtents - The fewest extents a file must have to be listed.
+//   files - Receives a new array (which the caller must free, with each path) of the files
+//     found, the most fragmented first.
+// Returns:
+//   The number of files found.
+uint32_t
+findFragmentedFiles (uint32_t minExtents, struct fragmentedFile** files)
+{
+    struct iNode* iNodes = malloc ((size_t)INODE_COUNT * sizeof (struct iNode));
+    char* visited = calloc (INODE_COUNT, 1);
+    // Every directory is queued at most once, and every file listed at most once.
+    struct pendingDirectory* queue = malloc ((size_t)INODE_COUNT * sizeof (struct pendingDirectory));
+    *files = malloc ((size_t)INODE_COUNT * sizeof (struct fragmentedFile));
+    if (iNodes == NULL || visited == NULL || queue == NULL || *files == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u inodes\n", INODE_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readINodeTable (iNodes);
+
+    uint32_t fileCount = 0;
+    uint32_t queueLength = 0;
+    queue[queueLength].iNodeNumber = ROOT_INODE_NUMBER;
+    queue[queueLength++].path = joinPath ("", "", 1);
+    visited[ROOT_INODE_NUMBER] = 1;
+    for (uint32_t next = 0; next < queueLength; ++next)
+    {
+        const struct iNode* dirNode = &iNodes[queue[next].iNodeNumber];
+        struct dirEntry entries[DIR_ENTRIES_PER_BLOCK];
+        uint32_t entryCount = dirNode->size / DIR_ENTRY_LENGTH;
+        for (uint32_t entryIndex = firstEntryIndex (dirNode); entryIndex < entryCount; ++entryIndex)
+        {
+            if (entryIndex % DIR_ENTRIES_PER_BLOCK == 0)
+            {
+                readDataBlock (getFileBlock (dirNode, entryIndex / DIR_ENTRIES_PER_BLOCK, NULL), (char*)entries);
+            }
+            const struct dirEntry* entry = &entries[entryIndex % DIR_ENTRIES_PER_BLOCK];
+            if (entry->name[0] == '\0' || strcmp (entry->name, ".") == 0 || strcmp (entry->name, "..") == 0
+                || entry->iNodeNumber >= INODE_COUNT || visited[entry->iNodeNumber])
+            {
+                continue;
+            }
+            visited[entry->iNodeNumber] = 1;
+            const struct iNode* node = &iNodes[entry->iNodeNumber];
+            if (node->mode & MU_S_DIREC)
+            {
+                queue[queueLength].iNodeNumber = entry->iNodeNumber;
+                queue[queueLength++].path = joinPath (queue[next].path, entry->name, 1);
+                continue;
+            }
+            uint32_t extents = countExtents (node);
+            if (extents >= minExtents)
+            {
+                (*files)[fileCount].path = joinPath (queue[next].path, entry->name, 0);
+                (*files)[fileCount].extents = extents;
+                (*files)[fileCount++].blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            }
+        }
+        free (queue[next].path);
+    }
+    qsort (*files, fileCount, sizeof (struct fragmentedFile), compareFragmentedFiles);
+
+    free (queue);
+    free (visited);
+    free (iNodes);
+    return fileCount;
+}
+
+// Returns the number of extents a file's blocks are stored in (0 for an empty or inline file).
+// Data on either side of a hole that is consecutive on disk counts as one extent.
+uint32_t
+countExtents (const struct iNode* node)
+{
+    if ((node->mode & MU_S_INLINE) || node->size == 0)
+    {
+        return 0;
+    }
+    uint32_t blockCount = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t extents = 0;
+    uint32_t nextBlock = 0;
+    for (uint32_t blockIndex = 0; blockIndex < blockCount; )
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+        runLength = (runLength < blockCount - blockIndex ? runLength : blockCount - blockIndex);
+        if (blockNum != 0)
+        {
+            extents += (blockNum != nextBlock);
+            nextBlock = blockNum + runLength;
+        }
+        blockIndex += runLength;
+    }
+    return extents;
+}
+
+// Orders files by extents per block, most first, since those gain the most from moving.
+int
+compareFragmentedFiles (const void* first, const void* second)
+{
+    const struct fragmentedFile* firstFile = first;
+    const struct fragmentedFile* secondFile = second;
+    uint64_t firstScore = (uint64_t)firstFile->extents * secondFile->blocks;
+    uint64_t secondScore = (uint64_t)secondFile->extents * firstFile->blocks;
+    return (firstScore < secondScore) - (firstScore > secondScore);
+}
+
+// Reads each file from start to end through muread, as a program using it would.
+// A file that cannot be opened (having been removed meanwhile) is skipped.
+void
+readFiles (const struct fragmentedFile* files, uint32_t fileCount, struct readResult* result)
+{
+    char* buffer = malloc (READ_BUFFER_BYTES);
+    if (buffer == NULL)
+    {
+        fprintf (stderr, "Could not allocate a read buffer\n");
+        exit (EXIT_FAILURE);
+    }
+    memset (result, 0, sizeof (*result));
+    uint64_t syscallsBefore = getSyscallCount ();
+    double start = now ();
+    for (uint32_t index = 0; index < fileCount; ++index)
+    {
+        int fd = muopen (files[index].path, MU_O_RDONLY);
+        if (fd < 0)
+        {
+            continue;
+        }
+        int count;
+        while ((count = muread (fd, buffer, READ_BUFFER_BYTES)) > 0)
+        {
+            result->bytes += count;
+        }
+        muclose (fd);
+    }
+    result->seconds = now () - start;
+    result->syscalls = getSyscallCount () - syscallsBefore;
+    free (buffer);
+}
+
+void
+reportReads (const char* when, const struct readResult* result)
+{
+    double megabytesPerSecond = (result->seconds > 0 ? result->bytes / result->seconds / (1024 * 1024) : 0);
+    printf ("sequential read %s: %lu bytes in %.3f s, %.1f MB/s, %lu system calls\n", when,
+            (unsigned long)result->bytes, result->seconds, megabytesPerSecond, (unsigned long)result->syscalls);
+}
+
+// Returns a new string (which the caller must free) naming an entry of a directory.
+// A directory's path ends in '/', so that it can start the paths of what it contains.
+char*
+joinPath (const char* dirPath, const char* name, int isDirectory)
+{
+    char* path = malloc (strlen (dirPath) + strlen (name) + 2);
+    if (path == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for a path\n");
+        exit (EXIT_FAILURE);
+    }
+    sprintf (path, "%s%s%s", dirPath, name, isDirectory ? "/" : "");
+    return path;
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -0,0 +1,217 @@
+// File: mudindex.c
+// Author: Matt Shenk
+// Implementation of the block-level operations on directory hash indexes.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mudindex.h"
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Returns the position of the first record in a leaf whose hash is at least hash.
+static uint32_t
+lowerBound (const struct dirIndexLeaf* leaf, uint32_t hash)
+{
+    uint32_t low = 0;
+    uint32_t high = leaf->recordCount;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (leaf->records[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Inserts a range into the root or a node of an index, which must have room for it.
+static void
+insertIndexRange (struct dirIndexRoot* parent, uint32_t position, uint32_t lowestHash, uint32_t block)
+{
+    assert (parent->rangeCount < DIR_INDEX_MAX_RANGES && position <= parent->rangeCount);
+    memmove (&parent->ranges[position + 1], &parent->ranges[position],
+             (parent->rangeCount - position) * sizeof (struct dirIndexRange));
+    parent->ranges[position].lowestHash = lowestHash;
+    parent->ranges[position].block = block;
+    ++parent->rangeCount;
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+uint32_t
+hashEntryName (const char* name)
+{
+    // FNV-1a, which is cheap and spreads short similar names well.
+    uint32_t hash = 2166136261u;
+    for (int index = 0; index < MAX_NAME_LENGTH && name[index] != '\0'; ++index)
+    {
+        hash ^= (uint8_t)name[index];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t
+firstEntryIndex (const struct iNode* dirNode)
+{
+    return ((dirNode->mode & MU_S_INDEXED) ? DIR_ENTRIES_PER_BLOCK : 0);
+}
+
+void
+startDirIndex (struct dirIndexRoot* root, struct dirIndexLeaf* leaf, uint32_t leafBlock)
+{
+    memset (root, 0, BLOCK_SIZE);
+    memset (leaf, 0, BLOCK_SIZE);
+    root->rangeCount = 1;
+    root->ranges[0].lowestHash = 0;
+    root->ranges[0].block = leafBlock;
+}
+
+uint32_t
+findIndexRange (const struct dirIndexRoot* root, uint32_t hash)
+{
+    assert (root->rangeCount > 0 && root->ranges[0].lowestHash <= hash);
+    // The last range whose lowest hash is at most hash.
+    uint32_t low = 0;
+    uint32_t high = root->rangeCount;
+    while (high - low > 1)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (root->ranges[middle].lowestHash <= hash)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int
+findIndexRecord (const struct dirIndexLeaf* leaf, uint32_t hash, const char* name)
+{
+    for (uint32_t position = lowerBound (leaf, hash);
+         position < leaf->recordCount && leaf->records[position].hash == hash; ++position)
+    {
+        if (strncmp (leaf->records[position].entry.name, name, MAX_NAME_LENGTH) == 0)
+        {
+            return position;
+        }
+    }
+    return -1;
+}
+
+int
+addIndexRecord (struct dirIndexLeaf* leaf, uint32_t entryIndex, const struct dirEntry* entry)
+{
+    if (leaf->recordCount == DIR_INDEX_RECORDS_PER_LEAF)
+    {
+        return -1;
+    }
+    uint32_t hash = hashEntryName (entry->name);
+    // After any records with the same hash, so that those stay in the order they were added.
+    uint32_t position = lowerBound (leaf, hash);
+    while (position < leaf->recordCount && leaf->records[position].hash == hash)
+    {
+        ++position;
+    }
+    memmove (&leaf->records[position + 1], &leaf->records[position],
+             (leaf->recordCount - position) * sizeof (struct dirIndexRecord));
+    leaf->records[position].hash = hash;
+    leaf->records[position].entryIndex = entryIndex;
+    leaf->records[position].entry = *entry;
+    ++leaf->recordCount;
+    return 0;
+}
+
+void
+removeIndexRecord (struct dirIndexLeaf* leaf, uint32_t position)
+{
+    assert (position < leaf->recordCount);
+    --leaf->recordCount;
+    memmove (&leaf->records[position], &leaf->records[position + 1],
+             (leaf->recordCount - position) * sizeof (struct dirIndexRecord));
+    memset (&leaf->records[leaf->recordCount], 0, sizeof (struct dirIndexRecord));
+}
+
+int
+splitIndexLeaf (struct dirIndexRoot* parent, uint32_t range, struct dirIndexLeaf* leaf,
+                struct dirIndexLeaf* newLeaf, uint32_t newLeafBlock)
+{
+    if (parent->rangeCount == DIR_INDEX_MAX_RANGES)
+    {
+        return -1;
+    }
+    // Split as near the middle as possible without parting records with equal hashes.
+    uint32_t count = leaf->recordCount;
+    uint32_t split = count / 2;
+    while (split < count && leaf->records[split].hash == leaf->records[split - 1].hash)
+    {
+        ++split;
+    }
+    if (split == count)
+    {
+        split = count / 2;
+        while (split > 0 && leaf->records[split].hash == leaf->records[split - 1].hash)
+        {
+            --split;
+        }
+        if (split == 0)
+        {
+            return -1;
+        }
+    }
+
+    memset (newLeaf, 0, BLOCK_SIZE);
+    newLeaf->recordCount = count - split;
+    memcpy (newLeaf->records, &leaf->records[split], newLeaf->recordCount * sizeof (struct dirIndexRecord));
+    memset (&leaf->records[split], 0, newLeaf->recordCount * sizeof (struct dirIndexRecord));
+    leaf->recordCount = split;
+    insertIndexRange (parent, range + 1, newLeaf->records[0].hash, newLeafBlock);
+    return 0;
+}
+
+void
+deepenDirIndex (struct dirIndexRoot* root, struct dirIndexRoot* node, uint32_t nodeBlock)
+{
+    assert (root->depth == 0);
+    memcpy (node, root, BLOCK_SIZE);
+    memset (root, 0, BLOCK_SIZE);
+    root->rangeCount = 1;
+    root->depth = 1;
+    root->ranges[0].lowestHash = 0;
+    root->ranges[0].block = nodeBlock;
+}
+
+int
+splitIndexNode (struct dirIndexRoot* root, uint32_t range, struct dirIndexRoot* node,
+                struct dirIndexRoot* newNode, uint32_t newNodeBlock)
+{
+    assert (root->depth == 1 && node->rangeCount > 1);
+    if (root->rangeCount == DIR_INDEX_MAX_RANGES)
+    {
+        return -1;
+    }
+    uint32_t split = node->rangeCount / 2;
+    memset (newNode, 0, BLOCK_SIZE);
+    newNode->rangeCount = node->rangeCount - split;
+    memcpy (newNode->ranges, &node->ranges[split], newNode->rangeCount * sizeof (struct dirIndexRange));
+    memset (&node->ranges[split], 0, newNode->rangeCount * sizeof (struct dirIndexRange));
+    node->rangeCount = split;
+    insertIndexRange (root, range + 1, newNode->ranges[0].lowestHash, newNodeBlock);
+    return 0;
+}
@@ -0,0 +1,113 @@
+// File: mudindex.h
+// Author: Matt Shenk
+// Interface for working on the blocks of the on-disk hash index that large directories
+//   have on VERSION22 images (see struct dirIndexRoot in mufs.h).
+// None of these functions read or write the disk, so they work the same on a loaded
+//   filesystem and on an image that mkdisk is building.
+// Part of munix lab in CSCI380.
+
+#ifndef MUDINDEX_H
+#define MUDINDEX_H
+
+#include <stdint.h>
+
+#include "mufs.h"
+
+
+// Hashes an entry name for a directory index.
+uint32_t
+hashEntryName (const char* name);
+
+
+// Returns the position of the first entry of a directory, which for an indexed directory
+//   is just past the root block.
+uint32_t
+firstEntryIndex (const struct iNode* dirNode);
+
+
+// Fills in a new, empty index.  A block of entries takes more than one leaf, so the
+//   caller adds the directory's entries afterwards, splitting leaves as they fill.
+// Params:
+//   root - Receives the root, one block long.
+//   leaf - Receives the only leaf, one block long.
+//   leafBlock - The block that leaf will be written to.
+void
+startDirIndex (struct dirIndexRoot* root, struct dirIndexLeaf* leaf, uint32_t leafBlock);
+
+
+// Finds the range of the root or a node of an index that a hash falls into.
+// Returns:
+//   The position of the range in root->ranges.
+uint32_t
+findIndexRange (const struct dirIndexRoot* root, uint32_t hash);
+
+
+// Finds the record for a name in a leaf.
+// Params:
+//   leaf - The leaf for the range that hash falls into.
+//   hash - The hash of name.
+//   name - The name to find.
+// Returns:
+//   The position of the record in leaf->records, or -1 if there is none.
+int
+findIndexRecord (const struct dirIndexLeaf* leaf, uint32_t hash, const char* name);
+
+
+// Adds a record for an entry to a leaf, keeping the records sorted.
+// Params:
+//   leaf - The leaf for the range that the entry's name hashes into.
+//   entryIndex - The position of the entry in its directory.
+//   entry - The entry.
+// Returns:
+//   0 on success, or -1 if the leaf is full.
+int
+addIndexRecord (struct dirIndexLeaf* leaf, uint32_t entryIndex, const struct dirEntry* entry);
+
+
+// Removes a record from a leaf.
+void
+removeIndexRecord (struct dirIndexLeaf* leaf, uint32_t position);
+
+
+// Moves the upper half of a full leaf's records into a new leaf and gives that leaf a
+//   range of its own.  Records with equal hashes always stay together.
+// Params:
+//   parent - The root of the index, or the node holding the leaf's range if the index
+//     has a depth of 1, which gains a range.
+//   range - The position of the full leaf's range in parent.
+//   leaf - The full leaf.
+//   newLeaf - Receives the new leaf, one block long.
+//   newLeafBlock - The block that newLeaf will be written to.
+// Returns:
+//   0 on success, or -1 (changing nothing) if parent has no room for another range or
+//   every record in the leaf has the same hash.
+int
+splitIndexLeaf (struct dirIndexRoot* parent, uint32_t range, struct dirIndexLeaf* leaf,
+                struct dirIndexLeaf* newLeaf, uint32_t newLeafBlock);
+
+
+// Gives an index whose root is full of ranges a depth of 1: the ranges move to a node,
+//   and the root is left with a single range for that node.
+// Params:
+//   root - The root of the index, whose depth is 0.
+//   node - Receives the new node, one block long.
+//   nodeBlock - The block that node will be written to.
+void
+deepenDirIndex (struct dirIndexRoot* root, struct dirIndexRoot* node, uint32_t nodeBlock);
+
+
+// Moves the upper half of a full node's ranges into a new node and gives that node a
+//   range of its own in the root.
+// Params:
+//   root - The root of the index, whose depth is 1.
+//   range - The position of the full node's range in the root.
+//   node - The full node.
+//   newNode - Receives the new node, one block long.
+//   newNodeBlock - The block that newNode will be written to.
+// Returns:
+//   0 on success, or -1 (changing nothing) if the root has no room for another range.
+int
+splitIndexNode (struct dirIndexRoot* root, uint32_t range, struct dirIndexRoot* node,
+                struct dirIndexRoot* newNode, uint32_t newNodeBlock);
+
+#endif//MUDINDEX_H
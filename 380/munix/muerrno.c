@@ -5,5 +5,5 @@
 
 #include "muerrno.h"
 
-// The global variable into which our functions will write when errors occur.
-int muerrno;
\ No newline at end of file
+// The variable into which our functions will write when errors occur, one per thread.
+__thread int muerrno;
\ No newline at end of file
@@ -6,8 +6,9 @@
 #ifndef MUERRNO_H
 #define MUERRNO_H
 
-// The global variable into which our functions will write error codes.
-extern int muerrno;
+// The variable into which our functions will write error codes.
+// Each thread has its own, like errno.
+extern __thread int muerrno;
 
 #define MU_E_BAD_NAME 1
 #define MU_E_DOES_NOT_EXIST 2
@@ -19,5 +20,9 @@ extern int muerrno;
 #define MU_E_NO_SUCH_USER 8
 #define MU_E_NO_SUCH_GROUP 9
 #define MU_E_NOT_MEMBER 10
+#define MU_E_EXISTS 11
+#define MU_E_NO_SPACE 12
+#define MU_E_BUSY 13
+#define MU_E_CORRUPT 14
 
 #endif//MUERRNO_H
\ No newline at end of file
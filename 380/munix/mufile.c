@@ -0,0 +1,534 @@
+// File: mufile.c
+// Author: Matt Shenk
+// Implementation of finding the data blocks of a file, whichever way its inode maps them.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mufile.h"
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Returns the extent at a position in the file's extent list.
+static struct extent*
+extentAt (struct iNode* node, struct extent* indirect, uint32_t position)
+{
+    if (position < NUM_INODE_EXTENTS)
+    {
+        return &node->extents[position];
+    }
+    assert (indirect != NULL);
+    return &indirect[position - NUM_INODE_EXTENTS];
+}
+
+// Returns the number of data blocks mapped by the extents stored in the inode itself.
+static uint32_t
+countINodeExtentBlocks (const struct iNode* node)
+{
+    uint32_t total = 0;
+    for (uint32_t position = 0; position < node->extentCount && position < NUM_INODE_EXTENTS; ++position)
+    {
+        total += node->extents[position].length;
+    }
+    return total;
+}
+
+// Copies the whole extent list of a file into a new array (which the caller must free),
+//   with room for two more extents than a file can have.
+static struct extent*
+readExtentList (const struct iNode* node)
+{
+    struct extent* list = calloc (MAX_EXTENTS + 2, sizeof (struct extent));
+    if (list == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u extents\n", MAX_EXTENTS);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t inINode = (node->extentCount < NUM_INODE_EXTENTS ? node->extentCount : NUM_INODE_EXTENTS);
+    memcpy (list, node->extents, inINode * sizeof (struct extent));
+    if (node->extentCount > NUM_INODE_EXTENTS)
+    {
+        readDataBlock (node->indirectExtentBlock, (char*)&list[NUM_INODE_EXTENTS]);
+    }
+    return list;
+}
+
+// Tidies an extent list, dropping empty extents and joining neighbours that are both
+//   holes or that continue one another on disk.
+// Returns:
+//   The number of extents left.
+static uint32_t
+mergeExtents (struct extent* list, uint32_t count)
+{
+    uint32_t kept = 0;
+    for (uint32_t position = 0; position < count; ++position)
+    {
+        if (list[position].length == 0)
+        {
+            continue;
+        }
+        struct extent* last = (kept > 0 ? &list[kept - 1] : NULL);
+        if (last != NULL && (last->startBlock == 0) == (list[position].startBlock == 0)
+            && (last->startBlock == 0 || last->startBlock + last->length == list[position].startBlock))
+        {
+            last->length += list[position].length;
+            continue;
+        }
+        list[kept++] = list[position];
+    }
+    return kept;
+}
+
+// Makes an extent list (after tidying it) the block map of a file, taking or giving back
+//   the indirect extent block as needed.
+// Params:
+//   node - The inode of the file, which is only changed in memory.
+//   list - The extents, with room for MAX_EXTENTS of them.
+//   count - The number of extents in list.
+// Returns:
+//   0 on success, or -1 (changing nothing) if there are too many extents or no block for
+//   an indirect extent block.
+static int
+writeExtentList (struct iNode* node, struct extent* list, uint32_t count)
+{
+    count = mergeExtents (list, count);
+    if (count > MAX_EXTENTS)
+    {
+        return -1;
+    }
+    if (count > NUM_INODE_EXTENTS && node->indirectExtentBlock == 0)
+    {
+        int indirectBlock = allocateBlock ();
+        if (indirectBlock < 0)
+        {
+            return -1;
+        }
+        node->indirectExtentBlock = indirectBlock;
+    }
+    memset (node->extents, 0, sizeof (node->extents));
+    memcpy (node->extents, list, (count < NUM_INODE_EXTENTS ? count : NUM_INODE_EXTENTS) * sizeof (struct extent));
+    if (count > NUM_INODE_EXTENTS)
+    {
+        memset (&list[count], 0, (MAX_EXTENTS - count) * sizeof (struct extent));
+        writeMetadataBlock (node->indirectExtentBlock, (char*)&list[NUM_INODE_EXTENTS]);
+    }
+    else if (node->indirectExtentBlock != 0)
+    {
+        releaseBlock (node->indirectExtentBlock);
+        node->indirectExtentBlock = 0;
+    }
+    node->extentCount = count;
+    return 0;
+}
+
+#ifndef NDEBUG
+// Returns the number of data blocks mapped by an extent-mapped inode, for assertions.
+static uint32_t
+countExtentBlocks (const struct iNode* node, const struct extent* indirect)
+{
+    uint32_t total = 0;
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        total += extentAt ((struct iNode*)node, (struct extent*)indirect, position)->length;
+    }
+    return total;
+}
+#endif
+
+
+//// Extent arithmetic /////////////////////////////////////////
+
+
+uint32_t
+findExtentBlock (const struct iNode* node, const struct extent* indirect, uint32_t blockIndex, uint32_t* runLength)
+{
+    uint32_t firstIndex = 0;
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        const struct extent* current = extentAt ((struct iNode*)node, (struct extent*)indirect, position);
+        if (blockIndex < firstIndex + current->length)
+        {
+            uint32_t offset = blockIndex - firstIndex;
+            if (runLength != NULL)
+            {
+                *runLength = current->length - offset;
+            }
+            return (current->startBlock == 0 ? 0 : current->startBlock + offset);
+        }
+        firstIndex += current->length;
+    }
+    assert (0);
+    return 0;
+}
+
+int
+appendExtentBlock (struct iNode* node, struct extent* indirect, uint32_t blockNum)
+{
+    if (node->extentCount > 0)
+    {
+        struct extent* last = extentAt (node, indirect, node->extentCount - 1);
+        if ((last->startBlock == 0 && blockNum == 0)
+            || (last->startBlock != 0 && last->startBlock + last->length == blockNum))
+        {
+            ++last->length;
+            return 0;
+        }
+    }
+    if (node->extentCount == MAX_EXTENTS)
+    {
+        return -1;
+    }
+    if (node->extentCount >= NUM_INODE_EXTENTS && indirect == NULL)
+    {
+        return EXTENT_NEEDS_INDIRECT;
+    }
+    struct extent* added = extentAt (node, indirect, node->extentCount);
+    added->startBlock = blockNum;
+    added->length = 1;
+    ++node->extentCount;
+    return 0;
+}
+
+
+//// Working on a loaded filesystem ////////////////////////////
+
+
+uint32_t
+maxFileSize ()
+{
+    return (usesExtents () ? MAX_EXTENT_FILE_SIZE : MAX_FILE_SIZE);
+}
+
+uint32_t
+getFileBlock (const struct iNode* node, uint32_t blockIndex, uint32_t* runLength)
+{
+    assert ((node->mode & MU_S_INLINE) == 0);
+    if (!usesExtents ())
+    {
+        assert (blockIndex < NUM_DIRECT_BLOCKS);
+        if (runLength != NULL)
+        {
+            // Count how far the direct blocks happen to be consecutive on disk (or holes).
+            uint32_t mapped = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            uint32_t first = node->directBlocks[blockIndex];
+            uint32_t length = 1;
+            while (blockIndex + length < mapped
+                   && node->directBlocks[blockIndex + length] == (first == 0 ? 0 : first + length))
+            {
+                ++length;
+            }
+            *runLength = length;
+        }
+        return node->directBlocks[blockIndex];
+    }
+    // The indirect extent block only needs to be read for blocks beyond the inode's own extents.
+    if (node->extentCount <= NUM_INODE_EXTENTS || blockIndex < countINodeExtentBlocks (node))
+    {
+        return findExtentBlock (node, NULL, blockIndex, runLength);
+    }
+    struct extent indirect[EXTENTS_PER_BLOCK];
+    readDataBlock (node->indirectExtentBlock, (char*)indirect);
+    return findExtentBlock (node, indirect, blockIndex, runLength);
+}
+
+int
+appendFileBlock (struct iNode* node, uint32_t blockIndex, uint32_t blockNum)
+{
+    assert ((node->mode & MU_S_INLINE) == 0);
+    if (!usesExtents ())
+    {
+        if (blockIndex >= NUM_DIRECT_BLOCKS)
+        {
+            return -1;
+        }
+        node->directBlocks[blockIndex] = blockNum;
+        return 0;
+    }
+    if (node->extentCount < NUM_INODE_EXTENTS
+        || (node->extentCount == NUM_INODE_EXTENTS && node->indirectExtentBlock == 0))
+    {
+        assert (blockIndex == countExtentBlocks (node, NULL));
+        int result = appendExtentBlock (node, NULL, blockNum);
+        if (result != EXTENT_NEEDS_INDIRECT)
+        {
+            return result;
+        }
+        // The inode's extents are full, so start an indirect extent block.
+        int indirectBlock = allocateBlock ();
+        if (indirectBlock < 0)
+        {
+            return -1;
+        }
+        struct extent indirect[EXTENTS_PER_BLOCK];
+        memset (indirect, 0, BLOCK_SIZE);
+        node->indirectExtentBlock = indirectBlock;
+        result = appendExtentBlock (node, indirect, blockNum);
+        writeMetadataBlock (indirectBlock, (char*)indirect);
+        return result;
+    }
+    struct extent indirect[EXTENTS_PER_BLOCK];
+    readDataBlock (node->indirectExtentBlock, (char*)indirect);
+    assert (blockIndex == countExtentBlocks (node, indirect));
+    int result = appendExtentBlock (node, indirect, blockNum);
+    if (result == 0)
+    {
+        writeMetadataBlock (node->indirectExtentBlock, (char*)indirect);
+    }
+    return result;
+}
+
+int
+appendFileHole (struct iNode* node, uint32_t blockIndex, uint32_t count)
+{
+    assert ((node->mode & MU_S_INLINE) == 0);
+    if (!usesExtents ())
+    {
+        if (count > NUM_DIRECT_BLOCKS - blockIndex)
+        {
+            return -1;
+        }
+        memset (&node->directBlocks[blockIndex], 0, count * sizeof (uint32_t));
+        return 0;
+    }
+    struct extent* list = readExtentList (node);
+    assert (blockIndex == countExtentBlocks (node, &list[NUM_INODE_EXTENTS]));
+    list[node->extentCount].startBlock = 0;
+    list[node->extentCount].length = count;
+    int result = writeExtentList (node, list, node->extentCount + 1);
+    free (list);
+    return result;
+}
+
+int
+fillFileHole (struct iNode* node, uint32_t blockIndex, uint32_t blockNum, uint32_t count)
+{
+    assert ((node->mode & MU_S_INLINE) == 0);
+    if (!usesExtents ())
+    {
+        for (uint32_t offset = 0; offset < count; ++offset)
+        {
+            assert (node->directBlocks[blockIndex + offset] == 0);
+            node->directBlocks[blockIndex + offset] = blockNum + offset;
+        }
+        return 0;
+    }
+    struct extent* list = readExtentList (node);
+    uint32_t position = 0;
+    uint32_t firstIndex = 0;
+    while (blockIndex >= firstIndex + list[position].length)
+    {
+        firstIndex += list[position++].length;
+        assert (position < node->extentCount);
+    }
+    struct extent hole = list[position];
+    assert (hole.startBlock == 0 && blockIndex + count <= firstIndex + hole.length);
+    // The hole becomes what is left of it before, the new blocks, and what is left after.
+    memmove (&list[position + 3], &list[position + 1], (node->extentCount - position - 1) * sizeof (struct extent));
+    list[position].length = blockIndex - firstIndex;
+    list[position + 1].startBlock = blockNum;
+    list[position + 1].length = count;
+    list[position + 2].startBlock = 0;
+    list[position + 2].length = hole.length - list[position].length - count;
+    int result = writeExtentList (node, list, node->extentCount + 2);
+    free (list);
+    return result;
+}
+
+int
+remapFileBlocks (struct iNode* node, uint32_t blockIndex, uint32_t count, const struct extent* runs, uint32_t runCount)
+{
+    assert ((node->mode & MU_S_INLINE) == 0);
+    if (!usesExtents ())
+    {
+        uint32_t offset = 0;
+        for (uint32_t run = 0; run < runCount; ++run)
+        {
+            for (uint32_t position = 0; position < runs[run].length; ++position)
+            {
+                node->directBlocks[blockIndex + offset++] = runs[run].startBlock + position;
+            }
+        }
+        assert (offset <= count);
+        while (offset < count)
+        {
+            node->directBlocks[blockIndex + offset++] = 0;
+        }
+        return 0;
+    }
+    struct extent* list = readExtentList (node);
+    // The extent holding the start of the range may end up split around it, and the
+    //   range itself becomes the runs and a hole.
+    struct extent* remapped = calloc (MAX_EXTENTS + runCount + 3, sizeof (struct extent));
+    if (remapped == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u extents\n", MAX_EXTENTS);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t end = blockIndex + count;
+    uint32_t remappedCount = 0;
+    uint32_t firstIndex = 0;
+    uint32_t dataBlocks = 0;
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        const struct extent* current = &list[position];
+        uint32_t currentEnd = firstIndex + current->length;
+        if (firstIndex < blockIndex)
+        {
+            remapped[remappedCount].startBlock = current->startBlock;
+            remapped[remappedCount++].length = (currentEnd < blockIndex ? currentEnd : blockIndex) - firstIndex;
+        }
+        if (firstIndex <= blockIndex && blockIndex < currentEnd)
+        {
+            for (uint32_t run = 0; run < runCount; ++run)
+            {
+                remapped[remappedCount++] = runs[run];
+                dataBlocks += runs[run].length;
+            }
+            assert (dataBlocks <= count);
+            remapped[remappedCount].startBlock = 0;
+            remapped[remappedCount++].length = count - dataBlocks;
+        }
+        if (currentEnd > end)
+        {
+            uint32_t skipped = (firstIndex < end ? end - firstIndex : 0);
+            remapped[remappedCount].startBlock = (current->startBlock == 0 ? 0 : current->startBlock + skipped);
+            remapped[remappedCount++].length = current->length - skipped;
+        }
+        firstIndex = currentEnd;
+    }
+    assert (end <= firstIndex);
+    int result = writeExtentList (node, remapped, remappedCount);
+    free (remapped);
+    free (list);
+    return result;
+}
+
+void
+releaseFileBlocksFrom (struct iNode* node, uint32_t blockIndex)
+{
+    assert ((node->mode & MU_S_INLINE) == 0);
+    uint32_t blockCount = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (!usesExtents ())
+    {
+        for (uint32_t index = blockIndex; index < blockCount; ++index)
+        {
+            if (node->directBlocks[index] != 0)
+            {
+                releaseBlock (node->directBlocks[index]);
+            }
+            node->directBlocks[index] = 0;
+        }
+        return;
+    }
+    struct extent* list = readExtentList (node);
+    uint32_t firstIndex = 0;
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        struct extent* current = &list[position];
+        uint32_t keep = (blockIndex <= firstIndex ? 0
+                         : blockIndex - firstIndex < current->length ? blockIndex - firstIndex : current->length);
+        for (uint32_t offset = keep; offset < current->length && current->startBlock != 0; ++offset)
+        {
+            releaseBlock (current->startBlock + offset);
+        }
+        firstIndex += current->length;
+        current->length = keep;
+    }
+    // Fewer extents never need a block that the file does not already have.
+    int result = writeExtentList (node, list, node->extentCount);
+    assert (result == 0);
+    (void)result;
+    free (list);
+}
+
+void
+releaseLastFileBlock (struct iNode* node, uint32_t blockIndex)
+{
+    if (!usesExtents ())
+    {
+        if (node->directBlocks[blockIndex] != 0)
+        {
+            releaseBlock (node->directBlocks[blockIndex]);
+        }
+        node->directBlocks[blockIndex] = 0;
+        return;
+    }
+    assert (node->extentCount > 0);
+    struct extent indirectBuffer[EXTENTS_PER_BLOCK];
+    struct extent* indirect = NULL;
+    if (node->extentCount > NUM_INODE_EXTENTS)
+    {
+        readDataBlock (node->indirectExtentBlock, (char*)indirectBuffer);
+        indirect = indirectBuffer;
+    }
+    struct extent* last = extentAt (node, indirect, node->extentCount - 1);
+    if (last->startBlock != 0)
+    {
+        releaseBlock (last->startBlock + last->length - 1);
+    }
+    if (--last->length == 0)
+    {
+        --node->extentCount;
+    }
+    if (indirect != NULL)
+    {
+        if (node->extentCount == NUM_INODE_EXTENTS)
+        {
+            releaseBlock (node->indirectExtentBlock);
+            node->indirectExtentBlock = 0;
+        }
+        else
+        {
+            writeMetadataBlock (node->indirectExtentBlock, (char*)indirect);
+        }
+    }
+}
+
+void
+releaseFileBlocks (struct iNode* node)
+{
+    // An inline file keeps its contents in the inode and has no blocks to give back.
+    if (node->mode & MU_S_INLINE)
+    {
+        return;
+    }
+    uint32_t blockCount = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (!usesExtents ())
+    {
+        for (uint32_t blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+        {
+            if (node->directBlocks[blockIndex] != 0)
+            {
+                releaseBlock (node->directBlocks[blockIndex]);
+            }
+        }
+        return;
+    }
+    struct extent indirectBuffer[EXTENTS_PER_BLOCK];
+    struct extent* indirect = NULL;
+    if (node->indirectExtentBlock != 0)
+    {
+        readDataBlock (node->indirectExtentBlock, (char*)indirectBuffer);
+        indirect = indirectBuffer;
+    }
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        struct extent* current = extentAt (node, indirect, position);
+        for (uint32_t offset = 0; offset < current->length && current->startBlock != 0; ++offset)
+        {
+            releaseBlock (current->startBlock + offset);
+        }
+    }
+    if (node->indirectExtentBlock != 0)
+    {
+        releaseBlock (node->indirectExtentBlock);
+    }
+    node->extentCount = 0;
+    node->indirectExtentBlock = 0;
+}
@@ -0,0 +1,142 @@
+// File: mufile.h
+// Author: Matt Shenk
+// Interface for finding the data blocks of a file, whichever way its inode maps them.
+// Part of munix lab in CSCI380.
+
+#ifndef MUFILE_H
+#define MUFILE_H
+
+#include <stdint.h>
+
+#include "mufs.h"
+
+#define EXTENT_NEEDS_INDIRECT 1
+
+
+//// Working on a loaded filesystem ////////////////////////////
+
+
+// Returns the largest size that a file can have on the loaded filesystem.
+uint32_t
+maxFileSize ();
+
+
+// Finds the data block holding one block of a file.
+// Params:
+//   node - The inode of the file.
+//   blockIndex - Which block of the file (0 for the first BLOCK_SIZE bytes, and so on).
+//   runLength - If not NULL, receives how many blocks starting with this one are
+//     consecutive both in the file and on disk (or are all part of the same hole).
+// Returns:
+//   The number of the data block, or 0 if the block is in a hole.
+uint32_t
+getFileBlock (const struct iNode* node, uint32_t blockIndex, uint32_t* runLength);
+
+
+// Adds a data block to the end of a file's block map.
+// The inode is only changed in memory, but an indirect extent block may be allocated and written.
+// Params:
+//   node - The inode of the file.
+//   blockIndex - The index that the new block will have, which must be the current block count.
+//   blockNum - The data block to add, or 0 to add a block of hole.
+// Returns:
+//   0 on success, or -1 if the file cannot map any more blocks.
+int
+appendFileBlock (struct iNode* node, uint32_t blockIndex, uint32_t blockNum);
+
+
+// Adds a hole (blocks that read as zeros but have no data blocks) to the end of a file's block map.
+// The inode is only changed in memory, but an indirect extent block may be allocated and written.
+// Params:
+//   node - The inode of the file.
+//   blockIndex - The index of the first block of the hole, which must be the current block count.
+//   count - The number of blocks in the hole.
+// Returns:
+//   0 on success, or -1 (changing nothing) if the file cannot map that many more blocks.
+int
+appendFileHole (struct iNode* node, uint32_t blockIndex, uint32_t count);
+
+
+// Gives blocks in a hole of a file the data blocks they will be written to.
+// The inode is only changed in memory, but an indirect extent block may be allocated,
+//   written or released.
+// Params:
+//   node - The inode of the file.
+//   blockIndex - The first block of the file to fill in.
+//   blockNum - The first of count consecutive data blocks to use.
+//   count - The number of blocks to fill in, which must all be in the same hole.
+// Returns:
+//   0 on success, or -1 (changing nothing) if the file cannot be split into any more extents.
+int
+fillFileHole (struct iNode* node, uint32_t blockIndex, uint32_t blockNum, uint32_t count);
+
+
+// Changes which data blocks a range of a file is stored in: its first blocks go to the given
+//   runs of data blocks in turn, and the rest of it becomes a hole.  No data block is
+//   released; the ones the range had before are left for the caller to reuse or give back.
+// The inode is only changed in memory, but an indirect extent block may be allocated,
+//   written or released.
+// Params:
+//   node - The inode of the file.
+//   blockIndex - The first block of the range.
+//   count - The number of blocks in the range, which must all be within the block map.
+//   runs - The runs of data blocks for the start of the range, in order.
+//   runCount - The number of runs, whose lengths add up to no more than count.
+// Returns:
+//   0 on success, or -1 (changing nothing) if the file cannot be split into that many extents.
+int
+remapFileBlocks (struct iNode* node, uint32_t blockIndex, uint32_t count, const struct extent* runs, uint32_t runCount);
+
+
+// Releases the data blocks of a file from one block on and removes them from its block map,
+//   leaving the map covering just blockIndex blocks; the caller then sets the size to match.
+// Params:
+//   node - The inode of the file, which is only changed in memory.
+//   blockIndex - The first block to release, no more than the current block count.
+void
+releaseFileBlocksFrom (struct iNode* node, uint32_t blockIndex);
+
+
+// Releases the last data block of a file and removes it from the file's block map.
+// Params:
+//   node - The inode of the file, which is only changed in memory.
+//   blockIndex - The index of the last block, which must be the current block count minus one.
+void
+releaseLastFileBlock (struct iNode* node, uint32_t blockIndex);
+
+
+// Releases every data block of a file (and its indirect extent block, if any).
+// Holes have no data blocks, so nothing is released for them.
+// Files whose contents are inline (MU_S_INLINE) have none; the other functions above must
+//   not be used on them.
+void
+releaseFileBlocks (struct iNode* node);
+
+
+//// Extent arithmetic, usable without a loaded filesystem //////
+
+
+// Finds a block of an extent-mapped file.
+// Params:
+//   node - The inode of the file.
+//   indirect - The contents of the indirect extent block, or NULL if the file has none.
+//   blockIndex - Which block of the file.
+//   runLength - If not NULL, receives how many blocks remain in the extent from this one on.
+// Returns:
+//   The number of the data block, or 0 if the block is in a hole.
+uint32_t
+findExtentBlock (const struct iNode* node, const struct extent* indirect, uint32_t blockIndex, uint32_t* runLength);
+
+
+// Adds a data block to the end of an extent-mapped file, growing the last extent when possible.
+// Params:
+//   node - The inode of the file.
+//   indirect - The contents of the indirect extent block, or NULL if the file has none.
+//   blockNum - The data block to add, or 0 to add a block of hole.
+// Returns:
+//   0 on success, EXTENT_NEEDS_INDIRECT if a new extent must go in an indirect extent
+//   block but indirect was NULL, or -1 if there is no room for another extent.
+int
+appendExtentBlock (struct iNode* node, struct extent* indirect, uint32_t blockNum);
+
+#endif//MUFILE_H
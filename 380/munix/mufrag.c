@@ -0,0 +1,198 @@
+// File: mufrag.c
+// Author: Matt Shenk
+// A fragmentation report for MUFS images.  It walks every directory from the root and
+//   shows how many extents (runs of consecutive blocks on disk) each file is stored in,
+//   since a file in one extent is read back sequentially in a single I/O.  Holes take no
+//   blocks, so data on either side of one that is consecutive on disk is one extent.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mufile.h"
+#include "mudindex.h"
+
+#define ROOT_INODE_NUMBER 0
+
+// A directory waiting to be walked, and the path that leads to it.
+struct pendingDirectory
+{
+    uint32_t iNodeNumber;
+    char* path;
+};
+
+// Totals over every file and directory reported.
+struct fragmentationTotals
+{
+    uint32_t files;
+    uint32_t contiguousFiles;
+    uint64_t extents;
+    uint64_t blocks;
+    uint32_t mostExtents;
+};
+
+void
+reportFile (const struct iNode* node, const char* path, int listExtents, struct fragmentationTotals* totals);
+
+char*
+joinPath (const char* dirPath, const char* name, int isDirectory);
+
+int
+main (int argc, char* argv[])
+{
+    int listExtents = 0;
+    int argIndex = 1;
+    if (argIndex < argc && strcmp (argv[argIndex], "-v") == 0)
+    {
+        listExtents = 1;
+        ++argIndex;
+    }
+    if (argIndex + 1 != argc)
+    {
+        fprintf (stderr, "Usage: %s [-v] diskName\n", argv[0]);
+        fprintf (stderr, "  -v  list the blocks of each extent as well\n");
+        exit (EXIT_FAILURE);
+    }
+
+    setup (argv[argIndex]);
+    struct iNode* iNodes = malloc ((size_t)INODE_COUNT * sizeof (struct iNode));
+    char* visited = calloc (INODE_COUNT, 1);
+    // Every directory is queued at most once, so the queue never holds more than INODE_COUNT.
+    struct pendingDirectory* queue = malloc ((size_t)INODE_COUNT * sizeof (struct pendingDirectory));
+    if (iNodes == NULL || visited == NULL || queue == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u inodes\n", INODE_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readINodeTable (iNodes);
+
+    struct fragmentationTotals totals;
+    memset (&totals, 0, sizeof (totals));
+    printf ("%8s %10s %12s  %s\n", "extents", "blocks", "bytes", "path");
+    uint32_t queueLength = 0;
+    queue[queueLength].iNodeNumber = ROOT_INODE_NUMBER;
+    queue[queueLength++].path = joinPath ("", "", 1);
+    visited[ROOT_INODE_NUMBER] = 1;
+    for (uint32_t next = 0; next < queueLength; ++next)
+    {
+        const struct iNode* dirNode = &iNodes[queue[next].iNodeNumber];
+        reportFile (dirNode, queue[next].path, listExtents, &totals);
+        struct dirEntry entries[DIR_ENTRIES_PER_BLOCK];
+        uint32_t entryCount = dirNode->size / DIR_ENTRY_LENGTH;
+        for (uint32_t entryIndex = firstEntryIndex (dirNode); entryIndex < entryCount; ++entryIndex)
+        {
+            if (entryIndex % DIR_ENTRIES_PER_BLOCK == 0)
+            {
+                readDataBlock (getFileBlock (dirNode, entryIndex / DIR_ENTRIES_PER_BLOCK, NULL), (char*)entries);
+            }
+            const struct dirEntry* entry = &entries[entryIndex % DIR_ENTRIES_PER_BLOCK];
+            // Holes, the links back up, and files already reported under another name are skipped.
+            if (entry->name[0] == '\0' || strcmp (entry->name, ".") == 0 || strcmp (entry->name, "..") == 0
+                || entry->iNodeNumber >= INODE_COUNT || visited[entry->iNodeNumber])
+            {
+                continue;
+            }
+            visited[entry->iNodeNumber] = 1;
+            const struct iNode* node = &iNodes[entry->iNodeNumber];
+            char* path = joinPath (queue[next].path, entry->name, (node->mode & MU_S_DIREC) != 0);
+            if (node->mode & MU_S_DIREC)
+            {
+                queue[queueLength].iNodeNumber = entry->iNodeNumber;
+                queue[queueLength++].path = path;
+            }
+            else
+            {
+                reportFile (node, path, listExtents, &totals);
+                free (path);
+            }
+        }
+        free (queue[next].path);
+    }
+
+    double average = (totals.files > 0 ? (double)totals.extents / totals.files : 0);
+    printf ("%u files and directories in %lu blocks: %u in one extent, %.2f extents each on average, at most %u\n",
+            totals.files, (unsigned long)totals.blocks, totals.contiguousFiles, average, totals.mostExtents);
+
+    free (queue);
+    free (visited);
+    free (iNodes);
+    teardown ();
+    return EXIT_SUCCESS;
+}
+
+// Prints one line for a file or directory with its extents, and adds it to the totals.
+// Files with no blocks (empty or inline) are not counted.
+// Params:
+//   node - The file's inode.
+//   path - The file's path, which ends in '/' for a directory.
+//   listExtents - 1 to print the first and last block of each extent too.
+//   totals - The totals to add to.
+void
+reportFile (const struct iNode* node, const char* path, int listExtents, struct fragmentationTotals* totals)
+{
+    if ((node->mode & MU_S_INLINE) || node->size == 0)
+    {
+        return;
+    }
+    uint32_t blockCount = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t extents = 0;
+    uint32_t dataBlocks = 0;
+    uint32_t nextBlock = 0;
+    for (uint32_t blockIndex = 0; blockIndex < blockCount; )
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+        runLength = (runLength < blockCount - blockIndex ? runLength : blockCount - blockIndex);
+        if (blockNum != 0)
+        {
+            extents += (blockNum != nextBlock);
+            dataBlocks += runLength;
+            nextBlock = blockNum + runLength;
+        }
+        blockIndex += runLength;
+    }
+    printf ("%8u %10u %12u  %s\n", extents, dataBlocks, node->size, path);
+    if (listExtents)
+    {
+        for (uint32_t blockIndex = 0; blockIndex < blockCount; )
+        {
+            uint32_t runLength;
+            uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+            runLength = (runLength < blockCount - blockIndex ? runLength : blockCount - blockIndex);
+            if (blockNum == 0)
+            {
+                printf ("%8s hole of %u blocks\n", "", runLength);
+            }
+            else
+            {
+                printf ("%8s blocks %u-%u\n", "", blockNum, blockNum + runLength - 1);
+            }
+            blockIndex += runLength;
+        }
+    }
+    ++totals->files;
+    totals->contiguousFiles += (extents <= 1);
+    totals->extents += extents;
+    totals->blocks += dataBlocks;
+    if (extents > totals->mostExtents)
+    {
+        totals->mostExtents = extents;
+    }
+}
+
+// Returns a new string (which the caller must free) naming an entry of a directory.
+// A directory's path ends in '/', so that it can start the paths of what it contains.
+char*
+joinPath (const char* dirPath, const char* name, int isDirectory)
+{
+    char* path = malloc (strlen (dirPath) + strlen (name) + 2);
+    if (path == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for a path\n");
+        exit (EXIT_FAILURE);
+    }
+    sprintf (path, "%s%s%s", dirPath, name, isDirectory ? "/" : "");
+    return path;
+}
@@ -10,71 +10,713 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "mufs.h"
+#include "mucache.h"
+#include "mubitmap.h"
+#include "mujournal.h"
+#include "muring.h"
 
 #define NOT_OPENED -1
 
-// The real file descriptor for the file on which our virtual filesystem is stored.
-int FILESYSTEM_FD = NOT_OPENED;
+// The loaded filesystem, starting out with nothing loaded and the original layout.
+struct mufsContext FILESYSTEM =
+{
+    .fd = NOT_OPENED,
+    .geometry = { DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT, DEFAULT_INODE_COUNT, 1, 2, 18, 0, 18, 0, 2 },
+    .backend = MUFS_BACKEND_FD,
+};
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Copies length bytes starting at offset in the disk image into buffer.
+// Returns the number of bytes copied, or -1 and sets errno.
+static ssize_t
+readAt (off_t offset, void* buffer, size_t length)
+{
+    if (FILESYSTEM.mapping != NULL)
+    {
+        if (offset < 0 || (size_t)offset + length > FILESYSTEM.mappingLength)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy (buffer, FILESYSTEM.mapping + offset, length);
+        return length;
+    }
+    countSyscall ();
+    return pread (FILESYSTEM_FD, buffer, length, offset);
+}
+
+// Copies length bytes from buffer into the disk image starting at offset.
+// Returns the number of bytes copied, or -1 and sets errno.
+static ssize_t
+writeAt (off_t offset, const void* buffer, size_t length)
+{
+    if (FILESYSTEM.mapping != NULL)
+    {
+        if (offset < 0 || (size_t)offset + length > FILESYSTEM.mappingLength)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy (FILESYSTEM.mapping + offset, buffer, length);
+        return length;
+    }
+    countSyscall ();
+    return pwrite (FILESYSTEM_FD, buffer, length, offset);
+}
+
+// Takes diskLock.
+static void
+lockDisk ()
+{
+    pthread_mutex_lock (&FILESYSTEM.diskLock);
+}
+
+// Releases diskLock.
+static void
+unlockDisk ()
+{
+    pthread_mutex_unlock (&FILESYSTEM.diskLock);
+}
+
+// Takes diskLock in order to change a range of data blocks, first waiting out the
+//   flusher if it is writing any of their cached copies right now.
+// The caller must not already hold diskLock.
+static void
+lockDiskForWrite (uint32_t firstBlock, uint32_t count)
+{
+    lockDisk ();
+    while (cacheIsFlushing (firstBlock, count))
+    {
+        unlockDisk ();
+        lockFlusher ();
+        unlockFlusher ();
+        lockDisk ();
+    }
+}
+
+// Creates diskLock.
+static void
+createDiskLock ()
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init (&attributes);
+    pthread_mutexattr_settype (&attributes, PTHREAD_MUTEX_RECURSIVE);
+    if (pthread_mutex_init (&FILESYSTEM.diskLock, &attributes) != 0)
+    {
+        fprintf (stderr, "Could not create the disk lock\n");
+        exit (EXIT_FAILURE);
+    }
+    pthread_mutexattr_destroy (&attributes);
+}
+
+// Puts FILESYSTEM back to having nothing loaded.  Only what outlasts one filesystem is kept:
+//   the geometry (which mkdisk sets without loading anything), the backend and the syscall count.
+static void
+clearContext ()
+{
+    struct mufsContext cleared =
+    {
+        .fd = NOT_OPENED,
+        .geometry = FILESYSTEM.geometry,
+        .backend = FILESYSTEM.backend,
+        .syscallCount = FILESYSTEM.syscallCount,
+    };
+    FILESYSTEM = cleared;
+}
+
+// Determines whether the disk holds the newest copy of every block in a range, so that
+//   it can be read without diskLock.  The caller must hold diskLock.
+// Returns 1 if no block in the range is dirty in the cache or in the journal, 0 otherwise.
+static int
+diskIsCurrent (uint32_t firstBlock, uint32_t count)
+{
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        if (cacheHasDirtyBlock (firstBlock + index) || journalHasBlock (firstBlock + index))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps the entire disk image into memory.
+static void
+mapImage (const char* diskName)
+{
+    struct stat info;
+    if (fstat (FILESYSTEM_FD, &info) != 0)
+    {
+        fprintf (stderr, "Could not determine the size of %s: %s\n", diskName, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    if (info.st_size < (off_t)BLOCK_COUNT * BLOCK_SIZE)
+    {
+        fprintf (stderr, "Disk image %s is too small to map\n", diskName);
+        exit (EXIT_FAILURE);
+    }
+    FILESYSTEM.mappingLength = (size_t)BLOCK_COUNT * BLOCK_SIZE;
+    FILESYSTEM.mapping = mmap (NULL, FILESYSTEM.mappingLength, PROT_READ | PROT_WRITE, MAP_SHARED, FILESYSTEM_FD, 0);
+    if (FILESYSTEM.mapping == MAP_FAILED)
+    {
+        fprintf (stderr, "Could not map %s into memory: %s\n", diskName, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+}
+
+// Allocates a buffer big enough for the on-disk free block map.
+static char*
+allocateFreeMapBuffer ()
+{
+    char* buffer = calloc (FREEBLOCKMAP_BLOCKS, BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf (stderr, "Could not allocate a free block map of %u blocks\n", FREEBLOCKMAP_BLOCKS);
+        exit (EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+// Reads the on-disk free block map (in whichever format the image uses) into freeBlocks.
+static void
+loadFreeBlocks ()
+{
+    char* onDisk = allocateFreeMapBuffer ();
+    off_t offset = (off_t)FREEBLOCKMAP_NUMBER * BLOCK_SIZE;
+    size_t length = (size_t)FREEBLOCKMAP_BLOCKS * BLOCK_SIZE;
+    if (readAt (offset, onDisk, length) < (ssize_t)length)
+    {
+        fprintf (stderr, "Failed to read free block map from disk: %s\n", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    initBitmap (&FILESYSTEM.freeBlocks, BLOCK_COUNT);
+    if (FILESYSTEM.bitmapOnDisk)
+    {
+        loadBitmapFromBits (&FILESYSTEM.freeBlocks, (uint8_t*)onDisk);
+    }
+    else
+    {
+        verifyFreeBlockMap (onDisk);
+        loadBitmapFromBytes (&FILESYSTEM.freeBlocks, onDisk);
+    }
+    FILESYSTEM.storedFreeMap = onDisk;
+    initBitmap (&FILESYSTEM.reservedBlocks, BLOCK_COUNT);
+    // Start allocating from the data region rather than rescanning the metadata blocks every time.
+    FILESYSTEM.freeBlocks.nextFit = FIRSTDATABLOCK_NUMBER;
+    FILESYSTEM.freeBlocksDirty = 0;
+}
+
+// Writes the blocks of freeBlocks that have changed to disk (in whichever format the
+//   image uses), or into the running transaction if the journal is enabled.
+static void
+storeFreeBlocks ()
+{
+    // Blocks that are only set aside go to disk as available, so that a file still open
+    //   at teardown (or a crash) cannot leak them.
+    int anyReserved = (FILESYSTEM.reservedBlocks.freeCount < BLOCK_COUNT);
+    struct blockBitmap stored = FILESYSTEM.freeBlocks;
+    if (anyReserved)
+    {
+        initBitmap (&stored, BLOCK_COUNT);
+        for (uint32_t wordIndex = 0; wordIndex < FILESYSTEM.freeBlocks.wordCount; ++wordIndex)
+        {
+            stored.words[wordIndex] = FILESYSTEM.freeBlocks.words[wordIndex] & ~FILESYSTEM.reservedBlocks.words[wordIndex];
+        }
+    }
+    char* onDisk = allocateFreeMapBuffer ();
+    if (FILESYSTEM.bitmapOnDisk)
+    {
+        storeBitmapToBits (&stored, (uint8_t*)onDisk);
+    }
+    else
+    {
+        storeBitmapToBytes (&stored, onDisk);
+    }
+    if (anyReserved)
+    {
+        destroyBitmap (&stored);
+    }
+    // Clear the flag first, since logging a block may commit and come back here.
+    FILESYSTEM.freeBlocksDirty = 0;
+    for (uint32_t mapBlock = 0; mapBlock < FREEBLOCKMAP_BLOCKS; ++mapBlock)
+    {
+        size_t start = (size_t)mapBlock * BLOCK_SIZE;
+        if (memcmp (onDisk + start, FILESYSTEM.storedFreeMap + start, BLOCK_SIZE) == 0)
+        {
+            continue;
+        }
+        if (isJournalEnabled ())
+        {
+            journalWriteBlock (FREEBLOCKMAP_NUMBER + mapBlock, onDisk + start);
+        }
+        else
+        {
+            writeBlocksToDisk (FREEBLOCKMAP_NUMBER + mapBlock, 1, onDisk + start);
+        }
+        memcpy (FILESYSTEM.storedFreeMap + start, onDisk + start, BLOCK_SIZE);
+    }
+    free (onDisk);
+}
+
+// Reads the on-disk block share table into blockShares, if the image has one.
+static void
+loadBlockShares ()
+{
+    if (!FILESYSTEM.sharedBlocks)
+    {
+        return;
+    }
+    size_t length = (size_t)SHARETABLE_BLOCKS * BLOCK_SIZE;
+    FILESYSTEM.blockShares = malloc (length);
+    FILESYSTEM.storedShareTable = malloc (length);
+    if (FILESYSTEM.blockShares == NULL || FILESYSTEM.storedShareTable == NULL)
+    {
+        fprintf (stderr, "Could not allocate a block share table of %u blocks\n", SHARETABLE_BLOCKS);
+        exit (EXIT_FAILURE);
+    }
+    if (readAt ((off_t)FIRSTSHARETABLEBLOCK_NUMBER * BLOCK_SIZE, FILESYSTEM.storedShareTable, length) < (ssize_t)length)
+    {
+        fprintf (stderr, "Failed to read block share table from disk: %s\n", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    memcpy (FILESYSTEM.blockShares, FILESYSTEM.storedShareTable, length);
+    FILESYSTEM.blockSharesDirty = 0;
+}
+
+// Writes the blocks of blockShares that have changed to disk, or into the running
+//   transaction if the journal is enabled.
+static void
+storeBlockShares ()
+{
+    const char* current = (const char*)FILESYSTEM.blockShares;
+    // Clear the flag first, since logging a block may commit and come back here.
+    FILESYSTEM.blockSharesDirty = 0;
+    for (uint32_t tableBlock = 0; tableBlock < SHARETABLE_BLOCKS; ++tableBlock)
+    {
+        size_t start = (size_t)tableBlock * BLOCK_SIZE;
+        if (memcmp (current + start, FILESYSTEM.storedShareTable + start, BLOCK_SIZE) == 0)
+        {
+            continue;
+        }
+        if (isJournalEnabled ())
+        {
+            journalWriteBlock (FIRSTSHARETABLEBLOCK_NUMBER + tableBlock, (char*)current + start);
+        }
+        else
+        {
+            writeBlocksToDisk (FIRSTSHARETABLEBLOCK_NUMBER + tableBlock, 1, current + start);
+        }
+        memcpy (FILESYSTEM.storedShareTable + start, current + start, BLOCK_SIZE);
+    }
+}
+
+// Makes the metadata on disk current: through a journal commit if the journal is
+//   enabled, or by storing the free block map and the share table directly if it is not.
+static void
+commitMetadata ()
+{
+    if (isJournalEnabled ())
+    {
+        journalCommit ();
+        return;
+    }
+    if (FILESYSTEM.freeBlocksDirty)
+    {
+        storeFreeBlocks ();
+    }
+    if (FILESYSTEM.blockSharesDirty)
+    {
+        storeBlockShares ();
+    }
+}
+
+// Returns the number of the block holding an inode.
+static uint32_t
+iNodeBlockOf (uint32_t iNodeNumber)
+{
+    return FIRSTINODEBLOCK_NUMBER + (uint32_t)((uint64_t)iNodeNumber * INODE_SIZE / BLOCK_SIZE);
+}
+
+// Computes the layout of a filesystem from its basic parameters.
+// Returns:
+//   0 on success, or -1 if the parameters do not describe a usable filesystem.
+static int
+computeGeometry (uint32_t blockSize, uint32_t blockCount, uint32_t iNodeCount, uint32_t journalBlocks,
+                 int packedFreeMap, int shareTable, struct mufsGeometry* geometry)
+{
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0
+        || blockCount == 0 || blockCount > MAX_BLOCK_COUNT || iNodeCount == 0)
+    {
+        return -1;
+    }
+    uint64_t mapBytes = (packedFreeMap ? ((uint64_t)blockCount + 7) / 8 : blockCount);
+    uint64_t iNodeBytes = (uint64_t)iNodeCount * INODE_SIZE;
+    uint64_t shareBytes = (shareTable ? (uint64_t)blockCount * sizeof (uint16_t) : 0);
+    uint64_t freeMapBlocks = (mapBytes + blockSize - 1) / blockSize;
+    uint64_t firstShareTableBlock = FREEBLOCKMAP_NUMBER + freeMapBlocks;
+    uint64_t shareTableBlocks = (shareBytes + blockSize - 1) / blockSize;
+    uint64_t firstINodeBlock = firstShareTableBlock + shareTableBlocks;
+    uint64_t firstJournalBlock = firstINodeBlock + (iNodeBytes + blockSize - 1) / blockSize;
+    uint64_t firstDataBlock = firstJournalBlock + journalBlocks;
+    if (journalBlocks != 0 && journalBlocks < minimumJournalBlocks (blockSize, blockCount, packedFreeMap, shareTable))
+    {
+        return -1;
+    }
+    // There must be room for at least the root directory's first block.
+    if (firstDataBlock >= blockCount)
+    {
+        return -1;
+    }
+    geometry->blockSize = blockSize;
+    geometry->blockCount = blockCount;
+    geometry->iNodeCount = iNodeCount;
+    geometry->freeMapBlocks = freeMapBlocks;
+    geometry->firstINodeBlock = firstINodeBlock;
+    geometry->firstDataBlock = firstDataBlock;
+    geometry->journalBlocks = journalBlocks;
+    geometry->firstJournalBlock = firstJournalBlock;
+    geometry->shareTableBlocks = shareTableBlocks;
+    geometry->firstShareTableBlock = firstShareTableBlock;
+    return 0;
+}
+
+// Reads the superblock of the image and makes its geometry the current one.
+static void
+loadGeometry (const char* diskName, struct superBlock* super)
+{
+    struct mufsGeometry stored = super->geometry;
+    if (stored.blockSize == 0)
+    {
+        // Written before the superblock recorded the geometry.
+        stored.blockSize = DEFAULT_BLOCK_SIZE;
+        stored.blockCount = DEFAULT_BLOCK_COUNT;
+        stored.iNodeCount = DEFAULT_INODE_COUNT;
+    }
+    struct mufsGeometry computed;
+    if (computeGeometry (stored.blockSize, stored.blockCount, stored.iNodeCount, stored.journalBlocks,
+                         FILESYSTEM.bitmapOnDisk, FILESYSTEM.sharedBlocks, &computed) != 0
+        || stored.shareTableBlocks != computed.shareTableBlocks
+        || (stored.firstDataBlock != 0 && (stored.freeMapBlocks != computed.freeMapBlocks
+                                            || stored.firstINodeBlock != computed.firstINodeBlock
+                                            || stored.firstDataBlock != computed.firstDataBlock))
+        || (stored.journalBlocks != 0 && stored.firstJournalBlock != computed.firstJournalBlock))
+    {
+        fprintf (stderr, "The superblock of %s describes an impossible geometry\n", diskName);
+        exit (EXIT_FAILURE);
+    }
+    GEOMETRY = computed;
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+int
+setGeometry (uint32_t blockSize, uint32_t blockCount, uint32_t iNodeCount, uint32_t journalBlocks, int packedFreeMap,
+             int shareTable)
+{
+    assert (FILESYSTEM_FD == NOT_OPENED);
+    return computeGeometry (blockSize, blockCount, iNodeCount, journalBlocks, packedFreeMap, shareTable, &GEOMETRY);
+}
+
+uint32_t
+minimumJournalBlocks (uint32_t blockSize, uint32_t blockCount, int packedFreeMap, int shareTable)
+{
+    uint64_t mapBytes = (packedFreeMap ? ((uint64_t)blockCount + 7) / 8 : blockCount);
+    uint64_t shareBytes = (shareTable ? (uint64_t)blockCount * sizeof (uint16_t) : 0);
+    uint64_t freeMapBlocks = (mapBytes + blockSize - 1) / blockSize;
+    uint64_t shareTableBlocks = (shareBytes + blockSize - 1) / blockSize;
+    // A journal must be able to hold a transaction that rewrites the whole free block map
+    //   and share table.
+    return MIN_JOURNAL_BLOCKS + 2 * (freeMapBlocks + shareTableBlocks);
+}
+
+void
+selectBackend (int newBackend)
+{
+    assert (FILESYSTEM_FD == NOT_OPENED);
+    assert (newBackend == MUFS_BACKEND_FD || newBackend == MUFS_BACKEND_MMAP || newBackend == MUFS_BACKEND_URING);
+    FILESYSTEM.backend = newBackend;
+}
 
 void
 setup (const char* diskName)
 {
     assert (FILESYSTEM_FD == NOT_OPENED);
+    clearContext ();
+    createDiskLock ();
     FILESYSTEM_FD = open (diskName, O_RDWR);
     if (FILESYSTEM_FD == NOT_OPENED)
     {
         fprintf (stderr, "Could not open file %s: %s\n", diskName, strerror (errno));
         exit (EXIT_FAILURE);
     }
-    char first8[8];
-    if (read (FILESYSTEM_FD, first8, sizeof (first8)) < sizeof (first8))
+    struct superBlock super;
+    if (readAt (0, &super, sizeof (super)) < (ssize_t)sizeof (super))
     {
         fprintf (stderr, "Could not read filesystem identifier from %s: %s\n", diskName, strerror (errno));
-        exit (EXIT_SUCCESS);
+        exit (EXIT_FAILURE);
+    }
+    const char* first8 = super.identifier;
+    FILESYSTEM.sharedBlocks = 0;
+    if (strcmp (first8, VERSION24) == 0)
+    {
+        FILESYSTEM.bitmapOnDisk = 1;
+        FILESYSTEM.extentINodes = 1;
+        FILESYSTEM.inlineINodes = 1;
+        FILESYSTEM.indexedDirectories = 1;
+        FILESYSTEM.compressedFiles = 1;
+        FILESYSTEM.sharedBlocks = 1;
+    }
+    else if (strcmp (first8, VERSION23) == 0)
+    {
+        FILESYSTEM.bitmapOnDisk = 1;
+        FILESYSTEM.extentINodes = 1;
+        FILESYSTEM.inlineINodes = 1;
+        FILESYSTEM.indexedDirectories = 1;
+        FILESYSTEM.compressedFiles = 1;
+    }
+    else if (strcmp (first8, VERSION22) == 0)
+    {
+        FILESYSTEM.bitmapOnDisk = 1;
+        FILESYSTEM.extentINodes = 1;
+        FILESYSTEM.inlineINodes = 1;
+        FILESYSTEM.indexedDirectories = 1;
+        FILESYSTEM.compressedFiles = 0;
+    }
+    else if (strcmp (first8, VERSION21) == 0)
+    {
+        FILESYSTEM.bitmapOnDisk = 1;
+        FILESYSTEM.extentINodes = 1;
+        FILESYSTEM.inlineINodes = 1;
+        FILESYSTEM.indexedDirectories = 0;
+        FILESYSTEM.compressedFiles = 0;
+    }
+    else if (strcmp (first8, VERSION20) == 0)
+    {
+        FILESYSTEM.bitmapOnDisk = 1;
+        FILESYSTEM.extentINodes = 1;
+        FILESYSTEM.inlineINodes = 0;
+        FILESYSTEM.indexedDirectories = 0;
+        FILESYSTEM.compressedFiles = 0;
+    }
+    else if (strcmp (first8, VERSION11) == 0)
+    {
+        FILESYSTEM.bitmapOnDisk = 1;
+        FILESYSTEM.extentINodes = 0;
+        FILESYSTEM.inlineINodes = 0;
+        FILESYSTEM.indexedDirectories = 0;
+        FILESYSTEM.compressedFiles = 0;
+    }
+    else
+    {
+        assert (strcmp (first8, VERSION10) == 0);
+        FILESYSTEM.bitmapOnDisk = 0;
+        FILESYSTEM.extentINodes = 0;
+        FILESYSTEM.inlineINodes = 0;
+        FILESYSTEM.indexedDirectories = 0;
+        FILESYSTEM.compressedFiles = 0;
+    }
+    loadGeometry (diskName, &super);
+    if (FILESYSTEM.backend == MUFS_BACKEND_MMAP)
+    {
+        mapImage (diskName);
+    }
+    // Replaying the journal has to come before anything else reads the metadata.
+    openJournal (FIRSTJOURNALBLOCK_NUMBER, JOURNAL_BLOCKS, FREEBLOCKMAP_BLOCKS + SHARETABLE_BLOCKS);
+    loadFreeBlocks ();
+    loadBlockShares ();
+    // A mapped image is already an in-memory copy, so caching it again would only add copies.
+    if (FILESYSTEM.mapping == NULL)
+    {
+        openBlockCache ();
+    }
+    // Without io_uring the asynchronous functions simply do their work at once.
+    if (FILESYSTEM.backend == MUFS_BACKEND_URING)
+    {
+        openRing (FILESYSTEM_FD, DEFAULT_RING_ENTRIES);
     }
-    assert (strcmp (first8, VERSION10) == 0);
 }
 
 void
 teardown ()
 {
     assert (FILESYSTEM_FD != NOT_OPENED);
+    closeRing ();
+    closeBlockCache ();
+    commitMetadata ();
+    closeJournal ();
+    destroyBitmap (&FILESYSTEM.freeBlocks);
+    destroyBitmap (&FILESYSTEM.reservedBlocks);
+    free (FILESYSTEM.storedFreeMap);
+    free (FILESYSTEM.blockShares);
+    free (FILESYSTEM.storedShareTable);
+    if (FILESYSTEM.mapping != NULL)
+    {
+        if (msync (FILESYSTEM.mapping, FILESYSTEM.mappingLength, MS_SYNC) != 0
+            || munmap (FILESYSTEM.mapping, FILESYSTEM.mappingLength) != 0)
+        {
+            fprintf (stderr, "Could not unmap filesystem: %s\n", strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+    }
     int result = close (FILESYSTEM_FD);
     if (result != 0)
     {
         fprintf (stderr, "Could not teardown filesystem: %s\n", strerror (errno));
         exit (EXIT_FAILURE);
     }
-    FILESYSTEM_FD = NOT_OPENED;
+    pthread_mutex_destroy (&FILESYSTEM.diskLock);
+    clearContext ();
+}
+
+void
+mufs_sync ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    waitDataBlocks ();
+    lockFlusher ();
+    lockDisk ();
+    flushBlockCache ();
+    commitMetadata ();
+    countSyscall ();
+    int result = (FILESYSTEM.mapping != NULL ? msync (FILESYSTEM.mapping, FILESYSTEM.mappingLength, MS_SYNC) : fsync (FILESYSTEM_FD));
+    unlockDisk ();
+    unlockFlusher ();
+    if (result != 0)
+    {
+        fprintf (stderr, "Could not sync filesystem: %s\n", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+}
+
+void
+mufs_datasync ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    waitDataBlocks ();
+    lockDisk ();
+    commitMetadata ();
+    countSyscall ();
+    int result = (FILESYSTEM.mapping != NULL ? msync (FILESYSTEM.mapping, FILESYSTEM.mappingLength, MS_SYNC) : fdatasync (FILESYSTEM_FD));
+    unlockDisk ();
+    if (result != 0)
+    {
+        fprintf (stderr, "Could not sync filesystem: %s\n", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+}
+
+void
+writeBackDataBlocks (uint32_t firstBlock, uint32_t count)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockFlusher ();
+    lockDisk ();
+    cacheWriteBackRange (firstBlock, count);
+    unlockDisk ();
+    unlockFlusher ();
+}
+
+void
+waitForFlusher ()
+{
+    lockFlusher ();
+    unlockFlusher ();
+}
+
+int
+usesAsyncIO ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    return isRingOpen ();
+}
+
+int
+usesExtents ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    return FILESYSTEM.extentINodes;
+}
+
+int
+usesInlineData ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    return FILESYSTEM.inlineINodes;
+}
+
+int
+usesDirIndex ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    return FILESYSTEM.indexedDirectories;
+}
+
+int
+usesCompression ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    return FILESYSTEM.compressedFiles;
+}
+
+int
+usesSharedBlocks ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    return FILESYSTEM.sharedBlocks;
 }
 
 void
 sanityCheck ()
 {
-    assert (sizeof (struct superBlock) == BLOCK_SIZE);
-    assert (sizeof (struct freeBlockMap) == BLOCK_SIZE);
+    assert (sizeof (struct superBlock) == MIN_BLOCK_SIZE);
     assert (sizeof (struct iNode) == INODE_SIZE);
     assert (sizeof (struct dirEntry) == DIR_ENTRY_LENGTH);
-    assert (FIRSTDATABLOCK_NUMBER == FIRSTINODEBLOCK_NUMBER + INODE_COUNT * INODE_SIZE / BLOCK_SIZE);
+    assert (sizeof (struct extent) == EXTENT_LENGTH);
+    assert (sizeof (struct dirIndexRoot) == DIR_INDEX_HEADER_LENGTH);
+    assert (sizeof (struct dirIndexRange) == DIR_INDEX_RANGE_LENGTH);
+    assert (sizeof (struct dirIndexRecord) == DIR_INDEX_RECORD_LENGTH);
+    assert (sizeof (struct dirIndexLeaf) == DIR_INDEX_HEADER_LENGTH);
+    assert (FIRSTINODEBLOCK_NUMBER == FREEBLOCKMAP_NUMBER + FREEBLOCKMAP_BLOCKS + SHARETABLE_BLOCKS);
+    assert (FIRSTDATABLOCK_NUMBER == FIRSTINODEBLOCK_NUMBER + ((uint64_t)INODE_COUNT * INODE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE);
 }
 
+// Without NDEBUG the checks run on every access; release builds leave them to mufsck.
 void
 verifyINode (struct iNode* buffer)
 {
+#ifndef NDEBUG
     uint16_t type = buffer->mode & (MU_S_AVAIL | MU_S_DIREC | MU_S_REGLR);
     assert (type == MU_S_AVAIL || type == MU_S_DIREC || type == MU_S_REGLR);
+    assert ((buffer->mode & MU_S_INLINE) == 0
+            || (FILESYSTEM.inlineINodes && type == MU_S_REGLR && buffer->size <= INLINE_DATA_SIZE));
+    assert ((buffer->mode & MU_S_INDEXED) == 0
+            || (FILESYSTEM.indexedDirectories && type == MU_S_DIREC && buffer->size > BLOCK_SIZE));
+    assert ((buffer->mode & MU_S_COMPRESSED) == 0
+            || (FILESYSTEM.compressedFiles && type == MU_S_REGLR && (buffer->mode & MU_S_INLINE) == 0));
+#endif
 }
 
 void
-verifyFreeBlockMap (struct freeBlockMap* buffer)
+verifyFreeBlockMap (const char* isUsed)
 {
-    for (int blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
+#ifndef NDEBUG
+    for (uint32_t blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
     {
-        assert (buffer->isUsed[blockNum] == BLOCK_USED || buffer->isUsed[blockNum] == BLOCK_AVAILABLE);
-        assert (blockNum >= FIRSTDATABLOCK_NUMBER || buffer->isUsed[blockNum] == BLOCK_USED);
+        assert (isUsed[blockNum] == BLOCK_USED || isUsed[blockNum] == BLOCK_AVAILABLE);
+        assert (blockNum >= FIRSTDATABLOCK_NUMBER || isUsed[blockNum] == BLOCK_USED);
     }
+#endif
 }
 
 void
@@ -82,19 +724,29 @@ readINode (uint32_t iNodeNumber, struct iNode* buffer)
 {
     assert (FILESYSTEM_FD != NOT_OPENED);
     assert (iNodeNumber < INODE_COUNT);
-    int offset = FIRSTINODEBLOCK_NUMBER * BLOCK_SIZE + iNodeNumber * INODE_SIZE;
-    int result = lseek (FILESYSTEM_FD, offset, SEEK_SET);
-    if (result < 0)
+    // Without a journal the disk always holds the newest copy, and no lock is needed to read it.
+    int journaled = 0;
+    if (isJournalEnabled ())
     {
-        fprintf (stderr, "Could not seek to inode %d on disk: %s\n", iNodeNumber, strerror (errno));
-        exit (EXIT_FAILURE);
+        // The newest copy of the inode may still be in the journal.
+        char block[BLOCK_SIZE];
+        lockDisk ();
+        if (journalReadBlock (iNodeBlockOf (iNodeNumber), block))
+        {
+            memcpy (buffer, block + (uint64_t)iNodeNumber * INODE_SIZE % BLOCK_SIZE, INODE_SIZE);
+            journaled = 1;
+        }
     }
-    int bytes = read (FILESYSTEM_FD, buffer, INODE_SIZE);
-    if (bytes < INODE_SIZE)
+    off_t offset = (off_t)FIRSTINODEBLOCK_NUMBER * BLOCK_SIZE + (off_t)iNodeNumber * INODE_SIZE;
+    if (!journaled && readAt (offset, buffer, INODE_SIZE) < INODE_SIZE)
     {
-        fprintf (stderr, "Failed to read inode %d from disk: %s\n", iNodeNumber, strerror (errno));
+        fprintf (stderr, "Failed to read inode %u from disk: %s\n", iNodeNumber, strerror (errno));
         exit (EXIT_FAILURE);
     }
+    if (isJournalEnabled ())
+    {
+        unlockDisk ();
+    }
     verifyINode (buffer);
 }
 
@@ -104,97 +756,632 @@ writeINode (uint32_t iNodeNumber, struct iNode* buffer)
     verifyINode (buffer);
     assert (FILESYSTEM_FD != NOT_OPENED);
     assert (iNodeNumber < INODE_COUNT);
-    int offset = FIRSTINODEBLOCK_NUMBER * BLOCK_SIZE + iNodeNumber * INODE_SIZE;
-    int result = lseek (FILESYSTEM_FD, offset, SEEK_SET);
-    if (result < 0)
+    if (isJournalEnabled ())
     {
-        fprintf (stderr, "Could not seek to inode %d on disk: %s\n", iNodeNumber, strerror (errno));
-        exit (EXIT_FAILURE);
+        // Log the whole block holding the inode.
+        uint32_t blockNum = iNodeBlockOf (iNodeNumber);
+        char block[BLOCK_SIZE];
+        lockDisk ();
+        if (!journalReadBlock (blockNum, block))
+        {
+            readBlocksFromDisk (blockNum, 1, block);
+        }
+        memcpy (block + (uint64_t)iNodeNumber * INODE_SIZE % BLOCK_SIZE, buffer, INODE_SIZE);
+        journalWriteBlock (blockNum, block);
+        unlockDisk ();
+        return;
     }
-    int bytes = write (FILESYSTEM_FD, buffer, INODE_SIZE);
-    if (bytes < INODE_SIZE)
+    off_t offset = (off_t)FIRSTINODEBLOCK_NUMBER * BLOCK_SIZE + (off_t)iNodeNumber * INODE_SIZE;
+    if (writeAt (offset, buffer, INODE_SIZE) < INODE_SIZE)
     {
-        fprintf (stderr, "Failed to write inode %d from disk: %s\n", iNodeNumber, strerror (errno));
+        fprintf (stderr, "Failed to write inode %u to disk: %s\n", iNodeNumber, strerror (errno));
         exit (EXIT_FAILURE);
     }
 }
 
 void
-readFreeBlockMap (struct freeBlockMap* buffer)
+readINodeTable (struct iNode* table)
 {
     assert (FILESYSTEM_FD != NOT_OPENED);
-    int offset = FREEBLOCKMAP_NUMBER * BLOCK_SIZE;
-    int result = lseek (FILESYSTEM_FD, offset, SEEK_SET);
-    if (result < 0)
+    size_t length = (size_t)INODE_COUNT * INODE_SIZE;
+    if (readAt ((off_t)FIRSTINODEBLOCK_NUMBER * BLOCK_SIZE, table, length) < (ssize_t)length)
     {
-        fprintf (stderr, "Could not seek to free block map on disk: %s\n", strerror (errno));
+        fprintf (stderr, "Failed to read the inode table from disk: %s\n", strerror (errno));
         exit (EXIT_FAILURE);
     }
-    int bytes = read (FILESYSTEM_FD, buffer, BLOCK_COUNT);
-    if (bytes < BLOCK_COUNT)
+    if (!isJournalEnabled ())
     {
-        fprintf (stderr, "Failed to read free block map from disk: %s\n", strerror (errno));
+        return;
+    }
+    // Any inode block in the running transaction is newer than the one on disk.
+    char* block = malloc (BLOCK_SIZE);
+    if (block == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory to read the inode table\n");
         exit (EXIT_FAILURE);
     }
-    verifyFreeBlockMap (buffer);
+    uint32_t iNodeBlocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    lockDisk ();
+    for (uint32_t index = 0; index < iNodeBlocks; ++index)
+    {
+        if (journalReadBlock (FIRSTINODEBLOCK_NUMBER + index, block))
+        {
+            size_t start = (size_t)index * BLOCK_SIZE;
+            memcpy ((char*)table + start, block, (length - start < BLOCK_SIZE ? length - start : BLOCK_SIZE));
+        }
+    }
+    unlockDisk ();
+    free (block);
+}
+
+void
+readFreeBlockMap (char* isUsed)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockDisk ();
+    storeBitmapToBytes (&FILESYSTEM.freeBlocks, isUsed);
+    unlockDisk ();
+    verifyFreeBlockMap (isUsed);
+}
+
+void
+copyFreeBlocks (struct blockBitmap* copy)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    initBitmap (copy, BLOCK_COUNT);
+    lockDisk ();
+    memcpy (copy->words, FILESYSTEM.freeBlocks.words, (size_t)FILESYSTEM.freeBlocks.wordCount * sizeof (uint64_t));
+    copy->freeCount = FILESYSTEM.freeBlocks.freeCount;
+    unlockDisk ();
+}
+
+void
+writeFreeBlockMap (const char* isUsed)
+{
+    verifyFreeBlockMap (isUsed);
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockDisk ();
+    loadBitmapFromBytes (&FILESYSTEM.freeBlocks, isUsed);
+    // A block that the new map makes available is no longer set aside.
+    for (uint32_t blockNum = FIRSTDATABLOCK_NUMBER; blockNum < BLOCK_COUNT; ++blockNum)
+    {
+        if (!isBitmapBlockUsed (&FILESYSTEM.freeBlocks, blockNum))
+        {
+            markBitmapBlockAvailable (&FILESYSTEM.reservedBlocks, blockNum);
+        }
+    }
+    FILESYSTEM.freeBlocksDirty = 1;
+    commitMetadata ();
+    unlockDisk ();
+}
+
+int
+allocateBlock ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockDisk ();
+    int blockNum = allocateBitmapBlock (&FILESYSTEM.freeBlocks);
+    if (blockNum >= 0)
+    {
+        assert (blockNum >= FIRSTDATABLOCK_NUMBER);
+        FILESYSTEM.freeBlocksDirty = 1;
+    }
+    unlockDisk ();
+    return blockNum;
+}
+
+int
+allocateRun (uint32_t count)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockDisk ();
+    int firstBlock = allocateBitmapRun (&FILESYSTEM.freeBlocks, count);
+    if (firstBlock >= 0)
+    {
+        assert (firstBlock >= FIRSTDATABLOCK_NUMBER);
+        FILESYSTEM.freeBlocksDirty = 1;
+    }
+    unlockDisk ();
+    return firstBlock;
+}
+
+uint32_t
+allocateRunAt (uint32_t blockNum, uint32_t maxCount)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    if (blockNum < FIRSTDATABLOCK_NUMBER)
+    {
+        return 0;
+    }
+    lockDisk ();
+    uint32_t count = allocateBitmapRunAt (&FILESYSTEM.freeBlocks, blockNum, maxCount);
+    if (count > 0)
+    {
+        FILESYSTEM.freeBlocksDirty = 1;
+    }
+    unlockDisk ();
+    return count;
 }
 
 void
-writeFreeBlockMap (struct freeBlockMap* buffer)
+releaseBlock (uint32_t blockNum)
 {
-    verifyFreeBlockMap (buffer);
     assert (FILESYSTEM_FD != NOT_OPENED);
-    int offset = FREEBLOCKMAP_NUMBER;
-    int result = lseek (FILESYSTEM_FD, offset, SEEK_SET);
-    if (result < 0)
+    assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
+    lockDisk ();
+    assert (isBitmapBlockUsed (&FILESYSTEM.freeBlocks, blockNum));
+    if (FILESYSTEM.sharedBlocks && FILESYSTEM.blockShares[blockNum] > 0)
+    {
+        --FILESYSTEM.blockShares[blockNum];
+        FILESYSTEM.blockSharesDirty = 1;
+    }
+    else
     {
-        fprintf (stderr, "Could not seek to free block map on disk: %s\n", strerror (errno));
+        markBitmapBlockAvailable (&FILESYSTEM.freeBlocks, blockNum);
+        FILESYSTEM.freeBlocksDirty = 1;
+        markBitmapBlockAvailable (&FILESYSTEM.reservedBlocks, blockNum);
+    }
+    unlockDisk ();
+}
+
+void
+markBlocksReserved (uint32_t firstBlock, uint32_t count)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockDisk ();
+    for (uint32_t blockNum = firstBlock; blockNum < firstBlock + count; ++blockNum)
+    {
+        assert (isBitmapBlockUsed (&FILESYSTEM.freeBlocks, blockNum) && !isBitmapBlockUsed (&FILESYSTEM.reservedBlocks, blockNum));
+        markBitmapBlockUsed (&FILESYSTEM.reservedBlocks, blockNum);
+    }
+    // The blocks were stored as used when they were allocated.
+    FILESYSTEM.freeBlocksDirty = 1;
+    unlockDisk ();
+}
+
+void
+claimReservedBlocks (uint32_t firstBlock, uint32_t count)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    lockDisk ();
+    for (uint32_t blockNum = firstBlock; blockNum < firstBlock + count; ++blockNum)
+    {
+        assert (isBitmapBlockUsed (&FILESYSTEM.reservedBlocks, blockNum));
+        markBitmapBlockAvailable (&FILESYSTEM.reservedBlocks, blockNum);
+    }
+    FILESYSTEM.freeBlocksDirty = 1;
+    unlockDisk ();
+}
+
+int
+shareBlock (uint32_t blockNum)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (FILESYSTEM.sharedBlocks);
+    assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
+    lockDisk ();
+    assert (isBitmapBlockUsed (&FILESYSTEM.freeBlocks, blockNum));
+    int result = -1;
+    if (FILESYSTEM.blockShares[blockNum] < MAX_BLOCK_SHARES)
+    {
+        ++FILESYSTEM.blockShares[blockNum];
+        FILESYSTEM.blockSharesDirty = 1;
+        result = 0;
+    }
+    unlockDisk ();
+    return result;
+}
+
+uint32_t
+getBlockShares (uint32_t blockNum)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (blockNum < BLOCK_COUNT);
+    if (!FILESYSTEM.sharedBlocks)
+    {
+        return 0;
+    }
+    lockDisk ();
+    uint32_t shares = FILESYSTEM.blockShares[blockNum];
+    unlockDisk ();
+    return shares;
+}
+
+void
+readBlockShares (uint16_t* shares)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (FILESYSTEM.sharedBlocks);
+    lockDisk ();
+    memcpy (shares, FILESYSTEM.blockShares, (size_t)BLOCK_COUNT * sizeof (uint16_t));
+    unlockDisk ();
+}
+
+void
+writeBlockShares (const uint16_t* shares)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (FILESYSTEM.sharedBlocks);
+    lockDisk ();
+    memcpy (FILESYSTEM.blockShares, shares, (size_t)BLOCK_COUNT * sizeof (uint16_t));
+    FILESYSTEM.blockSharesDirty = 1;
+    commitMetadata ();
+    unlockDisk ();
+}
+
+void
+readDataBlock (uint32_t blockNum, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
+    lockDisk ();
+    if (journalReadBlock (blockNum, buffer))
+    {
+        unlockDisk ();
+        return;
+    }
+    if (isBlockCacheEnabled ())
+    {
+        cacheReadBlock (blockNum, buffer);
+        unlockDisk ();
+    }
+    else
+    {
+        unlockDisk ();
+        readDataBlockFromDisk (blockNum, buffer);
+    }
+}
+
+void
+writeDataBlock (uint32_t blockNum, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
+    lockDiskForWrite (blockNum, 1);
+    journalForget (blockNum);
+    if (isBlockCacheEnabled ())
+    {
+        cacheWriteBlock (blockNum, buffer);
+    }
+    else
+    {
+        writeDataBlockToDisk (blockNum, buffer);
+    }
+    unlockDisk ();
+}
+
+void
+writeMetadataBlock (uint32_t blockNum, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
+    if (!isJournalEnabled ())
+    {
+        writeDataBlock (blockNum, buffer);
+        return;
+    }
+    lockDiskForWrite (blockNum, 1);
+    journalWriteBlock (blockNum, buffer);
+    // A cached copy must not be written back over the journaled one.
+    if (isBlockCacheEnabled ())
+    {
+        cacheRefreshBlock (blockNum, buffer);
+    }
+    unlockDisk ();
+}
+
+void
+readDataBlocks (uint32_t firstBlock, uint32_t count, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock >= FIRSTDATABLOCK_NUMBER && firstBlock + count <= BLOCK_COUNT);
+    // When nothing newer is held in memory, the read itself can go ahead without the lock,
+    //   which is what lets readers on different threads overlap.
+    lockDisk ();
+    int current = diskIsCurrent (firstBlock, count);
+    if (current)
+    {
+        unlockDisk ();
+    }
+    off_t offset = (off_t)firstBlock * BLOCK_SIZE;
+    size_t length = (size_t)count * BLOCK_SIZE;
+    if (readAt (offset, buffer, length) < (ssize_t)length)
+    {
+        fprintf (stderr, "Failed to read data blocks %u-%u from disk: %s\n", firstBlock, firstBlock + count - 1, strerror (errno));
         exit (EXIT_FAILURE);
     }
-    int bytes = write (FILESYSTEM_FD, buffer, BLOCK_COUNT);
-    if (bytes < BLOCK_COUNT)
+    if (current)
     {
-        fprintf (stderr, "Failed to write block map to disk: %s\n", strerror (errno));
+        return;
+    }
+    // The cache and the journal may hold newer copies of some of these blocks than the disk does.
+    for (uint32_t index = 0; index < count && isBlockCacheEnabled (); ++index)
+    {
+        cachePeekBlock (firstBlock + index, buffer + (size_t)index * BLOCK_SIZE);
+    }
+    for (uint32_t index = 0; index < count && isJournalEnabled (); ++index)
+    {
+        journalReadBlock (firstBlock + index, buffer + (size_t)index * BLOCK_SIZE);
+    }
+    unlockDisk ();
+}
+
+void
+writeDataBlocks (uint32_t firstBlock, uint32_t count, const char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock >= FIRSTDATABLOCK_NUMBER && firstBlock + count <= BLOCK_COUNT);
+    // Held throughout so that a cached copy cannot be written back between the write and the refresh.
+    lockDiskForWrite (firstBlock, count);
+    for (uint32_t index = 0; index < count && isJournalEnabled (); ++index)
+    {
+        journalForget (firstBlock + index);
+    }
+    off_t offset = (off_t)firstBlock * BLOCK_SIZE;
+    size_t length = (size_t)count * BLOCK_SIZE;
+    if (writeAt (offset, buffer, length) < (ssize_t)length)
+    {
+        fprintf (stderr, "Failed to write data blocks %u-%u to disk: %s\n", firstBlock, firstBlock + count - 1, strerror (errno));
         exit (EXIT_FAILURE);
     }
+    // Keep any cached copies in step with what is now on disk.
+    for (uint32_t index = 0; index < count && isBlockCacheEnabled (); ++index)
+    {
+        cacheRefreshBlock (firstBlock + index, buffer + (size_t)index * BLOCK_SIZE);
+    }
+    unlockDisk ();
 }
 
 void
-readDataBlock (uint32_t blockNum, char buffer[BLOCK_SIZE])
+prefetchDataBlocks (uint32_t firstBlock, uint32_t count)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    if (firstBlock < FIRSTDATABLOCK_NUMBER || count == 0)
+    {
+        return;
+    }
+    if (firstBlock + count > BLOCK_COUNT)
+    {
+        count = BLOCK_COUNT - firstBlock;
+    }
+    if (FILESYSTEM.mapping != NULL)
+    {
+        countSyscall ();
+        madvise (FILESYSTEM.mapping + (size_t)firstBlock * BLOCK_SIZE, (size_t)count * BLOCK_SIZE, MADV_WILLNEED);
+        return;
+    }
+    if (!isBlockCacheEnabled ())
+    {
+        return;
+    }
+    // Skip the leading blocks that are already cached, then bring the rest in with one read.
+    lockDisk ();
+    while (count > 0 && cacheHasBlock (firstBlock))
+    {
+        ++firstBlock;
+        --count;
+    }
+    char* buffer = (count == 0 ? NULL : malloc ((size_t)count * BLOCK_SIZE));
+    char* cached = (count == 0 ? NULL : malloc (count));
+    if (buffer == NULL || cached == NULL)
+    {
+        unlockDisk ();
+        free (buffer);
+        free (cached);
+        return;
+    }
+    // Note which blocks are cached before reading, since their disk copies may be stale and
+    //   filling the others could evict them before the loop below reaches them.
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        cached[index] = (char)cacheHasBlock (firstBlock + index);
+    }
+    // The others cannot change while the caller is reading the file they belong to, so the
+    //   lock is not needed during the read itself.
+    unlockDisk ();
+    off_t offset = (off_t)firstBlock * BLOCK_SIZE;
+    size_t length = (size_t)count * BLOCK_SIZE;
+    ssize_t result = readAt (offset, buffer, length);
+    lockDisk ();
+    if (result == (ssize_t)length)
+    {
+        for (uint32_t index = 0; index < count; ++index)
+        {
+            if (!cached[index])
+            {
+                cacheFillBlock (firstBlock + index, buffer + (size_t)index * BLOCK_SIZE);
+            }
+        }
+    }
+    unlockDisk ();
+    free (cached);
+    free (buffer);
+}
+
+void
+readDataBlocksAsync (uint32_t firstBlock, uint32_t count, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock >= FIRSTDATABLOCK_NUMBER && firstBlock + count <= BLOCK_COUNT);
+    if (!isRingOpen ())
+    {
+        readDataBlocks (firstBlock, count, buffer);
+        return;
+    }
+    lockDisk ();
+    int current = diskIsCurrent (firstBlock, count);
+    unlockDisk ();
+    // Blocks with newer copies in memory are rare enough (metadata, mostly) to just read now.
+    if (!current)
+    {
+        readDataBlocks (firstBlock, count, buffer);
+        return;
+    }
+    ringRead (firstBlock, count, buffer);
+}
+
+void
+writeDataBlocksAsync (uint32_t firstBlock, uint32_t count, const char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock >= FIRSTDATABLOCK_NUMBER && firstBlock + count <= BLOCK_COUNT);
+    if (!isRingOpen ())
+    {
+        writeDataBlocks (firstBlock, count, buffer);
+        return;
+    }
+    // Any cached copies take on the new contents now, so that nothing older can be written back
+    //   once the write has completed.
+    lockDiskForWrite (firstBlock, count);
+    for (uint32_t index = 0; index < count && isJournalEnabled (); ++index)
+    {
+        journalForget (firstBlock + index);
+    }
+    for (uint32_t index = 0; index < count && isBlockCacheEnabled (); ++index)
+    {
+        cacheRefreshBlock (firstBlock + index, buffer + (size_t)index * BLOCK_SIZE);
+    }
+    ringWrite (firstBlock, count, buffer);
+    unlockDisk ();
+}
+
+void
+waitDataBlocks ()
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    if (isRingOpen ())
+    {
+        ringWait ();
+    }
+}
+
+uint64_t
+getSyscallCount ()
+{
+    return __atomic_load_n (&FILESYSTEM.syscallCount, __ATOMIC_RELAXED);
+}
+
+char*
+mapDataBlock (uint32_t blockNum)
 {
     assert (FILESYSTEM_FD != NOT_OPENED);
     assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
-    int offset = blockNum * BLOCK_SIZE;
-    int result = lseek (FILESYSTEM_FD, offset, SEEK_SET);
-    if (result < 0)
+    if (FILESYSTEM.mapping == NULL)
     {
-        fprintf (stderr, "Could not seek to data block %d on disk: %s\n", blockNum, strerror (errno));
+        return NULL;
+    }
+    return FILESYSTEM.mapping + (size_t)blockNum * BLOCK_SIZE;
+}
+
+void
+readBlocksFromDisk (uint32_t firstBlock, uint32_t count, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock + count <= BLOCK_COUNT);
+    off_t offset = (off_t)firstBlock * BLOCK_SIZE;
+    size_t length = (size_t)count * BLOCK_SIZE;
+    if (readAt (offset, buffer, length) < (ssize_t)length)
+    {
+        fprintf (stderr, "Failed to read blocks %u-%u from disk: %s\n", firstBlock, firstBlock + count - 1, strerror (errno));
         exit (EXIT_FAILURE);
     }
-    int bytes = read (FILESYSTEM_FD, buffer, BLOCK_SIZE);
-    if (bytes < BLOCK_SIZE)
+}
+
+void
+writeBlocksToDisk (uint32_t firstBlock, uint32_t count, const char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock + count <= BLOCK_COUNT);
+    off_t offset = (off_t)firstBlock * BLOCK_SIZE;
+    size_t length = (size_t)count * BLOCK_SIZE;
+    if (writeAt (offset, buffer, length) < (ssize_t)length)
     {
-        fprintf (stderr, "Failed to read data block %d from disk: %s\n", blockNum, strerror (errno));
+        fprintf (stderr, "Failed to write blocks %u-%u to disk: %s\n", firstBlock, firstBlock + count - 1, strerror (errno));
         exit (EXIT_FAILURE);
     }
 }
 
 void
-writeDataBlock (uint32_t blockNum, char buffer[BLOCK_SIZE])
+countSyscall ()
+{
+    __atomic_add_fetch (&FILESYSTEM.syscallCount, 1, __ATOMIC_RELAXED);
+}
+
+void
+journalWillCommit ()
+{
+    if (FILESYSTEM.freeBlocksDirty)
+    {
+        storeFreeBlocks ();
+    }
+    if (FILESYSTEM.blockSharesDirty)
+    {
+        storeBlockShares ();
+    }
+}
+
+void
+lockBlockCache ()
+{
+    lockDisk ();
+}
+
+void
+unlockBlockCache ()
+{
+    unlockDisk ();
+}
+
+void
+readDataBlockFromDisk (uint32_t blockNum, char* buffer)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
+    off_t offset = (off_t)blockNum * BLOCK_SIZE;
+    if (readAt (offset, buffer, BLOCK_SIZE) < (ssize_t)BLOCK_SIZE)
+    {
+        fprintf (stderr, "Failed to read data block %u from disk: %s\n", blockNum, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+}
+
+void
+writeDataBlockToDisk (uint32_t blockNum, const char* buffer)
 {
     assert (FILESYSTEM_FD != NOT_OPENED);
     assert (blockNum >= FIRSTDATABLOCK_NUMBER && blockNum < BLOCK_COUNT);
-    int offset = blockNum * BLOCK_SIZE;
-    int result = lseek (FILESYSTEM_FD, offset, SEEK_SET);
-    if (result < 0)
+    off_t offset = (off_t)blockNum * BLOCK_SIZE;
+    if (writeAt (offset, buffer, BLOCK_SIZE) < (ssize_t)BLOCK_SIZE)
     {
-        fprintf (stderr, "Could not seek to data block %d on disk: %s\n", blockNum, strerror (errno));
+        fprintf (stderr, "Failed to write data block %u to disk: %s\n", blockNum, strerror (errno));
         exit (EXIT_FAILURE);
     }
-    int bytes = write (FILESYSTEM_FD, buffer, BLOCK_SIZE);
-    if (bytes < BLOCK_SIZE)
+}
+
+void
+writeDataRunToDisk (uint32_t firstBlock, uint32_t count, const struct iovec* vectors)
+{
+    assert (FILESYSTEM_FD != NOT_OPENED);
+    assert (firstBlock >= FIRSTDATABLOCK_NUMBER && firstBlock + count <= BLOCK_COUNT);
+    off_t offset = (off_t)firstBlock * BLOCK_SIZE;
+    ssize_t length = (ssize_t)count * BLOCK_SIZE;
+    ssize_t result;
+    if (FILESYSTEM.mapping != NULL)
+    {
+        for (uint32_t index = 0; index < count; ++index)
+        {
+            memcpy (FILESYSTEM.mapping + offset + (off_t)index * BLOCK_SIZE, vectors[index].iov_base, BLOCK_SIZE);
+        }
+        result = length;
+    }
+    else
+    {
+        countSyscall ();
+        result = pwritev (FILESYSTEM_FD, vectors, count, offset);
+    }
+    if (result < length)
     {
-        fprintf (stderr, "Failed to write data block %d to disk: %s\n", blockNum, strerror (errno));
+        fprintf (stderr, "Failed to write data blocks %u-%u to disk: %s\n", firstBlock, firstBlock + count - 1, strerror (errno));
         exit (EXIT_FAILURE);
     }
 }
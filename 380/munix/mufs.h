@@ -6,25 +6,64 @@
 #ifndef MUFS_H
 #define MUFS_H
 
+#include <pthread.h>
 #include <stdint.h>
 
+#include "mubitmap.h"
+
 #define VERSION10 "mufs1.0"
-#define BLOCK_SIZE 1024
-#define BLOCK_COUNT 1024
+#define VERSION11 "mufs1.1"
+#define VERSION20 "mufs2.0"
+#define VERSION21 "mufs2.1"
+#define VERSION22 "mufs2.2"
+#define VERSION23 "mufs2.3"
+#define VERSION24 "mufs2.4"
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_BLOCK_COUNT 1024
+#define DEFAULT_INODE_COUNT 256
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_BLOCK_COUNT 0x7fffffffu
 #define IDENTIFIER_LENGTH 8
 #define INODE_SIZE 64
-#define INODE_COUNT 256
 #define NUM_DIRECT_BLOCKS 12
 #define SUPERBLOCK_NUMBER 0
 #define FREEBLOCKMAP_NUMBER 1
-#define FIRSTINODEBLOCK_NUMBER 2
-#define FIRSTDATABLOCK_NUMBER 18
+
+// The geometry of the loaded filesystem (see struct mufsGeometry).
+#define BLOCK_SIZE (GEOMETRY.blockSize)
+#define BLOCK_COUNT (GEOMETRY.blockCount)
+#define INODE_COUNT (GEOMETRY.iNodeCount)
+#define FREEBLOCKMAP_BLOCKS (GEOMETRY.freeMapBlocks)
+#define FIRSTINODEBLOCK_NUMBER (GEOMETRY.firstINodeBlock)
+#define FIRSTDATABLOCK_NUMBER (GEOMETRY.firstDataBlock)
+#define JOURNAL_BLOCKS (GEOMETRY.journalBlocks)
+#define FIRSTJOURNALBLOCK_NUMBER (GEOMETRY.firstJournalBlock)
+#define SHARETABLE_BLOCKS (GEOMETRY.shareTableBlocks)
+#define FIRSTSHARETABLEBLOCK_NUMBER (GEOMETRY.firstShareTableBlock)
 #define MAX_NAME_LENGTH 28
 #define DIR_ENTRY_LENGTH 32
 #define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / DIR_ENTRY_LENGTH)
 #define BLOCK_USED 1
 #define BLOCK_AVAILABLE 0
 #define MAX_FILE_SIZE (NUM_DIRECT_BLOCKS * BLOCK_SIZE)
+#define NUM_INODE_EXTENTS 5
+#define EXTENT_LENGTH 8
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / EXTENT_LENGTH)
+#define MAX_EXTENTS (NUM_INODE_EXTENTS + EXTENTS_PER_BLOCK)
+#define MAX_EXTENT_FILE_SIZE UINT32_MAX
+#define INLINE_DATA_SIZE (NUM_DIRECT_BLOCKS * 4)
+#define DIR_INDEX_HEADER_LENGTH 8
+#define DIR_INDEX_RANGE_LENGTH 8
+#define DIR_INDEX_RECORD_LENGTH 40
+#define DIR_INDEX_MAX_RANGES ((BLOCK_SIZE - DIR_INDEX_HEADER_LENGTH) / DIR_INDEX_RANGE_LENGTH)
+#define DIR_INDEX_RECORDS_PER_LEAF ((BLOCK_SIZE - DIR_INDEX_HEADER_LENGTH) / DIR_INDEX_RECORD_LENGTH)
+#define COMPRESSION_UNIT_BLOCKS 8
+#define MAX_BLOCK_SHARES UINT16_MAX
+
+#define MUFS_BACKEND_FD 1
+#define MUFS_BACKEND_MMAP 2
+#define MUFS_BACKEND_URING 3
 
 #define MU_O_RDONLY 1
 #define MU_O_WRONLY 2
@@ -42,27 +81,76 @@
 #define MU_S_REGLR 512  // 00000010 00000000
 #define MU_S_DIREC 1024 // 00000100 00000000
 #define MU_S_AVAIL 2048 // 00001000 00000000
+#define MU_S_INLINE 4096 // 00010000 00000000
+#define MU_S_INDEXED 8192 // 00100000 00000000
+#define MU_S_COMPRESSED 16384 // 01000000 00000000
 #define MU_S_IRWXO 7    // 00000000 00000111
 #define MU_S_IRWXG 56   // 00000000 00111000
 #define MU_S_IRWXU 448  // 00000001 11000000
 
-// The structure of the filesystem superblock.
+// The layout of a filesystem.
+// The free block map starts at FREEBLOCKMAP_NUMBER, the block share table (if any)
+//   follows it, then the inodes, then the journal (if any), and the data blocks come last.
+struct mufsGeometry
+{
+    // The size of every block, in bytes (a power of two).
+    uint32_t blockSize;
+    // The number of blocks in the image, including the metadata blocks.
+    uint32_t blockCount;
+    // The number of inodes.
+    uint32_t iNodeCount;
+    // The number of blocks holding the free block map.
+    uint32_t freeMapBlocks;
+    // The number of the first block holding inodes.
+    uint32_t firstINodeBlock;
+    // The number of the first data block.
+    uint32_t firstDataBlock;
+    // The number of blocks in the metadata journal, or 0 if there is none.
+    uint32_t journalBlocks;
+    // The number of the first block of the journal (meaningful only if there is one).
+    uint32_t firstJournalBlock;
+    // The number of blocks in the block share table, or 0 if there is none (before VERSION24).
+    uint32_t shareTableBlocks;
+    // The number of the first block of the share table (meaningful only if there is one).
+    uint32_t firstShareTableBlock;
+};
+
+// The structure of the filesystem superblock, which occupies the start of block 0.
 struct superBlock
 {
-    // An 8-character identifier -- should be VERSION10.
+    // An 8-character identifier -- VERSION10, VERSION11, VERSION20, VERSION21, VERSION22,
+    //   VERSION23 or VERSION24.
     char identifier[IDENTIFIER_LENGTH];
-    // Space reserved for use in later versions of the filesystem.
-    char reserved[BLOCK_SIZE - IDENTIFIER_LENGTH];
+    // The geometry of the filesystem.  Images made before these fields existed have
+    //   zeros here, which stand for the original 1 MiB layout.
+    struct mufsGeometry geometry;
+    // Space reserved for use in later versions of the filesystem (as is the rest of block 0).
+    char reserved[MIN_BLOCK_SIZE - IDENTIFIER_LENGTH - sizeof (struct mufsGeometry)];
 };
 
-// The structure of the free block map.
-struct freeBlockMap
+// The free block map, in the form that readFreeBlockMap and writeFreeBlockMap use, is an
+//   array of BLOCK_COUNT bytes that each contain either BLOCK_USED or BLOCK_AVAILABLE.
+// VERSION10 images store it on disk exactly like that, while later versions pack it
+//   into one bit per block (bit blockNum % 8 of byte blockNum / 8).
+
+// A run of consecutive data blocks belonging to a file.
+struct extent
 {
-    // A byte per block that contains either 1 for used or 0 for available.
-    char isUsed[BLOCK_SIZE];
+    // The number of the first data block in the run.
+    uint32_t startBlock;
+    // The number of blocks in the run.
+    uint32_t length;
 };
 
 // The structure of an inode.
+// VERSION10 / VERSION11 images map files with directBlocks, while VERSION20 images
+//   use the same space for extents, continued in an indirect extent block if needed.
+// On any version a regular file may have holes, blocks that read as zeros but have no
+//   data block: a directBlocks entry of 0, or an extent whose startBlock is 0 (block 0,
+//   the superblock, is never a data block).  Directories never have holes.
+// VERSION21 images are VERSION20 images in which a regular file of at most
+//   INLINE_DATA_SIZE bytes may have MU_S_INLINE in its mode, meaning that the space
+//   holds the file's contents instead and the file has no data blocks.
 struct iNode
 {
     // The ID number of the user who owns the file.
@@ -75,8 +163,22 @@ struct iNode
     uint32_t size;
     // The number of hard links to the file.
     uint32_t linkCount;
-    // The numbers of the first 10 data blocks.
-    uint32_t directBlocks[NUM_DIRECT_BLOCKS];
+    union
+    {
+        // The numbers of the first 12 data blocks.
+        uint32_t directBlocks[NUM_DIRECT_BLOCKS];
+        struct
+        {
+            // The first extents of the file, in file order.
+            struct extent extents[NUM_INODE_EXTENTS];
+            // The total number of extents, including those in the indirect extent block.
+            uint32_t extentCount;
+            // A data block holding EXTENTS_PER_BLOCK more extents, or 0 if there is none.
+            uint32_t indirectExtentBlock;
+        };
+        // The contents of a file whose mode includes MU_S_INLINE.
+        char inlineData[INLINE_DATA_SIZE];
+    };
 };
 
 // An entry in a directory.
@@ -88,34 +190,249 @@ struct dirEntry
     char name[MAX_NAME_LENGTH];
 };
 
-// The real file descriptor for the file on which our virtual filesystem is stored.
-extern int FILESYSTEM_FD;
+// VERSION22 images are VERSION21 images in which a directory of more than one block may
+//   have MU_S_INDEXED in its mode.  Block 0 of such a directory then holds the root of a
+//   hash index instead of entries, and its entries start at block 1, still in the order
+//   they were added.  The root divides the hashes of entry names into ranges, each with
+//   a leaf block (outside the directory's block map) holding a copy of every entry whose
+//   name hashes into the range, so that finding a name reads only the root and one leaf.
+// A root whose depth is 1 has outgrown a single block of ranges: each of its ranges then
+//   has a node block (also outside the block map) laid out like a root of depth 0, which
+//   divides the range again among leaves, and finding a name reads one node as well.
+
+// One range of hashes in the root or a node of a directory index.
+struct dirIndexRange
+{
+    // The smallest hash in the range; the range ends where the next one starts.
+    uint32_t lowestHash;
+    // The block for the range: a leaf holding the entries whose names hash into the
+    //   range, or in the root of an index of depth 1, a node dividing it further.
+    uint32_t block;
+};
+
+// The root of a directory index, which fills block 0 of the directory, or a node below it.
+struct dirIndexRoot
+{
+    // The number of ranges, which are in increasing order and start with a lowestHash of 0
+    //   in the root, or with the lowestHash of the root's range for a node.
+    uint32_t rangeCount;
+    // 0 if the ranges lead straight to leaves, or 1 if they lead to nodes (root only).
+    uint32_t depth;
+    struct dirIndexRange ranges[];
+};
+
+// A copy of one directory entry in a leaf of a directory index.
+struct dirIndexRecord
+{
+    // The hash of the entry's name (see hashEntryName).
+    uint32_t hash;
+    // The position of the entry in the directory, counting the root block's worth.
+    uint32_t entryIndex;
+    struct dirEntry entry;
+};
+
+// A leaf of a directory index.
+struct dirIndexLeaf
+{
+    // The number of records, which are sorted by hash.
+    uint32_t recordCount;
+    uint32_t reserved;
+    struct dirIndexRecord records[];
+};
+
+// VERSION23 images are VERSION22 images in which a regular file that is not inline may
+//   have MU_S_COMPRESSED in its mode.  Its blocks are then taken COMPRESSION_UNIT_BLOCKS
+//   at a time (the last unit may be shorter), and each unit is stored in one of three ways:
+//   - as all holes, if it holds nothing but zeros;
+//   - compressed, in its first few blocks with the rest of it a hole, when that saves at
+//     least one block: the first block starts with a struct compressedUnit, and the
+//     stored form of each block of the unit follows it in turn (see mucompress.h);
+//   - as it is, with a data block for every block.
+//   So a unit whose first block has data and whose last block is a hole is compressed.
+
+// The start of a compressed unit.
+struct compressedUnit
+{
+    // The length of the stored form of each block of the unit: 0 for a block of zeros,
+    //   BLOCK_SIZE for one stored as it is, or otherwise the length of its compressed form.
+    uint32_t blockLengths[COMPRESSION_UNIT_BLOCKS];
+};
+
+// VERSION24 images are VERSION23 images in which a data block of a regular file that is
+//   not compressed may be shared: mapped by several files, or at several places in one,
+//   because they hold the same data (see mudedup).  The block share table, an array of
+//   BLOCK_COUNT uint16_t, holds the number of references to each block beyond the first,
+//   so it is 0 for every block that is not shared.  A shared block is never written in
+//   place; a file that changes one is given a copy of its own first (copy-on-write).
+
+// Everything mufs knows about the loaded filesystem.  setup fills it in from the disk
+//   image and teardown gives back what it holds, so that another image can be loaded.
+// There is one per process, shared by every thread; the block cache (mucache), the journal
+//   (mujournal) and the io_uring (muring) belong to it in the same way.
+struct mufsContext
+{
+    // The real file descriptor for the file on which our virtual filesystem is stored.
+    int fd;
+    // The geometry of the loaded filesystem, or of the one being built by mkdisk.
+    // Until either happens it describes the original 1 MiB layout.
+    struct mufsGeometry geometry;
+    // How the disk image is accessed (MUFS_BACKEND_FD, MUFS_BACKEND_MMAP or MUFS_BACKEND_URING),
+    //   which is kept from one setup to the next.
+    int backend;
+    // The whole disk image, when it is memory-mapped.
+    char* mapping;
+    size_t mappingLength;
+    // Whether the on-disk free block map is a packed bitmap (VERSION11 and later) or a byte per block (VERSION10).
+    int bitmapOnDisk;
+    // Whether inodes hold extents (VERSION20 or later) rather than direct block numbers.
+    int extentINodes;
+    // Whether small files may be stored in their inodes (VERSION21 or later).
+    int inlineINodes;
+    // Whether large directories may have hash indexes (VERSION22 or later).
+    int indexedDirectories;
+    // Whether regular files may be compressed (VERSION23 or later).
+    int compressedFiles;
+    // Whether data blocks may be shared, with a block share table (VERSION24).
+    int sharedBlocks;
+    // The in-memory copy of the free block map that all allocation goes through, and
+    //   whether it has changed since it was last written to disk.
+    struct blockBitmap freeBlocks;
+    int freeBlocksDirty;
+    // The blocks that are used in freeBlocks only because they are set aside for growing
+    //   files (see markBlocksReserved), which are stored on disk as available.
+    struct blockBitmap reservedBlocks;
+    // The on-disk form of the free block map as it was last loaded or stored, so that only
+    //   the blocks of it that change need to be written.
+    char* storedFreeMap;
+    // The in-memory copy of the block share table (SHARETABLE_BLOCKS blocks, of which the
+    //   first BLOCK_COUNT entries are used), whether it has changed since it was last written
+    //   to disk, and its on-disk form as it was last loaded or stored.
+    uint16_t* blockShares;
+    int blockSharesDirty;
+    char* storedShareTable;
+    // The number of system calls made on the disk image so far, by every filesystem loaded.
+    uint64_t syscallCount;
+    // Serializes every use of the block cache, the journal and the free block map, which
+    //   are shared by all threads.  It is recursive because library functions call each other.
+    pthread_mutex_t diskLock;
+};
+
+// The loaded filesystem.
+extern struct mufsContext FILESYSTEM;
+
+// Shorthands for the parts of FILESYSTEM that the rest of munix uses.
+#define FILESYSTEM_FD (FILESYSTEM.fd)
+#define GEOMETRY (FILESYSTEM.geometry)
+
+
 
+// Returns 1 if readDataBlocksAsync / writeDataBlocksAsync really are asynchronous, 0 if
+//   they do their work before returning.
+int
+usesAsyncIO ();
+
+
+// Returns 1 if the loaded filesystem maps files with extents (VERSION20 or later), 0 otherwise.
+int
+usesExtents ();
+
+// Returns 1 if files on the loaded filesystem may keep their contents in their inodes
+//   (VERSION21 or later), 0 otherwise.
+int
+usesInlineData ();
+
+// Returns 1 if directories on the loaded filesystem may have hash indexes (VERSION22 or
+//   later), 0 otherwise.
+int
+usesDirIndex ();
+
+// Returns 1 if files on the loaded filesystem may be compressed (VERSION23 or later), 0 otherwise.
+int
+usesCompression ();
+
+// Returns 1 if data blocks on the loaded filesystem may be shared (VERSION24), 0 otherwise.
+int
+usesSharedBlocks ();
+
+
+// Chooses how the next setup will access the disk image.
+// MUFS_BACKEND_FD (the default) uses a read / write per access, while MUFS_BACKEND_MMAP
+//   maps the whole image once so that every access is a memory copy.
+// MUFS_BACKEND_URING is MUFS_BACKEND_FD plus an io_uring that the asynchronous functions
+//   use to keep many requests in flight; where the kernel has no io_uring it is just
+//   MUFS_BACKEND_FD.
+void
+selectBackend (int backend);
+
+
+// Works out the layout of a filesystem and makes it the current GEOMETRY.
+// Must not be called while a filesystem is loaded.
+// Params:
+//   blockSize - The size of each block, a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE.
+//   blockCount - The number of blocks in the image, up to MAX_BLOCK_COUNT.
+//   iNodeCount - The number of inodes.
+//   journalBlocks - The size of the metadata journal, or 0 for none.
+//   packedFreeMap - 1 if the free block map has a bit per block, 0 if it has a byte per block.
+//   shareTable - 1 if there is a block share table (VERSION24), 0 if not.
+// Returns:
+//   0 on success, or -1 (leaving GEOMETRY alone) if the values cannot describe a filesystem.
+int
+setGeometry (uint32_t blockSize, uint32_t blockCount, uint32_t iNodeCount, uint32_t journalBlocks, int packedFreeMap,
+             int shareTable);
+
+
+// Works out the smallest journal that a filesystem may have: enough for a transaction that
+//   rewrites its whole free block map and share table.
+// Params:
+//   blockSize, blockCount, packedFreeMap, shareTable - As for setGeometry.
+// Returns:
+//   The number of journal blocks.
+uint32_t
+minimumJournalBlocks (uint32_t blockSize, uint32_t blockCount, int packedFreeMap, int shareTable);
 
 
 // Loads an MUFS filesystem so that you can interact with it.
+// Its geometry is taken from the superblock, and the rest of FILESYSTEM is filled in from
+//   it; only one filesystem can be loaded at a time.
+// Between setup and teardown the other functions may be called from any number of threads.
 void
 setup (const char* diskName);
 
 
 // Unloads an MUFS filesystem when you are finished with it.
+// FILESYSTEM is left with nothing loaded but the same geometry, backend and syscall count.
+// No other thread may be using the filesystem.
 void
 teardown ();
 
 
+// Writes any cached changes to the disk image and asks the OS to make them durable.
+void
+mufs_sync ();
+
+
+// Makes durable the data blocks that have already been written to the disk image, plus
+//   the metadata, without writing back the rest of the block cache.
+void
+mufs_datasync ();
+
+
 // A function that ensures all of our math is correct.
 void
 sanityCheck ();
 
 
 // Checks that an inode contains sensible values.
+// Like the check below, it does nothing in a release build (compiled with -DNDEBUG).
 void
 verifyINode (struct iNode* buffer);
 
 
-// Checks that a free block map contains sensible values.
+// Checks that a free block map (BLOCK_COUNT bytes) contains sensible values.
+// This scans the whole map, so it is skipped in release builds; mufsck checks the
+//   map thoroughly instead.
 void
-verifyFreeBlockMap (struct freeBlockMap* buffer);
+verifyFreeBlockMap (const char* isUsed);
 
 
 // Reads the contents of an inode from disk into memory.
@@ -128,23 +445,167 @@ void
 writeINode (uint32_t iNodeNumber, struct iNode* buffer);
 
 
-// Reads the free block map from disk.
+// Reads every inode at once, with a single I/O, into table (INODE_COUNT inodes).
+// Unlike readINode it does not check the inodes, so it can be used on a damaged filesystem.
 void
-readFreeBlockMap (struct freeBlockMap* buffer);
+readINodeTable (struct iNode* table);
 
 
-// Writes the free block map to disk.
+// Reads the free block map (from the in-memory copy loaded by setup) into BLOCK_COUNT bytes.
 void
-writeFreeBlockMap (struct freeBlockMap* buffer);
+readFreeBlockMap (char* isUsed);
 
 
-// Reads a data block from disk.
+// Fills copy, which must not be initialized yet, with the in-memory free block map,
+//   without checking it.  The caller destroys it with destroyBitmap.
 void
-readDataBlock (uint32_t blockNum, char buffer[BLOCK_SIZE]);
+copyFreeBlocks (struct blockBitmap* copy);
 
 
-// Writes a data block to disk.
+// Writes a free block map of BLOCK_COUNT bytes to disk, replacing the in-memory copy.
 void
-writeDataBlock (uint32_t blockNum, char buffer[BLOCK_SIZE]);
+writeFreeBlockMap (const char* isUsed);
+
+
+// Finds an available data block and marks it used.
+// The change reaches the disk on mufs_sync or teardown.
+// Returns:
+//   The number of the block, or -1 if the disk is full.
+int
+allocateBlock ();
+
+
+// Finds count consecutive available data blocks and marks them all used.
+// Returns:
+//   The number of the first block of the run, or -1 if there is no run that long.
+int
+allocateRun (uint32_t count);
+
+
+// Marks as used the available data blocks that start at blockNum, up to maxCount of them,
+//   so that a file can grow into the blocks right after its last one.
+// Returns:
+//   The number of blocks marked, which is 0 if blockNum is used or is not a data block.
+uint32_t
+allocateRunAt (uint32_t blockNum, uint32_t maxCount);
+
+
+// Drops a reference to a previously-allocated data block: a shared block loses one of its
+//   shares, and any other block is marked as available again.
+void
+releaseBlock (uint32_t blockNum);
+
+
+// Sets aside count data blocks, starting at firstBlock, that a growing file may take later.
+// The blocks must have just been allocated.  They stay used in memory, but are stored on
+//   disk as available until claimReservedBlocks, so that a crash or a file still open at
+//   teardown cannot leak them.  releaseBlock gives a block back whether it is set aside or not.
+void
+markBlocksReserved (uint32_t firstBlock, uint32_t count);
+
+
+// Makes count blocks set aside by markBlocksReserved, starting at firstBlock, ordinary used
+//   blocks, as a file takes them.
+void
+claimReservedBlocks (uint32_t firstBlock, uint32_t count);
+
+
+// Adds a reference to a data block that is in use, making it shared.
+// Returns:
+//   0 on success, or -1 if the block already has MAX_BLOCK_SHARES shares.
+int
+shareBlock (uint32_t blockNum);
+
+
+// Returns the number of references to a data block beyond the first (0 unless it is
+//   shared, and always 0 before VERSION24).
+uint32_t
+getBlockShares (uint32_t blockNum);
+
+
+// Reads the block share table (from the in-memory copy loaded by setup) into BLOCK_COUNT
+//   uint16_t.  Must only be called on a VERSION24 filesystem.
+void
+readBlockShares (uint16_t* shares);
+
+
+// Writes a block share table of BLOCK_COUNT uint16_t, replacing the in-memory copy.
+// Must only be called on a VERSION24 filesystem.
+void
+writeBlockShares (const uint16_t* shares);
+
+
+// Reads a data block from disk (or from the block cache, if it is held there).
+void
+readDataBlock (uint32_t blockNum, char* buffer);
+
+
+// Writes a data block to disk.  With the block cache enabled the write is
+//   deferred until the block is evicted or mufs_sync / teardown is called.
+void
+writeDataBlock (uint32_t blockNum, char* buffer);
+
+
+// Writes a data block that holds metadata (a directory block or an indirect extent
+//   block), which goes through the journal if the filesystem has one.
+void
+writeMetadataBlock (uint32_t blockNum, char* buffer);
+
+
+
+// Reads count consecutive data blocks, starting at firstBlock, with a single I/O.
+void
+readDataBlocks (uint32_t firstBlock, uint32_t count, char* buffer);
+
+
+// Writes count consecutive data blocks, starting at firstBlock, with a single I/O.
+void
+writeDataBlocks (uint32_t firstBlock, uint32_t count, const char* buffer);
+
+
+// Hints that count consecutive data blocks starting at firstBlock will be read soon.
+// With the block cache enabled they are read into it with a single I/O.
+// The blocks must belong to a file that the caller is reading, so that nothing writes them meanwhile.
+void
+prefetchDataBlocks (uint32_t firstBlock, uint32_t count);
+
+
+// Starts reading count consecutive data blocks into buffer, possibly returning before
+//   the read is done.  Neither buffer nor the blocks may be used until waitDataBlocks.
+void
+readDataBlocksAsync (uint32_t firstBlock, uint32_t count, char* buffer);
+
+
+// Starts writing count consecutive data blocks from buffer, possibly returning before
+//   the write is done.  Neither buffer nor the blocks may be used until waitDataBlocks.
+void
+writeDataBlocksAsync (uint32_t firstBlock, uint32_t count, const char* buffer);
+
+
+// Waits until every asynchronous read and write (started by any thread) has finished.
+void
+waitDataBlocks ();
+
+
+// Writes back any cached changes to count consecutive data blocks, leaving the rest of
+//   the cache alone.
+void
+writeBackDataBlocks (uint32_t firstBlock, uint32_t count);
+
+
+// Waits until the block cache's flusher thread (if any) has finished the batch it is writing.
+void
+waitForFlusher ();
+
+
+// Returns the number of system calls that have been made on the disk image.
+uint64_t
+getSyscallCount ();
+
+
+// Returns a pointer directly into the mapped disk image for a data block, or NULL
+//   if the image is not memory-mapped.  Writes through the pointer change the disk.
+char*
+mapDataBlock (uint32_t blockNum);
 
 #endif//MUFS_H
\ No newline at end of file
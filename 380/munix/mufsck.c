@@ -0,0 +1,938 @@
+// File: mufsck.c
+// Author: Matt Shenk
+// A consistency checker for MUFS images.  It loads the inode table and the free block
+//   map once, walks every directory from the root, and cross-checks block ownership
+//   (and the block share table, see VERSION24 in mufs.h), directory entries and link
+//   counts in time proportional to blocks + inodes, optionally repairing what it finds.
+// Part of munix lab in CSCI380.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mufile.h"
+#include "mubitmap.h"
+#include "mucompress.h"
+#include "mudindex.h"
+
+#define ROOT_INODE_NUMBER 0
+
+// Exit statuses, following fsck.
+#define FSCK_CLEAN 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNREPAIRED 4
+
+// Flags kept for each inode.
+#define INODE_BROKEN 1
+#define INODE_VISITED 2
+#define INODE_DIRTY 4
+// The directory's hash index is broken and is being ignored.
+#define INODE_BAD_INDEX 8
+
+// How many leaked or unrecorded blocks are named before only a count is given.
+#define MAX_BLOCKS_NAMED 10
+
+// Everything the checker knows about the filesystem.
+struct checkState
+{
+    // Whether problems should be repaired, or only reported.
+    int repair;
+    // The whole inode table, with any repairs made so far.
+    struct iNode* iNodes;
+    // INODE_BROKEN / INODE_VISITED / INODE_DIRTY / INODE_BAD_INDEX for each inode.
+    char* flags;
+    // How many directory entries refer to each inode.
+    uint32_t* references;
+    // The blocks that the metadata and the inodes account for, built by the checker.
+    struct blockBitmap owned;
+    // The free block map as the filesystem has it.
+    struct blockBitmap recorded;
+    // On a filesystem that shares blocks, the references to each block beyond its first as
+    //   the share table has them and as counted by the checker, and the owned blocks that
+    //   were first claimed as data of a file that may share them.  NULL / empty otherwise.
+    uint16_t* recordedShares;
+    uint16_t* countedShares;
+    struct blockBitmap shareable;
+    uint32_t problems;
+    uint32_t repairs;
+    uint32_t directories;
+};
+
+int
+isInUse (const struct iNode* node);
+
+int
+checkBlockMap (struct checkState* state, uint32_t iNodeNumber, int report);
+
+void
+checkIndexRoot (struct checkState* state, uint32_t iNodeNumber, int report);
+
+struct dirIndexRoot*
+readIndexLeafRanges (const struct iNode* dirNode, struct dirIndexRoot* root);
+
+void
+checkCompressedUnits (struct checkState* state, uint32_t iNodeNumber);
+
+void
+checkIndexLeaves (struct checkState* state, uint32_t dirINodeNumber, const struct dirEntry* entries);
+
+void
+dropDirIndex (struct checkState* state, uint32_t dirINodeNumber);
+
+void
+startClaims (struct checkState* state);
+
+void
+claimBlocks (struct checkState* state, uint32_t iNodeNumber, uint32_t firstBlock, uint32_t count, int shareable,
+             int report);
+
+void
+checkINodes (struct checkState* state);
+
+void
+walkDirectories (struct checkState* state);
+
+void
+checkDirectory (struct checkState* state, uint32_t dirINodeNumber, uint32_t* queue, uint32_t* queueLength);
+
+void
+checkLinkCounts (struct checkState* state);
+
+void
+claimAllBlocks (struct checkState* state);
+
+void
+checkFreeBlockMap (struct checkState* state);
+
+void
+checkBlockShares (struct checkState* state);
+
+void
+problem (struct checkState* state, int repairable, const char* format, ...);
+
+int
+main (int argc, char* argv[])
+{
+    struct checkState state;
+    memset (&state, 0, sizeof (state));
+    int argIndex = 1;
+    if (argIndex < argc && strcmp (argv[argIndex], "--repair") == 0)
+    {
+        state.repair = 1;
+        ++argIndex;
+    }
+    if (argIndex + 1 != argc)
+    {
+        fprintf (stderr, "Usage: %s [--repair] diskName\n", argv[0]);
+        exit (EXIT_FAILURE);
+    }
+
+    setup (argv[argIndex]);
+    state.iNodes = malloc ((size_t)INODE_COUNT * sizeof (struct iNode));
+    state.flags = calloc (INODE_COUNT, 1);
+    state.references = calloc (INODE_COUNT, sizeof (uint32_t));
+    if (state.iNodes == NULL || state.flags == NULL || state.references == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u inodes\n", INODE_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    readINodeTable (state.iNodes);
+    copyFreeBlocks (&state.recorded);
+    if (usesSharedBlocks ())
+    {
+        state.recordedShares = malloc ((size_t)BLOCK_COUNT * sizeof (uint16_t));
+        state.countedShares = malloc ((size_t)BLOCK_COUNT * sizeof (uint16_t));
+        if (state.recordedShares == NULL || state.countedShares == NULL)
+        {
+            fprintf (stderr, "Could not allocate a block share table\n");
+            exit (EXIT_FAILURE);
+        }
+        readBlockShares (state.recordedShares);
+    }
+
+    checkINodes (&state);
+    walkDirectories (&state);
+    checkLinkCounts (&state);
+    checkFreeBlockMap (&state);
+    if (state.recordedShares != NULL)
+    {
+        checkBlockShares (&state);
+    }
+
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    {
+        if (state.flags[iNodeNumber] & INODE_DIRTY)
+        {
+            writeINode (iNodeNumber, &state.iNodes[iNodeNumber]);
+        }
+    }
+    uint32_t dataBlocks = BLOCK_COUNT - FIRSTDATABLOCK_NUMBER;
+    uint32_t ownedDataBlocks = BLOCK_COUNT - state.owned.freeCount - FIRSTDATABLOCK_NUMBER;
+    printf ("%u directories, %u of %u data blocks in use\n", state.directories, ownedDataBlocks, dataBlocks);
+    printf ("%u problems found, %u repaired\n", state.problems, state.repairs);
+
+    destroyBitmap (&state.owned);
+    destroyBitmap (&state.recorded);
+    if (state.recordedShares != NULL)
+    {
+        destroyBitmap (&state.shareable);
+    }
+    free (state.countedShares);
+    free (state.recordedShares);
+    free (state.references);
+    free (state.flags);
+    free (state.iNodes);
+    teardown ();
+    if (state.problems == 0)
+    {
+        return FSCK_CLEAN;
+    }
+    return (state.repairs == state.problems ? FSCK_REPAIRED : FSCK_UNREPAIRED);
+}
+
+// Returns 1 if an inode holds a file or directory, 0 if it is available.
+int
+isInUse (const struct iNode* node)
+{
+    return (node->mode & MU_S_AVAIL) == 0;
+}
+
+// Checks that an inode's type is sensible and that its block map only names data
+//   blocks and covers exactly its size, and claims those blocks if so.
+// Params:
+//   iNodeNumber - The inode to check, which must be in use.
+//   report - 1 to report blocks that another inode has already claimed, 0 to stay quiet.
+// Returns:
+//   0 if the inode is sound, or -1 (having claimed nothing) if it is not.
+int
+checkBlockMap (struct checkState* state, uint32_t iNodeNumber, int report)
+{
+    struct iNode* node = &state->iNodes[iNodeNumber];
+    uint32_t type = node->mode & (MU_S_AVAIL | MU_S_DIREC | MU_S_REGLR);
+    if (type != MU_S_DIREC && type != MU_S_REGLR)
+    {
+        if (report)
+        {
+            problem (state, state->repair, "Inode %u has an invalid mode %o\n", iNodeNumber, node->mode);
+        }
+        return -1;
+    }
+    // Only a regular file with blocks of its own can be compressed.
+    if ((node->mode & MU_S_COMPRESSED) && (!usesCompression () || type != MU_S_REGLR || (node->mode & MU_S_INLINE)))
+    {
+        if (report)
+        {
+            problem (state, state->repair, "Inode %u cannot be compressed\n", iNodeNumber);
+        }
+        return -1;
+    }
+    // An inline file owns no blocks, but must fit in its inode.
+    if (node->mode & MU_S_INLINE)
+    {
+        if (!usesInlineData () || type != MU_S_REGLR || node->size > INLINE_DATA_SIZE)
+        {
+            if (report)
+            {
+                problem (state, state->repair, "Inode %u cannot hold its %u bytes inline\n", iNodeNumber, node->size);
+            }
+            return -1;
+        }
+        return 0;
+    }
+    uint64_t mapped = ((uint64_t)node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // The data blocks of a regular file may be shared, unless its units are compressed.
+    int shareable = (type == MU_S_REGLR && (node->mode & MU_S_COMPRESSED) == 0);
+    if (!usesExtents ())
+    {
+        if (mapped > NUM_DIRECT_BLOCKS)
+        {
+            if (report)
+            {
+                problem (state, state->repair, "Inode %u is too large for its block map\n", iNodeNumber);
+            }
+            return -1;
+        }
+        for (uint32_t blockIndex = 0; blockIndex < mapped; ++blockIndex)
+        {
+            uint32_t blockNum = node->directBlocks[blockIndex];
+            // A regular file may have holes, but a directory may not.
+            if (blockNum == 0 && type == MU_S_REGLR)
+            {
+                continue;
+            }
+            if (blockNum < FIRSTDATABLOCK_NUMBER || blockNum >= BLOCK_COUNT)
+            {
+                if (report)
+                {
+                    problem (state, state->repair, "Inode %u maps block %u, which is not a data block\n",
+                             iNodeNumber, blockNum);
+                }
+                return -1;
+            }
+        }
+        for (uint32_t blockIndex = 0; blockIndex < mapped; ++blockIndex)
+        {
+            if (node->directBlocks[blockIndex] != 0)
+            {
+                claimBlocks (state, iNodeNumber, node->directBlocks[blockIndex], 1, shareable, report);
+            }
+        }
+        return 0;
+    }
+
+    uint32_t indirectBlock = node->indirectExtentBlock;
+    int hasIndirect = (indirectBlock != 0);
+    if (node->extentCount > MAX_EXTENTS || (node->extentCount > NUM_INODE_EXTENTS && !hasIndirect)
+        || (hasIndirect && (indirectBlock < FIRSTDATABLOCK_NUMBER || indirectBlock >= BLOCK_COUNT)))
+    {
+        if (report)
+        {
+            problem (state, state->repair, "Inode %u has an invalid extent list\n", iNodeNumber);
+        }
+        return -1;
+    }
+    struct extent* indirect = NULL;
+    if (hasIndirect)
+    {
+        indirect = malloc (BLOCK_SIZE);
+        if (indirect == NULL)
+        {
+            fprintf (stderr, "Could not allocate an indirect extent block\n");
+            exit (EXIT_FAILURE);
+        }
+        readDataBlock (indirectBlock, (char*)indirect);
+    }
+    uint64_t total = 0;
+    int sound = 1;
+    for (uint32_t position = 0; position < node->extentCount && sound; ++position)
+    {
+        const struct extent* current = (position < NUM_INODE_EXTENTS ? &node->extents[position]
+                                        : &indirect[position - NUM_INODE_EXTENTS]);
+        int hole = (current->startBlock == 0 && type == MU_S_REGLR);
+        sound = (current->length > 0
+                 && (hole || (current->startBlock >= FIRSTDATABLOCK_NUMBER
+                              && (uint64_t)current->startBlock + current->length <= BLOCK_COUNT)));
+        total += current->length;
+    }
+    if (!sound || total != mapped)
+    {
+        if (report)
+        {
+            problem (state, state->repair, "Inode %u has extents that do not match its size of %u bytes\n",
+                     iNodeNumber, node->size);
+        }
+        free (indirect);
+        return -1;
+    }
+    for (uint32_t position = 0; position < node->extentCount; ++position)
+    {
+        const struct extent* current = (position < NUM_INODE_EXTENTS ? &node->extents[position]
+                                        : &indirect[position - NUM_INODE_EXTENTS]);
+        if (current->startBlock != 0)
+        {
+            claimBlocks (state, iNodeNumber, current->startBlock, current->length, shareable, report);
+        }
+    }
+    if (hasIndirect)
+    {
+        claimBlocks (state, iNodeNumber, indirectBlock, 1, 0, report);
+    }
+    free (indirect);
+    if (node->mode & MU_S_INDEXED)
+    {
+        checkIndexRoot (state, iNodeNumber, report);
+    }
+    return 0;
+}
+
+// Checks that the root of a directory's hash index and any nodes below it are sensible,
+//   and claims its nodes and leaves if so.
+// A broken index is thrown away when repairing, and ignored from then on otherwise; the
+//   directory's entries do not depend on it either way.
+void
+checkIndexRoot (struct checkState* state, uint32_t iNodeNumber, int report)
+{
+    const struct iNode* node = &state->iNodes[iNodeNumber];
+    if (state->flags[iNodeNumber] & INODE_BAD_INDEX)
+    {
+        return;
+    }
+    uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+    struct dirIndexRoot* leaves = NULL;
+    if (usesDirIndex () && (node->mode & MU_S_DIREC) != 0 && node->size > BLOCK_SIZE)
+    {
+        leaves = readIndexLeafRanges (node, root);
+    }
+    if (leaves != NULL)
+    {
+        for (uint32_t range = 0; range < root->rangeCount; ++range)
+        {
+            claimBlocks (state, iNodeNumber, root->ranges[range].block, 1, 0, report);
+        }
+        for (uint32_t range = 0; root->depth == 1 && range < leaves->rangeCount; ++range)
+        {
+            claimBlocks (state, iNodeNumber, leaves->ranges[range].block, 1, 0, report);
+        }
+        free (leaves);
+        return;
+    }
+    if (report)
+    {
+        problem (state, state->repair, "Directory %u has a hash index with an invalid root\n", iNodeNumber);
+    }
+    if (state->repair)
+    {
+        dropDirIndex (state, iNodeNumber);
+    }
+    else
+    {
+        state->flags[iNodeNumber] |= INODE_BAD_INDEX;
+    }
+}
+
+// Reads the root of a directory's hash index and any nodes below it, checking that they
+//   are sensible.
+// Params:
+//   dirNode - The directory, whose block 0 holds the root.
+//   root - Receives the root.
+// Returns:
+//   The ranges of all of the index's leaves in order, laid out as a root of depth 0 would
+//   be (for the caller to free), or NULL if the root or a node is not sensible.
+struct dirIndexRoot*
+readIndexLeafRanges (const struct iNode* dirNode, struct dirIndexRoot* root)
+{
+    readDataBlock (getFileBlock (dirNode, 0, NULL), (char*)root);
+    if (root->rangeCount == 0 || root->rangeCount > DIR_INDEX_MAX_RANGES || root->depth > 1
+        || root->ranges[0].lowestHash != 0)
+    {
+        return NULL;
+    }
+    uint32_t nodeBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* node = (struct dirIndexRoot*)nodeBuffer;
+    struct dirIndexRoot* leaves = NULL;
+    uint32_t leafCount = 0;
+    int sound = 1;
+    for (uint32_t range = 0; sound && range < root->rangeCount; ++range)
+    {
+        uint32_t block = root->ranges[range].block;
+        sound = (block >= FIRSTDATABLOCK_NUMBER && block < BLOCK_COUNT);
+        if (sound && root->depth == 1)
+        {
+            readDataBlock (block, (char*)node);
+            sound = (node->rangeCount > 0 && node->rangeCount <= DIR_INDEX_MAX_RANGES && node->depth == 0
+                     && node->ranges[0].lowestHash == root->ranges[range].lowestHash);
+        }
+        else
+        {
+            // A root of depth 0 is its own only node.
+            node->rangeCount = 1;
+            node->ranges[0] = root->ranges[range];
+        }
+        if (!sound)
+        {
+            break;
+        }
+        leaves = realloc (leaves, DIR_INDEX_HEADER_LENGTH + (leafCount + node->rangeCount) * DIR_INDEX_RANGE_LENGTH);
+        if (leaves == NULL)
+        {
+            fprintf (stderr, "Could not allocate the leaves of a directory index\n");
+            exit (EXIT_FAILURE);
+        }
+        for (uint32_t nodeRange = 0; sound && nodeRange < node->rangeCount; ++nodeRange)
+        {
+            const struct dirIndexRange* leafRange = &node->ranges[nodeRange];
+            sound = (leafRange->block >= FIRSTDATABLOCK_NUMBER && leafRange->block < BLOCK_COUNT
+                     && (leafCount == 0 || leaves->ranges[leafCount - 1].lowestHash < leafRange->lowestHash));
+            leaves->ranges[leafCount++] = *leafRange;
+        }
+    }
+    if (!sound)
+    {
+        free (leaves);
+        return NULL;
+    }
+    leaves->rangeCount = leafCount;
+    leaves->depth = 0;
+    return leaves;
+}
+
+// Checks that every unit of a compressed file (see struct compressedUnit) has its data
+//   blocks before any hole in it, and expands each unit that is compressed.
+// A unit that fails is not repaired: the data it held cannot be recovered.
+// Params:
+//   iNodeNumber - The compressed file, whose block map must be sound.
+void
+checkCompressedUnits (struct checkState* state, uint32_t iNodeNumber)
+{
+    const struct iNode* node = &state->iNodes[iNodeNumber];
+    size_t unitBytes = (size_t)COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE;
+    char* stored = malloc (2 * unitBytes);
+    if (stored == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for a unit of %u blocks\n", COMPRESSION_UNIT_BLOCKS);
+        exit (EXIT_FAILURE);
+    }
+    char* data = stored + unitBytes;
+    uint32_t mapped = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t first = 0; first < mapped; first += COMPRESSION_UNIT_BLOCKS)
+    {
+        uint32_t blockCount = (mapped - first < COMPRESSION_UNIT_BLOCKS ? mapped - first : COMPRESSION_UNIT_BLOCKS);
+        uint32_t dataBlocks = 0;
+        int afterHole = 0;
+        int misplaced = 0;
+        for (uint32_t blockIndex = 0; blockIndex < blockCount && !misplaced; ++blockIndex)
+        {
+            uint32_t blockNum = getFileBlock (node, first + blockIndex, NULL);
+            misplaced = (blockNum != 0 && afterHole);
+            if (misplaced)
+            {
+                problem (state, 0, "Inode %u has data after a hole in unit %u\n", iNodeNumber, first / COMPRESSION_UNIT_BLOCKS);
+            }
+            afterHole |= (blockNum == 0);
+            if (blockNum != 0)
+            {
+                readDataBlock (blockNum, stored + (size_t)dataBlocks++ * BLOCK_SIZE);
+            }
+        }
+        if (!misplaced && afterHole && dataBlocks > 0 && unpackUnit (stored, dataBlocks, blockCount, data) < 0)
+        {
+            problem (state, 0, "Inode %u has a damaged compressed unit %u\n", iNodeNumber, first / COMPRESSION_UNIT_BLOCKS);
+        }
+    }
+    free (stored);
+}
+
+// Starts over with no blocks owned but the metadata, and no shared ones.
+void
+startClaims (struct checkState* state)
+{
+    initBitmap (&state->owned, BLOCK_COUNT);
+    for (uint32_t blockNum = 0; blockNum < FIRSTDATABLOCK_NUMBER; ++blockNum)
+    {
+        markBitmapBlockUsed (&state->owned, blockNum);
+    }
+    if (state->countedShares != NULL)
+    {
+        initBitmap (&state->shareable, BLOCK_COUNT);
+        memset (state->countedShares, 0, (size_t)BLOCK_COUNT * sizeof (uint16_t));
+    }
+}
+
+// Records that an inode owns a run of data blocks, reporting any already owned by another.
+// On a filesystem that shares blocks, a block may be claimed again if every claim on it
+//   is shareable, which counts one more reference to it instead.
+// Other such blocks are not repaired: there is no telling which owner is right.
+// Params:
+//   shareable - 1 if the blocks are data blocks of a file that may share them, 0 if not.
+void
+claimBlocks (struct checkState* state, uint32_t iNodeNumber, uint32_t firstBlock, uint32_t count, int shareable,
+             int report)
+{
+    int sharing = (shareable && state->countedShares != NULL);
+    for (uint32_t blockNum = firstBlock; blockNum < firstBlock + count; ++blockNum)
+    {
+        if (isBitmapBlockUsed (&state->owned, blockNum))
+        {
+            if (sharing && isBitmapBlockUsed (&state->shareable, blockNum)
+                && state->countedShares[blockNum] < MAX_BLOCK_SHARES)
+            {
+                ++state->countedShares[blockNum];
+                continue;
+            }
+            if (report)
+            {
+                problem (state, 0, "Block %u of inode %u also belongs to another inode\n", blockNum, iNodeNumber);
+            }
+            continue;
+        }
+        markBitmapBlockUsed (&state->owned, blockNum);
+        if (sharing)
+        {
+            markBitmapBlockUsed (&state->shareable, blockNum);
+        }
+    }
+}
+
+// Checks every inode that is in use, claiming the blocks of the sound ones.
+// Broken inodes are freed when repairing, and ignored from then on otherwise.
+void
+checkINodes (struct checkState* state)
+{
+    startClaims (state);
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    {
+        struct iNode* node = &state->iNodes[iNodeNumber];
+        if (!isInUse (node))
+        {
+            continue;
+        }
+        if (checkBlockMap (state, iNodeNumber, 1) == 0)
+        {
+            if (node->mode & MU_S_COMPRESSED)
+            {
+                checkCompressedUnits (state, iNodeNumber);
+            }
+            continue;
+        }
+        if (state->repair)
+        {
+            memset (node, 0, sizeof (struct iNode));
+            node->mode = MU_S_AVAIL;
+            state->flags[iNodeNumber] |= INODE_DIRTY;
+        }
+        else
+        {
+            state->flags[iNodeNumber] |= INODE_BROKEN;
+        }
+    }
+}
+
+// Walks every directory reachable from the root, breadth first, counting the
+//   references to each inode.
+void
+walkDirectories (struct checkState* state)
+{
+    const struct iNode* root = &state->iNodes[ROOT_INODE_NUMBER];
+    if (!isInUse (root) || (root->mode & MU_S_DIREC) == 0 || (state->flags[ROOT_INODE_NUMBER] & INODE_BROKEN))
+    {
+        fprintf (stderr, "The root directory is missing, so nothing else can be checked\n");
+        exit (FSCK_UNREPAIRED);
+    }
+    // Every directory is queued at most once, so the queue never holds more than INODE_COUNT.
+    uint32_t* queue = malloc ((size_t)INODE_COUNT * sizeof (uint32_t));
+    if (queue == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for the directory walk\n");
+        exit (EXIT_FAILURE);
+    }
+    uint32_t queueLength = 0;
+    queue[queueLength++] = ROOT_INODE_NUMBER;
+    state->flags[ROOT_INODE_NUMBER] |= INODE_VISITED;
+    for (uint32_t next = 0; next < queueLength; ++next)
+    {
+        checkDirectory (state, queue[next], queue, &queueLength);
+    }
+    free (queue);
+}
+
+// Checks the entries of one directory, queueing the subdirectories not yet visited.
+// Entries naming an inode that is not in use become holes when repairing.
+void
+checkDirectory (struct checkState* state, uint32_t dirINodeNumber, uint32_t* queue, uint32_t* queueLength)
+{
+    const struct iNode* dirNode = &state->iNodes[dirINodeNumber];
+    ++state->directories;
+    if (dirNode->size % DIR_ENTRY_LENGTH != 0)
+    {
+        problem (state, 0, "Directory %u has a size of %u, which is not a whole number of entries\n",
+                 dirINodeNumber, dirNode->size);
+    }
+    uint32_t mapped = (dirNode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char* blocks = malloc ((size_t)(mapped > 0 ? mapped : 1) * BLOCK_SIZE);
+    if (blocks == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for directory %u\n", dirINodeNumber);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t blockIndex = 0;
+    while (blockIndex < mapped)
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (dirNode, blockIndex, &runLength);
+        uint32_t count = (runLength < mapped - blockIndex ? runLength : mapped - blockIndex);
+        readDataBlocks (blockNum, count, blocks + (size_t)blockIndex * BLOCK_SIZE);
+        blockIndex += count;
+    }
+
+    struct dirEntry* entries = (struct dirEntry*)blocks;
+    uint32_t entryCount = dirNode->size / DIR_ENTRY_LENGTH;
+    for (uint32_t entryIndex = firstEntryIndex (dirNode); entryIndex < entryCount; ++entryIndex)
+    {
+        struct dirEntry* entry = &entries[entryIndex];
+        // An entry with an empty name is a hole left behind by muunlink.
+        if (entry->name[0] == '\0')
+        {
+            continue;
+        }
+        uint32_t target = entry->iNodeNumber;
+        if (target >= INODE_COUNT || !isInUse (&state->iNodes[target]))
+        {
+            problem (state, state->repair, "Entry %.*s of directory %u refers to inode %u, which is not in use\n",
+                     MAX_NAME_LENGTH, entry->name, dirINodeNumber, target);
+            if (state->repair)
+            {
+                uint32_t entryBlock = entryIndex / DIR_ENTRIES_PER_BLOCK;
+                memset (entry->name, 0, MAX_NAME_LENGTH);
+                writeMetadataBlock (getFileBlock (dirNode, entryBlock, NULL), blocks + (size_t)entryBlock * BLOCK_SIZE);
+            }
+            continue;
+        }
+        ++state->references[target];
+        if (strcmp (entry->name, ".") == 0)
+        {
+            if (target != dirINodeNumber)
+            {
+                problem (state, 0, "Entry . of directory %u refers to inode %u\n", dirINodeNumber, target);
+            }
+            continue;
+        }
+        const struct iNode* targetNode = &state->iNodes[target];
+        if (strcmp (entry->name, "..") != 0 && (targetNode->mode & MU_S_DIREC) != 0
+            && (state->flags[target] & (INODE_VISITED | INODE_BROKEN)) == 0)
+        {
+            state->flags[target] |= INODE_VISITED;
+            queue[(*queueLength)++] = target;
+        }
+    }
+    if ((dirNode->mode & MU_S_INDEXED) && (state->flags[dirINodeNumber] & INODE_BAD_INDEX) == 0)
+    {
+        checkIndexLeaves (state, dirINodeNumber, entries);
+    }
+    free (blocks);
+}
+
+// Checks that a directory's hash index has exactly one record for each of its entries,
+//   each filed under the right hash.  An index that does not is thrown away when repairing.
+// Params:
+//   entries - All of the directory's entries, read in whole.
+void
+checkIndexLeaves (struct checkState* state, uint32_t dirINodeNumber, const struct dirEntry* entries)
+{
+    const struct iNode* dirNode = &state->iNodes[dirINodeNumber];
+    uint32_t entryCount = dirNode->size / DIR_ENTRY_LENGTH;
+    uint32_t liveEntries = 0;
+    for (uint32_t entryIndex = firstEntryIndex (dirNode); entryIndex < entryCount; ++entryIndex)
+    {
+        liveEntries += (entries[entryIndex].name[0] != '\0');
+    }
+    char* indexed = calloc (entryCount, 1);
+    uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t leafBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+    struct dirIndexLeaf* leaf = (struct dirIndexLeaf*)leafBuffer;
+    if (indexed == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for directory %u\n", dirINodeNumber);
+        exit (EXIT_FAILURE);
+    }
+    struct dirIndexRoot* leaves = readIndexLeafRanges (dirNode, root);
+    uint32_t records = 0;
+    int sound = (leaves != NULL);
+    for (uint32_t range = 0; sound && range < leaves->rangeCount; ++range)
+    {
+        readDataBlock (leaves->ranges[range].block, (char*)leaf);
+        sound = (leaf->recordCount <= DIR_INDEX_RECORDS_PER_LEAF);
+        for (uint32_t position = 0; sound && position < leaf->recordCount; ++position)
+        {
+            const struct dirIndexRecord* record = &leaf->records[position];
+            uint32_t entryIndex = record->entryIndex;
+            sound = (record->hash == hashEntryName (record->entry.name) && findIndexRange (leaves, record->hash) == range
+                     && (position == 0 || leaf->records[position - 1].hash <= record->hash)
+                     && entryIndex >= firstEntryIndex (dirNode) && entryIndex < entryCount && !indexed[entryIndex]
+                     && entries[entryIndex].name[0] != '\0'
+                     && entries[entryIndex].iNodeNumber == record->entry.iNodeNumber
+                     && strncmp (entries[entryIndex].name, record->entry.name, MAX_NAME_LENGTH) == 0);
+            if (sound)
+            {
+                indexed[entryIndex] = 1;
+                ++records;
+            }
+        }
+    }
+    free (indexed);
+    if (sound && records == liveEntries)
+    {
+        free (leaves);
+        return;
+    }
+    problem (state, state->repair, "The hash index of directory %u does not match its entries\n", dirINodeNumber);
+    if (state->repair)
+    {
+        for (uint32_t range = 0; range < root->rangeCount; ++range)
+        {
+            markBitmapBlockAvailable (&state->owned, root->ranges[range].block);
+        }
+        for (uint32_t range = 0; leaves != NULL && root->depth == 1 && range < leaves->rangeCount; ++range)
+        {
+            markBitmapBlockAvailable (&state->owned, leaves->ranges[range].block);
+        }
+        dropDirIndex (state, dirINodeNumber);
+    }
+    free (leaves);
+}
+
+// Throws away a directory's hash index, leaving its root block as holes.  The caller
+//   sees to the leaves, which are no longer owned.
+void
+dropDirIndex (struct checkState* state, uint32_t dirINodeNumber)
+{
+    struct iNode* dirNode = &state->iNodes[dirINodeNumber];
+    // An inode that should never have had the flag keeps its first block as it is.
+    if (usesDirIndex () && (dirNode->mode & MU_S_DIREC) != 0 && dirNode->size > BLOCK_SIZE)
+    {
+        char zeros[BLOCK_SIZE];
+        memset (zeros, 0, BLOCK_SIZE);
+        writeMetadataBlock (getFileBlock (dirNode, 0, NULL), zeros);
+    }
+    dirNode->mode &= ~MU_S_INDEXED;
+    state->flags[dirINodeNumber] |= INODE_DIRTY;
+}
+
+// Compares each inode's link count with the number of entries that refer to it.
+// Inodes that nothing refers to are freed when repairing, and their blocks with them.
+void
+checkLinkCounts (struct checkState* state)
+{
+    int freedAny = 0;
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    {
+        struct iNode* node = &state->iNodes[iNodeNumber];
+        if (!isInUse (node) || (state->flags[iNodeNumber] & INODE_BROKEN))
+        {
+            continue;
+        }
+        uint32_t references = state->references[iNodeNumber];
+        if (references == 0)
+        {
+            problem (state, state->repair, "Inode %u is in use but is not in any directory\n", iNodeNumber);
+            if (state->repair)
+            {
+                memset (node, 0, sizeof (struct iNode));
+                node->mode = MU_S_AVAIL;
+                state->flags[iNodeNumber] |= INODE_DIRTY;
+                freedAny = 1;
+            }
+        }
+        else if (node->linkCount != references)
+        {
+            problem (state, state->repair, "Inode %u has a link count of %u but %u entries refer to it\n",
+                     iNodeNumber, node->linkCount, references);
+            if (state->repair)
+            {
+                node->linkCount = references;
+                state->flags[iNodeNumber] |= INODE_DIRTY;
+            }
+        }
+    }
+    // The freed inodes' blocks must no longer count as owned.
+    if (freedAny)
+    {
+        destroyBitmap (&state->owned);
+        if (state->countedShares != NULL)
+        {
+            destroyBitmap (&state->shareable);
+        }
+        claimAllBlocks (state);
+    }
+}
+
+// Rebuilds the owned blocks from the inodes, without reporting anything again.
+void
+claimAllBlocks (struct checkState* state)
+{
+    startClaims (state);
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    {
+        if (isInUse (&state->iNodes[iNodeNumber]) && (state->flags[iNodeNumber] & INODE_BROKEN) == 0)
+        {
+            checkBlockMap (state, iNodeNumber, 0);
+        }
+    }
+}
+
+// Compares the free block map with the blocks that are really owned, 64 blocks at a time.
+// Leaked blocks (used but owned by nothing) and unrecorded ones (owned but marked
+//   available) are both fixed by writing the owned blocks as the new map.
+void
+checkFreeBlockMap (struct checkState* state)
+{
+    uint32_t leaked = 0;
+    uint32_t unrecorded = 0;
+    for (uint32_t wordIndex = 0; wordIndex < state->owned.wordCount; ++wordIndex)
+    {
+        uint64_t owned = state->owned.words[wordIndex];
+        uint64_t recorded = state->recorded.words[wordIndex];
+        if (owned == recorded)
+        {
+            continue;
+        }
+        for (uint32_t bit = 0; bit < 64; ++bit)
+        {
+            uint32_t blockNum = wordIndex * 64 + bit;
+            int isOwned = (owned >> bit) & 1;
+            int isRecorded = (recorded >> bit) & 1;
+            if (isRecorded && !isOwned && leaked++ < MAX_BLOCKS_NAMED)
+            {
+                printf ("Block %u is marked used but belongs to nothing\n", blockNum);
+            }
+            else if (isOwned && !isRecorded && unrecorded++ < MAX_BLOCKS_NAMED)
+            {
+                printf ("Block %u is in use but marked available\n", blockNum);
+            }
+        }
+    }
+    if (leaked > 0)
+    {
+        problem (state, state->repair, "%u blocks have leaked\n", leaked);
+    }
+    if (unrecorded > 0)
+    {
+        problem (state, state->repair, "%u blocks in use are marked available\n", unrecorded);
+    }
+    if (state->repair && (leaked > 0 || unrecorded > 0))
+    {
+        char* isUsed = malloc (BLOCK_COUNT);
+        if (isUsed == NULL)
+        {
+            fprintf (stderr, "Could not allocate a free block map\n");
+            exit (EXIT_FAILURE);
+        }
+        storeBitmapToBytes (&state->owned, isUsed);
+        writeFreeBlockMap (isUsed);
+        free (isUsed);
+    }
+}
+
+// Compares the block share table with the references to each block that the inodes
+//   account for (none for a block that nothing owns).  Wrong counts are fixed by writing
+//   the counted ones as the new table.
+void
+checkBlockShares (struct checkState* state)
+{
+    uint32_t wrong = 0;
+    for (uint32_t blockNum = 0; blockNum < BLOCK_COUNT; ++blockNum)
+    {
+        uint16_t counted = (isBitmapBlockUsed (&state->owned, blockNum) ? state->countedShares[blockNum] : 0);
+        if (state->recordedShares[blockNum] != counted && wrong++ < MAX_BLOCKS_NAMED)
+        {
+            printf ("Block %u has %u references beyond its first but the share table records %u\n", blockNum,
+                    counted, state->recordedShares[blockNum]);
+        }
+    }
+    if (wrong > 0)
+    {
+        problem (state, state->repair, "%u blocks have the wrong share count\n", wrong);
+    }
+    if (state->repair && wrong > 0)
+    {
+        writeBlockShares (state->countedShares);
+    }
+}
+
+// Reports a problem, counting it as repaired if the caller is about to repair it.
+void
+problem (struct checkState* state, int repairable, const char* format, ...)
+{
+    va_list arguments;
+    va_start (arguments, format);
+    vprintf (format, arguments);
+    va_end (arguments);
+    ++state->problems;
+    if (repairable)
+    {
+        ++state->repairs;
+    }
+}
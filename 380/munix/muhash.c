@@ -0,0 +1,131 @@
+// File: muhash.c
+// Author: Matt Shenk
+// Implementation of block hashing and the index of blocks by hash.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "muhash.h"
+
+// The multipliers of the hash, which are odd and have their bits well mixed (they are
+//   the primes of xxHash64, whose round this follows).
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3 0x165667B19E3779F9ull
+// A block is hashed as 4 independent lanes of 8 bytes, so that the multiplies overlap.
+#define HASH_LANES 4
+// How many slots after its first a block may be put in.
+#define PROBE_SLOTS 8
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Rotates a word left by some bits.
+static uint64_t
+rotateLeft (uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Returns the first slot for a hash.
+static uint32_t
+homeSlot (const struct blockIndex* index, uint64_t hash)
+{
+    return (uint32_t)(hash >> 32) & index->mask;
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+uint64_t
+hashBlock (const char* block)
+{
+    uint64_t lanes[HASH_LANES] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1 };
+    for (uint32_t position = 0; position < BLOCK_SIZE; position += HASH_LANES * sizeof (uint64_t))
+    {
+        for (int lane = 0; lane < HASH_LANES; ++lane)
+        {
+            uint64_t word;
+            memcpy (&word, block + position + lane * sizeof (uint64_t), sizeof (word));
+            lanes[lane] = rotateLeft (lanes[lane] + word * HASH_PRIME2, 31) * HASH_PRIME1;
+        }
+    }
+    uint64_t hash = rotateLeft (lanes[0], 1) + rotateLeft (lanes[1], 7) + rotateLeft (lanes[2], 12)
+                    + rotateLeft (lanes[3], 18) + BLOCK_SIZE;
+    // Mix every bit into the top ones, which pick the slot.
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void
+initBlockIndex (struct blockIndex* index, uint32_t capacity)
+{
+    uint32_t slotCount = PROBE_SLOTS;
+    while (slotCount / 2 < capacity && slotCount < (1u << 31))
+    {
+        slotCount *= 2;
+    }
+    index->slots = calloc (slotCount, sizeof (struct indexedBlock));
+    if (index->slots == NULL)
+    {
+        fprintf (stderr, "Could not allocate a block index of %u slots\n", slotCount);
+        exit (EXIT_FAILURE);
+    }
+    index->mask = slotCount - 1;
+    index->count = 0;
+}
+
+void
+destroyBlockIndex (struct blockIndex* index)
+{
+    free (index->slots);
+    index->slots = NULL;
+}
+
+const struct indexedBlock*
+findIndexedBlock (const struct blockIndex* index, uint64_t hash)
+{
+    uint32_t first = homeSlot (index, hash);
+    for (uint32_t probe = 0; probe < PROBE_SLOTS; ++probe)
+    {
+        const struct indexedBlock* slot = &index->slots[(first + probe) & index->mask];
+        if (slot->blockNum == 0)
+        {
+            return NULL;
+        }
+        if (slot->hash == hash)
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+void
+addIndexedBlock (struct blockIndex* index, const struct indexedBlock* block)
+{
+    assert (block->blockNum != 0);
+    uint32_t first = homeSlot (index, block->hash);
+    struct indexedBlock* target = &index->slots[first];
+    for (uint32_t probe = 0; probe < PROBE_SLOTS; ++probe)
+    {
+        struct indexedBlock* slot = &index->slots[(first + probe) & index->mask];
+        if (slot->blockNum == 0 || slot->hash == block->hash)
+        {
+            target = slot;
+            break;
+        }
+    }
+    index->count += (target->blockNum == 0);
+    *target = *block;
+}
@@ -0,0 +1,71 @@
+// File: muhash.h
+// Author: Matt Shenk
+// Interface for finding data blocks by their contents, which deduplication uses to share
+//   the blocks that hold the same data (see VERSION24 in mufs.h): a fast 64-bit hash of a
+//   block, and an in-memory index from those hashes to blocks.
+// None of these functions read or write the disk.  Two blocks with the same hash are
+//   only likely to be the same, so the caller compares them before sharing one.
+// Part of munix lab in CSCI380.
+
+#ifndef MUHASH_H
+#define MUHASH_H
+
+#include <stdint.h>
+
+// A block that the index knows the hash of, and where it was seen.
+struct indexedBlock
+{
+    uint64_t hash;
+    // The data block, or 0 for an empty slot.
+    uint32_t blockNum;
+    // The file it was seen in and its position in that file, which the caller checks to
+    //   be sure that the block still belongs there.
+    uint32_t iNodeNumber;
+    uint32_t blockIndex;
+    uint32_t reserved;
+};
+
+// An index from hashes to blocks.  It has a fixed number of slots and keeps the newest
+//   blocks once they are full, so it forgets blocks rather than ever growing.
+struct blockIndex
+{
+    struct indexedBlock* slots;
+    // The number of slots less one (a power of two less one).
+    uint32_t mask;
+    // The number of slots in use.
+    uint32_t count;
+};
+
+
+// Hashes the contents of a block (BLOCK_SIZE bytes), 8 bytes at a time.
+uint64_t
+hashBlock (const char* block);
+
+
+// Creates an empty index.
+// Params:
+//   index - The index to fill in.
+//   capacity - How many blocks it should be able to hold; it gets at least twice as
+//     many slots, so that few blocks are forgotten before it is that full.
+void
+initBlockIndex (struct blockIndex* index, uint32_t capacity);
+
+
+// Releases the memory held by an index.
+void
+destroyBlockIndex (struct blockIndex* index);
+
+
+// Finds a block with a given hash.
+// Returns:
+//   The block, or NULL if the index has none with that hash.
+const struct indexedBlock*
+findIndexedBlock (const struct blockIndex* index, uint64_t hash);
+
+
+// Adds a block to an index, replacing any block with the same hash (or, when the slots
+//   near the hash are all taken, the block in its first slot).
+void
+addIndexedBlock (struct blockIndex* index, const struct indexedBlock* block);
+
+#endif//MUHASH_H
@@ -0,0 +1,220 @@
+// File: muicache.c
+// Author: Matt Shenk
+// Implementation of the inode cache used by munix.
+// Cached inodes are chained in a fixed number of buckets by inode number, and those that
+//   nothing refers to are also kept on a list from least to most recently released,
+//   from whose front they are evicted.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mufs.h"
+#include "muicache.h"
+
+#define ICACHE_BUCKETS 1024
+
+// One cached inode.
+struct cachedINode
+{
+    // The inode itself, first so that a pointer to it is a pointer to its entry.
+    struct iNode node;
+    uint32_t iNodeNumber;
+    // How many holders refer to the inode.
+    uint32_t references;
+    // Whether the inode has changes that have not been written to disk.
+    int dirty;
+    // The next inode in the same bucket.
+    struct cachedINode* next;
+    // The neighbours on the list of unused inodes, while references is 0.
+    struct cachedINode* older;
+    struct cachedINode* newer;
+};
+
+static struct cachedINode* buckets[ICACHE_BUCKETS];
+static struct cachedINode* oldestUnused = NULL;
+static struct cachedINode* newestUnused = NULL;
+static uint32_t unusedCount = 0;
+static struct icacheStats stats;
+static pthread_mutex_t icacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Returns the entry of a cached inode.
+static struct cachedINode*
+entryOf (struct iNode* node)
+{
+    return (struct cachedINode*)node;
+}
+
+// Writes an inode to disk and marks it clean.
+static void
+writeEntry (struct cachedINode* entry)
+{
+    writeINode (entry->iNodeNumber, &entry->node);
+    entry->dirty = 0;
+    ++stats.writeBacks;
+}
+
+// Takes an inode off the list of unused inodes.
+static void
+unlinkUnused (struct cachedINode* entry)
+{
+    if (entry->older != NULL) { entry->older->newer = entry->newer; } else { oldestUnused = entry->newer; }
+    if (entry->newer != NULL) { entry->newer->older = entry->older; } else { newestUnused = entry->older; }
+    entry->older = entry->newer = NULL;
+    --unusedCount;
+}
+
+// Takes an unused inode out of the cache and frees it.
+static void
+forgetEntry (struct cachedINode* entry)
+{
+    unlinkUnused (entry);
+    struct cachedINode** link = &buckets[entry->iNodeNumber % ICACHE_BUCKETS];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    free (entry);
+}
+
+// Drops a reference, putting the inode on the list of unused inodes (and evicting the
+//   least recently used ones beyond ICACHE_MAX_UNUSED) when it was the last.
+// Must be called with icacheLock held.
+static void
+dropReference (struct cachedINode* entry)
+{
+    assert (entry->references > 0);
+    if (--entry->references > 0)
+    {
+        return;
+    }
+    entry->older = newestUnused;
+    entry->newer = NULL;
+    if (newestUnused != NULL) { newestUnused->newer = entry; } else { oldestUnused = entry; }
+    newestUnused = entry;
+    ++unusedCount;
+    while (unusedCount > ICACHE_MAX_UNUSED)
+    {
+        forgetEntry (oldestUnused);
+        ++stats.evictions;
+    }
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+struct iNode*
+icacheGet (uint32_t iNodeNumber)
+{
+    pthread_mutex_lock (&icacheLock);
+    struct cachedINode** bucket = &buckets[iNodeNumber % ICACHE_BUCKETS];
+    struct cachedINode* entry = *bucket;
+    while (entry != NULL && entry->iNodeNumber != iNodeNumber)
+    {
+        entry = entry->next;
+    }
+    if (entry != NULL)
+    {
+        if (entry->references == 0)
+        {
+            unlinkUnused (entry);
+        }
+        ++stats.hits;
+    }
+    else
+    {
+        entry = calloc (1, sizeof (struct cachedINode));
+        if (entry == NULL)
+        {
+            fprintf (stderr, "Could not allocate a cached inode\n");
+            exit (EXIT_FAILURE);
+        }
+        readINode (iNodeNumber, &entry->node);
+        entry->iNodeNumber = iNodeNumber;
+        entry->next = *bucket;
+        *bucket = entry;
+        ++stats.misses;
+    }
+    ++entry->references;
+    pthread_mutex_unlock (&icacheLock);
+    return &entry->node;
+}
+
+void
+icacheHold (struct iNode* node)
+{
+    pthread_mutex_lock (&icacheLock);
+    assert (entryOf (node)->references > 0);
+    ++entryOf (node)->references;
+    pthread_mutex_unlock (&icacheLock);
+}
+
+void
+icacheMarkDirty (struct iNode* node)
+{
+    pthread_mutex_lock (&icacheLock);
+    entryOf (node)->dirty = 1;
+    pthread_mutex_unlock (&icacheLock);
+}
+
+void
+icacheWriteBack (struct iNode* node)
+{
+    pthread_mutex_lock (&icacheLock);
+    writeEntry (entryOf (node));
+    pthread_mutex_unlock (&icacheLock);
+}
+
+void
+icacheRelease (struct iNode* node)
+{
+    struct cachedINode* entry = entryOf (node);
+    pthread_mutex_lock (&icacheLock);
+    if (entry->references == 1 && entry->dirty)
+    {
+        writeEntry (entry);
+    }
+    dropReference (entry);
+    pthread_mutex_unlock (&icacheLock);
+}
+
+void
+icacheDiscard (struct iNode* node)
+{
+    struct cachedINode* entry = entryOf (node);
+    pthread_mutex_lock (&icacheLock);
+    dropReference (entry);
+    if (entry->references == 0 && entry->dirty)
+    {
+        // The changes are lost, so the copy in memory must not be used again.
+        forgetEntry (entry);
+    }
+    pthread_mutex_unlock (&icacheLock);
+}
+
+void
+icacheClear ()
+{
+    pthread_mutex_lock (&icacheLock);
+    while (oldestUnused != NULL)
+    {
+        forgetEntry (oldestUnused);
+    }
+    pthread_mutex_unlock (&icacheLock);
+}
+
+void
+getIcacheStats (struct icacheStats* out)
+{
+    pthread_mutex_lock (&icacheLock);
+    *out = stats;
+    pthread_mutex_unlock (&icacheLock);
+}
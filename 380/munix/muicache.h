@@ -0,0 +1,86 @@
+// File: muicache.h
+// Author: Matt Shenk
+// Interface of the inode cache used by munix, which keeps one copy in memory of each
+//   inode in use, shared by every file table entry, working directory and directory
+//   cache entry that refers to it, so that an inode is read from disk once however often
+//   it is opened and every holder sees the others' changes.
+// Holders take a reference with icacheGet and give it back with icacheRelease.  A change
+//   made in memory is either written at once with icacheWriteBack or marked with
+//   icacheMarkDirty and written when the last reference is released.  The most recently
+//   released inodes stay cached (clean) in case they are wanted again.
+// The cache's own table is protected by an internal lock, but the contents of an inode
+//   are not: callers change them under whatever lock protects that file.
+// Part of munix lab in CSCI380.
+
+#ifndef MUICACHE_H
+#define MUICACHE_H
+
+#include <stdint.h>
+
+#include "mufs.h"
+
+// How many inodes that nothing refers to are kept cached.
+#define ICACHE_MAX_UNUSED 512
+
+// Counters describing how well the inode cache is working.
+struct icacheStats
+{
+    // References taken to inodes that were already cached.
+    uint64_t hits;
+    // References taken to inodes that had to be read from disk.
+    uint64_t misses;
+    // Inodes written to disk.
+    uint64_t writeBacks;
+    // Inodes that nothing referred to, thrown away to make room for others.
+    uint64_t evictions;
+};
+
+
+// Takes a reference to an inode, reading it from disk only if it is not cached.
+// Params:
+//   iNodeNumber - The number of the inode.
+// Returns:
+//   The cached inode, which stays valid until the reference is released.
+struct iNode*
+icacheGet (uint32_t iNodeNumber);
+
+
+// Takes another reference to an inode that the caller already holds one to.
+void
+icacheHold (struct iNode* node);
+
+
+// Records that a held inode has been changed in memory, so that it is written to disk
+//   when its last reference is released.
+void
+icacheMarkDirty (struct iNode* node);
+
+
+// Writes a held inode to disk now, whether or not it is marked dirty, and marks it clean.
+void
+icacheWriteBack (struct iNode* node);
+
+
+// Gives back a reference to an inode.  The last one writes the inode to disk if it is
+//   dirty, and leaves it cached (but perhaps evicted by later releases).
+void
+icacheRelease (struct iNode* node);
+
+
+// Gives back a reference to an inode without writing it, for an inode of a disk that may
+//   no longer be loaded.  With the last reference, any changes not yet written are lost.
+void
+icacheDiscard (struct iNode* node);
+
+
+// Throws away every inode that nothing refers to, so that the next reference to it
+//   rereads the disk (as it must once another disk has been loaded).
+void
+icacheClear ();
+
+
+// Copies the current cache counters into stats.
+void
+getIcacheStats (struct icacheStats* stats);
+
+#endif//MUICACHE_H
@@ -0,0 +1,137 @@
+// File: mujbench.c
+// Author: Matt Shenk
+// A benchmark of metadata-heavy work (creating, writing and removing small files),
+//   run once without and once with the metadata journal.
+// Part of munix lab in CSCI380.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "munix.h"
+#include "mufs.h"
+#include "mujournal.h"
+
+#define DEFAULT_OPERATIONS 2000
+#define FILES_PER_ROUND 100
+#define FILE_BYTES 100
+
+// The results of one run of the workload.
+struct benchResult
+{
+    double seconds;
+    uint64_t syscalls;
+};
+
+void
+runWorkload (const char* diskName, int journaled, int operations, struct benchResult* result);
+
+double
+now ();
+
+int
+main (int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        fprintf (stderr, "Usage: %s diskName [operations]\n", argv[0]);
+        fprintf (stderr, "The disk should be made with mkdisk --journal.\n");
+        exit (EXIT_FAILURE);
+    }
+    int operations = (argc > 2 ? atoi (argv[2]) : DEFAULT_OPERATIONS);
+    if (operations < 2)
+    {
+        fprintf (stderr, "The number of operations must be at least 2\n");
+        exit (EXIT_FAILURE);
+    }
+
+    struct benchResult plain;
+    struct benchResult journaled;
+    runWorkload (argv[1], 0, operations, &plain);
+    resetJournalStats ();
+    runWorkload (argv[1], 1, operations, &journaled);
+    struct journalStats stats;
+    getJournalStats (&stats);
+
+    printf ("%-10s %12s %12s %14s\n", "journal", "ops/sec", "syscalls", "syscalls/op");
+    printf ("%-10s %12.0f %12lu %14.2f\n", "off", operations / plain.seconds,
+            (unsigned long)plain.syscalls, (double)plain.syscalls / operations);
+    printf ("%-10s %12.0f %12lu %14.2f\n", "on", operations / journaled.seconds,
+            (unsigned long)journaled.syscalls, (double)journaled.syscalls / operations);
+    printf ("Journal: %lu commits, %lu blocks logged, %lu updates absorbed, %lu checkpoints of %lu blocks\n",
+            (unsigned long)stats.commits, (unsigned long)stats.blocksLogged, (unsigned long)stats.updatesAbsorbed,
+            (unsigned long)stats.checkpoints, (unsigned long)stats.blocksCheckpointed);
+    return EXIT_SUCCESS;
+}
+
+// Creates, writes, closes and then removes files in the root directory, counting
+//   each creation and each removal as one operation, and finishing with mufs_sync.
+void
+runWorkload (const char* diskName, int journaled, int operations, struct benchResult* result)
+{
+    configureJournal (journaled);
+    setup (diskName);
+    if (journaled && !isJournalEnabled ())
+    {
+        fprintf (stderr, "%s has no journal; make it with mkdisk --journal\n", diskName);
+        exit (EXIT_FAILURE);
+    }
+    if (muinit ("root", "admin") < 0)
+    {
+        fprintf (stderr, "Could not log in as root: %d\n", muerrno);
+        exit (EXIT_FAILURE);
+    }
+    char data[FILE_BYTES];
+    memset (data, 'j', FILE_BYTES);
+    char name[MAX_NAME_LENGTH];
+
+    uint64_t syscallsBefore = getSyscallCount ();
+    double start = now ();
+    int done = 0;
+    while (done < operations)
+    {
+        int files = (operations - done) / 2;
+        if (files > FILES_PER_ROUND)
+        {
+            files = FILES_PER_ROUND;
+        }
+        if (files == 0)
+        {
+            break;
+        }
+        for (int index = 0; index < files; ++index)
+        {
+            snprintf (name, MAX_NAME_LENGTH, "bench%d", index);
+            int fd = mucreat (name, MU_S_IRUSR | MU_S_IWUSR);
+            if (fd < 0 || muwrite (fd, data, FILE_BYTES) != FILE_BYTES || muclose (fd) < 0)
+            {
+                fprintf (stderr, "Could not create %s: %d\n", name, muerrno);
+                exit (EXIT_FAILURE);
+            }
+        }
+        for (int index = files - 1; index >= 0; --index)
+        {
+            snprintf (name, MAX_NAME_LENGTH, "bench%d", index);
+            if (muunlink (name) < 0)
+            {
+                fprintf (stderr, "Could not remove %s: %d\n", name, muerrno);
+                exit (EXIT_FAILURE);
+            }
+        }
+        done += 2 * files;
+    }
+    mufs_sync ();
+    result->seconds = now () - start;
+    result->syscalls = getSyscallCount () - syscallsBefore;
+    teardown ();
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
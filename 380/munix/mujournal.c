@@ -0,0 +1,472 @@
+// File: mujournal.c
+// Author: Matt Shenk
+// Implementation of the write-ahead metadata journal of MUFS.
+// The journal area holds a header block followed by transactions, each written with a
+//   single I/O as a descriptor block, the block copies and a commit block.  Every block
+//   in a committed or running transaction is also kept in memory, so that reads see it
+//   and a checkpoint can write it home without reading the journal back.
+// Part of munix lab in CSCI380.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mufs.h"
+#include "mujournal.h"
+
+#define NO_ENTRY ((uint32_t)-1)
+#define DESCRIPTOR_CAPACITY ((BLOCK_SIZE - sizeof (struct journalDescriptor)) / sizeof (uint32_t))
+
+// A block that is part of a committed or running transaction.
+struct journalEntry
+{
+    // Where the block belongs.
+    uint32_t blockNum;
+    // The transaction that last changed it.
+    uint64_t sequence;
+    // The next entry in the same hash bucket.
+    uint32_t hashNext;
+};
+
+// The configuration that the next openJournal will use.
+static int configuredEnabled = 1;
+
+// The state of the open journal.
+static int enabled = 0;
+static uint32_t journalStart = 0;
+static uint32_t journalLength = 0;
+static uint32_t reserved = 0;
+static uint32_t maxTransactionBlocks = 0;
+// The sequence number of the running transaction.
+static uint64_t nextSequence = 0;
+// Where (relative to journalStart) the running transaction will be written.
+static uint32_t logOffset = 1;
+// The number of entries that belong to the running transaction.
+static uint32_t runningCount = 0;
+// Whether journalWillCommit is being called, so that it may use the reserved blocks.
+static int committing = 0;
+
+// The blocks that are in the journal, found through a chained hash table.
+static struct journalEntry* entries = NULL;
+static char* entryData = NULL;
+static uint32_t entryCount = 0;
+static uint32_t* buckets = NULL;
+static uint32_t bucketMask = 0;
+
+static struct journalStats stats;
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+static uint32_t
+bucketOf (uint32_t blockNum)
+{
+    return (blockNum * 2654435761u) & bucketMask;
+}
+
+static char*
+entryBlock (uint32_t index)
+{
+    return entryData + (size_t)index * BLOCK_SIZE;
+}
+
+static uint32_t
+findEntry (uint32_t blockNum)
+{
+    if (entries == NULL)
+    {
+        return NO_ENTRY;
+    }
+    for (uint32_t index = buckets[bucketOf (blockNum)]; index != NO_ENTRY; index = entries[index].hashNext)
+    {
+        if (entries[index].blockNum == blockNum)
+        {
+            return index;
+        }
+    }
+    return NO_ENTRY;
+}
+
+static uint32_t
+addEntry (uint32_t blockNum)
+{
+    assert (entryCount < journalLength);
+    uint32_t index = entryCount++;
+    uint32_t bucket = bucketOf (blockNum);
+    entries[index].blockNum = blockNum;
+    entries[index].sequence = 0;
+    entries[index].hashNext = buckets[bucket];
+    buckets[bucket] = index;
+    return index;
+}
+
+static void
+clearEntries ()
+{
+    entryCount = 0;
+    for (uint32_t bucket = 0; bucket <= bucketMask; ++bucket)
+    {
+        buckets[bucket] = NO_ENTRY;
+    }
+}
+
+// FNV-1a checksum of a transaction's descriptor and block copies.
+static uint32_t
+checksum (const char* data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t index = 0; index < length; ++index)
+    {
+        hash ^= (uint8_t)data[index];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void
+writeHeader (uint64_t firstSequence)
+{
+    char block[BLOCK_SIZE];
+    memset (block, 0, BLOCK_SIZE);
+    struct journalHeader* header = (struct journalHeader*)block;
+    formatJournalHeader (header);
+    header->firstSequence = firstSequence;
+    writeBlocksToDisk (journalStart, 1, block);
+}
+
+static int
+compareEntryBlocks (const void* left, const void* right)
+{
+    uint32_t leftBlock = entries[*(const uint32_t*)left].blockNum;
+    uint32_t rightBlock = entries[*(const uint32_t*)right].blockNum;
+    return (leftBlock > rightBlock) - (leftBlock < rightBlock);
+}
+
+// Writes every journaled block home (in ascending order, a run at a time) and empties
+//   the journal.  Only called when there is no running transaction.
+static void
+checkpoint ()
+{
+    assert (runningCount == 0);
+    uint32_t* order = malloc ((size_t)entryCount * sizeof (uint32_t));
+    char* run = malloc ((size_t)entryCount * BLOCK_SIZE);
+    if (order == NULL || run == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for a journal checkpoint\n");
+        exit (EXIT_FAILURE);
+    }
+    for (uint32_t index = 0; index < entryCount; ++index)
+    {
+        order[index] = index;
+    }
+    qsort (order, entryCount, sizeof (uint32_t), compareEntryBlocks);
+    uint32_t position = 0;
+    while (position < entryCount)
+    {
+        uint32_t firstBlock = entries[order[position]].blockNum;
+        uint32_t length = 0;
+        while (position + length < entryCount && entries[order[position + length]].blockNum == firstBlock + length)
+        {
+            memcpy (run + (size_t)length * BLOCK_SIZE, entryBlock (order[position + length]), BLOCK_SIZE);
+            ++length;
+        }
+        writeBlocksToDisk (firstBlock, length, run);
+        position += length;
+    }
+    stats.blocksCheckpointed += entryCount;
+    ++stats.checkpoints;
+    free (run);
+    free (order);
+
+    // Only once every block is home may the transactions be dropped from the journal.
+    writeHeader (nextSequence);
+    logOffset = 1;
+    clearEntries ();
+}
+
+// Applies every committed transaction found in the journal area to the disk.
+static void
+replay ()
+{
+    char block[BLOCK_SIZE];
+    readBlocksFromDisk (journalStart, 1, block);
+    struct journalHeader* header = (struct journalHeader*)block;
+    if (strncmp (header->magic, JOURNAL_MAGIC, sizeof (header->magic)) != 0)
+    {
+        fprintf (stderr, "The journal of this filesystem has no valid header\n");
+        exit (EXIT_FAILURE);
+    }
+    uint64_t sequence = header->firstSequence;
+    uint32_t offset = 1;
+    while (offset + 2 <= journalLength)
+    {
+        readBlocksFromDisk (journalStart + offset, 1, block);
+        struct journalDescriptor* descriptor = (struct journalDescriptor*)block;
+        if (strncmp (descriptor->magic, JOURNAL_DESCRIPTOR_MAGIC, sizeof (descriptor->magic)) != 0
+            || descriptor->sequence != sequence || descriptor->count == 0
+            || descriptor->count > DESCRIPTOR_CAPACITY || offset + descriptor->count + 2 > journalLength)
+        {
+            break;
+        }
+        uint32_t count = descriptor->count;
+        char* transaction = malloc ((size_t)(count + 2) * BLOCK_SIZE);
+        if (transaction == NULL)
+        {
+            fprintf (stderr, "Could not allocate memory to replay the journal\n");
+            exit (EXIT_FAILURE);
+        }
+        memcpy (transaction, block, BLOCK_SIZE);
+        readBlocksFromDisk (journalStart + offset + 1, count + 1, transaction + BLOCK_SIZE);
+        struct journalCommit* commit = (struct journalCommit*)(transaction + (size_t)(count + 1) * BLOCK_SIZE);
+        if (strncmp (commit->magic, JOURNAL_COMMIT_MAGIC, sizeof (commit->magic)) != 0
+            || commit->sequence != sequence
+            || commit->checksum != checksum (transaction, (size_t)(count + 1) * BLOCK_SIZE))
+        {
+            // A transaction that was being written when the crash happened.
+            free (transaction);
+            break;
+        }
+        descriptor = (struct journalDescriptor*)transaction;
+        for (uint32_t index = 0; index < count; ++index)
+        {
+            if (descriptor->blockNumbers[index] < BLOCK_COUNT)
+            {
+                writeBlocksToDisk (descriptor->blockNumbers[index], 1, transaction + (size_t)(index + 1) * BLOCK_SIZE);
+            }
+        }
+        free (transaction);
+        ++stats.transactionsReplayed;
+        ++sequence;
+        offset += count + 2;
+    }
+    nextSequence = sequence;
+    writeHeader (nextSequence);
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+void
+configureJournal (int newEnabled)
+{
+    assert (entries == NULL);
+    configuredEnabled = newEnabled;
+}
+
+void
+getJournalStats (struct journalStats* out)
+{
+    *out = stats;
+}
+
+void
+resetJournalStats ()
+{
+    memset (&stats, 0, sizeof (stats));
+}
+
+void
+formatJournalHeader (struct journalHeader* header)
+{
+    memset (header, 0, sizeof (struct journalHeader));
+    strncpy (header->magic, JOURNAL_MAGIC, sizeof (header->magic));
+    header->firstSequence = 1;
+}
+
+void
+openJournal (uint32_t firstBlock, uint32_t blockCount, uint32_t reservedBlocks)
+{
+    assert (entries == NULL);
+    enabled = 0;
+    journalStart = firstBlock;
+    journalLength = blockCount;
+    if (blockCount == 0)
+    {
+        return;
+    }
+    replay ();
+
+    // A transaction may use at most half of the journal, so that one always fits after
+    //   the checkpoint that follows any commit leaving the journal more than half full.
+    maxTransactionBlocks = (journalLength - 1) / 2 - 2;
+    if (maxTransactionBlocks > DESCRIPTOR_CAPACITY)
+    {
+        maxTransactionBlocks = DESCRIPTOR_CAPACITY;
+    }
+    reserved = reservedBlocks;
+    if (!configuredEnabled || maxTransactionBlocks <= reserved)
+    {
+        return;
+    }
+
+    uint32_t bucketCount = 1;
+    while (bucketCount < journalLength)
+    {
+        bucketCount *= 2;
+    }
+    entries = malloc ((size_t)journalLength * sizeof (struct journalEntry));
+    entryData = malloc ((size_t)journalLength * BLOCK_SIZE);
+    buckets = malloc ((size_t)bucketCount * sizeof (uint32_t));
+    if (entries == NULL || entryData == NULL || buckets == NULL)
+    {
+        fprintf (stderr, "Could not allocate a journal of %u blocks\n", journalLength);
+        exit (EXIT_FAILURE);
+    }
+    bucketMask = bucketCount - 1;
+    clearEntries ();
+    logOffset = 1;
+    runningCount = 0;
+    enabled = 1;
+}
+
+void
+closeJournal ()
+{
+    if (enabled)
+    {
+        journalCommit ();
+        if (entryCount > 0)
+        {
+            checkpoint ();
+        }
+    }
+    free (entries);
+    free (entryData);
+    free (buckets);
+    entries = NULL;
+    entryData = NULL;
+    buckets = NULL;
+    entryCount = 0;
+    enabled = 0;
+}
+
+int
+isJournalEnabled ()
+{
+    return enabled;
+}
+
+void
+journalWriteBlock (uint32_t blockNum, const char* buffer)
+{
+    assert (enabled);
+    uint32_t index = findEntry (blockNum);
+    int inRunning = (index != NO_ENTRY && entries[index].sequence == nextSequence);
+    if (!inRunning && runningCount >= (committing ? maxTransactionBlocks : maxTransactionBlocks - reserved))
+    {
+        // The running transaction is full, so this update starts the next one.
+        assert (!committing);
+        journalCommit ();
+        index = findEntry (blockNum);
+    }
+    if (index == NO_ENTRY)
+    {
+        index = addEntry (blockNum);
+    }
+    if (inRunning)
+    {
+        ++stats.updatesAbsorbed;
+    }
+    else
+    {
+        entries[index].sequence = nextSequence;
+        ++runningCount;
+    }
+    memcpy (entryBlock (index), buffer, BLOCK_SIZE);
+}
+
+int
+journalReadBlock (uint32_t blockNum, char* buffer)
+{
+    uint32_t index = findEntry (blockNum);
+    if (index == NO_ENTRY)
+    {
+        return 0;
+    }
+    memcpy (buffer, entryBlock (index), BLOCK_SIZE);
+    return 1;
+}
+
+int
+journalHasBlock (uint32_t blockNum)
+{
+    return findEntry (blockNum) != NO_ENTRY;
+}
+
+void
+journalForget (uint32_t blockNum)
+{
+    if (findEntry (blockNum) == NO_ENTRY)
+    {
+        return;
+    }
+    // Replaying an old copy over the new contents must become impossible, which is
+    //   simplest to guarantee by emptying the journal before the block is reused.
+    journalCommit ();
+    if (entryCount > 0)
+    {
+        checkpoint ();
+    }
+}
+
+void
+journalCommit ()
+{
+    if (!enabled)
+    {
+        return;
+    }
+    committing = 1;
+    journalWillCommit ();
+    committing = 0;
+    if (runningCount == 0)
+    {
+        return;
+    }
+
+    uint32_t count = runningCount;
+    char* transaction = calloc (count + 2, BLOCK_SIZE);
+    if (transaction == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory to commit a transaction\n");
+        exit (EXIT_FAILURE);
+    }
+    struct journalDescriptor* descriptor = (struct journalDescriptor*)transaction;
+    strncpy (descriptor->magic, JOURNAL_DESCRIPTOR_MAGIC, sizeof (descriptor->magic));
+    descriptor->sequence = nextSequence;
+    descriptor->count = count;
+    uint32_t position = 0;
+    for (uint32_t index = 0; index < entryCount; ++index)
+    {
+        if (entries[index].sequence == nextSequence)
+        {
+            descriptor->blockNumbers[position] = entries[index].blockNum;
+            memcpy (transaction + (size_t)(position + 1) * BLOCK_SIZE, entryBlock (index), BLOCK_SIZE);
+            ++position;
+        }
+    }
+    assert (position == count);
+    struct journalCommit* commit = (struct journalCommit*)(transaction + (size_t)(count + 1) * BLOCK_SIZE);
+    strncpy (commit->magic, JOURNAL_COMMIT_MAGIC, sizeof (commit->magic));
+    commit->sequence = nextSequence;
+    commit->checksum = checksum (transaction, (size_t)(count + 1) * BLOCK_SIZE);
+
+    assert (logOffset + count + 2 <= journalLength);
+    writeBlocksToDisk (journalStart + logOffset, count + 2, transaction);
+    free (transaction);
+
+    ++stats.commits;
+    stats.blocksLogged += count;
+    logOffset += count + 2;
+    ++nextSequence;
+    runningCount = 0;
+
+    // Checkpoint lazily: only once the journal is more than half full.
+    if (logOffset > journalLength / 2)
+    {
+        checkpoint ();
+    }
+}
@@ -0,0 +1,156 @@
+// File: mujournal.h
+// Author: Matt Shenk
+// Interface of the write-ahead metadata journal of MUFS.
+// Metadata blocks (inode blocks, free map blocks, directory blocks and indirect extent
+//   blocks) are gathered into transactions, each of which is committed to the journal
+//   area with one sequential write and only later checkpointed to its home location.
+// Part of munix lab in CSCI380.
+
+#ifndef MUJOURNAL_H
+#define MUJOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "mujnl1"
+#define JOURNAL_DESCRIPTOR_MAGIC "mujdesc"
+#define JOURNAL_COMMIT_MAGIC "mujcmt"
+#define DEFAULT_JOURNAL_BLOCKS 64
+#define MIN_JOURNAL_BLOCKS 16
+
+// The first block of the journal area.
+struct journalHeader
+{
+    // JOURNAL_MAGIC.
+    char magic[8];
+    // The sequence number of the first transaction that has not been checkpointed.
+    // Transactions are found right after this block with consecutive sequence numbers.
+    uint64_t firstSequence;
+};
+
+// The block that starts a transaction in the journal area.
+// It is followed by one copy of each block that it lists, then a commit block.
+struct journalDescriptor
+{
+    // JOURNAL_DESCRIPTOR_MAGIC.
+    char magic[8];
+    // The sequence number of the transaction.
+    uint64_t sequence;
+    // The number of blocks in the transaction.
+    uint32_t count;
+    // Where each of the blocks belongs (count entries, filling the rest of the block).
+    uint32_t blockNumbers[];
+};
+
+// The block that ends a transaction.  A transaction without a valid one is ignored.
+struct journalCommit
+{
+    // JOURNAL_COMMIT_MAGIC.
+    char magic[8];
+    // The sequence number of the transaction.
+    uint64_t sequence;
+    // A checksum of the descriptor and every block copy in the transaction.
+    uint32_t checksum;
+};
+
+// Counters describing the work the journal has done.
+struct journalStats
+{
+    // The number of transactions committed.
+    uint64_t commits;
+    // The number of block copies written to the journal area.
+    uint64_t blocksLogged;
+    // The number of metadata block updates absorbed by a block already in a transaction.
+    uint64_t updatesAbsorbed;
+    // The number of times the journal was emptied by writing its blocks home.
+    uint64_t checkpoints;
+    // The number of blocks written home by checkpoints.
+    uint64_t blocksCheckpointed;
+    // The number of transactions replayed by setup after a crash.
+    uint64_t transactionsReplayed;
+};
+
+
+// Chooses whether the next setup uses the journal of an image that has one.
+// Even when it is disabled, committed transactions left by a crash are replayed.
+void
+configureJournal (int enabled);
+
+
+// Copies the current journal counters into stats.
+void
+getJournalStats (struct journalStats* stats);
+
+
+// Sets all of the journal counters back to zero.
+void
+resetJournalStats ();
+
+
+// Fills in the header of an empty journal.  Used by mkdisk.
+void
+formatJournalHeader (struct journalHeader* header);
+
+
+//// Used by mufs.c only ///////////////////////////////////////
+
+
+// Replays any committed transactions in a journal area and, if the journal is
+//   enabled, prepares to log into it.
+// Params:
+//   firstBlock - The first block of the journal area.
+//   blockCount - The number of blocks in the journal area (0 if the image has none).
+//   reservedBlocks - How many blocks of every transaction to keep free for journalWillCommit.
+void
+openJournal (uint32_t firstBlock, uint32_t blockCount, uint32_t reservedBlocks);
+
+
+// Commits and checkpoints everything, leaving the journal empty, and releases it.
+void
+closeJournal ();
+
+
+// Returns 1 if metadata writes are going through the journal, 0 otherwise.
+int
+isJournalEnabled ();
+
+
+// Adds the new contents of a metadata block to the running transaction.
+void
+journalWriteBlock (uint32_t blockNum, const char* buffer);
+
+
+// Copies the newest journaled contents of a block into buffer, if there are any.
+// Returns 1 if the block is in the journal, 0 (leaving buffer alone) otherwise.
+int
+journalReadBlock (uint32_t blockNum, char* buffer);
+
+
+// Returns 1 if a block has journaled contents that are newer than the disk, 0 otherwise.
+int
+journalHasBlock (uint32_t blockNum);
+
+
+// Makes sure that the journal will never write a block home again, because the
+//   block is about to be overwritten with file data.
+void
+journalForget (uint32_t blockNum);
+
+
+// Writes the running transaction (if it has any blocks) to the journal area.
+void
+journalCommit ();
+
+
+// The functions the journal uses to reach the disk.  Provided by mufs.c.
+void
+readBlocksFromDisk (uint32_t firstBlock, uint32_t count, char* buffer);
+
+void
+writeBlocksToDisk (uint32_t firstBlock, uint32_t count, const char* buffer);
+
+// Called just before a transaction is committed, so that mufs can add any metadata
+//   that it has been holding back (the free block map and the block share table) to it.
+void
+journalWillCommit ();
+
+#endif//MUJOURNAL_H
@@ -6,9 +6,17 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "munix.h"
 #include "mufs.h"
+#include "mufile.h"
+#include "mudcache.h"
+#include "muicache.h"
+#include "mudindex.h"
+#include "mucompress.h"
+#include "muhash.h"
 #include "muusers.h"
 #include "muerrno.h"
 
@@ -20,69 +28,332 @@
 // In real UNIX that would be split across three different structures.
 struct openFile
 {
-    // The inode of the file.
-    struct iNode inode;
-    // The block (if any) that is currently buffered.
-    char currentData[BLOCK_SIZE];
-    // The index (into the inode's direct blocks array) of which block is currently
-    //   buffered, or -1 if none are buffered.
+    // The inode of the file, held in the inode cache, so that it is shared with every
+    //   other file table entry (in any process) that refers to the file.
+    struct iNode* inode;
+    // The block (if any) that is currently buffered, BLOCK_SIZE bytes allocated by muinit.
+    char* currentData;
+    // The index (within the file) of which block is currently buffered, or -1 if
+    //   none are buffered.
     uint32_t currentBlockIndex;
     // The location in the file where the next byte would be read / written.
     uint32_t filePointer;
     // The flags used when this file was opened.
     int flags;
-    // Whether or not the buffered block (if any) has been modified.
+    // Whether or not the buffered block (if any) has been modified.  Only ever set during a
+    //   call, since each call that changes the file's data writes the block back before it
+    //   returns (see publishFileData).
     int dirty;
+    // Whether the buffered block is in a hole, so that it needs a data block of its own
+    //   before it can be written.
+    int currentHole;
+    // Whether the buffered block's data block is shared with other blocks (see VERSION24 in
+    //   mufs.h), so that it needs a data block of its own before it can be written.
+    int currentShared;
     // The number of this file's inode, or -1 to indicate no open file.
     int iNodeNumber;
+    // The block index that a sequential reader would want next.
+    uint32_t nextSequentialBlock;
+    // How many blocks to prefetch beyond the current read, which grows while reads stay sequential.
+    uint32_t readAheadBlocks;
+    // The block index just past the blocks that have already been prefetched.
+    uint32_t readAheadEnd;
+    // For a compressed file, the unit expanded into unitData, or NO_BLOCK if none is.
+    // unitData is allocated the first time it is needed, with room for
+    //   COMPRESSION_UNIT_BLOCKS blocks of the unit followed by as many of its stored form.
+    char* unitData;
+    uint32_t currentUnit;
+    // The values of the inode lock's mapChanges and dataChanges when unitData and the
+    //   buffered block were known to be current.
+    uint64_t seenMapChanges;
+    uint64_t seenDataChanges;
+    // Counters describing how this file has been used since it was opened.
+    struct muFileStats stats;
+};
+
+// The number of files that one process may have open at once.
+#define FILE_TABLE_SIZE 10
+
+// Everything that belongs to one simulated process.
+struct muContext
+{
+    // The table of files that the process has open.
+    // Indexes into this array are used as file descriptors.
+    struct openFile files[FILE_TABLE_SIZE];
+    // The user number of the currently-logged in user.
+    int activeUserNumber;
+    // The group number of the currently-logged in group.
+    int activeGroupNumber;
+    // The inode of the processe's current working directory, held in the inode cache, or
+    //   NULL before muinit.
+    struct iNode* workingDirINode;
+    // The number of the inode of the process's current working directory.
+    uint32_t workingDirINodeNumber;
+};
+
+// The lock on one inode, shared by every process.
+struct iNodeLock
+{
+    // Held for reading by muread and for writing by anything that changes the file's data.
+    pthread_rwlock_t lock;
+    // The number of file table entries (in any process) that refer to the inode.
+    uint32_t openCount;
+    // A run of blocks set aside for the file's next blocks, starting at reservedStart, which
+    //   are stored on disk as available until the file takes them (see markBlocksReserved).
+    // Changed with lock held for writing, and given back when openCount drops to 0.
+    uint32_t reservedStart;
+    uint32_t reservedCount;
+    // Counts the units stored into a compressed file, the shared blocks of a file given
+    //   blocks of their own, and the blocks of a file that mucopy replaced, which move its
+    //   data between blocks, so that other file table entries know that the unit or block
+    //   they have buffered may be stale.
+    // Changed with lock held for writing.
+    uint64_t mapChanges;
+    // Counts the calls that changed the file's data, so that other file table entries know
+    //   that the block they have buffered may be stale.
+    // Changed with lock held for writing.
+    uint64_t dataChanges;
+};
+
+// A directory that paths have recently been walked through, along with the permissions
+//   that the last process to walk through it had on it.
+struct cachedDirectory
+{
+    // Whether or not this slot holds a directory.
+    int valid;
+    // The number of the directory's inode.
+    uint32_t iNodeNumber;
+    // The directory's inode, held in the inode cache.
+    struct iNode* node;
+    // The user and group whose permissions are in permissions, or -1 if none are.
+    int permissionUser;
+    int permissionGroup;
+    // The bits returned by applicablePermissions for that user and group.
+    int permissions;
+};
+
+// Where a path leads once every component but its last has been walked.
+struct pathLookup
+{
+    // The number of the directory that should contain the last component.
+    uint32_t dirINodeNumber;
+    // The inode of that directory, which its caller, the working directory or the
+    //   directory cache holds (so it stays valid until the next lookUpDirectory).
+    struct iNode* dirNode;
+    // The last component of the path.
+    char name[MAX_NAME_LENGTH];
 };
 
 
 //// Constants that are only relevant to this file /////////////
 
-#define FILE_TABLE_SIZE 10
+#define NO_BLOCK ((uint32_t)-1)
+#define ROOT_INODE_NUMBER 0
+#define MAX_READAHEAD_BLOCKS 32
+#define DIR_CACHE_SIZE 64
+#define DEFAULT_RESERVE_BLOCKS 64
+#define ZERO_FILL_BLOCKS 32
+#define RELOCATE_CHUNK_BLOCKS 64
+#define DEDUP_BATCH_BLOCKS 64
+#define COPY_CHUNK_BLOCKS 64
+#define DEDUP_INDEX_BLOCKS (1u << 20)
+#define RAW_UNIT_EXTENTS (MAX_EXTENTS / 4)
 
 
 //// Global variables //////////////////////////////////////////
 
 
-// The table of files that the process has open.
-// Indexes into this array are used as file descriptors.
-struct openFile files[FILE_TABLE_SIZE];
+// The process that threads act as until they choose another with muusecontext.
+struct muContext defaultContext;
+
+// The process that the calling thread is acting as.
+__thread struct muContext* process = &defaultContext;
 
-// The user number of the currently-logged in user.
-int activeUserNumber;
+// Held by every call that looks up, adds or removes directory entries, since the directory
+//   entry cache, the inode table and the open counts are shared by all processes.
+pthread_mutex_t namespaceLock = PTHREAD_MUTEX_INITIALIZER;
 
-// The group number of the currently-logged in group.
-int activeGroupNumber;
+// One lock for each inode of the filesystem, allocated by muinit.
+struct iNodeLock* iNodeLocks = NULL;
+uint32_t iNodeLockCount = 0;
 
-// The inode of the processe's current working directory.
-struct iNode workingDirINode;
+// The directories that paths have recently been walked through, indexed by inode number
+//   modulo DIR_CACHE_SIZE.  Protected by namespaceLock.
+struct cachedDirectory dirCache[DIR_CACHE_SIZE];
+
+// How many blocks beyond what it needs a growing file sets aside for its next blocks.
+uint32_t reserveBlocks = DEFAULT_RESERVE_BLOCKS;
+
+// A block of zeros, which reads of holes are served from without touching the disk.
+const char zeroPage[MAX_BLOCK_SIZE] = { 0 };
+
+// Whether whole blocks appended to files share a block that already holds the same data
+//   instead of being written again, as set by mudedup.
+int dedupWrites = 0;
+
+// The blocks recently written to files, by hash, which dedupWrites finds duplicates in.
+// Allocated the first time it is needed.  Protected by dedupLock.
+struct blockIndex dedupIndex = { NULL, 0, 0 };
+pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;
 
 
 //// Helper functions //////////////////////////////////////////
 
 
+// Reads every block of a directory at once, with a request in flight for each
+//   disk-contiguous run of it.
+// Params:
+//   dirNode - The inode of the directory.
+// Returns:
+//   The directory's entries, in a buffer that the caller must free.
+struct dirEntry*
+readDirectory (const struct iNode* dirNode)
+{
+    uint32_t mapped = (dirNode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char* blocks = malloc ((size_t)(mapped > 0 ? mapped : 1) * BLOCK_SIZE);
+    if (blocks == NULL)
+    {
+        fprintf (stderr, "Could not allocate a buffer for a directory of %u blocks\n", mapped);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t blockIndex = 0;
+    while (blockIndex < mapped)
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (dirNode, blockIndex, &runLength);
+        uint32_t count = (runLength < mapped - blockIndex ? runLength : mapped - blockIndex);
+        readDataBlocksAsync (blockNum, count, blocks + (size_t)blockIndex * BLOCK_SIZE);
+        blockIndex += count;
+    }
+    waitDataBlocks ();
+    return (struct dirEntry*)blocks;
+}
+
+// Reads every entry of a directory into the directory entry cache.
+// Params:
+//   dirINodeNumber - The number of the directory's inode.
+//   dirNode - The inode of the directory.
+void
+indexDirectory (uint32_t dirINodeNumber, const struct iNode* dirNode)
+{
+    dcacheBeginDirectory (dirINodeNumber);
+    struct dirEntry* entries = readDirectory (dirNode);
+    uint32_t entryCount = dirNode->size / DIR_ENTRY_LENGTH;
+    for (uint32_t entryIndex = firstEntryIndex (dirNode); entryIndex < entryCount; ++entryIndex)
+    {
+        struct dirEntry* entry = &entries[entryIndex];
+        // An entry with an empty name is a hole left behind by muunlink.
+        if (entry->name[0] != '\0')
+        {
+            dcacheAdd (dirINodeNumber, entry->name, entry->iNodeNumber);
+        }
+    }
+    free (entries);
+}
+
+// Finds the leaf of a directory's hash index that a hash falls into.
+// Params:
+//   dirNode - The inode of the directory, whose mode includes MU_S_INDEXED.
+//   hash - The hash to find.
+//   root - Receives the root of the index.
+//   node - Receives the node between the root and the leaf, if the index has a depth of 1.
+//   nodeBlock - Receives the block of the node, or 0 if there is none.
+// Returns:
+//   The block of the leaf.
+uint32_t
+findIndexLeaf (const struct iNode* dirNode, uint32_t hash, struct dirIndexRoot* root,
+               struct dirIndexRoot* node, uint32_t* nodeBlock)
+{
+    readDataBlock (getFileBlock (dirNode, 0, NULL), (char*)root);
+    *nodeBlock = 0;
+    if (root->depth == 0)
+    {
+        return root->ranges[findIndexRange (root, hash)].block;
+    }
+    *nodeBlock = root->ranges[findIndexRange (root, hash)].block;
+    readDataBlock (*nodeBlock, (char*)node);
+    return node->ranges[findIndexRange (node, hash)].block;
+}
+
+// Looks a name up in the hash index of a directory, which reads the root, one leaf, and
+//   in an index of depth 1 one node.
+// Params:
+//   dirNode - The inode of the directory, whose mode includes MU_S_INDEXED.
+//   name - The name to find.
+//   found - Receives the name's record if it is found.
+// Returns:
+//   0 if the name was found, -1 if it was not.
+int
+lookUpIndexedEntry (const struct iNode* dirNode, const char* name, struct dirIndexRecord* found)
+{
+    uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t nodeBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t leafBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+    struct dirIndexRoot* node = (struct dirIndexRoot*)nodeBuffer;
+    struct dirIndexLeaf* leaf = (struct dirIndexLeaf*)leafBuffer;
+    uint32_t hash = hashEntryName (name);
+    uint32_t nodeBlock;
+    readDataBlock (findIndexLeaf (dirNode, hash, root, node, &nodeBlock), (char*)leaf);
+    int position = findIndexRecord (leaf, hash, name);
+    if (position < 0)
+    {
+        return -1;
+    }
+    *found = leaf->records[position];
+    return 0;
+}
+
 // Finds a file in a directory.
 // Params:
 //   name - The name of the file we are searching for.
+//   dirINodeNumber - The number of the inode of the directory in which we are searching.
 //   dirNode - The inode of the directory in which we are searching.
 // Returns:
 //   The inode number of the file, or -1 if the file does not exist.
 int
-findFile (const char* name, const struct iNode* dirNode)
+findFile (const char* name, uint32_t dirINodeNumber, const struct iNode* dirNode)
 {
-    //TODO
-    char * file[1024];
-    for(int x = 0; x < 12; x++){
-        readDataBlock(dirNode->directBlocks[x], file);
-        if(strcmp(file->dirEntry.name, name) == 0)
+    int result = dcacheLookup (dirINodeNumber, name);
+    if (result == DCACHE_NOT_CACHED)
+    {
+        // An indexed directory is too big to be worth reading in whole for one name, so
+        //   only the names looked up in it are cached, whether they exist or not.
+        if (dirNode->mode & MU_S_INDEXED)
         {
-            return x;
+            dcacheBeginPartialDirectory (dirINodeNumber);
+            struct dirIndexRecord record;
+            if (lookUpIndexedEntry (dirNode, name, &record) < 0)
+            {
+                dcacheAddAbsent (dirINodeNumber, name);
+                return -1;
+            }
+            dcacheAdd (dirINodeNumber, name, record.entry.iNodeNumber);
+            return record.entry.iNodeNumber;
         }
+        indexDirectory (dirINodeNumber, dirNode);
+        result = dcacheLookup (dirINodeNumber, name);
     }
-    
-    return -1;
+    return (result == DCACHE_NOT_FOUND ? -1 : result);
+}
+
+// Determines which three permission bits of a file apply to the process.
+// Params:
+//   node The inode of the file.
+// Returns:
+//   The relevant read / write / execute bits, shifted down to MU_S_IRWXO's position.
+int
+applicablePermissions (const struct iNode* node)
+{
+    if (node->userOwner == process->activeUserNumber)
+    {
+        return (node->mode & MU_S_IRWXU) >> 6;
+    }
+    else if (node->groupOwner == process->activeGroupNumber || isUserInGroup (process->activeUserNumber, node->groupOwner))
+    {
+        return (node->mode & MU_S_IRWXG) >> 3;
+    }
+    return node->mode & MU_S_IRWXO;
 }
 
 // Determines whether or not the process can read a file.
@@ -93,12 +364,7 @@ findFile (const char* name, const struct iNode* dirNode)
 int
 canRead (const struct iNode* node)
 {
-    if(node->userOwner = activeUserNumber)
-        return 1;
-    else if(node->groupOwner = activeGroupNumber)
-        return 1;
-
-    return 0;
+    return (applicablePermissions (node) & MU_S_IROTH) != 0;
 }
 
 // Determines whether or not the process can write a file.
@@ -109,14 +375,7 @@ canRead (const struct iNode* node)
 int
 canWrite (const struct iNode* node)
 {
-    if(node->userOwner = activeUserNumber)
-        return 1;
-    else if(node->groupOwner = activeGroupNumber)
-        return 1;
-
-    return 0;
-
-    return 0;
+    return (applicablePermissions (node) & MU_S_IWOTH) != 0;
 }
 
 // Determines whether or not the process can execute a file.
@@ -126,248 +385,3294 @@ canWrite (const struct iNode* node)
 //   1 if the process has execute permission, 0 otherwise.
 int canExecute (const struct iNode* node)
 {
-    if(node->userOwner = activeUserNumber)
-        return 1;
-    else if(node->groupOwner = activeGroupNumber)
-        return 1;
+    return (applicablePermissions (node) & MU_S_IXOTH) != 0;
+}
 
-    return 0;
+// Finds a directory's inode in the directory cache, taking it from the inode cache (and
+//   evicting whatever shared its slot) if it is not there.  Must be called with
+//   namespaceLock held.
+// Params:
+//   iNodeNumber - The number of the inode.
+// Returns:
+//   The cache entry, which stays valid until the next call, or NULL and sets muerrno to
+//   MU_E_NOT_DIR if the inode is not a directory.
+struct cachedDirectory*
+lookUpDirectory (uint32_t iNodeNumber)
+{
+    struct cachedDirectory* entry = &dirCache[iNodeNumber % DIR_CACHE_SIZE];
+    if (entry->valid && entry->iNodeNumber == iNodeNumber)
+    {
+        return entry;
+    }
+    struct iNode* node = icacheGet (iNodeNumber);
+    if ((node->mode & MU_S_DIREC) == 0)
+    {
+        icacheRelease (node);
+        muerrno = MU_E_NOT_DIR;
+        return NULL;
+    }
+    if (entry->valid)
+    {
+        icacheRelease (entry->node);
+    }
+    entry->valid = 1;
+    entry->iNodeNumber = iNodeNumber;
+    entry->node = node;
+    entry->permissionUser = -1;
+    entry->permissionGroup = -1;
+    return entry;
 }
 
-// Searches for a free block, marking it as used.
+// Determines whether or not the process can search a cached directory, remembering the
+//   answer for the next walk by the same user and group.
+// Params:
+//   entry - The directory's cache entry.
 // Returns:
-//   The number of the previously-free block if one is found, or -1 if none are found.
+//   1 if the process has execute permission, 0 otherwise.
 int
-findAndMarkFreeBlock ()
+canSearch (struct cachedDirectory* entry)
 {
-    // TODO
-    struct freeBlockMap buffer[BLOCK_SIZE];
-    readDataBlock(buffer);
-    return -1;
+    if (entry->permissionUser != process->activeUserNumber
+        || entry->permissionGroup != process->activeGroupNumber)
+    {
+        entry->permissions = applicablePermissions (entry->node);
+        entry->permissionUser = process->activeUserNumber;
+        entry->permissionGroup = process->activeGroupNumber;
+    }
+    return (entry->permissions & MU_S_IXOTH) != 0;
 }
 
-//// Library functions /////////////////////////////////////////
-
+// Walks every component of a path but the last.  Empty components (from repeated or
+//   trailing '/' characters) are ignored, and a path made only of '/' characters names
+//   the root directory's "." entry.  Must be called with namespaceLock held.
+// Params:
+//   path - The path, which starts at the root if it begins with '/'.
+//   startINodeNumber - The number of the directory that a relative path starts from.
+//   startNode - The inode of that directory.
+//   result - Receives the directory that the last component should be looked up in.
+// Returns:
+//   0 on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_BAD_NAME if the path is blank or has a component too long for a directory entry.
+//   MU_E_DOES_NOT_EXIST if a component before the last does not exist.
+//   MU_E_NOT_DIR if a component before the last is not a directory.
+//   MU_E_PERMISSION if the process cannot execute a directory that the path passes into.
 int
-muinit (const char* userName, const char* groupName)
+walkPath (const char* path, uint32_t startINodeNumber, struct iNode* startNode, struct pathLookup* result)
 {
-    // TODO
-
-    // Look up user and group numbers, check for existence and membership.
-    if(lookUpUserNumber(userName) == -1){
-        muerrno = MU_E_NO_SUCH_USER;
-        return -1;
-    }
-    if(lookUpGroupNumber(groupName) == -1){
-        muerrno = MU_E_NO_SUCH_GROUP;
-        return -1;
-    }
-    if(isUserInGroup(lookUpUserNumber(userName), lookUpGroupNumber(groupName)) == 0){
-        muerrno = MU_E_NOT_MEMBER;
+    if (path == NULL || path[0] == '\0')
+    {
+        muerrno = MU_E_BAD_NAME;
         return -1;
     }
-    // Set user and group number.
-    activeUserNumber = lookUpUserNumber(userName);
-    activeGroupNumber = lookUpGroupNumber(groupName);
-    
-    // Set each file table entry to be for inode number -1.
-    for(int x = 0; i < FILE_TABLE_SIZE; i++){
-        files[x].iNodeNumber = -1;
+    uint32_t dirINodeNumber = startINodeNumber;
+    struct iNode* dirNode = startNode;
+    if (path[0] == '/')
+    {
+        struct cachedDirectory* root = lookUpDirectory (ROOT_INODE_NUMBER);
+        assert (root != NULL);
+        dirINodeNumber = ROOT_INODE_NUMBER;
+        dirNode = root->node;
     }
 
-    workingDirInode = files[0].inode;
+    strcpy (result->name, ".");
+    const char* component = path;
+    while (1)
+    {
+        while (*component == '/')
+        {
+            ++component;
+        }
+        if (*component == '\0')
+        {
+            break;
+        }
+        size_t length = strcspn (component, "/");
+        if (length >= MAX_NAME_LENGTH)
+        {
+            muerrno = MU_E_BAD_NAME;
+            return -1;
+        }
+        memcpy (result->name, component, length);
+        result->name[length] = '\0';
+        const char* next = component + length;
+        while (*next == '/')
+        {
+            ++next;
+        }
+        if (*next == '\0')
+        {
+            break;
+        }
+
+        int iNodeNumber = findFile (result->name, dirINodeNumber, dirNode);
+        if (iNodeNumber < 0)
+        {
+            muerrno = MU_E_DOES_NOT_EXIST;
+            return -1;
+        }
+        struct cachedDirectory* entry = lookUpDirectory (iNodeNumber);
+        if (entry == NULL)
+        {
+            return -1;
+        }
+        if (!canSearch (entry))
+        {
+            muerrno = MU_E_PERMISSION;
+            return -1;
+        }
+        dirINodeNumber = iNodeNumber;
+        dirNode = entry->node;
+        component = next;
+    }
 
+    result->dirINodeNumber = dirINodeNumber;
+    result->dirNode = dirNode;
     return 0;
 }
 
-int
-mucd (const char* dirName)
+// Finds the directory that a path names and checks that the process may search it.
+//   Must be called with namespaceLock held.
+// Params:
+//   path - The path of the directory.
+//   startINodeNumber - The number of the directory that a relative path starts from.
+//   startNode - The inode of that directory.
+// Returns:
+//   The directory's cache entry, or NULL and sets muerrno as walkPath does, or to
+//   MU_E_DOES_NOT_EXIST, MU_E_NOT_DIR or MU_E_PERMISSION for the last component.
+struct cachedDirectory*
+findDirectory (const char* path, uint32_t startINodeNumber, struct iNode* startNode)
 {
-    // TODO
-
-    // Check for valid directory name.
-    if(dirName.strstr("/") == NULL || strcmp(dirName, "") == 0){
-        muerrno = MU_E_BAD_NAME;
-        return 0;
-    }
-    // Find iNode associated with name / check that it exists.
-    bool found = false;
-    char * file[1024];
-    int nodeNum;
-    for(int x = 0; x < 12; x++){
-        readDataBlock(dirNode->directBlocks[x], file);
-        if(strcmp(file->dirEntry.name, dirName) == 0)
-        {
-            nodeNum = x;
-            found = true;
-        }
+    struct pathLookup lookup;
+    if (walkPath (path, startINodeNumber, startNode, &lookup) < 0)
+    {
+        return NULL;
     }
-    if(found == false){
+    int iNodeNumber = findFile (lookup.name, lookup.dirINodeNumber, lookup.dirNode);
+    if (iNodeNumber < 0)
+    {
         muerrno = MU_E_DOES_NOT_EXIST;
-        return 0;
+        return NULL;
     }
-    
-    // Read inode associated with directory.
-    struct iNode nodeBuffer[INODE_SIZE];
-    readInode(nodeNum, &nodeBuffer);
-
-    // Check that file type is directory.
-    
- 
-    // Check that directory can be executed.
-    if(canRead(nodeBuffer) == 0){
+    struct cachedDirectory* entry = lookUpDirectory (iNodeNumber);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    if (!canSearch (entry))
+    {
         muerrno = MU_E_PERMISSION;
-        return 0;
+        return NULL;
     }
+    return entry;
+}
 
-    // Overwrite working directory inode with this directory's inode.
-    workingDirINode = dirINode;
-
-    return 0;
+// Searches for a free block, marking it as used.
+// Returns:
+//   The number of the previously-free block if one is found, or -1 if none are found.
+int
+findAndMarkFreeBlock ()
+{
+    return allocateBlock ();
 }
 
+// Searches for an available inode.
+// Returns:
+//   The number of an available inode, or -1 if all are in use.
 int
-muopen (const char* fileName, int flags)
+findFreeINode ()
 {
-    // TODO
-    int fileSpot = -1;
-    // Find an unused location in the file descriptor table.
-    for(int x = 0; x < FILE_TABLE_SIZE; i++)
+    // Freeing or taking an inode is always written through the inode cache at once, so
+    //   the inodes on disk can be scanned without filling the cache with them.
+    struct iNode node;
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
     {
-        if(openFile[x] == -1)
+        readINode (iNodeNumber, &node);
+        if (node.mode & MU_S_AVAIL)
         {
-            fileSpot = x;
-            break;
+            return iNodeNumber;
         }
     }
-
-    // Check for existence of unused location in file descriptor table.
-    if(fileSpot < 0){
-        muerrno = MU_E_FULL_TABLE;
-        return;
-    }
-
-    // Check for valid file name.
-    if(fileName.strstr("/") == NULL || strcmp(fileName, "") == 0){
-        muerrno = MU_E_BAD_NAME;
-        return -1;
-    }
-
-    // Find inode associated with name / check that it exists.
-    
- 
-
-    // Read file's inode.
-
-    // Check that file type is regular file.
-
-    // Check for read permission if we are requesting it.
-    if(canRead())
-    // Check for write permission if we are requesting it.
-
-    // Copy iNode into chosen spot in file descriptor table, set it up for appropriate
-    //   permissions with no data block loaded and file pointer at 0.
-
     return -1;
 }
 
+// Finds an unused location in the file descriptor table.
+// Returns:
+//   The index of the location, or -1 if the table is full.
 int
-muclose (int fd)
+findFreeDescriptor ()
 {
-    // TODO
-    bool found = false;
-    int nodeIndex = 0;
-    // Check for valid file descriptor.
-    for(int x = 0; x < FILE_TABLE_SIZE; x++){
-        if(fd == x){
-            break;
+    for (int fd = 0; fd < FILE_TABLE_SIZE; ++fd)
+    {
+        if (process->files[fd].iNodeNumber == -1)
+        {
+            return fd;
         }
     }
-    if(found == false){
-        muerrno = MU_E_INVALID_FD;
-        return -1;
-    }
-
-    // Write block to disk if dirty.
-    char buff[BLOCK_SIZE];
-    writeDataBlock(fd, buff);
-
-    // Mark location's inode as available.
-    openFile[nodeIndex = -1;]
-
-    return 0;
+    return -1;
 }
 
+// Determines whether or not a file descriptor refers to an open file.
+// Returns:
+//   1 if it does, 0 otherwise.
 int
-muread (int fd, char* buffer, int n)
+isValidDescriptor (int fd)
 {
-    // TODO
-    // Check for valid file descriptor.
-    bool found = false;
-    for(int x = 0; x < FILE_TABLE_SIZE; x++){
-        if(fd == openFile[x]){
-            found == true;
-            break;
-        }
-    }
-    if(found == false){
-        muerrno = MU_E_INVALID_FD;
-        return -1;
-    }
-
-    // Check that file is open for reading.
-
-    // Read until n bytes have been read or end of file reached.
-
-    while (0 /*something*/)
-    {
-        // If wrong block loaded, unload it and write if dirty.
-
-        // If no block loaded, load it.
-
-        // Copy one byte.
-
-    }
-
-    return -1;
+    return fd >= 0 && fd < FILE_TABLE_SIZE && process->files[fd].iNodeNumber != -1;
 }
 
+// Determines whether or not any file descriptor (in any process) refers to an inode.
+// Returns:
+//   1 if it does, 0 otherwise.
 int
-muwrite (int fd, const char* buffer, int n)
+isOpen (uint32_t iNodeNumber)
 {
-    // TODO
+    return iNodeLocks[iNodeNumber].openCount > 0;
+}
 
-    // Check for valid file descriptor.
+// Takes namespaceLock.  A working directory's inode is shared through the inode cache, so
+//   any change that another process has made to it is already visible.
+void
+lockNamespace ()
+{
+    pthread_mutex_lock (&namespaceLock);
+}
 
-    // Check that file is open for writing.
+// Releases namespaceLock.
+void
+unlockNamespace ()
+{
+    pthread_mutex_unlock (&namespaceLock);
+}
 
-    // Write until n bytes have been written or file is maximum length.
-    int readIn
-    while (0 /*something*/)
+// Makes sure there is one lock for each inode of the loaded filesystem.
+// Must be called with namespaceLock held, and while no process has any file open.
+void
+prepareINodeLocks ()
+{
+    if (iNodeLocks != NULL && iNodeLockCount == INODE_COUNT)
     {
-        // If wrong block loaded, unload it and write if dirty.
-
-        // If no block loaded, load it.
-        if (0 /*something*/)
-        {
-            // If block does not yet exist, allocate one for it.
-
-            // Load the block
-        }
-        // Copy one byte, increasing size if necessary.
-
+        return;
     }
-    // Write inode in case file size / direct blocks changed.
-
-    return -1;
+    for (uint32_t iNodeNumber = 0; iNodeNumber < iNodeLockCount; ++iNodeNumber)
+    {
+        pthread_rwlock_destroy (&iNodeLocks[iNodeNumber].lock);
+    }
+    free (iNodeLocks);
+    iNodeLocks = malloc ((size_t)INODE_COUNT * sizeof (struct iNodeLock));
+    if (iNodeLocks == NULL)
+    {
+        fprintf (stderr, "Could not allocate locks for %u inodes\n", INODE_COUNT);
+        exit (EXIT_FAILURE);
+    }
+    for (uint32_t iNodeNumber = 0; iNodeNumber < INODE_COUNT; ++iNodeNumber)
+    {
+        pthread_rwlock_init (&iNodeLocks[iNodeNumber].lock, NULL);
+        iNodeLocks[iNodeNumber].openCount = 0;
+        iNodeLocks[iNodeNumber].reservedCount = 0;
+        iNodeLocks[iNodeNumber].mapChanges = 0;
+        iNodeLocks[iNodeNumber].dataChanges = 0;
+    }
+    iNodeLockCount = INODE_COUNT;
 }
 
+// Gives back the blocks set aside for a file that no file table entry refers to any more.
+// Must be called with namespaceLock held.
 void
-muls ()
+releaseReservation (uint32_t iNodeNumber)
 {
-    // TODO
-    for(int x = 0; x < FILE_TABLE_SIZE; x++){
-        
+    struct iNodeLock* iNodeLock = &iNodeLocks[iNodeNumber];
+    for (uint32_t offset = 0; offset < iNodeLock->reservedCount; ++offset)
+    {
+        releaseBlock (iNodeLock->reservedStart + offset);
     }
+    iNodeLock->reservedCount = 0;
+}
 
-}
\ No newline at end of file
+// Allocates blocks for a file that is growing, as a run that follows on from its last
+//   block when that is possible.  Rather than allocating only what it needs, the file sets
+//   aside a further reserveBlocks blocks, which its next calls take from first, so that a
+//   file written a little at a time (or beside other growing files) still ends up in one
+//   extent.
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file, which must not be inline.
+//   wanted - The number of blocks the file needs now.
+//   count - Receives the number of blocks allocated, from 1 to wanted.
+// Returns:
+//   The number of the first block allocated, or -1 if the disk is full.
+int
+allocateFileBlocks (struct openFile* file, uint32_t wanted, uint32_t* count)
+{
+    struct iNodeLock* iNodeLock = &iNodeLocks[file->iNodeNumber];
+    if (iNodeLock->reservedCount == 0)
+    {
+        // No more than the file could ever hold, which matters for direct block maps.
+        uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t room = (uint32_t)(((uint64_t)maxFileSize () + BLOCK_SIZE - 1) / BLOCK_SIZE) - mapped;
+        uint32_t target = (reserveBlocks < room - wanted ? wanted + reserveBlocks : room);
+        int firstBlock = -1;
+        uint32_t allocated = 0;
+        if (mapped > 0)
+        {
+            firstBlock = getFileBlock (file->inode, mapped - 1, NULL) + 1;
+            allocated = allocateRunAt (firstBlock, target);
+        }
+        // Otherwise settle for the longest run that can be found, halving the length each time.
+        for (uint32_t length = target; allocated == 0 && length > 0; length /= 2)
+        {
+            firstBlock = allocateRun (length);
+            allocated = (firstBlock >= 0 ? length : 0);
+        }
+        if (allocated == 0)
+        {
+            return -1;
+        }
+        markBlocksReserved (firstBlock, allocated);
+        iNodeLock->reservedStart = firstBlock;
+        iNodeLock->reservedCount = allocated;
+    }
+    *count = (wanted < iNodeLock->reservedCount ? wanted : iNodeLock->reservedCount);
+    int firstBlock = iNodeLock->reservedStart;
+    claimReservedBlocks (firstBlock, *count);
+    iNodeLock->reservedStart += *count;
+    iNodeLock->reservedCount -= *count;
+    return firstBlock;
+}
+
+// Forgets every file that a process has open, without writing any buffered data (or
+//   changes to its inode that have not been written yet).
+// Must be called with namespaceLock held.
+void
+dropOpenFiles (struct muContext* context)
+{
+    for (int fd = 0; fd < FILE_TABLE_SIZE; ++fd)
+    {
+        // A process that has never been through muinit has no buffers and no open files.
+        int iNodeNumber = context->files[fd].iNodeNumber;
+        if (context->files[fd].currentData != NULL && iNodeNumber != -1)
+        {
+            icacheDiscard (context->files[fd].inode);
+            if ((uint32_t)iNodeNumber < iNodeLockCount && --iNodeLocks[iNodeNumber].openCount == 0)
+            {
+                releaseReservation (iNodeNumber);
+            }
+        }
+        context->files[fd].iNodeNumber = -1;
+    }
+}
+
+// Adds a record for a new entry to a directory's hash index, splitting its leaf if full.
+// A root that is full of ranges gets a level of nodes below it, and nodes split as well.
+// Params:
+//   dirNode - The inode of the directory, whose mode includes MU_S_INDEXED.
+//   entryIndex - The position of the entry in the directory.
+//   entry - The entry.
+// Returns:
+//   0 on success, or -1 if the index cannot take the entry (its root and the entry's node
+//   are both full, or there are no free blocks), in which case the index is unchanged.
+int
+indexDirEntry (const struct iNode* dirNode, uint32_t entryIndex, const struct dirEntry* entry)
+{
+    uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t nodeBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t newNodeBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t leafBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t newLeafBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+    struct dirIndexRoot* node = (struct dirIndexRoot*)nodeBuffer;
+    struct dirIndexRoot* newNode = (struct dirIndexRoot*)newNodeBuffer;
+    struct dirIndexLeaf* leaf = (struct dirIndexLeaf*)leafBuffer;
+    struct dirIndexLeaf* newLeaf = (struct dirIndexLeaf*)newLeafBuffer;
+    uint32_t rootBlock = getFileBlock (dirNode, 0, NULL);
+    uint32_t hash = hashEntryName (entry->name);
+    uint32_t nodeBlock;
+    uint32_t leafBlock = findIndexLeaf (dirNode, hash, root, node, &nodeBlock);
+    readDataBlock (leafBlock, (char*)leaf);
+    if (addIndexRecord (leaf, entryIndex, entry) == 0)
+    {
+        writeMetadataBlock (leafBlock, (char*)leaf);
+        return 0;
+    }
+
+    // Everything is worked out in memory first, so that a failure changes nothing on disk.
+    int newLeafBlock = findAndMarkFreeBlock ();
+    int deepenedBlock = -1;
+    int newNodeBlock = -1;
+    struct dirIndexRoot* parent = (nodeBlock == 0 ? root : node);
+    int failed = (newLeafBlock < 0);
+    if (!failed && parent->rangeCount == DIR_INDEX_MAX_RANGES && root->depth == 0)
+    {
+        deepenedBlock = findAndMarkFreeBlock ();
+        failed = (deepenedBlock < 0);
+        if (!failed)
+        {
+            deepenDirIndex (root, node, deepenedBlock);
+            nodeBlock = deepenedBlock;
+            parent = node;
+        }
+    }
+    if (!failed && parent->rangeCount == DIR_INDEX_MAX_RANGES)
+    {
+        uint32_t rootRange = findIndexRange (root, hash);
+        newNodeBlock = findAndMarkFreeBlock ();
+        failed = (newNodeBlock < 0 || splitIndexNode (root, rootRange, node, newNode, newNodeBlock) < 0);
+        if (!failed && findIndexRange (root, hash) != rootRange)
+        {
+            parent = newNode;
+        }
+    }
+    failed = (failed || splitIndexLeaf (parent, findIndexRange (parent, hash), leaf, newLeaf, newLeafBlock) < 0);
+    if (failed)
+    {
+        if (newLeafBlock >= 0) { releaseBlock (newLeafBlock); }
+        if (deepenedBlock >= 0) { releaseBlock (deepenedBlock); }
+        if (newNodeBlock >= 0) { releaseBlock (newNodeBlock); }
+        return -1;
+    }
+
+    // The record belongs in whichever half now covers its hash.
+    if (parent->ranges[findIndexRange (parent, hash)].block == leafBlock)
+    {
+        addIndexRecord (leaf, entryIndex, entry);
+    }
+    else
+    {
+        addIndexRecord (newLeaf, entryIndex, entry);
+    }
+    writeMetadataBlock (newLeafBlock, (char*)newLeaf);
+    writeMetadataBlock (leafBlock, (char*)leaf);
+    if (newNodeBlock >= 0)
+    {
+        writeMetadataBlock (newNodeBlock, (char*)newNode);
+    }
+    if (nodeBlock != 0)
+    {
+        writeMetadataBlock (nodeBlock, (char*)node);
+    }
+    writeMetadataBlock (rootBlock, (char*)root);
+    return 0;
+}
+
+// Throws away the hash index of a directory that has outgrown it.  Its root block becomes
+//   a block of holes, so the directory goes on working as an ordinary one.
+// Params:
+//   dirNode - The inode of the directory, which is only changed in memory.
+void
+dropDirIndex (struct iNode* dirNode)
+{
+    uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t nodeBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+    struct dirIndexRoot* node = (struct dirIndexRoot*)nodeBuffer;
+    uint32_t rootBlock = getFileBlock (dirNode, 0, NULL);
+    readDataBlock (rootBlock, (char*)root);
+    for (uint32_t range = 0; range < root->rangeCount; ++range)
+    {
+        if (root->depth == 1)
+        {
+            readDataBlock (root->ranges[range].block, (char*)node);
+            for (uint32_t nodeRange = 0; nodeRange < node->rangeCount; ++nodeRange)
+            {
+                releaseBlock (node->ranges[nodeRange].block);
+            }
+        }
+        releaseBlock (root->ranges[range].block);
+    }
+    memset (root, 0, BLOCK_SIZE);
+    writeMetadataBlock (rootBlock, (char*)root);
+    dirNode->mode &= ~MU_S_INDEXED;
+}
+
+// Gives a directory whose first block has just filled up a hash index: its entries move
+//   to a new block 1, and block 0 becomes the root of the index.
+// Params:
+//   dirNode - The inode of the directory, which is only changed in memory.
+// Returns:
+//   0 on success, or -1 (changing nothing) if there are no free blocks.  If the index
+//   cannot take all of the entries, it is thrown away again, but the entries stay moved.
+int
+startIndexing (struct iNode* dirNode)
+{
+    assert (dirNode->size == BLOCK_SIZE && (dirNode->mode & MU_S_INDEXED) == 0);
+    int movedBlock = findAndMarkFreeBlock ();
+    int leafBlock = findAndMarkFreeBlock ();
+    if (movedBlock < 0 || leafBlock < 0 || appendFileBlock (dirNode, 1, movedBlock) < 0)
+    {
+        if (movedBlock >= 0) { releaseBlock (movedBlock); }
+        if (leafBlock >= 0) { releaseBlock (leafBlock); }
+        return -1;
+    }
+    struct dirEntry entries[DIR_ENTRIES_PER_BLOCK];
+    uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    uint32_t leafBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+    struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+    struct dirIndexLeaf* leaf = (struct dirIndexLeaf*)leafBuffer;
+    uint32_t rootBlock = getFileBlock (dirNode, 0, NULL);
+    readDataBlock (rootBlock, (char*)entries);
+    startDirIndex (root, leaf, leafBlock);
+    writeMetadataBlock (movedBlock, (char*)entries);
+    writeMetadataBlock (leafBlock, (char*)leaf);
+    writeMetadataBlock (rootBlock, (char*)root);
+    dirNode->mode |= MU_S_INDEXED;
+    dirNode->size = 2 * BLOCK_SIZE;
+    for (uint32_t position = 0; position < DIR_ENTRIES_PER_BLOCK; ++position)
+    {
+        if (entries[position].name[0] != '\0'
+            && indexDirEntry (dirNode, DIR_ENTRIES_PER_BLOCK + position, &entries[position]) < 0)
+        {
+            dropDirIndex (dirNode);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Appends an entry to a directory.
+// On a VERSION22 image a directory gets a hash index as it grows past one block.
+// Params:
+//   dirINodeNumber - The number of the directory's inode.
+//   dirNode - The directory's cached inode, which will be updated and written to disk.
+//   name - The name of the new entry.
+//   iNodeNumber - The inode that the entry refers to.
+// Returns:
+//   0 on success, or -1 if the directory is full or there are no free blocks.
+int
+addDirEntry (uint32_t dirINodeNumber, struct iNode* dirNode, const char* name, uint32_t iNodeNumber)
+{
+    if (dirNode->size + DIR_ENTRY_LENGTH > maxFileSize ())
+    {
+        return -1;
+    }
+    uint32_t sizeBefore = dirNode->size;
+    if (usesDirIndex () && dirNode->size == BLOCK_SIZE && (dirNode->mode & MU_S_INDEXED) == 0
+        && startIndexing (dirNode) < 0)
+    {
+        return -1;
+    }
+    uint32_t blockIndex = dirNode->size / BLOCK_SIZE;
+    uint32_t blockNum;
+    struct dirEntry entries[DIR_ENTRIES_PER_BLOCK];
+    if (dirNode->size % BLOCK_SIZE == 0)
+    {
+        int newBlock = findAndMarkFreeBlock ();
+        if (newBlock < 0 || appendFileBlock (dirNode, blockIndex, newBlock) < 0)
+        {
+            if (newBlock >= 0) { releaseBlock (newBlock); }
+            // Entries that were just moved out of the way of an index stay moved.
+            if (dirNode->size != sizeBefore)
+            {
+                icacheWriteBack (dirNode);
+            }
+            return -1;
+        }
+        blockNum = newBlock;
+        memset (entries, 0, BLOCK_SIZE);
+    }
+    else
+    {
+        blockNum = getFileBlock (dirNode, blockIndex, NULL);
+        readDataBlock (blockNum, (char*)entries);
+    }
+    uint32_t entryIndex = dirNode->size / DIR_ENTRY_LENGTH;
+    struct dirEntry* entry = &entries[entryIndex % DIR_ENTRIES_PER_BLOCK];
+    entry->iNodeNumber = iNodeNumber;
+    memset (entry->name, 0, MAX_NAME_LENGTH);
+    strncpy (entry->name, name, MAX_NAME_LENGTH - 1);
+    writeMetadataBlock (blockNum, (char*)entries);
+    if ((dirNode->mode & MU_S_INDEXED) && indexDirEntry (dirNode, entryIndex, entry) < 0)
+    {
+        dropDirIndex (dirNode);
+    }
+
+    dirNode->size += DIR_ENTRY_LENGTH;
+    icacheWriteBack (dirNode);
+    dcacheAdd (dirINodeNumber, name, iNodeNumber);
+    return 0;
+}
+
+// Turns an entry of a directory into a hole (an entry with an empty name), giving back the
+//   space at the end of the directory if that is where it was.
+// Params:
+//   dirINodeNumber - The number of the directory's inode.
+//   dirNode - The directory's cached inode, which will be updated and written to disk.
+//   entryIndex - The position of the entry.
+//   name - The name of the entry.
+void
+punchDirEntry (uint32_t dirINodeNumber, struct iNode* dirNode, uint32_t entryIndex, const char* name)
+{
+    struct dirEntry entries[DIR_ENTRIES_PER_BLOCK];
+    uint32_t blockIndex = entryIndex / DIR_ENTRIES_PER_BLOCK;
+    uint32_t blockNum = getFileBlock (dirNode, blockIndex, NULL);
+    readDataBlock (blockNum, (char*)entries);
+    memset (entries[entryIndex % DIR_ENTRIES_PER_BLOCK].name, 0, MAX_NAME_LENGTH);
+    writeMetadataBlock (blockNum, (char*)entries);
+    // Give back space at the end of the directory so that it does not only ever grow.
+    if (entryIndex == dirNode->size / DIR_ENTRY_LENGTH - 1)
+    {
+        dirNode->size -= DIR_ENTRY_LENGTH;
+        if (dirNode->size % BLOCK_SIZE == 0)
+        {
+            releaseLastFileBlock (dirNode, blockIndex);
+        }
+        icacheWriteBack (dirNode);
+    }
+    dcacheRemove (dirINodeNumber, name);
+}
+
+// Removes an entry from a directory, leaving a hole (an entry with an empty name) behind.
+// Params:
+//   dirINodeNumber - The number of the directory's inode.
+//   dirNode - The directory's cached inode, which will be updated and written to disk.
+//   name - The name of the entry to remove.
+void
+removeDirEntry (uint32_t dirINodeNumber, struct iNode* dirNode, const char* name)
+{
+    // The index says where the entry is, and loses its record of it.
+    if (dirNode->mode & MU_S_INDEXED)
+    {
+        uint32_t rootBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+        uint32_t nodeBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+        uint32_t leafBuffer[BLOCK_SIZE / sizeof (uint32_t)];
+        struct dirIndexRoot* root = (struct dirIndexRoot*)rootBuffer;
+        struct dirIndexRoot* node = (struct dirIndexRoot*)nodeBuffer;
+        struct dirIndexLeaf* leaf = (struct dirIndexLeaf*)leafBuffer;
+        uint32_t hash = hashEntryName (name);
+        uint32_t nodeBlock;
+        uint32_t leafBlock = findIndexLeaf (dirNode, hash, root, node, &nodeBlock);
+        readDataBlock (leafBlock, (char*)leaf);
+        int position = findIndexRecord (leaf, hash, name);
+        if (position >= 0)
+        {
+            uint32_t entryIndex = leaf->records[position].entryIndex;
+            removeIndexRecord (leaf, position);
+            writeMetadataBlock (leafBlock, (char*)leaf);
+            punchDirEntry (dirINodeNumber, dirNode, entryIndex, name);
+        }
+        return;
+    }
+
+    struct dirEntry entries[DIR_ENTRIES_PER_BLOCK];
+    uint32_t entryCount = dirNode->size / DIR_ENTRY_LENGTH;
+    for (uint32_t entryIndex = 0; entryIndex < entryCount; ++entryIndex)
+    {
+        uint32_t blockIndex = entryIndex / DIR_ENTRIES_PER_BLOCK;
+        if (entryIndex % DIR_ENTRIES_PER_BLOCK == 0)
+        {
+            readDataBlock (getFileBlock (dirNode, blockIndex, NULL), (char*)entries);
+        }
+        if (strncmp (entries[entryIndex % DIR_ENTRIES_PER_BLOCK].name, name, MAX_NAME_LENGTH) == 0)
+        {
+            punchDirEntry (dirINodeNumber, dirNode, entryIndex, name);
+            return;
+        }
+    }
+}
+
+// Sets up a file descriptor table entry for a file that has just been opened.
+// Params:
+//   fd - The file descriptor.
+//   iNodeNumber - The number of the file's inode.
+//   node - The file's cached inode, whose reference now belongs to the entry.
+//   flags - The flags the file was opened with.
+void
+installOpenFile (int fd, uint32_t iNodeNumber, struct iNode* node, int flags)
+{
+    process->files[fd].inode = node;
+    process->files[fd].currentBlockIndex = NO_BLOCK;
+    process->files[fd].filePointer = 0;
+    process->files[fd].flags = flags;
+    process->files[fd].dirty = 0;
+    process->files[fd].currentHole = 0;
+    process->files[fd].currentShared = 0;
+    process->files[fd].iNodeNumber = iNodeNumber;
+    ++iNodeLocks[iNodeNumber].openCount;
+    process->files[fd].nextSequentialBlock = 0;
+    process->files[fd].readAheadBlocks = 0;
+    process->files[fd].readAheadEnd = 0;
+    process->files[fd].currentUnit = NO_BLOCK;
+    process->files[fd].seenMapChanges = iNodeLocks[iNodeNumber].mapChanges;
+    process->files[fd].seenDataChanges = iNodeLocks[iNodeNumber].dataChanges;
+    memset (&process->files[fd].stats, 0, sizeof (struct muFileStats));
+}
+
+// Writes the buffered block of an open file to disk if it has been modified.
+void
+flushCurrentBlock (struct openFile* file)
+{
+    if (file->currentBlockIndex != NO_BLOCK && file->dirty)
+    {
+        writeDataBlock (getFileBlock (file->inode, file->currentBlockIndex, NULL), file->currentData);
+    }
+    file->dirty = 0;
+}
+
+// Ends a call that changed an open file's data by writing its buffered block back, so that
+//   the data is where every other file table entry for the file will read it, and having
+//   those entries drop the blocks they have buffered (see refreshBlockMap).
+// Must be called with the file's inode lock held for writing.
+void
+publishFileData (struct openFile* file)
+{
+    flushCurrentBlock (file);
+    file->seenDataChanges = ++iNodeLocks[file->iNodeNumber].dataChanges;
+}
+
+// Counts the whole blocks that a read could copy without going through the file's buffer.
+// Params:
+//   file - The open file, whose file pointer must be at the start of a block.
+//   wanted - The number of bytes that the caller still wants.
+// Returns:
+//   The number of complete blocks that lie within both the request and the file.
+uint32_t
+wholeBlocksAhead (const struct openFile* file, int wanted)
+{
+    if (file->filePointer % BLOCK_SIZE != 0)
+    {
+        return 0;
+    }
+    uint32_t available = file->inode->size - file->filePointer;
+    uint32_t bytes = ((uint32_t)wanted < available ? (uint32_t)wanted : available);
+    return bytes / BLOCK_SIZE;
+}
+
+// Records that blocks of a file are being read, and prefetches the blocks after them if
+//   the file is being read sequentially.
+// Readahead happens in batches: a new batch is only started once the reader reaches the
+//   end of the previous one, and each batch is twice as long as the last (up to
+//   MAX_READAHEAD_BLOCKS).  Reading anywhere else drops back to no readahead.
+// Params:
+//   file - The open file.
+//   blockIndex - The first block being read.
+//   count - How many consecutive blocks are being read.
+void
+noteBlockAccess (struct openFile* file, uint32_t blockIndex, uint32_t count)
+{
+    int sequential = (blockIndex == file->nextSequentialBlock);
+    file->nextSequentialBlock = blockIndex + count;
+    if (!sequential)
+    {
+        file->readAheadBlocks = 0;
+        file->readAheadEnd = 0;
+        return;
+    }
+    if (blockIndex + count < file->readAheadEnd)
+    {
+        return;
+    }
+    file->readAheadBlocks = (file->readAheadBlocks == 0 ? 1 : file->readAheadBlocks * 2);
+    if (file->readAheadBlocks > MAX_READAHEAD_BLOCKS)
+    {
+        file->readAheadBlocks = MAX_READAHEAD_BLOCKS;
+    }
+
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t first = blockIndex + count;
+    uint32_t end = first + file->readAheadBlocks;
+    if (end > mapped)
+    {
+        end = mapped;
+    }
+    // Prefetch one disk-contiguous run at a time so that each becomes a single I/O.
+    while (first < end)
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (file->inode, first, &runLength);
+        uint32_t runCount = (runLength < end - first ? runLength : end - first);
+        if (blockNum != 0)
+        {
+            prefetchDataBlocks (blockNum, runCount);
+            file->stats.prefetchedBlocks += runCount;
+        }
+        first += runCount;
+    }
+    file->readAheadEnd = end;
+}
+
+// Allocates data blocks for blocks in the middle of a file, right after the block before
+//   them when those are free, so that a file rewritten from the front stays in one extent.
+// Params:
+//   file - The open file.
+//   blockIndex - The first block that needs a data block.
+//   wanted - How many blocks need data blocks.
+//   count - Receives the number of blocks allocated, from 1 to wanted.
+// Returns:
+//   The number of the first block allocated, or -1 if the disk is full.
+int
+allocateBlocksAfter (struct openFile* file, uint32_t blockIndex, uint32_t wanted, uint32_t* count)
+{
+    int firstBlock = -1;
+    uint32_t allocated = 0;
+    if (blockIndex > 0)
+    {
+        uint32_t before = getFileBlock (file->inode, blockIndex - 1, NULL);
+        if (before != 0)
+        {
+            firstBlock = before + 1;
+            allocated = allocateRunAt (firstBlock, wanted);
+        }
+    }
+    for (uint32_t length = wanted; allocated == 0 && length > 0; length /= 2)
+    {
+        firstBlock = allocateRun (length);
+        allocated = (firstBlock >= 0 ? length : 0);
+    }
+    *count = allocated;
+    return (allocated > 0 ? firstBlock : -1);
+}
+
+// Gives blocks in a hole of a file data blocks of their own (see allocateBlocksAfter).
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file.
+//   blockIndex - The first block to fill.
+//   wanted - How many blocks to fill, which must all be in the same hole.
+//   count - Receives the number of blocks filled, from 1 to wanted.
+// Returns:
+//   The number of the first data block used, or -1 if the disk is full or the file
+//   cannot be split into any more extents.
+int
+fillHoleBlocks (struct openFile* file, uint32_t blockIndex, uint32_t wanted, uint32_t* count)
+{
+    uint32_t allocated;
+    int firstBlock = allocateBlocksAfter (file, blockIndex, wanted, &allocated);
+    if (firstBlock < 0)
+    {
+        return -1;
+    }
+    if (fillFileHole (file->inode, blockIndex, firstBlock, allocated) < 0)
+    {
+        for (uint32_t offset = 0; offset < allocated; ++offset)
+        {
+            releaseBlock (firstBlock + offset);
+        }
+        return -1;
+    }
+    *count = allocated;
+    return firstBlock;
+}
+
+// Gives shared blocks of a file data blocks of their own, so that they can be written
+//   without changing the other blocks that share their data blocks.  Nothing is copied,
+//   since the caller is about to write all of each block.
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file.
+//   blockIndex - The first block to give a data block of its own.
+//   wanted - How many blocks to give data blocks, which must be stored in consecutive
+//     data blocks that are all shared.
+//   count - Receives the number of blocks given data blocks, from 1 to wanted.
+// Returns:
+//   The number of the first data block used, or -1 if the disk is full or the file
+//   cannot be split into any more extents.
+int
+unshareBlocks (struct openFile* file, uint32_t blockIndex, uint32_t wanted, uint32_t* count)
+{
+    uint32_t oldBlock = getFileBlock (file->inode, blockIndex, NULL);
+    struct extent run;
+    int firstBlock = allocateBlocksAfter (file, blockIndex, wanted, &run.length);
+    if (firstBlock < 0)
+    {
+        return -1;
+    }
+    run.startBlock = firstBlock;
+    if (remapFileBlocks (file->inode, blockIndex, run.length, &run, 1) < 0)
+    {
+        for (uint32_t offset = 0; offset < run.length; ++offset)
+        {
+            releaseBlock (firstBlock + offset);
+        }
+        return -1;
+    }
+    // Releasing a shared block only drops one of its references.
+    for (uint32_t offset = 0; offset < run.length; ++offset)
+    {
+        releaseBlock (oldBlock + offset);
+    }
+    file->seenMapChanges = ++iNodeLocks[file->iNodeNumber].mapChanges;
+    file->stats.unsharedBlocks += run.length;
+    *count = run.length;
+    return firstBlock;
+}
+
+// Locks dedupIndex, allocating it if this is the first time it is needed.
+void
+lockDedupIndex ()
+{
+    pthread_mutex_lock (&dedupLock);
+    if (dedupIndex.slots == NULL)
+    {
+        initBlockIndex (&dedupIndex, BLOCK_COUNT < DEDUP_INDEX_BLOCKS ? BLOCK_COUNT : DEDUP_INDEX_BLOCKS);
+    }
+}
+
+// Appends blocks to a file by sharing data blocks that already hold the same data, if
+//   dedupIndex knows of them: a run of consecutive blocks of one file, as many of them as
+//   follow on from the first.  They must still be where the index saw them, in a regular
+//   file that no other file table entry has open (another entry could have a modified copy
+//   of one buffered, and write that to it later).
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file.
+//   blockIndex - The first block to append, which must be the current block count.
+//   data - The data to be appended, count blocks.
+//   hashes - The hashes of those blocks.
+//   count - The number of blocks, at least 1.
+// Returns:
+//   The number of blocks appended, or 0 if the first must be written instead.
+uint32_t
+shareDuplicateBlocks (struct openFile* file, uint32_t blockIndex, const char* data, const uint64_t* hashes,
+                      uint32_t count)
+{
+    lockDedupIndex ();
+    const struct indexedBlock* found = findIndexedBlock (&dedupIndex, hashes[0]);
+    struct indexedBlock candidate = { 0 };
+    uint32_t length = 0;
+    if (found != NULL)
+    {
+        candidate = *found;
+        length = 1;
+        // The index saw the blocks after it in the same file, in the blocks after it.
+        while (length < count && (found = findIndexedBlock (&dedupIndex, hashes[length])) != NULL
+               && found->iNodeNumber == candidate.iNodeNumber && found->blockIndex == candidate.blockIndex + length
+               && found->blockNum == candidate.blockNum + length)
+        {
+            ++length;
+        }
+    }
+    pthread_mutex_unlock (&dedupLock);
+    // The index may remember blocks of a disk that has since been replaced.
+    if (length == 0 || candidate.blockNum + length > BLOCK_COUNT || candidate.iNodeNumber >= iNodeLockCount)
+    {
+        return 0;
+    }
+
+    // Nothing can open, unlink or move the other file meanwhile.
+    pthread_mutex_lock (&namespaceLock);
+    int usable;
+    struct iNode* owner;
+    if (candidate.iNodeNumber == (uint32_t)file->iNodeNumber)
+    {
+        owner = file->inode;
+        usable = (iNodeLocks[candidate.iNodeNumber].openCount == 1);
+        // A modified block that is buffered has not been written to its data block yet.
+        if (file->dirty && file->currentBlockIndex >= candidate.blockIndex
+            && file->currentBlockIndex < candidate.blockIndex + length)
+        {
+            length = file->currentBlockIndex - candidate.blockIndex;
+        }
+    }
+    else
+    {
+        owner = icacheGet (candidate.iNodeNumber);
+        usable = !isOpen (candidate.iNodeNumber);
+    }
+    uint32_t runLength = 0;
+    usable = usable && length > 0 && (owner->mode & MU_S_REGLR)
+             && (owner->mode & (MU_S_INLINE | MU_S_COMPRESSED)) == 0
+             && candidate.blockIndex < (owner->size + BLOCK_SIZE - 1) / BLOCK_SIZE
+             && getFileBlock (owner, candidate.blockIndex, &runLength) == candidate.blockNum;
+    uint32_t shared = 0;
+    if (usable)
+    {
+        uint32_t ownerMapped = (owner->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        length = (length < runLength ? length : runLength);
+        length = (length < ownerMapped - candidate.blockIndex ? length : ownerMapped - candidate.blockIndex);
+        // Blocks with the same hash are only likely to hold the same data.
+        char* stored = malloc ((size_t)length * BLOCK_SIZE);
+        if (stored == NULL)
+        {
+            fprintf (stderr, "Could not allocate %u blocks\n", length);
+            exit (EXIT_FAILURE);
+        }
+        waitDataBlocks ();
+        readDataBlocks (candidate.blockNum, length, stored);
+        while (shared < length
+               && memcmp (stored + (size_t)shared * BLOCK_SIZE, data + (size_t)shared * BLOCK_SIZE, BLOCK_SIZE) == 0
+               && shareBlock (candidate.blockNum + shared) == 0)
+        {
+            if (appendFileBlock (file->inode, blockIndex + shared, candidate.blockNum + shared) < 0)
+            {
+                releaseBlock (candidate.blockNum + shared);
+                break;
+            }
+            if (owner == file->inode && file->currentBlockIndex == candidate.blockIndex + shared)
+            {
+                file->currentShared = 1;
+            }
+            ++shared;
+        }
+        free (stored);
+    }
+    if (owner != file->inode)
+    {
+        icacheRelease (owner);
+    }
+    pthread_mutex_unlock (&namespaceLock);
+    return shared;
+}
+
+// Counts how many of a batch of blocks about to be appended to a file should be written,
+//   stopping at the first one after the first that might share a data block instead: one
+//   whose hash dedupIndex knows, or that repeats an earlier block of the batch (which will
+//   be known once that one is written).
+// Params:
+//   hashes - The hashes of the blocks.
+//   count - The number of blocks.
+// Returns:
+//   The number of blocks to write, at least 1.
+uint32_t
+countFreshBlocks (const uint64_t* hashes, uint32_t count)
+{
+    lockDedupIndex ();
+    uint32_t fresh = 1;
+    while (fresh < count && findIndexedBlock (&dedupIndex, hashes[fresh]) == NULL)
+    {
+        uint32_t earlier = 0;
+        while (earlier < fresh && hashes[earlier] != hashes[fresh])
+        {
+            ++earlier;
+        }
+        if (earlier < fresh)
+        {
+            break;
+        }
+        ++fresh;
+    }
+    pthread_mutex_unlock (&dedupLock);
+    return fresh;
+}
+
+// Adds blocks just appended to a file to dedupIndex, so that later blocks with the same
+//   data can share them.
+// Params:
+//   file - The open file.
+//   blockIndex - The first block appended.
+//   firstBlock - The data block it was written to, the first of count consecutive ones.
+//   hashes - The hashes of the blocks.
+//   count - The number of blocks.
+void
+indexAppendedBlocks (const struct openFile* file, uint32_t blockIndex, uint32_t firstBlock,
+                     const uint64_t* hashes, uint32_t count)
+{
+    lockDedupIndex ();
+    for (uint32_t offset = 0; offset < count; ++offset)
+    {
+        struct indexedBlock block = { hashes[offset], firstBlock + offset, file->iNodeNumber, blockIndex + offset, 0 };
+        addIndexedBlock (&dedupIndex, &block);
+    }
+    pthread_mutex_unlock (&dedupLock);
+}
+
+// Grows a file that a writer has seeked past the end of with a hole, up to the block that
+//   its file pointer is in, so that the write can go on to append blocks from there.
+// The bytes of the old last block past the end of the file are always zero, as are those
+//   of the hole, so the file reads as zeros up to the file pointer.
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file, which must not be inline.
+// Returns:
+//   0 on success, or -1 (changing nothing) if the file cannot map that many blocks.
+int
+padWithHoles (struct openFile* file)
+{
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t target = file->filePointer / BLOCK_SIZE;
+    if (target <= mapped)
+    {
+        return 0;
+    }
+    if (appendFileHole (file->inode, mapped, target - mapped) < 0)
+    {
+        return -1;
+    }
+    file->inode->size = target * BLOCK_SIZE;
+    return 0;
+}
+
+// Starts writing whole blocks from the caller's buffer straight to disk, skipping the file's
+//   buffer; the caller must waitDataBlocks before reusing the buffer.
+// Blocks that the file already has are overwritten, blocks in holes and shared blocks are
+//   given data blocks of their own (see fillHoleBlocks and unshareBlocks), and new blocks
+//   are allocated (as one contiguous run when possible, see allocateFileBlocks) and
+//   appended to the file.  With dedupWrites, a new block whose data some data block already
+//   holds shares that block instead (see shareDuplicateBlocks).
+// Params:
+//   file - The open file, whose file pointer must be at the start of a block that is not buffered.
+//   buffer - The data to write.
+//   count - The number of whole blocks available in buffer.
+// Returns:
+//   The number of blocks written, which is 0 only if no block could be allocated.
+uint32_t
+writeWholeBlocks (struct openFile* file, const char* buffer, uint32_t count)
+{
+    uint32_t blockIndex = file->filePointer / BLOCK_SIZE;
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t written = 0;
+    if (blockIndex < mapped)
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (file->inode, blockIndex, &runLength);
+        written = (runLength < count ? runLength : count);
+        if (written > mapped - blockIndex)
+        {
+            written = mapped - blockIndex;
+        }
+        if (blockNum == 0)
+        {
+            int firstBlock = fillHoleBlocks (file, blockIndex, written, &written);
+            if (firstBlock < 0)
+            {
+                return 0;
+            }
+            blockNum = firstBlock;
+        }
+        else if (usesSharedBlocks ())
+        {
+            // Write only as far as the blocks stay shared, or stay unshared.
+            int shared = (getBlockShares (blockNum) > 0);
+            uint32_t same = 1;
+            while (same < written && (getBlockShares (blockNum + same) > 0) == shared)
+            {
+                ++same;
+            }
+            written = same;
+            if (shared)
+            {
+                int firstBlock = unshareBlocks (file, blockIndex, written, &written);
+                if (firstBlock < 0)
+                {
+                    return 0;
+                }
+                blockNum = firstBlock;
+            }
+        }
+        writeDataBlocksAsync (blockNum, written, buffer);
+    }
+    else
+    {
+        uint64_t hashes[DEDUP_BATCH_BLOCKS];
+        int dedup = (dedupWrites && usesSharedBlocks ());
+        if (dedup)
+        {
+            count = (count < DEDUP_BATCH_BLOCKS ? count : DEDUP_BATCH_BLOCKS);
+            for (uint32_t offset = 0; offset < count; ++offset)
+            {
+                hashes[offset] = hashBlock (buffer + (size_t)offset * BLOCK_SIZE);
+            }
+            written = shareDuplicateBlocks (file, blockIndex, buffer, hashes, count);
+            if (written > 0)
+            {
+                file->stats.sharedBlocks += written;
+                return written;
+            }
+            count = countFreshBlocks (hashes, count);
+        }
+        uint32_t allocated;
+        int firstBlock = allocateFileBlocks (file, count, &allocated);
+        if (firstBlock < 0)
+        {
+            return 0;
+        }
+        while (written < allocated && appendFileBlock (file->inode, blockIndex + written, firstBlock + written) == 0)
+        {
+            ++written;
+        }
+        // Give back whatever the file could not map.
+        for (uint32_t unused = written; unused < allocated; ++unused)
+        {
+            releaseBlock (firstBlock + unused);
+        }
+        if (written > 0)
+        {
+            writeDataBlocksAsync (firstBlock, written, buffer);
+        }
+        if (dedup)
+        {
+            indexAppendedBlocks (file, blockIndex, firstBlock, hashes, written);
+        }
+    }
+    file->stats.directBlocks += written;
+    return written;
+}
+
+// Copies bytes of an inline file, from its file pointer on, into the caller's buffer.
+// Params:
+//   file - The open file, whose mode includes MU_S_INLINE.
+//   buffer - Where to copy the bytes.
+//   n - The maximum number of bytes to copy.
+// Returns:
+//   The number of bytes copied.
+int
+readInlineData (struct openFile* file, char* buffer, int n)
+{
+    uint32_t span = (file->filePointer < file->inode->size ? file->inode->size - file->filePointer : 0);
+    if (span > (uint32_t)n)
+    {
+        span = n;
+    }
+    memcpy (buffer, file->inode->inlineData + file->filePointer, span);
+    file->filePointer += span;
+    return span;
+}
+
+// Copies bytes from the caller's buffer into an inline file at its file pointer.
+// Params:
+//   file - The open file, whose mode includes MU_S_INLINE.
+//   buffer - The bytes to copy.
+//   n - The number of bytes, which must all fit within INLINE_DATA_SIZE.
+void
+writeInlineData (struct openFile* file, const char* buffer, int n)
+{
+    assert (file->filePointer + n <= INLINE_DATA_SIZE);
+    memcpy (file->inode->inlineData + file->filePointer, buffer, n);
+    file->filePointer += n;
+    if (file->filePointer > file->inode->size)
+    {
+        file->inode->size = file->filePointer;
+    }
+}
+
+// Moves the contents of an inline file out of its inode into a data block, which becomes
+//   the file's first block and is left buffered (and dirty) in the file table entry.
+// Params:
+//   file - The open file, whose mode includes MU_S_INLINE.
+// Returns:
+//   0 on success, or -1 if no block could be allocated.
+int
+promoteInlineData (struct openFile* file)
+{
+    char contents[INLINE_DATA_SIZE];
+    memcpy (contents, file->inode->inlineData, INLINE_DATA_SIZE);
+    int blockNum = -1;
+    if (file->inode->size > 0)
+    {
+        blockNum = findAndMarkFreeBlock ();
+        if (blockNum < 0)
+        {
+            return -1;
+        }
+    }
+    // Zeroing the inline data leaves an empty extent map.
+    memset (file->inode->inlineData, 0, INLINE_DATA_SIZE);
+    file->inode->mode &= ~MU_S_INLINE;
+    if (blockNum >= 0)
+    {
+        int appended = appendFileBlock (file->inode, 0, blockNum);
+        assert (appended == 0);
+        (void)appended;
+        memset (file->currentData, 0, BLOCK_SIZE);
+        memcpy (file->currentData, contents, file->inode->size);
+        file->currentBlockIndex = 0;
+        file->currentHole = 0;
+        file->currentShared = 0;
+        file->dirty = 1;
+    }
+    return 0;
+}
+
+// Drops the unit or block that an open file has buffered if another file table entry has
+//   since written the file, or moved its data to other blocks by storing a unit or giving a
+//   shared block a block of its own.  A modified block is kept (a modified block is never
+//   shared, so it has not moved).  The inode itself is shared, so it is current.
+// Must be called with the file's inode lock held.
+void
+refreshBlockMap (struct openFile* file)
+{
+    struct iNodeLock* iNodeLock = &iNodeLocks[file->iNodeNumber];
+    if (file->seenMapChanges != iNodeLock->mapChanges || file->seenDataChanges != iNodeLock->dataChanges)
+    {
+        file->currentUnit = NO_BLOCK;
+        if (!file->dirty)
+        {
+            file->currentBlockIndex = NO_BLOCK;
+        }
+        file->seenMapChanges = iNodeLock->mapChanges;
+        file->seenDataChanges = iNodeLock->dataChanges;
+    }
+}
+
+// Makes sure that an open compressed file has a unit buffer, and that the unit buffered
+//   (if any) is current (see refreshBlockMap).
+// Must be called with the file's inode lock held.
+void
+refreshCompressedFile (struct openFile* file)
+{
+    if (file->unitData == NULL)
+    {
+        file->unitData = malloc ((size_t)2 * COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE);
+        if (file->unitData == NULL)
+        {
+            fprintf (stderr, "Could not allocate a unit buffer of %u blocks\n", 2 * COMPRESSION_UNIT_BLOCKS);
+            exit (EXIT_FAILURE);
+        }
+    }
+    refreshBlockMap (file);
+}
+
+// Expands one unit of a compressed file into its unit buffer (see struct compressedUnit).
+// Must be called with the file's inode lock held, after refreshCompressedFile.
+// Params:
+//   file - The open file, whose mode includes MU_S_COMPRESSED.
+//   unitIndex - The unit to expand, which reads as zeros if it lies past the end of the file.
+// Returns:
+//   0 on success, or -1 (leaving no unit buffered) if the unit's stored form is damaged.
+int
+loadUnit (struct openFile* file, uint32_t unitIndex)
+{
+    size_t unitBytes = (size_t)COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE;
+    char* stored = file->unitData + unitBytes;
+    memset (file->unitData, 0, unitBytes);
+    file->currentUnit = NO_BLOCK;
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t first = unitIndex * COMPRESSION_UNIT_BLOCKS;
+    if (first < mapped)
+    {
+        uint32_t blockCount = (mapped - first < COMPRESSION_UNIT_BLOCKS ? mapped - first : COMPRESSION_UNIT_BLOCKS);
+        // A unit that ends in a hole keeps its compressed form in the data blocks before it.
+        int compressed = (getFileBlock (file->inode, first + blockCount - 1, NULL) == 0);
+        char* destination = (compressed ? stored : file->unitData);
+        uint32_t dataBlocks = 0;
+        uint32_t offset = 0;
+        while (offset < blockCount)
+        {
+            uint32_t runLength;
+            uint32_t blockNum = getFileBlock (file->inode, first + offset, &runLength);
+            uint32_t count = (runLength < blockCount - offset ? runLength : blockCount - offset);
+            if (blockNum == 0 && compressed)
+            {
+                break;
+            }
+            if (blockNum != 0)
+            {
+                readDataBlocks (blockNum, count, destination + (size_t)offset * BLOCK_SIZE);
+                dataBlocks += count;
+            }
+            offset += count;
+        }
+        if (compressed && dataBlocks > 0)
+        {
+            if (unpackUnit (stored, dataBlocks, blockCount, file->unitData) < 0)
+            {
+                memset (file->unitData, 0, unitBytes);
+                return -1;
+            }
+            ++file->stats.unitsExpanded;
+        }
+    }
+    file->currentUnit = unitIndex;
+    return 0;
+}
+
+// Stores the buffered unit of a compressed file in as few data blocks as packUnit can
+//   manage, overwriting the blocks the unit had before where it can and giving back the
+//   ones it no longer needs.  Any new blocks follow on from the last data block before
+//   them when those are free, as in fillHoleBlocks.  A packed unit that does not fit in
+//   the file's block map is stored as it is instead, which often overwrites the unit's
+//   own blocks and so needs no more extents.
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file, whose unit buffer holds the unit as it should now read.
+//   newSize - The file's size afterwards, no less than it is now; if that grows the file,
+//     the buffered unit must be the new last one, and holes fill any gap before it.
+//   mayPack - 1 to pack the unit if the file has extents to spare, 0 to store it as it is.
+// Returns:
+//   0 on success, or -1 (leaving the file as it was) if the disk is full or the file
+//   cannot be split into any more extents.
+int
+storeUnit (struct openFile* file, uint32_t newSize, int mayPack)
+{
+    struct iNode* node = file->inode;
+    char* stored = file->unitData + (size_t)COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE;
+    uint32_t first = file->currentUnit * COMPRESSION_UNIT_BLOCKS;
+    uint32_t mapped = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t newMapped = (uint32_t)(((uint64_t)newSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    assert (newSize >= node->size && first < newMapped);
+    uint32_t blockCount = (newMapped - first < COMPRESSION_UNIT_BLOCKS ? newMapped - first : COMPRESSION_UNIT_BLOCKS);
+
+    // The unit's data blocks, which always come before any hole in it.
+    struct extent oldRuns[COMPRESSION_UNIT_BLOCKS];
+    uint32_t oldRunCount = 0;
+    uint32_t oldBlocks = 0;
+    uint32_t oldEnd = (mapped < first + COMPRESSION_UNIT_BLOCKS ? mapped : first + COMPRESSION_UNIT_BLOCKS);
+    for (uint32_t blockIndex = first; blockIndex < oldEnd; )
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+        if (blockNum == 0)
+        {
+            break;
+        }
+        runLength = (runLength < oldEnd - blockIndex ? runLength : oldEnd - blockIndex);
+        oldRuns[oldRunCount].startBlock = blockNum;
+        oldRuns[oldRunCount++].length = runLength;
+        oldBlocks += runLength;
+        blockIndex += runLength;
+    }
+
+    // A packed unit can split the file into three more extents, so a file that is getting
+    //   close to the most it can have stores the rest of its units as they are, running on
+    //   from one another, and keeps RAW_UNIT_EXTENTS for the times they cannot.
+    uint32_t storedBlocks = blockCount;
+    if (mayPack && node->extentCount + 3 + RAW_UNIT_EXTENTS <= MAX_EXTENTS)
+    {
+        storedBlocks = packUnit (file->unitData, blockCount, stored);
+    }
+    const char* source = (storedBlocks == blockCount ? file->unitData : stored);
+
+    // Reuse the unit's own blocks, in order, then allocate whatever more it needs.
+    struct extent runs[COMPRESSION_UNIT_BLOCKS];
+    uint32_t runCount = 0;
+    uint32_t placed = 0;
+    for (uint32_t run = 0; run < oldRunCount && placed < storedBlocks; ++run)
+    {
+        runs[runCount].startBlock = oldRuns[run].startBlock;
+        runs[runCount].length = (oldRuns[run].length < storedBlocks - placed ? oldRuns[run].length : storedBlocks - placed);
+        placed += runs[runCount++].length;
+    }
+    uint32_t reusedRuns = runCount;
+    uint32_t nextBlock = (runCount > 0 ? runs[runCount - 1].startBlock + runs[runCount - 1].length : 0);
+    for (uint32_t blockIndex = (first < mapped ? first : mapped);
+         nextBlock == 0 && blockIndex > 0 && first - blockIndex < COMPRESSION_UNIT_BLOCKS; --blockIndex)
+    {
+        uint32_t before = getFileBlock (node, blockIndex - 1, NULL);
+        nextBlock = (before != 0 ? before + 1 : 0);
+    }
+    int failed = 0;
+    while (placed < storedBlocks && !failed)
+    {
+        uint32_t wanted = storedBlocks - placed;
+        int firstBlock = nextBlock;
+        uint32_t allocated = (nextBlock != 0 ? allocateRunAt (nextBlock, wanted) : 0);
+        for (uint32_t length = wanted; allocated == 0 && length > 0; length /= 2)
+        {
+            firstBlock = allocateRun (length);
+            allocated = (firstBlock >= 0 ? length : 0);
+        }
+        failed = (allocated == 0);
+        if (!failed)
+        {
+            runs[runCount].startBlock = firstBlock;
+            runs[runCount++].length = allocated;
+            placed += allocated;
+            nextBlock = firstBlock + allocated;
+        }
+    }
+
+    // The file grows by a hole, which the unit's data blocks then take the start of.
+    // When the unit keeps just the blocks it had, in place, its map is already right.
+    int grown = 0;
+    if (!failed && newMapped > mapped)
+    {
+        failed = (appendFileHole (node, mapped, newMapped - mapped) < 0);
+        grown = !failed;
+    }
+    if (!failed && storedBlocks != oldBlocks && remapFileBlocks (node, first, blockCount, runs, runCount) < 0)
+    {
+        failed = 1;
+        if (grown)
+        {
+            releaseFileBlocksFrom (node, mapped);
+        }
+    }
+    if (failed)
+    {
+        for (uint32_t run = reusedRuns; run < runCount; ++run)
+        {
+            for (uint32_t offset = 0; offset < runs[run].length; ++offset)
+            {
+                releaseBlock (runs[run].startBlock + offset);
+            }
+        }
+        return (storedBlocks < blockCount ? storeUnit (file, newSize, 0) : -1);
+    }
+    ++file->stats.unitsStored;
+
+    uint32_t written = 0;
+    for (uint32_t run = 0; run < runCount; ++run)
+    {
+        writeDataBlocks (runs[run].startBlock, runs[run].length, source + (size_t)written * BLOCK_SIZE);
+        written += runs[run].length;
+    }
+    uint32_t kept = 0;
+    for (uint32_t run = 0; run < oldRunCount; ++run)
+    {
+        for (uint32_t offset = 0; offset < oldRuns[run].length; ++offset)
+        {
+            if (kept++ >= storedBlocks)
+            {
+                releaseBlock (oldRuns[run].startBlock + offset);
+            }
+        }
+    }
+    node->size = newSize;
+    file->seenMapChanges = ++iNodeLocks[file->iNodeNumber].mapChanges;
+    return 0;
+}
+
+// Stores the last unit of a compressed file at full length before the file grows past it,
+//   if it is short and stored as it is, since it would otherwise end in a hole and so read
+//   back as compressed.
+// Must be called with the file's inode lock held for writing, after refreshCompressedFile.
+// Params:
+//   file - The open file, whose mode includes MU_S_COMPRESSED.
+//   unitIndex - The unit that the file is about to grow into.
+// Returns:
+//   0 on success, or -1 if the last unit is damaged or could not be stored.
+int
+settleLastUnit (struct openFile* file, uint32_t unitIndex)
+{
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t lastUnit = mapped / COMPRESSION_UNIT_BLOCKS;
+    if (mapped % COMPRESSION_UNIT_BLOCKS == 0 || unitIndex <= lastUnit
+        || getFileBlock (file->inode, mapped - 1, NULL) == 0)
+    {
+        return 0;
+    }
+    if (file->currentUnit != lastUnit && loadUnit (file, lastUnit) < 0)
+    {
+        return -1;
+    }
+    return storeUnit (file, (lastUnit + 1) * COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE, 1);
+}
+
+// Copies bytes of a compressed file, from its file pointer on, into the caller's buffer,
+//   expanding each unit that they come from.
+// Must be called with the file's inode lock held.
+// Params:
+//   file - The open file, whose mode includes MU_S_COMPRESSED.
+//   buffer - Where to copy the bytes.
+//   n - The maximum number of bytes to copy.
+// Returns:
+//   The number of bytes copied, which stops short at a damaged unit, or -1 if the first
+//   unit is damaged.
+int
+readCompressedData (struct openFile* file, char* buffer, int n)
+{
+    refreshCompressedFile (file);
+    uint32_t unitBytes = COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE;
+    int bytesRead = 0;
+    while (bytesRead < n && file->filePointer < file->inode->size)
+    {
+        uint32_t unitIndex = file->filePointer / unitBytes;
+        if (file->currentUnit != unitIndex && loadUnit (file, unitIndex) < 0)
+        {
+            return (bytesRead > 0 ? bytesRead : -1);
+        }
+        uint32_t offset = file->filePointer % unitBytes;
+        uint32_t span = unitBytes - offset;
+        if (span > (uint32_t)(n - bytesRead))
+        {
+            span = n - bytesRead;
+        }
+        if (span > file->inode->size - file->filePointer)
+        {
+            span = file->inode->size - file->filePointer;
+        }
+        memcpy (buffer + bytesRead, file->unitData + offset, span);
+        bytesRead += span;
+        file->filePointer += span;
+    }
+    return bytesRead;
+}
+
+// Copies bytes from the caller's buffer into a compressed file at its file pointer, storing
+//   each unit again as soon as the bytes for it are in (see storeUnit).  A writer that has
+//   seeked past the end leaves a hole behind it, as in any other file.
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file, whose mode includes MU_S_COMPRESSED.
+//   buffer - The bytes to copy.
+//   n - The number of bytes.
+// Returns:
+//   The number of bytes written, which stops short if the disk is full, the file cannot
+//   be split into any more extents or a unit is damaged, or -1 if the first unit is damaged.
+int
+writeCompressedData (struct openFile* file, const char* buffer, int n)
+{
+    refreshCompressedFile (file);
+    uint32_t unitBytes = COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE;
+    uint32_t limit = maxFileSize ();
+    int bytesWritten = 0;
+    while (bytesWritten < n && file->filePointer < limit)
+    {
+        uint32_t unitIndex = file->filePointer / unitBytes;
+        if (settleLastUnit (file, unitIndex) < 0)
+        {
+            file->currentUnit = NO_BLOCK;
+            break;
+        }
+        if (file->currentUnit != unitIndex && loadUnit (file, unitIndex) < 0)
+        {
+            return (bytesWritten > 0 ? bytesWritten : -1);
+        }
+        uint32_t offset = file->filePointer % unitBytes;
+        uint32_t span = unitBytes - offset;
+        if (span > (uint32_t)(n - bytesWritten))
+        {
+            span = n - bytesWritten;
+        }
+        if (span > limit - file->filePointer)
+        {
+            span = limit - file->filePointer;
+        }
+        memcpy (file->unitData + offset, buffer + bytesWritten, span);
+        uint32_t end = file->filePointer + span;
+        if (storeUnit (file, end > file->inode->size ? end : file->inode->size, 1) < 0)
+        {
+            // The unit buffer no longer matches what is on disk.
+            file->currentUnit = NO_BLOCK;
+            break;
+        }
+        bytesWritten += span;
+        file->filePointer += span;
+    }
+    return bytesWritten;
+}
+
+// Grows a file to a length, giving it zeroed blocks for everything past its old end.
+// Either every block is allocated or the file is left as it was.
+// A compressed file grows by a hole instead, since its blocks are only settled as each
+//   unit is stored; if that fails, it may be left grown with zeros to the end of its last
+//   unit.
+// Must be called with the file's inode lock held for writing.
+// Params:
+//   file - The open file.
+//   length - The new length, which must be no more than maxFileSize.
+// Returns:
+//   0 on success, or -1 if there are not enough free blocks.
+int
+extendFile (struct openFile* file, uint32_t length)
+{
+    if (length <= file->inode->size)
+    {
+        return 0;
+    }
+    if (file->inode->mode & MU_S_INLINE)
+    {
+        // Inline data past the end of the file is always zero.
+        if (length <= INLINE_DATA_SIZE)
+        {
+            file->inode->size = length;
+            icacheMarkDirty (file->inode);
+            return 0;
+        }
+        if (promoteInlineData (file) < 0)
+        {
+            return -1;
+        }
+    }
+    if (file->inode->mode & MU_S_COMPRESSED)
+    {
+        refreshCompressedFile (file);
+        uint32_t unitIndex = (length - 1) / (COMPRESSION_UNIT_BLOCKS * BLOCK_SIZE);
+        if (settleLastUnit (file, unitIndex) < 0
+            || (file->currentUnit != unitIndex && loadUnit (file, unitIndex) < 0) || storeUnit (file, length, 1) < 0)
+        {
+            // Settling the last unit may have grown the file to the end of that unit.
+            file->currentUnit = NO_BLOCK;
+            icacheWriteBack (file->inode);
+            return -1;
+        }
+        // Storing a unit releases the blocks it was stored in before, so the inode must
+        //   stop pointing at them at once.
+        icacheWriteBack (file->inode);
+        return 0;
+    }
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t needed = (uint32_t)(((uint64_t)length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    uint32_t zeroBlocks = (needed - mapped < ZERO_FILL_BLOCKS ? needed - mapped : ZERO_FILL_BLOCKS);
+    char* zeros = calloc (zeroBlocks > 0 ? zeroBlocks : 1, BLOCK_SIZE);
+    if (zeros == NULL)
+    {
+        fprintf (stderr, "Could not allocate %u blocks of zeros\n", zeroBlocks);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t blockIndex = mapped;
+    while (blockIndex < needed)
+    {
+        uint32_t count;
+        int firstBlock = allocateFileBlocks (file, needed - blockIndex, &count);
+        if (firstBlock < 0)
+        {
+            break;
+        }
+        uint32_t appended = 0;
+        while (appended < count && appendFileBlock (file->inode, blockIndex + appended, firstBlock + appended) == 0)
+        {
+            ++appended;
+        }
+        for (uint32_t unused = appended; unused < count; ++unused)
+        {
+            releaseBlock (firstBlock + unused);
+        }
+        // The blocks may still hold whatever a deleted file left in them.
+        for (uint32_t zeroed = 0; zeroed < appended; zeroed += zeroBlocks)
+        {
+            uint32_t chunk = (appended - zeroed < zeroBlocks ? appended - zeroed : zeroBlocks);
+            writeDataBlocks (firstBlock + zeroed, chunk, zeros);
+        }
+        blockIndex += appended;
+        if (appended < count)
+        {
+            break;
+        }
+    }
+    free (zeros);
+    if (blockIndex < needed)
+    {
+        while (blockIndex > mapped)
+        {
+            releaseLastFileBlock (file->inode, --blockIndex);
+        }
+        return -1;
+    }
+    file->inode->size = length;
+    icacheMarkDirty (file->inode);
+    return 0;
+}
+
+// Puts blocks copied from another file into a file at its file pointer, without writing
+//   any data: consecutive data blocks that the caller has taken a share of for each, or a
+//   hole.  Blocks past the end of the file are appended, and blocks that the file already
+//   has are remapped, their old data blocks released.
+// Must be called with the file's inode lock held for writing, and with namespaceLock held
+//   if no other file table entry may have the file open (see linkCopiedBlocks).
+// Params:
+//   file - The open file, whose file pointer must be at the start of a block that is not
+//     buffered, and no further than the end of the file.
+//   firstBlock - The first of the data blocks, or 0 for a hole.
+//   count - The number of blocks, no more than COPY_CHUNK_BLOCKS.
+// Returns:
+//   The number of blocks put in, which is 0 if the file cannot map any of them.
+uint32_t
+mapCopiedBlocks (struct openFile* file, uint32_t firstBlock, uint32_t count)
+{
+    uint32_t blockIndex = file->filePointer / BLOCK_SIZE;
+    uint32_t mapped = (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blockIndex >= mapped)
+    {
+        if (firstBlock == 0)
+        {
+            return (appendFileHole (file->inode, blockIndex, count) == 0 ? count : 0);
+        }
+        uint32_t appended = 0;
+        while (appended < count && appendFileBlock (file->inode, blockIndex + appended, firstBlock + appended) == 0)
+        {
+            ++appended;
+        }
+        return appended;
+    }
+
+    count = (count < mapped - blockIndex ? count : mapped - blockIndex);
+    uint32_t oldBlocks[COPY_CHUNK_BLOCKS];
+    for (uint32_t offset = 0; offset < count; ++offset)
+    {
+        oldBlocks[offset] = getFileBlock (file->inode, blockIndex + offset, NULL);
+    }
+    struct extent run = { firstBlock, count };
+    if (remapFileBlocks (file->inode, blockIndex, count, &run, firstBlock != 0) < 0)
+    {
+        return 0;
+    }
+    // Releasing a shared block only drops one of its references.
+    for (uint32_t offset = 0; offset < count; ++offset)
+    {
+        if (oldBlocks[offset] != 0)
+        {
+            releaseBlock (oldBlocks[offset]);
+        }
+    }
+    file->seenMapChanges = ++iNodeLocks[file->iNodeNumber].mapChanges;
+    return count;
+}
+
+// Copies blocks of one file into another at their file pointers by linking them: a hole
+//   becomes a hole, and on an image that can share blocks (see VERSION24 in mufs.h), data
+//   blocks are shared rather than copied.  The source must not be open through another file
+//   table entry, which could have a modified copy of one of them buffered and write that to
+//   it later, nor the destination if blocks that it already has are to be replaced.
+// Must be called with the source's inode lock held and the destination's held for writing.
+// Params:
+//   src - The open file copied from.
+//   dst - The open file copied to, whose file pointer must be at the start of a block that
+//     is not buffered, and no further than the end of the file.
+//   blockNum - The first of the consecutive data blocks of the source to copy, or 0 for a hole.
+//   count - The number of blocks, no more than COPY_CHUNK_BLOCKS.
+// Returns:
+//   The number of blocks copied, or 0 if the first must be written instead.
+uint32_t
+linkCopiedBlocks (struct openFile* src, struct openFile* dst, uint32_t blockNum, uint32_t count)
+{
+    pthread_mutex_lock (&namespaceLock);
+    uint32_t mapped = (dst->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int replacing = (dst->filePointer / BLOCK_SIZE < mapped);
+    uint32_t linked = 0;
+    if ((!replacing || iNodeLocks[dst->iNodeNumber].openCount == 1)
+        && (blockNum == 0 || (usesSharedBlocks () && iNodeLocks[src->iNodeNumber].openCount == 1)))
+    {
+        // Take the new references first, since replacing blocks may drop the destination's
+        //   old references to the same data blocks.
+        uint32_t referenced = count;
+        if (blockNum != 0)
+        {
+            referenced = 0;
+            while (referenced < count && shareBlock (blockNum + referenced) == 0)
+            {
+                ++referenced;
+            }
+        }
+        linked = (referenced > 0 ? mapCopiedBlocks (dst, blockNum, referenced) : 0);
+        for (uint32_t unused = linked; blockNum != 0 && unused < referenced; ++unused)
+        {
+            releaseBlock (blockNum + unused);
+        }
+    }
+    pthread_mutex_unlock (&namespaceLock);
+    if (blockNum != 0 && linked > 0)
+    {
+        // The source's buffered block may now be shared.
+        uint32_t blockIndex = src->filePointer / BLOCK_SIZE;
+        if (src->currentBlockIndex != NO_BLOCK && src->currentBlockIndex >= blockIndex
+            && src->currentBlockIndex < blockIndex + linked)
+        {
+            src->currentShared = 1;
+        }
+        dst->stats.sharedBlocks += linked;
+    }
+    return linked;
+}
+
+// Copies whole blocks of one file into another at their file pointers, advancing both and
+//   growing the destination as needed.  Each run of the source is linked if it can be (see
+//   linkCopiedBlocks), or else read and written a chunk at a time (see writeWholeBlocks).
+// Must be called with the source's inode lock held and the destination's held for writing.
+// Params:
+//   src - The open file copied from, whose file pointer must be at the start of a block and
+//     whose modified buffered block (if any) has been written to disk.
+//   dst - The open file copied to, whose file pointer must be at the start of a block that
+//     is not buffered, and no further than the end of the file.
+//   count - The number of blocks to copy, all within the source.
+// Returns:
+//   The number of blocks copied, fewer than count only if the disk is full or the
+//   destination cannot map any more blocks.
+uint32_t
+copyWholeBlocks (struct openFile* src, struct openFile* dst, uint32_t count)
+{
+    char* buffer = NULL;
+    uint32_t copied = 0;
+    while (copied < count)
+    {
+        uint32_t runLength;
+        uint32_t blockNum = getFileBlock (src->inode, src->filePointer / BLOCK_SIZE, &runLength);
+        uint32_t wanted = (runLength < count - copied ? runLength : count - copied);
+        wanted = (wanted < COPY_CHUNK_BLOCKS ? wanted : COPY_CHUNK_BLOCKS);
+        uint32_t done = linkCopiedBlocks (src, dst, blockNum, wanted);
+        if (done == 0)
+        {
+            if (buffer == NULL)
+            {
+                buffer = malloc ((size_t)COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+                if (buffer == NULL)
+                {
+                    fprintf (stderr, "Could not allocate %u blocks\n", COPY_CHUNK_BLOCKS);
+                    exit (EXIT_FAILURE);
+                }
+            }
+            if (blockNum == 0)
+            {
+                memset (buffer, 0, (size_t)wanted * BLOCK_SIZE);
+            }
+            else
+            {
+                readDataBlocks (blockNum, wanted, buffer);
+            }
+            done = writeWholeBlocks (dst, buffer, wanted);
+            waitDataBlocks ();
+            if (done == 0)
+            {
+                break;
+            }
+        }
+        dst->stats.copiedBlocks += done;
+        copied += done;
+        src->filePointer += done * BLOCK_SIZE;
+        dst->filePointer += done * BLOCK_SIZE;
+        if (dst->filePointer > dst->inode->size)
+        {
+            dst->inode->size = dst->filePointer;
+        }
+    }
+    free (buffer);
+    return copied;
+}
+
+// Copies bytes from one open file to another through a buffer, with muread and muwrite,
+//   for what mucopy cannot copy a block at a time.
+// Params:
+//   srcFd, dstFd - As for mucopy.
+//   n - The number of bytes to copy.
+// Returns:
+//   The number of bytes copied (with the source's file pointer just past them), or -1 and
+//   sets muerrno if nothing could be read or written.
+int
+copyThroughBuffer (int srcFd, int dstFd, int n)
+{
+    char* buffer = malloc ((size_t)COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf (stderr, "Could not allocate %u blocks\n", COPY_CHUNK_BLOCKS);
+        exit (EXIT_FAILURE);
+    }
+    int copied = 0;
+    while (copied < n)
+    {
+        int chunk = (n - copied < COPY_CHUNK_BLOCKS * BLOCK_SIZE ? n - copied : COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+        uint32_t position = process->files[srcFd].filePointer;
+        int bytesRead = muread (srcFd, buffer, chunk);
+        int bytesWritten = (bytesRead > 0 ? muwrite (dstFd, buffer, bytesRead) : bytesRead);
+        if (bytesWritten < bytesRead)
+        {
+            // Leave what could not be written to be read again.
+            process->files[srcFd].filePointer = position + (bytesWritten > 0 ? bytesWritten : 0);
+        }
+        if (bytesWritten < 0)
+        {
+            copied = (copied > 0 ? copied : -1);
+            break;
+        }
+        copied += bytesWritten;
+        if (bytesWritten < chunk)
+        {
+            break;
+        }
+    }
+    free (buffer);
+    return copied;
+}
+
+// Does the work of mucd.  Must be called with namespaceLock held.
+int
+changeDirectory (const char* dirPath)
+{
+    // Walk the path and check that it ends at a directory that can be executed.
+    struct cachedDirectory* entry = findDirectory (dirPath, process->workingDirINodeNumber, process->workingDirINode);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    // Hold this directory's inode instead of the old working directory's.
+    icacheHold (entry->node);
+    icacheRelease (process->workingDirINode);
+    process->workingDirINode = entry->node;
+    process->workingDirINodeNumber = entry->iNodeNumber;
+
+    return 0;
+}
+
+// Does the work of muopen and muopenat.  Must be called with namespaceLock held.
+// Params:
+//   filePath - The path of the file to open.
+//   startINodeNumber - The number of the directory that a relative path starts from.
+//   startNode - The inode of that directory.
+//   flags - The flags given to muopen.
+int
+openByPath (const char* filePath, uint32_t startINodeNumber, struct iNode* startNode, int flags)
+{
+    // Find an unused location in the file descriptor table.
+    int fd = findFreeDescriptor ();
+
+    // Check for existence of unused location in file descriptor table.
+    if (fd < 0)
+    {
+        muerrno = MU_E_FULL_TABLE;
+        return -1;
+    }
+
+    // Walk to the directory that should contain the file.
+    struct pathLookup lookup;
+    if (walkPath (filePath, startINodeNumber, startNode, &lookup) < 0)
+    {
+        return -1;
+    }
+
+    // Find inode associated with name / check that it exists.
+    int iNodeNumber = findFile (lookup.name, lookup.dirINodeNumber, lookup.dirNode);
+    if (iNodeNumber < 0)
+    {
+        muerrno = MU_E_DOES_NOT_EXIST;
+        return -1;
+    }
+
+    // Get file's inode, which is only read from disk if no one has it cached.
+    struct iNode* node = icacheGet (iNodeNumber);
+
+    // Check that file type is regular file.
+    if ((node->mode & MU_S_REGLR) == 0)
+    {
+        icacheRelease (node);
+        muerrno = MU_E_NOT_REG;
+        return -1;
+    }
+
+    // Check for read permission if we are requesting it.
+    if ((flags & MU_O_RDONLY) && !canRead (node))
+    {
+        icacheRelease (node);
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+
+    // Check for write permission if we are requesting it.
+    if ((flags & MU_O_WRONLY) && !canWrite (node))
+    {
+        icacheRelease (node);
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+
+    // Put iNode into chosen spot in file descriptor table, set it up for appropriate
+    //   permissions with no data block loaded and file pointer at 0.
+    installOpenFile (fd, iNodeNumber, node, flags);
+
+    return fd;
+}
+
+// Does the work of muopendir.  Must be called with namespaceLock held.
+int
+openDirectory (const char* dirPath)
+{
+    int fd = findFreeDescriptor ();
+    if (fd < 0)
+    {
+        muerrno = MU_E_FULL_TABLE;
+        return -1;
+    }
+    struct cachedDirectory* entry = findDirectory (dirPath, process->workingDirINodeNumber, process->workingDirINode);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    // With neither MU_O_RDONLY nor MU_O_WRONLY, muread and muwrite refuse the descriptor.
+    icacheHold (entry->node);
+    installOpenFile (fd, entry->iNodeNumber, entry->node, 0);
+    return fd;
+}
+
+// Does the work of muopenat.  Must be called with namespaceLock held.
+int
+openAt (int dirFd, const char* filePath, int flags)
+{
+    if (!isValidDescriptor (dirFd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    // The descriptor shares the directory's inode, so it sees every entry added since.
+    struct openFile* dir = &process->files[dirFd];
+    if ((dir->inode->mode & MU_S_DIREC) == 0)
+    {
+        muerrno = MU_E_NOT_DIR;
+        return -1;
+    }
+    return openByPath (filePath, dir->iNodeNumber, dir->inode, flags);
+}
+
+// Does the work of mucreat.  Must be called with namespaceLock held.
+int
+createByName (const char* filePath, int mode)
+{
+    int fd = findFreeDescriptor ();
+    if (fd < 0)
+    {
+        muerrno = MU_E_FULL_TABLE;
+        return -1;
+    }
+    struct pathLookup lookup;
+    if (walkPath (filePath, process->workingDirINodeNumber, process->workingDirINode, &lookup) < 0)
+    {
+        return -1;
+    }
+    if (!canWrite (lookup.dirNode) || !canExecute (lookup.dirNode))
+    {
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+    if (findFile (lookup.name, lookup.dirINodeNumber, lookup.dirNode) >= 0)
+    {
+        muerrno = MU_E_EXISTS;
+        return -1;
+    }
+
+    int iNodeNumber = findFreeINode ();
+    if (iNodeNumber < 0)
+    {
+        muerrno = MU_E_NO_SPACE;
+        return -1;
+    }
+    struct iNode* node = icacheGet (iNodeNumber);
+    memset (node, 0, sizeof (*node));
+    node->userOwner = process->activeUserNumber;
+    node->groupOwner = process->activeGroupNumber;
+    node->mode = (mode & (MU_S_IRWXU | MU_S_IRWXG | MU_S_IRWXO)) | MU_S_REGLR;
+    // A new file keeps its contents in its inode until they outgrow it, unless it is to be
+    //   compressed.
+    if (usesCompression () && (mode & MU_S_COMPRESSED))
+    {
+        node->mode |= MU_S_COMPRESSED;
+    }
+    else if (usesInlineData ())
+    {
+        node->mode |= MU_S_INLINE;
+    }
+    node->size = 0;
+    node->linkCount = 1;
+    icacheWriteBack (node);
+
+    if (addDirEntry (lookup.dirINodeNumber, lookup.dirNode, lookup.name, iNodeNumber) < 0)
+    {
+        node->mode = MU_S_AVAIL;
+        node->linkCount = 0;
+        icacheWriteBack (node);
+        icacheRelease (node);
+        muerrno = MU_E_NO_SPACE;
+        return -1;
+    }
+
+    installOpenFile (fd, iNodeNumber, node, MU_O_WRONLY);
+    return fd;
+}
+
+// Does the work of muunlink.  Must be called with namespaceLock held.
+int
+unlinkByName (const char* filePath)
+{
+    struct pathLookup lookup;
+    if (walkPath (filePath, process->workingDirINodeNumber, process->workingDirINode, &lookup) < 0)
+    {
+        return -1;
+    }
+    int iNodeNumber = findFile (lookup.name, lookup.dirINodeNumber, lookup.dirNode);
+    if (iNodeNumber < 0)
+    {
+        muerrno = MU_E_DOES_NOT_EXIST;
+        return -1;
+    }
+    struct iNode* node = icacheGet (iNodeNumber);
+    int result = -1;
+    if ((node->mode & MU_S_REGLR) == 0)
+    {
+        muerrno = MU_E_NOT_REG;
+    }
+    else if (!canWrite (lookup.dirNode) || !canExecute (lookup.dirNode))
+    {
+        muerrno = MU_E_PERMISSION;
+    }
+    else if (isOpen (iNodeNumber))
+    {
+        muerrno = MU_E_BUSY;
+    }
+    else
+    {
+        removeDirEntry (lookup.dirINodeNumber, lookup.dirNode, lookup.name);
+
+        // Release the file's storage once nothing refers to it any more.
+        if (--node->linkCount == 0)
+        {
+            releaseFileBlocks (node);
+            memset (node, 0, sizeof (*node));
+            node->mode = MU_S_AVAIL;
+        }
+        icacheWriteBack (node);
+        result = 0;
+    }
+    icacheRelease (node);
+    return result;
+}
+
+// Moves the data blocks of a file that are scattered over the disk into as few runs of
+//   free blocks as it can, up to maxRuns of them (the longest it can find, halving the
+//   length each time).  Holes stay holes, so the blocks on either side of one count as
+//   adjacent.  Blocks shared with other files are copied like the rest, so the file stops
+//   sharing them.
+// The copy reaches the disk before the inode points at it, and the inode before the old
+//   blocks are released, so a crash at any point leaves the file whole (at worst with
+//   blocks leaked, which mufsck --repair recovers).
+// Must be called with namespaceLock held, for a file that no process has open, or as
+//   compactBlockMap does.
+// Params:
+//   node - The file's cached inode, which will be updated and written to disk.
+//   maxRuns - The most runs the data blocks may be moved into.
+// Returns:
+//   1 if the file was moved, 0 if its data blocks are already in one run (or it has
+//   none), or -1 if the free blocks are not in long enough runs.
+int
+relocateFile (struct iNode* node, uint32_t maxRuns)
+{
+    if ((node->mode & MU_S_INLINE) || node->size == 0)
+    {
+        return 0;
+    }
+    uint32_t mapped = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t dataBlocks = 0;
+    uint32_t nextBlock = 0;
+    int scattered = 0;
+    uint32_t runLength;
+    for (uint32_t blockIndex = 0; blockIndex < mapped; blockIndex += runLength)
+    {
+        uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+        runLength = (runLength < mapped - blockIndex ? runLength : mapped - blockIndex);
+        if (blockNum != 0)
+        {
+            scattered |= (dataBlocks > 0 && blockNum != nextBlock);
+            dataBlocks += runLength;
+            nextBlock = blockNum + runLength;
+        }
+    }
+    if (!scattered)
+    {
+        return 0;
+    }
+    struct extent* runs = malloc ((size_t)maxRuns * sizeof (struct extent));
+    if (runs == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for %u runs\n", maxRuns);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t runCount = 0;
+    uint32_t placed = 0;
+    for (uint32_t length = dataBlocks; placed < dataBlocks && runCount < maxRuns && length > 0; )
+    {
+        uint32_t wanted = (length < dataBlocks - placed ? length : dataBlocks - placed);
+        int firstBlock = allocateRun (wanted);
+        if (firstBlock < 0)
+        {
+            length = wanted / 2;
+            continue;
+        }
+        runs[runCount].startBlock = firstBlock;
+        runs[runCount++].length = wanted;
+        placed += wanted;
+    }
+
+    char* buffer = malloc ((size_t)RELOCATE_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf (stderr, "Could not allocate a buffer of %u blocks\n", RELOCATE_CHUNK_BLOCKS);
+        exit (EXIT_FAILURE);
+    }
+    // Copy the data, building the new block map as it goes.
+    struct iNode moved = *node;
+    memset (moved.directBlocks, 0, INLINE_DATA_SIZE);
+    uint32_t run = 0;
+    uint32_t runOffset = 0;
+    uint32_t blockIndex = 0;
+    int mapFailed = (placed < dataBlocks);
+    while (blockIndex < mapped && !mapFailed)
+    {
+        uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+        uint32_t count = (runLength < mapped - blockIndex ? runLength : mapped - blockIndex);
+        if (blockNum == 0)
+        {
+            mapFailed = (appendFileHole (&moved, blockIndex, count) < 0);
+            blockIndex += count;
+            continue;
+        }
+        if (count > RELOCATE_CHUNK_BLOCKS)
+        {
+            count = RELOCATE_CHUNK_BLOCKS;
+        }
+        if (count > runs[run].length - runOffset)
+        {
+            count = runs[run].length - runOffset;
+        }
+        uint32_t destination = runs[run].startBlock + runOffset;
+        readDataBlocks (blockNum, count, buffer);
+        writeDataBlocks (destination, count, buffer);
+        for (uint32_t offset = 0; offset < count && !mapFailed; ++offset)
+        {
+            mapFailed = (appendFileBlock (&moved, blockIndex + offset, destination + offset) < 0);
+        }
+        runOffset += count;
+        if (runOffset == runs[run].length)
+        {
+            ++run;
+            runOffset = 0;
+        }
+        blockIndex += count;
+    }
+    free (buffer);
+    if (mapFailed)
+    {
+        // The new map can only have lacked a block for its indirect extent block.
+        if (usesExtents () && moved.indirectExtentBlock != 0)
+        {
+            releaseBlock (moved.indirectExtentBlock);
+        }
+        for (run = 0; run < runCount; ++run)
+        {
+            for (uint32_t offset = 0; offset < runs[run].length; ++offset)
+            {
+                releaseBlock (runs[run].startBlock + offset);
+            }
+        }
+        free (runs);
+        return -1;
+    }
+
+    for (run = 0; run < runCount; ++run)
+    {
+        writeBackDataBlocks (runs[run].startBlock, runs[run].length);
+    }
+    free (runs);
+    mufs_sync ();
+    struct iNode old = *node;
+    *node = moved;
+    icacheWriteBack (node);
+    mufs_sync ();
+    releaseFileBlocks (&old);
+    return 1;
+}
+
+// Copies bytes from the caller's buffer into a file that is neither inline nor compressed,
+//   at its file pointer, through the file's buffer or (for whole blocks) straight to disk.
+// Must be called with the file's inode lock held for writing, once any gap between the
+//   end of the file and the file pointer is a hole (see padWithHoles).
+// Params:
+//   file - The open file.
+//   buffer - The bytes to copy.
+//   n - The number of bytes.
+//   limit - The largest size the file may reach.
+// Returns:
+//   The number of bytes written, which stops short if the disk is full or the file's block
+//   map cannot take another extent.
+int
+writeBlockData (struct openFile* file, const char* buffer, int n, uint32_t limit)
+{
+    int bytesWritten = 0;
+    while (bytesWritten < n && file->filePointer < limit)
+    {
+        uint32_t blockIndex = file->filePointer / BLOCK_SIZE;
+        uint32_t offset = file->filePointer % BLOCK_SIZE;
+
+        // If wrong block loaded, unload it and write if dirty.
+        if (file->currentBlockIndex != blockIndex && file->currentBlockIndex != NO_BLOCK)
+        {
+            flushCurrentBlock (file);
+            file->currentBlockIndex = NO_BLOCK;
+        }
+
+        // If no block loaded, load it.
+        if (file->currentBlockIndex == NO_BLOCK)
+        {
+            // Whole blocks go straight from the caller's buffer to disk.
+            uint32_t wholeBlocks = (offset == 0 ? (uint32_t)(n - bytesWritten) / BLOCK_SIZE : 0);
+            if (wholeBlocks > (limit - file->filePointer) / BLOCK_SIZE)
+            {
+                wholeBlocks = (limit - file->filePointer) / BLOCK_SIZE;
+            }
+            if (wholeBlocks > 0)
+            {
+                uint32_t count = writeWholeBlocks (file, buffer + bytesWritten, wholeBlocks);
+                if (count == 0)
+                {
+                    break;
+                }
+                bytesWritten += count * BLOCK_SIZE;
+                file->filePointer += count * BLOCK_SIZE;
+                if (file->filePointer > file->inode->size)
+                {
+                    file->inode->size = file->filePointer;
+                }
+                continue;
+            }
+
+            // If block does not yet exist, allocate one for it.
+            if (blockIndex >= (file->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+            {
+                uint32_t count;
+                int blockNum = allocateFileBlocks (file, 1, &count);
+                if (blockNum < 0)
+                {
+                    break;
+                }
+                if (appendFileBlock (file->inode, blockIndex, blockNum) < 0)
+                {
+                    releaseBlock (blockNum);
+                    break;
+                }
+                memset (file->currentData, 0, BLOCK_SIZE);
+                file->currentHole = 0;
+                file->currentShared = 0;
+            }
+            // Load the block
+            else
+            {
+                uint32_t blockNum = getFileBlock (file->inode, blockIndex, NULL);
+                if (blockNum == 0)
+                {
+                    memcpy (file->currentData, zeroPage, BLOCK_SIZE);
+                }
+                else
+                {
+                    readDataBlock (blockNum, file->currentData);
+                }
+                file->currentHole = (blockNum == 0);
+                file->currentShared = (blockNum != 0 && getBlockShares (blockNum) > 0);
+            }
+            file->currentBlockIndex = blockIndex;
+        }
+
+        // A block in a hole or a shared block (perhaps buffered by an earlier read) needs a
+        //   data block of its own.
+        if (file->currentHole)
+        {
+            uint32_t count;
+            if (fillHoleBlocks (file, blockIndex, 1, &count) < 0)
+            {
+                break;
+            }
+            file->currentHole = 0;
+        }
+        else if (file->currentShared)
+        {
+            uint32_t count;
+            if (unshareBlocks (file, blockIndex, 1, &count) < 0)
+            {
+                break;
+            }
+            file->currentShared = 0;
+        }
+
+        // Copy as much of the caller's data as fits in this block, increasing size if necessary.
+        uint32_t span = BLOCK_SIZE - offset;
+        if (span > (uint32_t)(n - bytesWritten))
+        {
+            span = n - bytesWritten;
+        }
+        if (span > limit - file->filePointer)
+        {
+            span = limit - file->filePointer;
+        }
+        memcpy (file->currentData + offset, buffer + bytesWritten, span);
+        file->dirty = 1;
+        bytesWritten += span;
+        file->filePointer += span;
+        if (file->filePointer > file->inode->size)
+        {
+            file->inode->size = file->filePointer;
+        }
+    }
+
+    return bytesWritten;
+}
+
+// Moves a file whose block map has run out of extents into fewer runs of blocks (see
+//   relocateFile), so that a write can go on while the disk has room.  The runs may be no
+//   more than half of the extents that the file's data takes, so that moving frees at
+//   least as many as it keeps; a file with so many holes that this leaves nothing to gain
+//   stays where it is.
+// Must be called with the file's inode lock held for writing.  Every other file table
+//   entry for the file has written its buffered block back (see publishFileData), and
+//   drops it once it sees the map change.
+// Params:
+//   file - The open file, which must not be inline.
+// Returns:
+//   1 if the file moved, or 0 if it did not.
+int
+compactBlockMap (struct openFile* file)
+{
+    struct iNode* node = file->inode;
+    if (!usesExtents () || node->extentCount + 2 < MAX_EXTENTS)
+    {
+        return 0;
+    }
+    // Each hole keeps an extent of its own, and may split a run of data in two.
+    uint32_t mapped = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t holes = 0;
+    uint32_t runLength;
+    for (uint32_t blockIndex = 0; blockIndex < mapped; blockIndex += runLength)
+    {
+        holes += (getFileBlock (node, blockIndex, &runLength) == 0);
+    }
+    if (2 * holes + 2 > node->extentCount)
+    {
+        return 0;
+    }
+    flushCurrentBlock (file);
+    file->currentBlockIndex = NO_BLOCK;
+    // The blocks set aside for the file follow on from where it was, not where it will be.
+    releaseReservation (file->iNodeNumber);
+    if (relocateFile (node, (node->extentCount - 2 * holes) / 2) <= 0)
+    {
+        return 0;
+    }
+    file->seenMapChanges = ++iNodeLocks[file->iNodeNumber].mapChanges;
+    return 1;
+}
+
+// Does the work of mudefrag.  Must be called with namespaceLock held.
+int
+defragByName (const char* filePath)
+{
+    struct pathLookup lookup;
+    if (walkPath (filePath, process->workingDirINodeNumber, process->workingDirINode, &lookup) < 0)
+    {
+        return -1;
+    }
+    int iNodeNumber = findFile (lookup.name, lookup.dirINodeNumber, lookup.dirNode);
+    if (iNodeNumber < 0)
+    {
+        muerrno = MU_E_DOES_NOT_EXIST;
+        return -1;
+    }
+    struct iNode* node = icacheGet (iNodeNumber);
+    int result = -1;
+    if ((node->mode & MU_S_REGLR) == 0)
+    {
+        muerrno = MU_E_NOT_REG;
+    }
+    else if (!canWrite (node))
+    {
+        muerrno = MU_E_PERMISSION;
+    }
+    // An open file may have a block buffered, or be read through its block map under its
+    //   inode lock (which this does not take), so only a closed file can move.
+    else if (isOpen (iNodeNumber))
+    {
+        muerrno = MU_E_BUSY;
+    }
+    else
+    {
+        result = relocateFile (node, 1);
+        if (result < 0)
+        {
+            muerrno = MU_E_NO_SPACE;
+        }
+    }
+    icacheRelease (node);
+    return result;
+}
+
+// Does the work of muls.  Must be called with namespaceLock held.
+void
+listWorkingDir ()
+{
+    struct dirEntry* entries = readDirectory (process->workingDirINode);
+    uint32_t entryCount = process->workingDirINode->size / DIR_ENTRY_LENGTH;
+    for (uint32_t entryIndex = firstEntryIndex (process->workingDirINode); entryIndex < entryCount; ++entryIndex)
+    {
+        struct dirEntry* entry = &entries[entryIndex];
+        if (entry->name[0] == '\0')
+        {
+            continue;
+        }
+        struct iNode* cached = icacheGet (entry->iNodeNumber);
+        struct iNode node = *cached;
+        icacheRelease (cached);
+        const char* userName = lookUpUserName (node.userOwner);
+        const char* groupName = lookupUpGroupName (node.groupOwner);
+        printf ("%c%c%c%c%c%c%c%c%c%c %10s %10s %s\n",
+                (node.mode & MU_S_DIREC) ? 'd' : '-',
+                (node.mode & MU_S_IRUSR) ? 'r' : '-',
+                (node.mode & MU_S_IWUSR) ? 'w' : '-',
+                (node.mode & MU_S_IXUSR) ? 'x' : '-',
+                (node.mode & MU_S_IRGRP) ? 'r' : '-',
+                (node.mode & MU_S_IWGRP) ? 'w' : '-',
+                (node.mode & MU_S_IXGRP) ? 'x' : '-',
+                (node.mode & MU_S_IROTH) ? 'r' : '-',
+                (node.mode & MU_S_IWOTH) ? 'w' : '-',
+                (node.mode & MU_S_IXOTH) ? 'x' : '-',
+                userName != NULL ? userName : "?",
+                groupName != NULL ? groupName : "?",
+                entry->name);
+    }
+    free (entries);
+}
+
+//// Library functions /////////////////////////////////////////
+
+int
+muinit (const char* userName, const char* groupName)
+{
+    // Look up user and group numbers, check for existence and membership.
+    int userNumber = lookUpUserNumber (userName);
+    if (userNumber == -1)
+    {
+        muerrno = MU_E_NO_SUCH_USER;
+        return -1;
+    }
+    int groupNumber = lookUpGroupNumber (groupName);
+    if (groupNumber == -1)
+    {
+        muerrno = MU_E_NO_SUCH_GROUP;
+        return -1;
+    }
+    if (isUserInGroup (userNumber, groupNumber) == 0)
+    {
+        muerrno = MU_E_NOT_MEMBER;
+        return -1;
+    }
+    // Set user and group number.
+    process->activeUserNumber = userNumber;
+    process->activeGroupNumber = groupNumber;
+
+    // Set each file table entry to be for inode number -1, with a buffer sized for this filesystem.
+    pthread_mutex_lock (&namespaceLock);
+    dropOpenFiles (process);
+    prepareINodeLocks ();
+    for (int fd = 0; fd < FILE_TABLE_SIZE; ++fd)
+    {
+        free (process->files[fd].currentData);
+        free (process->files[fd].unitData);
+        process->files[fd].unitData = NULL;
+        process->files[fd].currentData = malloc (BLOCK_SIZE);
+        if (process->files[fd].currentData == NULL)
+        {
+            fprintf (stderr, "Could not allocate a file buffer of %u bytes\n", BLOCK_SIZE);
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    // Another disk may have been loaded since, so forget every inode that nothing else
+    //   holds, then start in the root directory.
+    if (process->workingDirINode != NULL)
+    {
+        icacheDiscard (process->workingDirINode);
+    }
+    dcacheClear ();
+    for (int slot = 0; slot < DIR_CACHE_SIZE; ++slot)
+    {
+        if (dirCache[slot].valid)
+        {
+            icacheDiscard (dirCache[slot].node);
+        }
+    }
+    memset (dirCache, 0, sizeof (dirCache));
+    icacheClear ();
+    process->workingDirINodeNumber = ROOT_INODE_NUMBER;
+    process->workingDirINode = icacheGet (ROOT_INODE_NUMBER);
+    pthread_mutex_unlock (&namespaceLock);
+
+    return 0;
+}
+
+int
+mucd (const char* dirPath)
+{
+    lockNamespace ();
+    int result = changeDirectory (dirPath);
+    unlockNamespace ();
+    return result;
+}
+
+int
+muopen (const char* filePath, int flags)
+{
+    lockNamespace ();
+    int result = openByPath (filePath, process->workingDirINodeNumber, process->workingDirINode, flags);
+    unlockNamespace ();
+    return result;
+}
+
+int
+muopendir (const char* dirPath)
+{
+    lockNamespace ();
+    int result = openDirectory (dirPath);
+    unlockNamespace ();
+    return result;
+}
+
+int
+muopenat (int dirFd, const char* filePath, int flags)
+{
+    lockNamespace ();
+    int result = openAt (dirFd, filePath, flags);
+    unlockNamespace ();
+    return result;
+}
+
+int
+mucreat (const char* filePath, int mode)
+{
+    lockNamespace ();
+    int result = createByName (filePath, mode);
+    unlockNamespace ();
+    return result;
+}
+
+int
+muunlink (const char* filePath)
+{
+    lockNamespace ();
+    int result = unlinkByName (filePath);
+    unlockNamespace ();
+    return result;
+}
+
+int
+muclose (int fd)
+{
+    // Check for valid file descriptor.
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+
+    struct openFile* file = &process->files[fd];
+
+    // Write block to disk if dirty.
+    pthread_rwlock_wrlock (&iNodeLocks[file->iNodeNumber].lock);
+    flushCurrentBlock (file);
+    pthread_rwlock_unlock (&iNodeLocks[file->iNodeNumber].lock);
+
+    // Let a batch that the flusher may be writing from this file land first.
+    if (file->flags & MU_O_WRONLY)
+    {
+        waitForFlusher ();
+    }
+
+    // Mark location's inode as available, writing the inode back if this was the last
+    //   reference to changes that have not been written yet.
+    pthread_mutex_lock (&namespaceLock);
+    if (--iNodeLocks[file->iNodeNumber].openCount == 0)
+    {
+        releaseReservation (file->iNodeNumber);
+    }
+    icacheRelease (file->inode);
+    file->inode = NULL;
+    file->iNodeNumber = -1;
+    pthread_mutex_unlock (&namespaceLock);
+
+    return 0;
+}
+
+int
+mufsync (int fd)
+{
+    // Check for valid file descriptor.
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    struct openFile* file = &process->files[fd];
+
+    // Write back the file's dirty blocks, one run of consecutive blocks at a time, then its
+    //   inode, which every descriptor shares (so it includes growth through any of them).
+    pthread_rwlock_wrlock (&iNodeLocks[file->iNodeNumber].lock);
+    flushCurrentBlock (file);
+    const struct iNode* node = file->inode;
+    if ((node->mode & MU_S_INLINE) == 0)
+    {
+        uint32_t blockCount = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t blockIndex = 0;
+        while (blockIndex < blockCount)
+        {
+            uint32_t runLength;
+            uint32_t blockNum = getFileBlock (node, blockIndex, &runLength);
+            if (runLength > blockCount - blockIndex)
+            {
+                runLength = blockCount - blockIndex;
+            }
+            if (blockNum != 0)
+            {
+                writeBackDataBlocks (blockNum, runLength);
+            }
+            blockIndex += runLength;
+        }
+    }
+    icacheWriteBack (file->inode);
+    pthread_rwlock_unlock (&iNodeLocks[file->iNodeNumber].lock);
+
+    mufs_datasync ();
+    return 0;
+}
+
+int
+mufallocate (int fd, uint32_t length)
+{
+    // Check for valid file descriptor.
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    struct openFile* file = &process->files[fd];
+
+    // Check that file is open for writing.
+    if ((file->flags & MU_O_WRONLY) == 0)
+    {
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+    if (length > maxFileSize ())
+    {
+        muerrno = MU_E_NO_SPACE;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock (&iNodeLocks[file->iNodeNumber].lock);
+    refreshBlockMap (file);
+    int result = extendFile (file, length);
+    publishFileData (file);
+    pthread_rwlock_unlock (&iNodeLocks[file->iNodeNumber].lock);
+    if (result < 0)
+    {
+        muerrno = MU_E_NO_SPACE;
+    }
+    return result;
+}
+
+int
+museek (int fd, uint32_t offset)
+{
+    // Check for valid file descriptor.
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    if (offset > maxFileSize ())
+    {
+        muerrno = MU_E_NO_SPACE;
+        return -1;
+    }
+    // The buffered block stays; the next muread / muwrite swaps it out if it must.
+    process->files[fd].filePointer = offset;
+    return 0;
+}
+
+void
+mureserve (uint32_t blocks)
+{
+    reserveBlocks = blocks;
+}
+
+void
+mudedup (int enabled)
+{
+    dedupWrites = enabled;
+}
+
+int
+muread (int fd, char* buffer, int n)
+{
+    // Check for valid file descriptor.
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    struct openFile* file = &process->files[fd];
+
+    // Check that file is open for reading.
+    if ((file->flags & MU_O_RDONLY) == 0)
+    {
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+
+    // Read until n bytes have been read or end of file reached.
+    // Other processes may read the file at the same time, but not change it.
+    pthread_rwlock_rdlock (&iNodeLocks[file->iNodeNumber].lock);
+    uint64_t syscallsBefore = getSyscallCount ();
+    refreshBlockMap (file);
+    int bytesRead = 0;
+    if (file->inode->mode & MU_S_INLINE)
+    {
+        bytesRead = readInlineData (file, buffer, n);
+    }
+    else if (file->inode->mode & MU_S_COMPRESSED)
+    {
+        bytesRead = readCompressedData (file, buffer, n);
+    }
+    while ((file->inode->mode & MU_S_COMPRESSED) == 0 && bytesRead < n && file->filePointer < file->inode->size)
+    {
+        uint32_t blockIndex = file->filePointer / BLOCK_SIZE;
+        uint32_t offset = file->filePointer % BLOCK_SIZE;
+
+        // If wrong block loaded, unload it and write if dirty.
+        if (file->currentBlockIndex != blockIndex && file->currentBlockIndex != NO_BLOCK)
+        {
+            flushCurrentBlock (file);
+            file->currentBlockIndex = NO_BLOCK;
+        }
+
+        // If no block loaded, load it.
+        if (file->currentBlockIndex == NO_BLOCK)
+        {
+            // Whole blocks go straight into the caller's buffer, with one request in flight
+            //   for each disk-contiguous run of them.
+            uint32_t wholeBlocks = wholeBlocksAhead (file, n - bytesRead);
+            if (wholeBlocks > 0)
+            {
+                noteBlockAccess (file, blockIndex, wholeBlocks);
+                uint32_t queued = 0;
+                while (queued < wholeBlocks)
+                {
+                    uint32_t runLength;
+                    uint32_t blockNum = getFileBlock (file->inode, blockIndex + queued, &runLength);
+                    uint32_t count = (runLength < wholeBlocks - queued ? runLength : wholeBlocks - queued);
+                    char* destination = buffer + bytesRead + (size_t)queued * BLOCK_SIZE;
+                    if (blockNum == 0)
+                    {
+                        for (uint32_t index = 0; index < count; ++index)
+                        {
+                            memcpy (destination + (size_t)index * BLOCK_SIZE, zeroPage, BLOCK_SIZE);
+                        }
+                        file->stats.holeBlocks += count;
+                    }
+                    else
+                    {
+                        readDataBlocksAsync (blockNum, count, destination);
+                    }
+                    queued += count;
+                }
+                waitDataBlocks ();
+                file->stats.directBlocks += wholeBlocks;
+                bytesRead += wholeBlocks * BLOCK_SIZE;
+                file->filePointer += wholeBlocks * BLOCK_SIZE;
+                continue;
+            }
+            noteBlockAccess (file, blockIndex, 1);
+            uint32_t blockNum = getFileBlock (file->inode, blockIndex, NULL);
+            if (blockNum == 0)
+            {
+                memcpy (file->currentData, zeroPage, BLOCK_SIZE);
+                ++file->stats.holeBlocks;
+            }
+            else
+            {
+                readDataBlock (blockNum, file->currentData);
+            }
+            file->currentBlockIndex = blockIndex;
+            file->currentHole = (blockNum == 0);
+            file->currentShared = (blockNum != 0 && getBlockShares (blockNum) > 0);
+        }
+
+        // Copy as much of the buffered block as the caller wants and the file holds.
+        uint32_t span = BLOCK_SIZE - offset;
+        if (span > (uint32_t)(n - bytesRead))
+        {
+            span = n - bytesRead;
+        }
+        if (span > file->inode->size - file->filePointer)
+        {
+            span = file->inode->size - file->filePointer;
+        }
+        memcpy (buffer + bytesRead, file->currentData + offset, span);
+        bytesRead += span;
+        file->filePointer += span;
+    }
+    pthread_rwlock_unlock (&iNodeLocks[file->iNodeNumber].lock);
+    if (bytesRead < 0)
+    {
+        muerrno = MU_E_CORRUPT;
+        return -1;
+    }
+
+    ++file->stats.readCalls;
+    file->stats.bytesRead += bytesRead;
+    file->stats.syscalls += getSyscallCount () - syscallsBefore;
+    return bytesRead;
+}
+
+int
+muwrite (int fd, const char* buffer, int n)
+{
+    // Check for valid file descriptor.
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    struct openFile* file = &process->files[fd];
+
+    // Check that file is open for writing.
+    if ((file->flags & MU_O_WRONLY) == 0)
+    {
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+
+    // Write until n bytes have been written or file is maximum length.
+    // No other process may use the file meanwhile.
+    pthread_rwlock_wrlock (&iNodeLocks[file->iNodeNumber].lock);
+    uint64_t syscallsBefore = getSyscallCount ();
+    refreshBlockMap (file);
+    uint64_t mapChangesBefore = iNodeLocks[file->iNodeNumber].mapChanges;
+    int bytesWritten = 0;
+    uint32_t limit = maxFileSize ();
+    if (file->inode->mode & MU_S_INLINE)
+    {
+        if ((uint64_t)file->filePointer + n <= INLINE_DATA_SIZE)
+        {
+            writeInlineData (file, buffer, n);
+            bytesWritten = n;
+        }
+        else if (promoteInlineData (file) < 0)
+        {
+            // The contents have nowhere to go, so nothing can be written.
+            limit = 0;
+        }
+    }
+    else if (file->inode->mode & MU_S_COMPRESSED)
+    {
+        // Each unit is stored as it is written, holes and all, so there is nothing left to do.
+        bytesWritten = writeCompressedData (file, buffer, n);
+        limit = 0;
+    }
+    // A writer that has seeked past the end leaves a hole behind it.
+    uint32_t sizeBefore = file->inode->size;
+    if (bytesWritten < n && file->filePointer > file->inode->size && file->filePointer < limit
+        && padWithHoles (file) < 0)
+    {
+        limit = 0;
+    }
+    bytesWritten += writeBlockData (file, buffer + bytesWritten, n - bytesWritten, limit);
+    // A file stopped by its block map rather than by a full disk tries once more, moved.
+    if (bytesWritten < n && file->filePointer < limit && compactBlockMap (file))
+    {
+        bytesWritten += writeBlockData (file, buffer + bytesWritten, n - bytesWritten, limit);
+    }
+
+    // A write that stored nothing takes back the hole it made.
+    if (bytesWritten == 0 && file->inode->size != sizeBefore)
+    {
+        releaseFileBlocksFrom (file->inode, (sizeBefore + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        file->inode->size = sizeBefore;
+    }
+
+    // Let the direct writes finish.  The inode is written when its last reference is
+    //   released, unless data moved out of blocks that have since been released (a unit
+    //   stored, or shared blocks given blocks of their own), which the inode on disk must
+    //   stop pointing at at once.
+    waitDataBlocks ();
+    publishFileData (file);
+    if (iNodeLocks[file->iNodeNumber].mapChanges != mapChangesBefore)
+    {
+        icacheWriteBack (file->inode);
+    }
+    else
+    {
+        icacheMarkDirty (file->inode);
+    }
+    pthread_rwlock_unlock (&iNodeLocks[file->iNodeNumber].lock);
+    if (bytesWritten < 0)
+    {
+        muerrno = MU_E_CORRUPT;
+        return -1;
+    }
+    // A write that could store none of its bytes fails; one that stored some returns that.
+    if (bytesWritten == 0 && n > 0)
+    {
+        muerrno = MU_E_NO_SPACE;
+        return -1;
+    }
+
+    ++file->stats.writeCalls;
+    file->stats.bytesWritten += bytesWritten;
+    file->stats.syscalls += getSyscallCount () - syscallsBefore;
+    return bytesWritten;
+}
+
+int
+mucopy (int srcFd, int dstFd, int n)
+{
+    // Check for valid file descriptors.
+    if (!isValidDescriptor (srcFd) || !isValidDescriptor (dstFd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    struct openFile* src = &process->files[srcFd];
+    struct openFile* dst = &process->files[dstFd];
+
+    // Check that the files are open for reading and writing.
+    if ((src->flags & MU_O_RDONLY) == 0 || (dst->flags & MU_O_WRONLY) == 0)
+    {
+        muerrno = MU_E_PERMISSION;
+        return -1;
+    }
+
+    // A file copied onto itself goes through a buffer, one chunk after another.
+    if (src->iNodeNumber == dst->iNodeNumber)
+    {
+        return copyThroughBuffer (srcFd, dstFd, n);
+    }
+
+    // Other processes may read the source at the same time, but not change it, and no other
+    //   process may use the destination.  The locks are taken in order of inode number, so
+    //   that copies between the same files in opposite directions cannot deadlock.
+    pthread_rwlock_t* srcLock = &iNodeLocks[src->iNodeNumber].lock;
+    pthread_rwlock_t* dstLock = &iNodeLocks[dst->iNodeNumber].lock;
+    if (src->iNodeNumber < dst->iNodeNumber)
+    {
+        pthread_rwlock_rdlock (srcLock);
+        pthread_rwlock_wrlock (dstLock);
+    }
+    else
+    {
+        pthread_rwlock_wrlock (dstLock);
+        pthread_rwlock_rdlock (srcLock);
+    }
+    uint64_t syscallsBefore = getSyscallCount ();
+    refreshBlockMap (src);
+    refreshBlockMap (dst);
+    uint64_t mapChangesBefore = iNodeLocks[dst->iNodeNumber].mapChanges;
+    // Copy until n bytes have been copied, the end of the source or the maximum length of
+    //   the destination.
+    uint32_t length = (src->filePointer < src->inode->size && n > 0 ? src->inode->size - src->filePointer : 0);
+    if (length > (uint32_t)n)
+    {
+        length = n;
+    }
+    uint32_t limit = maxFileSize ();
+    uint32_t room = (dst->filePointer < limit ? limit - dst->filePointer : 0);
+    if (length > room)
+    {
+        length = room;
+    }
+
+    // Whole blocks are copied a block at a time when both file pointers are at the start of
+    //   a block and both files store their data a block at a time.
+    uint32_t wholeBlocks = length / BLOCK_SIZE;
+    if (src->filePointer % BLOCK_SIZE != 0 || dst->filePointer % BLOCK_SIZE != 0
+        || (src->inode->mode & MU_S_REGLR) == 0 || (dst->inode->mode & MU_S_REGLR) == 0
+        || (src->inode->mode & MU_S_INLINE) || ((src->inode->mode | dst->inode->mode) & MU_S_COMPRESSED))
+    {
+        wholeBlocks = 0;
+    }
+    if (wholeBlocks > 0 && (dst->inode->mode & MU_S_INLINE) && promoteInlineData (dst) < 0)
+    {
+        wholeBlocks = 0;
+    }
+    // A copy past the end of the destination leaves a hole behind it.
+    uint32_t sizeBefore = dst->inode->size;
+    if (wholeBlocks > 0 && padWithHoles (dst) < 0)
+    {
+        wholeBlocks = 0;
+    }
+    uint32_t copied = 0;
+    if (wholeBlocks > 0)
+    {
+        // The blocks are copied from disk, so a modified block must be written there first.
+        flushCurrentBlock (src);
+        flushCurrentBlock (dst);
+        dst->currentBlockIndex = NO_BLOCK;
+        copied = copyWholeBlocks (src, dst, wholeBlocks) * BLOCK_SIZE;
+        // A copy that stored nothing takes back the hole it made.
+        if (copied == 0 && dst->inode->size != sizeBefore)
+        {
+            releaseFileBlocksFrom (dst->inode, (sizeBefore + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            dst->inode->size = sizeBefore;
+        }
+    }
+
+    // As for muwrite, the inode is written at once if blocks it pointed at were released.
+    publishFileData (dst);
+    if (iNodeLocks[dst->iNodeNumber].mapChanges != mapChangesBefore)
+    {
+        icacheWriteBack (dst->inode);
+    }
+    else
+    {
+        icacheMarkDirty (dst->inode);
+    }
+    pthread_rwlock_unlock (srcLock);
+    pthread_rwlock_unlock (dstLock);
+    src->stats.bytesRead += copied;
+    dst->stats.bytesWritten += copied;
+    dst->stats.syscalls += getSyscallCount () - syscallsBefore;
+
+    // The rest (the part of a block at the end, or everything if the blocks do not line up)
+    //   goes through a buffer, unless the destination ran out of room.
+    if (copied == wholeBlocks * BLOCK_SIZE && copied < length)
+    {
+        int rest = copyThroughBuffer (srcFd, dstFd, length - copied);
+        if (rest < 0)
+        {
+            return (copied > 0 ? (int)copied : -1);
+        }
+        copied += rest;
+    }
+    return copied;
+}
+
+int
+mudefrag (const char* filePath)
+{
+    lockNamespace ();
+    int result = defragByName (filePath);
+    unlockNamespace ();
+    return result;
+}
+
+int
+mufstats (int fd, struct muFileStats* stats)
+{
+    if (!isValidDescriptor (fd))
+    {
+        muerrno = MU_E_INVALID_FD;
+        return -1;
+    }
+    *stats = process->files[fd].stats;
+    return 0;
+}
+
+void
+muls ()
+{
+    lockNamespace ();
+    listWorkingDir ();
+    unlockNamespace ();
+}
+
+struct muContext*
+munewcontext ()
+{
+    struct muContext* context = calloc (1, sizeof (struct muContext));
+    if (context == NULL)
+    {
+        return NULL;
+    }
+    for (int fd = 0; fd < FILE_TABLE_SIZE; ++fd)
+    {
+        context->files[fd].iNodeNumber = -1;
+    }
+    return context;
+}
+
+void
+muusecontext (struct muContext* context)
+{
+    process = (context != NULL ? context : &defaultContext);
+}
+
+void
+mufreecontext (struct muContext* context)
+{
+    assert (context != &defaultContext && context != process);
+    // Borrow the context just long enough to close its files, so that their data is written.
+    struct muContext* previous = process;
+    process = context;
+    for (int fd = 0; fd < FILE_TABLE_SIZE; ++fd)
+    {
+        if (isValidDescriptor (fd))
+        {
+            muclose (fd);
+        }
+        free (context->files[fd].currentData);
+        free (context->files[fd].unitData);
+    }
+    if (context->workingDirINode != NULL)
+    {
+        icacheRelease (context->workingDirINode);
+    }
+    process = previous;
+    free (context);
+}
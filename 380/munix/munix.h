@@ -6,8 +6,48 @@
 #ifndef MUNIX_H
 #define MUNIX_H
 
+#include <stdint.h>
+
 #include "muerrno.h"
 
+// Counters describing how one open file has been used since it was opened.
+struct muFileStats
+{
+    // The number of muread / muwrite calls made on the file.
+    uint64_t readCalls;
+    uint64_t writeCalls;
+    // The number of bytes those calls transferred.
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    // The number of system calls made on the disk image while serving those calls.
+    uint64_t syscalls;
+    // The number of whole blocks copied directly between the caller's buffer and the disk.
+    uint64_t directBlocks;
+    // The number of blocks that readahead asked to have prefetched.
+    uint64_t prefetchedBlocks;
+    // The number of blocks read from holes, which were copied from a block of zeros.
+    uint64_t holeBlocks;
+    // For a compressed file, the number of units expanded from their compressed form to be
+    //   read or written, and the number of units packed and stored by writes.
+    uint64_t unitsExpanded;
+    uint64_t unitsStored;
+    // The number of whole blocks written by sharing a data block that already held the same
+    //   data (see mudedup and mucopy), and the number of shared blocks that were given data
+    //   blocks of their own to be written.
+    uint64_t sharedBlocks;
+    uint64_t unsharedBlocks;
+    // The number of whole blocks that mucopy copied into the file a block at a time, without
+    //   going through a buffer of its own.
+    uint64_t copiedBlocks;
+};
+
+// Everything that belongs to one simulated process: its open file table, its user and
+//   group, and its working directory.
+// Each thread acts as one process at a time, so threads that use different contexts
+//   behave like separate processes sharing the filesystem.  Threads that have not
+//   chosen a context share a default one, which is only safe for one thread at a time.
+struct muContext;
+
 // Initializes the data for the process that is being simulated.
 // Params:
 //   userName - The name of the user who is running the process.
@@ -21,35 +61,118 @@
 int
 muinit (const char* userName, const char* groupName);
 
+// Every call below that takes a path accepts either an absolute path (starting with '/',
+//   resolved from the root directory) or a relative one (resolved from the working
+//   directory, or from a directory opened with muopendir for muopenat).  Repeated and
+//   trailing '/' characters are ignored.  Every directory that a path passes into must
+//   be executable by the user/group; the directories walked through are cached, so
+//   resolving a deep path again does not reread them.
+
 // Changes the calling process's current working directory.
 // Params:
-//   dirName - A string containing the name of the directory to change to.
+//   dirPath - A string containing the path of the directory to change to.
 // Returns:
 //   0 on success, or -1 and sets muerrno.
 // Errors:
-//   MU_E_BAD_NAME if dirName is blank or contains a '/' character.
-//   MU_E_DOES_NOT_EXIST if dirName is not the name of an entry in the working directory.
-//   MU_E_NOT_DIR if dirName is the name of a regular file in the working directory.
-//   MU_E_PERMISSION if the user/group does not have execute permission on dirName.
+//   MU_E_BAD_NAME if dirPath is blank or has a component too long to be a name.
+//   MU_E_DOES_NOT_EXIST if a component of dirPath does not exist.
+//   MU_E_NOT_DIR if a component of dirPath is a regular file.
+//   MU_E_PERMISSION if the user/group does not have execute permission on a directory
+//     along dirPath, including the last.
 int
-mucd (const char* dirName);
+mucd (const char* dirPath);
 
-// Opens a file from the current working directory.
+// Opens a file.
 // Params:
-//   fileName - A string containing the name of the file to open.
+//   filePath - A string containing the path of the file to open.
 //   flags - Either MU_O_RDONLY or MU_O_WRONLY or MU_O_RDWR.
 // Returns:
 //   A usable file descriptor on success, or -1 and sets muerrno.
 // Errors:
 //   MU_E_FULL_TABLE if the open file table is full.
-//   MU_E_BAD_NAME if fileName is blank or contains a '/' character.
-//   MU_E_DOES_NOT_EXIST if fileName is not the name of an entry in the working directory.
-//   MU_E_NOT_REG is fileName is the name of a directory in the working directory.
-//   MU_E_PERMISSION if the user/group does not have the permissions implied by flags.
+//   MU_E_BAD_NAME if filePath is blank or has a component too long to be a name.
+//   MU_E_DOES_NOT_EXIST if a component of filePath does not exist.
+//   MU_E_NOT_DIR if a component of filePath before the last is a regular file.
+//   MU_E_NOT_REG if filePath names a directory.
+//   MU_E_PERMISSION if the user/group cannot execute a directory along filePath, or does
+//     not have the permissions implied by flags.
+int
+muopen (const char* filePath, int flags);
+
+// Opens a directory as a handle that muopenat can resolve paths from, so that files deep
+//   in the tree can be opened without walking the whole path each time.
+// The descriptor cannot be read or written (muread and muwrite fail with MU_E_PERMISSION),
+//   and it takes a slot in the open file table until it is passed to muclose.
+// Params:
+//   dirPath - A string containing the path of the directory to open.
+// Returns:
+//   A usable file descriptor on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_FULL_TABLE if the open file table is full.
+//   The errors of mucd otherwise.
+int
+muopendir (const char* dirPath);
+
+// Opens a file like muopen, but resolves a relative path from an open directory instead
+//   of from the working directory.  An absolute path ignores the directory.
+// Params:
+//   dirFd - A file descriptor from muopendir.
+//   filePath - A string containing the path of the file to open.
+//   flags - Either MU_O_RDONLY or MU_O_WRONLY or MU_O_RDWR.
+// Returns:
+//   A usable file descriptor on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_INVALID_FD if dirFd does not refer to an open file.
+//   MU_E_NOT_DIR if dirFd refers to a regular file.
+//   The errors of muopen otherwise.
+int
+muopenat (int dirFd, const char* filePath, int flags);
+
+// Creates a new, empty regular file and opens it for writing.
+// On a VERSION23 (or later) image, a mode including MU_S_COMPRESSED makes a compressed
+//   file: each unit of COMPRESSION_UNIT_BLOCKS blocks is stored in as few blocks as it
+//   compresses to, and expanded again when it is read.  Since each unit that compresses
+//   costs up to two extents, and a quarter of the extents are kept for units stored as
+//   they are, only about the first 3 * MAX_EXTENTS / 8 units that compress are stored
+//   compressed; the rest are stored as they are.  Every muwrite stores the units
+//   it changes straight away, so small writes cost a unit's compression each.  Elsewhere
+//   MU_S_COMPRESSED is ignored.
+// Params:
+//   filePath - A string containing the path of the file to create.
+//   mode - The permission bits (some combination of MU_S_IRWXU / MU_S_IRWXG / MU_S_IRWXO),
+//     and MU_S_COMPRESSED for a compressed file.
+// Returns:
+//   A usable file descriptor on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_FULL_TABLE if the open file table is full.
+//   MU_E_BAD_NAME if filePath is blank or has a component too long to be a name.
+//   MU_E_DOES_NOT_EXIST if a directory along filePath does not exist.
+//   MU_E_NOT_DIR if a component of filePath before the last is a regular file.
+//   MU_E_PERMISSION if the user/group cannot execute a directory along filePath, or cannot
+//     write and execute the directory that would contain the file.
+//   MU_E_EXISTS if filePath already names an entry.
+//   MU_E_NO_SPACE if there is no free inode or no room in the directory.
 int
-muopen (const char* fileName, int flags);
+mucreat (const char* filePath, int mode);
 
-// Closes an open file, writing any buffered data to disk.
+// Removes a regular file from its directory, freeing its storage when no links to it remain.
+// Params:
+//   filePath - A string containing the path of the file to remove.
+// Returns:
+//   0 on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_BAD_NAME if filePath is blank or has a component too long to be a name.
+//   MU_E_DOES_NOT_EXIST if a component of filePath does not exist.
+//   MU_E_NOT_DIR if a component of filePath before the last is a regular file.
+//   MU_E_NOT_REG if filePath names a directory.
+//   MU_E_PERMISSION if the user/group cannot execute a directory along filePath, or cannot
+//     write and execute the directory that contains the file.
+//   MU_E_BUSY if the file is currently open.
+int
+muunlink (const char* filePath);
+
+// Closes an open file, writing any buffered data to disk.  Every descriptor (in any
+//   process) shares the file's inode, which is written back once the last one closes.
 // Params:
 //   fd - The file descriptor of the file to close.
 // Returns:
@@ -59,6 +182,73 @@ muopen (const char* fileName, int flags);
 int
 muclose (int fd);
 
+// Makes an open file's contents durable: writes back whatever of it is still buffered or
+//   cached, leaving the rest of the block cache alone, and then syncs the disk image.
+// Params:
+//   fd - The file descriptor of the file to sync.
+// Returns:
+//   0 on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_INVALID_FD if the file desciptor does not refer to an open file.
+int
+mufsync (int fd);
+
+// Makes sure that an open file has blocks for its first length bytes, as few runs of
+//   consecutive blocks as possible, growing it with zeros if it is shorter.  Writing
+//   over those bytes later cannot run out of space, and reads them back sequentially.
+// Holes that the file already has (see museek) are left as they are.
+// A compressed file is grown with a hole instead, since how many blocks its data needs is
+//   only known as it is written.
+// Params:
+//   fd - The file descriptor of the file.
+//   length - The length that the file should have room for.
+// Returns:
+//   0 on success, or -1 and sets muerrno (in which case the file is unchanged).
+// Errors:
+//   MU_E_INVALID_FD if the file descriptor does not refer to an open file.
+//   MU_E_PERMISSION if the file is not open for writing.
+//   MU_E_NO_SPACE if length is more than a file can hold or there are not enough free blocks.
+int
+mufallocate (int fd, uint32_t length);
+
+// Moves the file pointer of an open file, so that the next muread / muwrite starts at offset.
+// Seeking past the end of a file does not change it, but a write there leaves a hole
+//   between the old end and the new data, which reads back as zeros yet has no blocks
+//   (and costs no disk I/O to read).
+// Params:
+//   fd - The file descriptor of the file.
+//   offset - The byte of the file to move to.
+// Returns:
+//   0 on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_INVALID_FD if the file descriptor does not refer to an open file.
+//   MU_E_NO_SPACE if offset is more than a file can hold.
+int
+museek (int fd, uint32_t offset);
+
+// Sets how many blocks beyond what it needs a file sets aside whenever it grows, so
+//   that its later blocks follow on from its earlier ones even when other files are
+//   growing at the same time (delayed allocation).  What a file has set aside is given
+//   back once nothing has it open.  The default is 64; 0 allocates only what is needed.
+// Params:
+//   blocks - The number of blocks to set aside.
+void
+mureserve (uint32_t blocks);
+
+// Turns inline deduplication on or off for every process.  While it is on, each whole block
+//   appended to a regular file is hashed, and if a data block of a file that is not open
+//   elsewhere already holds the same data, the new block shares that data block instead of
+//   being written (see VERSION24 in mufs.h).  A shared block that is written later gets a
+//   data block of its own first, whether or not deduplication is on.
+// The blocks to share are found in an index of recently written blocks kept in memory, so
+//   duplicates of blocks written before the disk was loaded (or long ago) are missed; the
+//   mudedup tool finds those.  Only VERSION24 images share blocks, and compressed and
+//   inline files never do.  The default is off.
+// Params:
+//   enabled - 1 to share duplicate blocks, 0 to write every block.
+void
+mudedup (int enabled);
+
 // Reads the next n bytes from the file into buffer.
 // Params:
 //   fd - The file descriptor of the file to read from.
@@ -69,10 +259,13 @@ muclose (int fd);
 // Errors:
 //   MU_E_INVALID_FD if the file descriptor does not refer to an open file.
 //   MU_E_PERMISSION if the file is not open for reading.
+//   MU_E_CORRUPT if the file is compressed and the first unit to be read cannot be expanded.
 int
 muread (int fd, char* buffer, int n);
 
 // Writes the first n bytes from the buffer into the file (or fewer if not enough space).
+// A file whose block map has run out of extents has its data moved into fewer, longer
+//   runs of free blocks (much as mudefrag does) so that the write can go on.
 // Params:
 //   fd - The file descriptor of the file to write to.
 //   buffer - An array from which the data should be copied.
@@ -82,9 +275,69 @@ muread (int fd, char* buffer, int n);
 // Errors:
 //   MU_E_INVALID_FD if the file descriptor does not refer to an open file.
 //   MU_E_PERMISSION if the file is not open for writing.
+//   MU_E_NO_SPACE if none of the bytes could be stored, because the disk is full, the
+//     file is as large as it can be, or its block map cannot take another extent.
+//   MU_E_CORRUPT if the file is compressed and the first unit to be written cannot be expanded.
 int
 muwrite (int fd, const char* buffer, int n);
 
+// Copies the next n bytes of one file into another (or fewer if the source ends first or
+//   there is not enough space), from and to each file's file pointer, advancing both.
+// The data does not go through the caller, and whole blocks need not go through memory at
+//   all: when both file pointers are at the start of a block, blocks are copied straight
+//   from one data block to another, holes stay holes, and on a VERSION24 image (mkdisk
+//   --dedup) the copy shares the source's data blocks, as mudedup would, so that copying
+//   a large file takes little more than changing its block map.  Blocks are only shared
+//   while neither file is open through another file descriptor.  Compressed and inline
+//   files, and the bytes that do not fill a block, are copied as with muread and muwrite.
+// Params:
+//   srcFd - The file descriptor of the file to copy from.
+//   dstFd - The file descriptor of the file to copy to, which may be the same file (whose
+//     overlapping ranges are copied forward, a chunk at a time).
+//   n - The maximum number of bytes to copy.
+// Returns:
+//   The number of bytes copied on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_INVALID_FD if either file descriptor does not refer to an open file.
+//   MU_E_PERMISSION if the source is not open for reading or the destination is not open
+//     for writing.
+//   MU_E_CORRUPT if either file is compressed and the first unit to be copied cannot be expanded.
+int
+mucopy (int srcFd, int dstFd, int n);
+
+// Moves a regular file that is stored in several runs of blocks into one run, so that it
+//   can be read back sequentially, while other processes go on using the filesystem.
+// Holes in the file stay holes, and blocks that it shares with other files (see mudedup)
+//   are copied like the rest, so it no longer shares them.
+// The file is copied before anything refers to the copy, so it survives a crash part way.
+// Params:
+//   filePath - A string containing the path of the file to move.
+// Returns:
+//   1 if the file was moved, 0 if it was already in one run (or has no blocks), or -1
+//   and sets muerrno.
+// Errors:
+//   MU_E_BAD_NAME if filePath is blank or has a component too long to be a name.
+//   MU_E_DOES_NOT_EXIST if a component of filePath does not exist.
+//   MU_E_NOT_DIR if a component of filePath before the last is a regular file.
+//   MU_E_NOT_REG if filePath names a directory.
+//   MU_E_PERMISSION if the user/group cannot execute a directory along filePath, or cannot
+//     write the file.
+//   MU_E_BUSY if the file is currently open.
+//   MU_E_NO_SPACE if there is no run of free blocks as long as the file's data.
+int
+mudefrag (const char* filePath);
+
+// Reports how an open file has been used since it was opened.
+// Params:
+//   fd - The file descriptor of the file.
+//   stats - Receives the file's counters.
+// Returns:
+//   0 on success, or -1 and sets muerrno.
+// Errors:
+//   MU_E_INVALID_FD if the file descriptor does not refer to an open file.
+int
+mufstats (int fd, struct muFileStats* stats);
+
 // Prints one line for each file/directory in the current working directory.
 // For directories, the first character will be 'd', while for regular files it will be '-'.
 // The next 9 characters will be 3 groups of 'rwx' (user-group-other) where each symbol is
@@ -96,4 +349,23 @@ muwrite (int fd, const char* buffer, int n);
 void
 muls ();
 
+// Creates a context for another process, which should be set up with muinit once a
+//   thread is using it.
+// Returns:
+//   The new context, or NULL if there is not enough memory.
+struct muContext*
+munewcontext ();
+
+// Makes the calling thread act as the process described by a context.
+// Params:
+//   context - The context to use, or NULL to go back to the default context.
+void
+muusecontext (struct muContext* context);
+
+// Closes any files still open in a context and frees it.
+// Params:
+//   context - A context from munewcontext that no thread is using.
+void
+mufreecontext (struct muContext* context);
+
 #endif//MUNIX_H
\ No newline at end of file
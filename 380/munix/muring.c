@@ -0,0 +1,366 @@
+// File: muring.c
+// Author: Matt Shenk
+// Implementation of an io_uring queue for MUFS block I/O, using the raw system calls.
+// Reads and writes are placed in the submission ring and handed to the kernel a batch
+//   at a time; their completions are collected when the caller waits, or earlier if the
+//   ring runs out of room.
+// Part of munix lab in CSCI380.
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// <linux/fs.h>, which io_uring.h includes, has a BLOCK_SIZE of its own.
+#undef BLOCK_SIZE
+#include "mufs.h"
+#include "muring.h"
+
+#define NOT_OPENED -1
+#define NO_REQUEST UINT32_MAX
+// How many queued requests are allowed to build up before they are handed to the kernel.
+#define SUBMIT_BATCH 8
+// The largest single request, so that one huge read does not hold up everything behind it.
+#define MAX_REQUEST_BYTES (1024 * 1024)
+
+// One read or write that is in the ring.
+struct ringRequest
+{
+    // The blocks being transferred, and where they go to or come from.
+    uint32_t firstBlock;
+    uint32_t count;
+    char* buffer;
+    // 1 for a write, 0 for a read.
+    int isWrite;
+    // The next unused request, while this one is unused.
+    uint32_t nextFree;
+};
+
+// The ring itself, and the file it works on.
+static int ringFd = NOT_OPENED;
+static int targetFd = NOT_OPENED;
+static uint32_t ringEntries = 0;
+
+// The three areas the kernel shares with us.
+static char* submissionRing = NULL;
+static size_t submissionRingLength = 0;
+static char* completionRing = NULL;
+static size_t completionRingLength = 0;
+static struct io_uring_sqe* submissionEntries = NULL;
+static size_t submissionEntriesLength = 0;
+
+// The fields of those areas, located by the offsets that io_uring_setup reports.
+static uint32_t* submissionTail = NULL;
+static uint32_t* submissionMask = NULL;
+static uint32_t* submissionArray = NULL;
+static uint32_t* completionHead = NULL;
+static uint32_t* completionTail = NULL;
+static uint32_t* completionMask = NULL;
+static struct io_uring_cqe* completionEntries = NULL;
+
+// One entry per request that may be in flight, with the unused ones in a list.
+static struct ringRequest* requests = NULL;
+static uint32_t firstFreeRequest = NO_REQUEST;
+
+// The number of requests queued but not yet handed to the kernel, and the number
+//   (including those) that have not completed.
+static uint32_t unsubmitted = 0;
+static uint32_t inFlight = 0;
+
+// Serializes every use of the ring.
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ringStats stats;
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+// Hands the unsubmitted requests to the kernel, optionally waiting for a completion.
+// Params:
+//   minComplete - How many completions to wait for (0 or 1).
+static void
+enterRing (uint32_t minComplete)
+{
+    while (1)
+    {
+        countSyscall ();
+        ++stats.enterCalls;
+        int result = syscall (__NR_io_uring_enter, ringFd, unsubmitted, minComplete,
+                              (minComplete > 0 ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+        if (result >= 0)
+        {
+            unsubmitted -= result;
+            return;
+        }
+        if (errno != EINTR)
+        {
+            fprintf (stderr, "Could not submit block I/O: %s\n", strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+    }
+}
+
+// Finishes one request, redoing it with ordinary I/O if the kernel did not transfer all of it.
+static void
+completeRequest (uint32_t index, int32_t result)
+{
+    struct ringRequest* request = &requests[index];
+    if (result != (int32_t)((size_t)request->count * BLOCK_SIZE))
+    {
+        ++stats.fallbacks;
+        if (request->isWrite)
+        {
+            writeBlocksToDisk (request->firstBlock, request->count, request->buffer);
+        }
+        else
+        {
+            readBlocksFromDisk (request->firstBlock, request->count, request->buffer);
+        }
+    }
+    request->nextFree = firstFreeRequest;
+    firstFreeRequest = index;
+    --inFlight;
+}
+
+// Collects every completion that the kernel has posted.
+static void
+reapCompletions ()
+{
+    uint32_t head = *completionHead;
+    uint32_t tail = __atomic_load_n (completionTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe* completion = &completionEntries[head & *completionMask];
+        completeRequest ((uint32_t)completion->user_data, completion->res);
+        ++head;
+    }
+    __atomic_store_n (completionHead, head, __ATOMIC_RELEASE);
+}
+
+// Places one request in the submission ring, waiting for room if every entry is in use.
+// Must be called with ringLock held.
+static void
+queueRequest (uint32_t firstBlock, uint32_t count, char* buffer, int isWrite)
+{
+    while (firstFreeRequest == NO_REQUEST)
+    {
+        enterRing (1);
+        reapCompletions ();
+    }
+    uint32_t index = firstFreeRequest;
+    struct ringRequest* request = &requests[index];
+    firstFreeRequest = request->nextFree;
+    request->firstBlock = firstBlock;
+    request->count = count;
+    request->buffer = buffer;
+    request->isWrite = isWrite;
+
+    uint32_t tail = *submissionTail;
+    uint32_t slot = tail & *submissionMask;
+    struct io_uring_sqe* entry = &submissionEntries[slot];
+    memset (entry, 0, sizeof (struct io_uring_sqe));
+    entry->opcode = (isWrite ? IORING_OP_WRITE : IORING_OP_READ);
+    entry->fd = targetFd;
+    entry->off = (uint64_t)firstBlock * BLOCK_SIZE;
+    entry->addr = (uint64_t)(uintptr_t)buffer;
+    entry->len = count * BLOCK_SIZE;
+    entry->user_data = index;
+    submissionArray[slot] = slot;
+    __atomic_store_n (submissionTail, tail + 1, __ATOMIC_RELEASE);
+
+    ++unsubmitted;
+    ++inFlight;
+    ++stats.requests;
+    if (inFlight > stats.maxInFlight)
+    {
+        stats.maxInFlight = inFlight;
+    }
+    if (unsubmitted >= SUBMIT_BATCH)
+    {
+        enterRing (0);
+    }
+}
+
+// Queues a transfer, split into requests of at most MAX_REQUEST_BYTES.
+static void
+queueTransfer (uint32_t firstBlock, uint32_t count, char* buffer, int isWrite)
+{
+    uint32_t maxBlocks = (MAX_REQUEST_BYTES > BLOCK_SIZE ? MAX_REQUEST_BYTES / BLOCK_SIZE : 1);
+    pthread_mutex_lock (&ringLock);
+    while (count > 0)
+    {
+        uint32_t part = (count < maxBlocks ? count : maxBlocks);
+        queueRequest (firstBlock, part, buffer, isWrite);
+        firstBlock += part;
+        count -= part;
+        buffer += (size_t)part * BLOCK_SIZE;
+    }
+    pthread_mutex_unlock (&ringLock);
+}
+
+// Unmaps whatever parts of the ring have been mapped and closes it.
+static void
+releaseRing ()
+{
+    if (submissionEntries != NULL)
+    {
+        munmap (submissionEntries, submissionEntriesLength);
+    }
+    if (completionRing != NULL && completionRing != submissionRing)
+    {
+        munmap (completionRing, completionRingLength);
+    }
+    if (submissionRing != NULL)
+    {
+        munmap (submissionRing, submissionRingLength);
+    }
+    if (ringFd != NOT_OPENED)
+    {
+        close (ringFd);
+    }
+    free (requests);
+    submissionEntries = NULL;
+    completionRing = NULL;
+    submissionRing = NULL;
+    requests = NULL;
+    ringFd = NOT_OPENED;
+    targetFd = NOT_OPENED;
+}
+
+// Maps one of the areas that the kernel shares with the ring.
+// Returns the area, or NULL if it could not be mapped.
+static void*
+mapRingArea (size_t length, off_t offset)
+{
+    void* area = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+    return (area == MAP_FAILED ? NULL : area);
+}
+
+
+//// Library functions /////////////////////////////////////////
+
+
+void
+getRingStats (struct ringStats* result)
+{
+    pthread_mutex_lock (&ringLock);
+    *result = stats;
+    pthread_mutex_unlock (&ringLock);
+}
+
+void
+resetRingStats ()
+{
+    pthread_mutex_lock (&ringLock);
+    memset (&stats, 0, sizeof (stats));
+    pthread_mutex_unlock (&ringLock);
+}
+
+int
+openRing (int fd, uint32_t entries)
+{
+    if (ringFd != NOT_OPENED)
+    {
+        closeRing ();
+    }
+    struct io_uring_params params;
+    memset (&params, 0, sizeof (params));
+    ringFd = syscall (__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0)
+    {
+        ringFd = NOT_OPENED;
+        return -1;
+    }
+    targetFd = fd;
+    ringEntries = params.sq_entries;
+    submissionRingLength = params.sq_off.array + params.sq_entries * sizeof (uint32_t);
+    completionRingLength = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (completionRingLength > submissionRingLength)
+        {
+            submissionRingLength = completionRingLength;
+        }
+        submissionRing = mapRingArea (submissionRingLength, IORING_OFF_SQ_RING);
+        completionRing = submissionRing;
+    }
+    else
+    {
+        submissionRing = mapRingArea (submissionRingLength, IORING_OFF_SQ_RING);
+        completionRing = mapRingArea (completionRingLength, IORING_OFF_CQ_RING);
+    }
+    submissionEntriesLength = params.sq_entries * sizeof (struct io_uring_sqe);
+    submissionEntries = mapRingArea (submissionEntriesLength, IORING_OFF_SQES);
+    requests = calloc (ringEntries, sizeof (struct ringRequest));
+    if (submissionRing == NULL || completionRing == NULL || submissionEntries == NULL || requests == NULL)
+    {
+        releaseRing ();
+        return -1;
+    }
+
+    submissionTail = (uint32_t*)(submissionRing + params.sq_off.tail);
+    submissionMask = (uint32_t*)(submissionRing + params.sq_off.ring_mask);
+    submissionArray = (uint32_t*)(submissionRing + params.sq_off.array);
+    completionHead = (uint32_t*)(completionRing + params.cq_off.head);
+    completionTail = (uint32_t*)(completionRing + params.cq_off.tail);
+    completionMask = (uint32_t*)(completionRing + params.cq_off.ring_mask);
+    completionEntries = (struct io_uring_cqe*)(completionRing + params.cq_off.cqes);
+
+    firstFreeRequest = NO_REQUEST;
+    for (uint32_t index = ringEntries; index > 0; --index)
+    {
+        requests[index - 1].nextFree = firstFreeRequest;
+        firstFreeRequest = index - 1;
+    }
+    unsubmitted = 0;
+    inFlight = 0;
+    return 0;
+}
+
+void
+closeRing ()
+{
+    if (ringFd == NOT_OPENED)
+    {
+        return;
+    }
+    ringWait ();
+    releaseRing ();
+}
+
+int
+isRingOpen ()
+{
+    return ringFd != NOT_OPENED;
+}
+
+void
+ringRead (uint32_t firstBlock, uint32_t count, char* buffer)
+{
+    queueTransfer (firstBlock, count, buffer, 0);
+}
+
+void
+ringWrite (uint32_t firstBlock, uint32_t count, const char* buffer)
+{
+    // The buffer is only read from, but requests keep a single pointer for both directions.
+    queueTransfer (firstBlock, count, (char*)buffer, 1);
+}
+
+void
+ringWait ()
+{
+    pthread_mutex_lock (&ringLock);
+    while (inFlight > 0)
+    {
+        enterRing (1);
+        reapCompletions ();
+    }
+    pthread_mutex_unlock (&ringLock);
+}
@@ -0,0 +1,89 @@
+// File: muring.h
+// Author: Matt Shenk
+// Interface of the io_uring queue that lets MUFS keep many block reads and writes in
+//   flight at once and collect their completions in batches.
+// Part of munix lab in CSCI380.
+
+#ifndef MURING_H
+#define MURING_H
+
+#include <stdint.h>
+
+#define DEFAULT_RING_ENTRIES 64
+
+// Counters describing the work the ring has done.
+struct ringStats
+{
+    // The number of reads and writes queued.
+    uint64_t requests;
+    // The number of io_uring_enter calls used to submit them and wait for them.
+    uint64_t enterCalls;
+    // The most requests that were in flight at the same time.
+    uint64_t maxInFlight;
+    // The number of requests that the kernel could not complete in full, which were
+    //   finished with ordinary reads and writes instead.
+    uint64_t fallbacks;
+};
+
+
+// Copies the current ring counters into stats.
+void
+getRingStats (struct ringStats* stats);
+
+
+// Sets all of the ring counters back to zero.
+void
+resetRingStats ();
+
+
+//// Used by mufs.c only ///////////////////////////////////////
+
+
+// Creates an io_uring on a file.
+// Params:
+//   fd - The file that every request will read or write.
+//   entries - The most requests that may be in flight at once.
+// Returns:
+//   0 on success, or -1 if the kernel does not provide io_uring.
+int
+openRing (int fd, uint32_t entries);
+
+
+// Waits for every request in flight and releases the ring.
+void
+closeRing ();
+
+
+// Returns 1 if a ring is open, 0 otherwise.
+int
+isRingOpen ();
+
+
+// Queues a read of count consecutive blocks into buffer.
+// Requests are handed to the kernel in batches, at the latest by ringWait.
+void
+ringRead (uint32_t firstBlock, uint32_t count, char* buffer);
+
+
+// Queues a write of count consecutive blocks from buffer.
+void
+ringWrite (uint32_t firstBlock, uint32_t count, const char* buffer);
+
+
+// Submits whatever is queued and waits until every request has completed.
+void
+ringWait ();
+
+
+// The functions the ring uses to finish requests that the kernel only partly completed,
+//   and to count its system calls.  Provided by mufs.c.
+void
+readBlocksFromDisk (uint32_t firstBlock, uint32_t count, char* buffer);
+
+void
+writeBlocksToDisk (uint32_t firstBlock, uint32_t count, const char* buffer);
+
+void
+countSyscall ();
+
+#endif//MURING_H
@@ -0,0 +1,251 @@
+// File: mustress.c
+// Author: Matt Shenk
+// A multi-threaded stress test that has several simulated processes, each on its own
+//   thread, read the same file at once, and reports how read throughput scales.
+// Part of munix lab in CSCI380.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "munix.h"
+#include "mufs.h"
+#include "mufile.h"
+
+#define STRESS_FILE_NAME "stress.dat"
+#define STRESS_FILE_BYTES (4 * 1024 * 1024)
+#define READ_CHUNK_BYTES (64 * 1024)
+#define DEFAULT_MEGABYTES 256
+
+// What one reader thread is asked to do, and what it found.
+struct readerTask
+{
+    // How many bytes to read in total, rereading the file as often as needed.
+    uint64_t bytesWanted;
+    // The number of bytes that were read, and whether they all matched what was written.
+    uint64_t bytesRead;
+    int corrupt;
+};
+
+uint32_t
+createStressFile ();
+
+void*
+runReader (void* argument);
+
+double
+runReaders (int threadCount, uint64_t bytesPerThread);
+
+char
+expectedByte (uint32_t position);
+
+double
+now ();
+
+int
+main (int argc, char* argv[])
+{
+    int argIndex = 1;
+    if (argIndex < argc && strcmp (argv[argIndex], "--mmap") == 0)
+    {
+        selectBackend (MUFS_BACKEND_MMAP);
+        ++argIndex;
+    }
+    if (argIndex >= argc)
+    {
+        fprintf (stderr, "Usage: %s [--mmap] diskName [maxThreads [megabytesPerThread]]\n", argv[0]);
+        fprintf (stderr, "The disk should be made with mkdisk --extents so that the test file can be large.\n");
+        exit (EXIT_FAILURE);
+    }
+    const char* diskName = argv[argIndex++];
+    int maxThreads = (argIndex < argc ? atoi (argv[argIndex++]) : (int)sysconf (_SC_NPROCESSORS_ONLN));
+    int megabytes = (argIndex < argc ? atoi (argv[argIndex++]) : DEFAULT_MEGABYTES);
+    if (maxThreads < 1 || megabytes < 1)
+    {
+        fprintf (stderr, "The number of threads and of megabytes must be positive\n");
+        exit (EXIT_FAILURE);
+    }
+
+    setup (diskName);
+    if (muinit ("root", "admin") < 0)
+    {
+        fprintf (stderr, "Could not log in as root: %d\n", muerrno);
+        exit (EXIT_FAILURE);
+    }
+    uint32_t fileBytes = createStressFile ();
+    printf ("Reading a %u byte file, %d MB per thread\n", fileBytes, megabytes);
+    printf ("%8s %12s %10s\n", "threads", "MB/sec", "speedup");
+
+    double single = 0;
+    for (int threadCount = 1; ; threadCount *= 2)
+    {
+        if (threadCount > maxThreads)
+        {
+            threadCount = maxThreads;
+        }
+        double rate = runReaders (threadCount, (uint64_t)megabytes * 1024 * 1024);
+        if (threadCount == 1)
+        {
+            single = rate;
+        }
+        printf ("%8d %12.1f %10.2f\n", threadCount, rate, rate / single);
+        if (threadCount == maxThreads)
+        {
+            break;
+        }
+    }
+
+    muunlink (STRESS_FILE_NAME);
+    teardown ();
+    return EXIT_SUCCESS;
+}
+
+// Creates the file that the readers share, making it as large as the filesystem allows
+//   up to STRESS_FILE_BYTES.
+// Returns:
+//   The size of the file.
+uint32_t
+createStressFile ()
+{
+    muunlink (STRESS_FILE_NAME);
+    int fd = mucreat (STRESS_FILE_NAME, MU_S_IRUSR | MU_S_IWUSR | MU_S_IRGRP | MU_S_IROTH);
+    if (fd < 0)
+    {
+        fprintf (stderr, "Could not create %s: %d\n", STRESS_FILE_NAME, muerrno);
+        exit (EXIT_FAILURE);
+    }
+    char chunk[READ_CHUNK_BYTES];
+    uint32_t size = 0;
+    while (size < STRESS_FILE_BYTES)
+    {
+        for (uint32_t index = 0; index < READ_CHUNK_BYTES; ++index)
+        {
+            chunk[index] = expectedByte (size + index);
+        }
+        int written = muwrite (fd, chunk, READ_CHUNK_BYTES);
+        size += (written > 0 ? written : 0);
+        if (written < READ_CHUNK_BYTES)
+        {
+            break;
+        }
+    }
+    muclose (fd);
+    if (size == 0)
+    {
+        fprintf (stderr, "There is no room for %s\n", STRESS_FILE_NAME);
+        exit (EXIT_FAILURE);
+    }
+    mufs_sync ();
+    return size;
+}
+
+// The body of a reader thread: logs in as its own process and reads the shared file
+//   from the start again and again, checking every byte.
+void*
+runReader (void* argument)
+{
+    struct readerTask* task = argument;
+    struct muContext* context = munewcontext ();
+    if (context == NULL)
+    {
+        fprintf (stderr, "Could not create a context\n");
+        exit (EXIT_FAILURE);
+    }
+    muusecontext (context);
+    if (muinit ("root", "admin") < 0)
+    {
+        fprintf (stderr, "Could not log in as root: %d\n", muerrno);
+        exit (EXIT_FAILURE);
+    }
+    char* chunk = malloc (READ_CHUNK_BYTES);
+    if (chunk == NULL)
+    {
+        fprintf (stderr, "Could not allocate a read buffer\n");
+        exit (EXIT_FAILURE);
+    }
+    while (task->bytesRead < task->bytesWanted)
+    {
+        int fd = muopen (STRESS_FILE_NAME, MU_O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf (stderr, "Could not open %s: %d\n", STRESS_FILE_NAME, muerrno);
+            exit (EXIT_FAILURE);
+        }
+        uint32_t position = 0;
+        int count;
+        while ((count = muread (fd, chunk, READ_CHUNK_BYTES)) > 0)
+        {
+            // Checking one byte in each block keeps the check from dominating the timing.
+            for (int index = 0; index < count; index += BLOCK_SIZE)
+            {
+                task->corrupt |= (chunk[index] != expectedByte (position + index));
+            }
+            position += count;
+            task->bytesRead += count;
+        }
+        muclose (fd);
+    }
+    free (chunk);
+    muusecontext (NULL);
+    mufreecontext (context);
+    return NULL;
+}
+
+// Runs threadCount readers at once and waits for all of them.
+// Returns:
+//   The combined read throughput, in megabytes per second.
+double
+runReaders (int threadCount, uint64_t bytesPerThread)
+{
+    pthread_t* threads = malloc (threadCount * sizeof (pthread_t));
+    struct readerTask* tasks = calloc (threadCount, sizeof (struct readerTask));
+    if (threads == NULL || tasks == NULL)
+    {
+        fprintf (stderr, "Could not allocate %d threads\n", threadCount);
+        exit (EXIT_FAILURE);
+    }
+    double start = now ();
+    for (int index = 0; index < threadCount; ++index)
+    {
+        tasks[index].bytesWanted = bytesPerThread;
+        if (pthread_create (&threads[index], NULL, runReader, &tasks[index]) != 0)
+        {
+            fprintf (stderr, "Could not start thread %d\n", index);
+            exit (EXIT_FAILURE);
+        }
+    }
+    uint64_t totalBytes = 0;
+    for (int index = 0; index < threadCount; ++index)
+    {
+        pthread_join (threads[index], NULL);
+        if (tasks[index].corrupt)
+        {
+            fprintf (stderr, "Thread %d read the wrong data\n", index);
+            exit (EXIT_FAILURE);
+        }
+        totalBytes += tasks[index].bytesRead;
+    }
+    double seconds = now () - start;
+    free (tasks);
+    free (threads);
+    return totalBytes / (1024.0 * 1024.0) / seconds;
+}
+
+// Returns the byte that belongs at a position of the stress file.
+char
+expectedByte (uint32_t position)
+{
+    return (char)(position / BLOCK_SIZE * 31 + position % 251);
+}
+
+// Returns the current time, in seconds, from a monotonic clock.
+double
+now ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -1,10 +1,16 @@
 // File: muusers.c
 // Author: Chad Hogg
 // Implementation of a library for looking up information about users and groups.
-// Uses static arrays of users, groups, and memberships, for simplicity.
+// The users, groups and memberships come from passwd / group style files, or from the
+//   built-in arrays below if none are loaded.  They are indexed once, into hash tables
+//   from names to numbers, arrays from numbers to names and a user x group bitset of
+//   memberships, so that every lookup takes constant time however many there are.
 // See muusers.h for documentation.
 // Part of CSCI380 munix lab.
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "muusers.h"
@@ -31,7 +37,8 @@ struct membership
 #define NUM_GROUPS 11
 #define NUM_MEMBERSHIPS 25
 
-const struct userEntry USERS[NUM_USERS] = 
+// The users, groups and memberships used until loadUserTables replaces them.
+const struct userEntry USERS[NUM_USERS] =
 {
     {1, "root"},
     {2, "zoppetti"},
@@ -68,67 +75,480 @@ const struct membership MEMBERSHIPS[NUM_MEMBERSHIPS] =
     {7, 2}, {7, 3}, {7, 4}, {7, 5}, {7, 11}
 };
 
-int
-lookUpUserNumber (const char* userName)
+#define NO_ENTRY -1
+#define MAX_ID UINT16_MAX
+#define LINE_LENGTH 4096
+
+// One slot of an open-addressing hash table from names to numbers.
+struct nameSlot
 {
-    for (int index = 0; index < NUM_USERS; ++index)
+    // The name, or NULL if the slot is empty.
+    char* name;
+    int number;
+};
+
+// The users or the groups: a name -> number hash table and a dense number -> entry array.
+struct idTable
+{
+    struct nameSlot* slots;
+    uint32_t mask;
+    // For each number up to maxNumber, the position of its entry, or NO_ENTRY.
+    int32_t* positions;
+    int maxNumber;
+    // The names in the order they were added, which is also their row / column in the
+    //   membership bitset.
+    char** names;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// Everything that the lookups use.
+struct userTables
+{
+    struct idTable users;
+    struct idTable groups;
+    // One row of groups.count bits per user, set where the user belongs to the group.
+    uint64_t* memberships;
+    uint32_t wordsPerRow;
+};
+
+// The tables in use, built from the built-in arrays the first time they are needed.
+static struct userTables tables;
+static pthread_once_t tablesBuilt = PTHREAD_ONCE_INIT;
+
+
+//// Helper functions //////////////////////////////////////////
+
+
+static uint32_t
+hashName (const char* name)
+{
+    // FNV-1a, as in the directory entry cache.
+    uint32_t hash = 2166136261u;
+    for (const char* next = name; *next != '\0'; ++next)
+    {
+        hash ^= (uint8_t)*next;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the number that goes with a name in a table, or NO_ENTRY if it is not there.
+static int
+findName (const struct idTable* table, const char* name)
+{
+    if (table->slots == NULL)
     {
-        if (strcmp (USERS[index].userName, userName) == 0)
+        return NO_ENTRY;
+    }
+    for (uint32_t probe = hashName (name) & table->mask; table->slots[probe].name != NULL; probe = (probe + 1) & table->mask)
+    {
+        if (strcmp (table->slots[probe].name, name) == 0)
         {
-            return USERS[index].userNumber;
+            return table->slots[probe].number;
         }
     }
-    return -1;
+    return NO_ENTRY;
 }
 
-const char*
-lookUpUserName (int userNumber)
+// Returns the position of a number in a table, or NO_ENTRY if it is not there.
+static int32_t
+findNumber (const struct idTable* table, int number)
 {
-    for (int index = 0; index < NUM_USERS; ++index)
+    if (number < 0 || number > table->maxNumber)
+    {
+        return NO_ENTRY;
+    }
+    return table->positions[number];
+}
+
+static void*
+allocateOrDie (size_t size)
+{
+    void* memory = calloc (1, size > 0 ? size : 1);
+    if (memory == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for the user tables\n");
+        exit (EXIT_FAILURE);
+    }
+    return memory;
+}
+
+// Makes room for at least needed elements in a growable array.
+static void
+growArray (void** array, uint32_t* capacity, uint32_t needed, size_t elementSize)
+{
+    if (needed <= *capacity)
     {
-        if (USERS[index].userNumber == userNumber)
+        return;
+    }
+    uint32_t newCapacity = (*capacity == 0 ? 16 : *capacity * 2);
+    void* grown = realloc (*array, (size_t)newCapacity * elementSize);
+    if (grown == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for the user tables\n");
+        exit (EXIT_FAILURE);
+    }
+    *array = grown;
+    *capacity = newCapacity;
+}
+
+// Adds a name to a table that has not been indexed yet.
+// Returns 0 on success, or -1 if the name is empty or the number is out of range.
+static int
+addName (struct idTable* table, const char* name, long number)
+{
+    if (number < 0 || number > MAX_ID || name[0] == '\0')
+    {
+        return -1;
+    }
+    // The two arrays grow in step, so they share one capacity.
+    uint32_t capacity = table->capacity;
+    growArray ((void**)&table->names, &capacity, table->count + 1, sizeof (char*));
+    growArray ((void**)&table->positions, &table->capacity, table->count + 1, sizeof (int32_t));
+    table->names[table->count] = strdup (name);
+    if (table->names[table->count] == NULL)
+    {
+        fprintf (stderr, "Could not allocate memory for the user tables\n");
+        exit (EXIT_FAILURE);
+    }
+    // Until the table is indexed, positions holds each entry's number.
+    table->positions[table->count] = (int32_t)number;
+    if ((int)number > table->maxNumber)
+    {
+        table->maxNumber = (int)number;
+    }
+    ++table->count;
+    return 0;
+}
+
+// Builds the hash table and the dense array of a table once all of its names are added.
+// Returns 0 on success, or -1 if two entries share a name or a number.
+static int
+indexTable (struct idTable* table)
+{
+    int32_t* numbers = table->positions;
+    table->positions = allocateOrDie ((size_t)(table->maxNumber + 1) * sizeof (int32_t));
+    for (int number = 0; number <= table->maxNumber; ++number)
+    {
+        table->positions[number] = NO_ENTRY;
+    }
+    uint32_t slotCount = 16;
+    while (slotCount < table->count * 2)
+    {
+        slotCount <<= 1;
+    }
+    table->mask = slotCount - 1;
+    table->slots = allocateOrDie (slotCount * sizeof (struct nameSlot));
+    int result = 0;
+    for (uint32_t position = 0; position < table->count; ++position)
+    {
+        int number = numbers[position];
+        if (table->positions[number] != NO_ENTRY || findName (table, table->names[position]) != NO_ENTRY)
+        {
+            fprintf (stderr, "%s (number %d) appears more than once\n", table->names[position], number);
+            result = -1;
+            break;
+        }
+        uint32_t probe = hashName (table->names[position]) & table->mask;
+        while (table->slots[probe].name != NULL)
         {
-            return USERS[index].userName;
+            probe = (probe + 1) & table->mask;
         }
+        table->slots[probe].name = table->names[position];
+        table->slots[probe].number = number;
+        table->positions[number] = position;
     }
-    return NULL;
+    free (numbers);
+    return result;
 }
 
-int
-lookUpGroupNumber (const char* groupName)
+// Creates an empty membership bitset for indexed users and groups.
+static void
+createMemberships (struct userTables* built)
+{
+    built->wordsPerRow = (built->groups.count + 63) / 64;
+    built->memberships = allocateOrDie ((size_t)built->users.count * built->wordsPerRow * sizeof (uint64_t));
+}
+
+// Records that the user at one position belongs to the group at another.
+static void
+addMembership (struct userTables* built, int32_t row, int32_t column)
 {
+    built->memberships[(size_t)row * built->wordsPerRow + column / 64] |= (uint64_t)1 << (column % 64);
+}
+
+static void
+destroyTable (struct idTable* table)
+{
+    for (uint32_t position = 0; position < table->count; ++position)
+    {
+        free (table->names[position]);
+    }
+    free (table->names);
+    free (table->positions);
+    free (table->slots);
+    memset (table, 0, sizeof (struct idTable));
+}
+
+static void
+destroyTables (struct userTables* built)
+{
+    destroyTable (&built->users);
+    destroyTable (&built->groups);
+    free (built->memberships);
+    built->memberships = NULL;
+}
+
+// Builds the tables from the built-in arrays.
+static void
+buildDefaultTables ()
+{
+    struct userTables built;
+    memset (&built, 0, sizeof (built));
+    for (int index = 0; index < NUM_USERS; ++index)
+    {
+        addName (&built.users, USERS[index].userName, USERS[index].userNumber);
+    }
     for (int index = 0; index < NUM_GROUPS; ++index)
     {
-        if (strcmp (GROUPS[index].groupName, groupName) == 0)
+        addName (&built.groups, GROUPS[index].groupName, GROUPS[index].groupNumber);
+    }
+    indexTable (&built.users);
+    indexTable (&built.groups);
+    createMemberships (&built);
+    for (int index = 0; index < NUM_MEMBERSHIPS; ++index)
+    {
+        addMembership (&built, findNumber (&built.users, MEMBERSHIPS[index].userNumber),
+                       findNumber (&built.groups, MEMBERSHIPS[index].groupNumber));
+    }
+    tables = built;
+}
+
+static void
+ensureTables ()
+{
+    pthread_once (&tablesBuilt, buildDefaultTables);
+}
+
+// Splits a line into colon-separated fields, in place.
+// Returns the number of fields found, at most maxFields (the last keeps any further colons).
+static int
+splitFields (char* line, char** fields, int maxFields)
+{
+    line[strcspn (line, "\r\n")] = '\0';
+    int count = 0;
+    fields[count++] = line;
+    for (char* next = line; *next != '\0' && count < maxFields; ++next)
+    {
+        if (*next == ':')
         {
-            return GROUPS[index].groupNumber;
+            *next = '\0';
+            fields[count++] = next + 1;
         }
     }
-    return -1;
+    return count;
 }
 
-const char*
-lookupUpGroupName (int groupNumber)
+// Parses a whole decimal number.
+// Returns the number, or -1 if text is not one.
+static long
+parseNumber (const char* text)
 {
-    for (int index = 0; index < NUM_GROUPS; ++index)
+    char* end;
+    long number = strtol (text, &end, 10);
+    return (end == text || *end != '\0' ? -1 : number);
+}
+
+// Returns 1 if a line of a passwd / group file holds nothing (is blank or a comment).
+static int
+isBlankLine (const char* line)
+{
+    return line[0] == '#' || line[strspn (line, " \t\r\n")] == '\0';
+}
+
+// Reads the users from a passwd-style file (name:password:number:group number:...).
+// Params:
+//   primaryGroups - Receives a malloc'd array giving each user's primary group number, or -1.
+// Returns:
+//   0 on success, or -1 after reporting the problem.
+static int
+readPasswdFile (FILE* file, const char* fileName, struct userTables* built, long** primaryGroups)
+{
+    char line[LINE_LENGTH];
+    uint32_t lineNumber = 0;
+    uint32_t capacity = 0;
+    while (fgets (line, LINE_LENGTH, file) != NULL)
     {
-        if (GROUPS[index].groupNumber == groupNumber)
+        ++lineNumber;
+        if (isBlankLine (line))
         {
-            return GROUPS[index].groupName;
+            continue;
         }
+        char* fields[5];
+        int fieldCount = splitFields (line, fields, 5);
+        long userNumber = (fieldCount >= 3 ? parseNumber (fields[2]) : -1);
+        if (userNumber < 0 || addName (&built->users, fields[0], userNumber) < 0)
+        {
+            fprintf (stderr, "%s:%u: not a valid user\n", fileName, lineNumber);
+            return -1;
+        }
+        growArray ((void**)primaryGroups, &capacity, built->users.count, sizeof (long));
+        (*primaryGroups)[built->users.count - 1] = (fieldCount >= 4 ? parseNumber (fields[3]) : -1);
+    }
+    return 0;
+}
+
+// Reads the groups from a group-style file (name:password:number:member,member,...).
+// Params:
+//   memberLists - Receives a malloc'd array holding each group's (malloc'd) member list.
+// Returns:
+//   0 on success, or -1 after reporting the problem.
+static int
+readGroupFile (FILE* file, const char* fileName, struct userTables* built, char*** memberLists)
+{
+    char line[LINE_LENGTH];
+    uint32_t lineNumber = 0;
+    uint32_t capacity = 0;
+    while (fgets (line, LINE_LENGTH, file) != NULL)
+    {
+        ++lineNumber;
+        if (isBlankLine (line))
+        {
+            continue;
+        }
+        char* fields[4];
+        int fieldCount = splitFields (line, fields, 4);
+        long groupNumber = (fieldCount >= 3 ? parseNumber (fields[2]) : -1);
+        if (groupNumber < 0 || addName (&built->groups, fields[0], groupNumber) < 0)
+        {
+            fprintf (stderr, "%s:%u: not a valid group\n", fileName, lineNumber);
+            return -1;
+        }
+        growArray ((void**)memberLists, &capacity, built->groups.count, sizeof (char*));
+        (*memberLists)[built->groups.count - 1] = strdup (fieldCount >= 4 ? fields[3] : "");
     }
-    return NULL;
+    return 0;
 }
 
+
+//// Library functions /////////////////////////////////////////
+
+
 int
-isUserInGroup (int userNumber, int groupNumber)
+loadUserTables (const char* passwdFileName, const char* groupFileName)
 {
-    for (int index = 0; index < NUM_MEMBERSHIPS; ++index)
+    FILE* passwdFile = fopen (passwdFileName, "r");
+    FILE* groupFile = fopen (groupFileName, "r");
+    if (passwdFile == NULL || groupFile == NULL)
+    {
+        fprintf (stderr, "Could not open %s\n", passwdFile == NULL ? passwdFileName : groupFileName);
+        if (passwdFile != NULL) { fclose (passwdFile); }
+        if (groupFile != NULL) { fclose (groupFile); }
+        return -1;
+    }
+    struct userTables built;
+    memset (&built, 0, sizeof (built));
+    long* primaryGroups = NULL;
+    char** memberLists = NULL;
+    int result = readPasswdFile (passwdFile, passwdFileName, &built, &primaryGroups);
+    if (result == 0)
     {
-        if (MEMBERSHIPS[index].userNumber == userNumber && MEMBERSHIPS[index].groupNumber == groupNumber)
+        result = readGroupFile (groupFile, groupFileName, &built, &memberLists);
+    }
+    if (result == 0 && (indexTable (&built.users) < 0 || indexTable (&built.groups) < 0))
+    {
+        result = -1;
+    }
+    if (result == 0)
+    {
+        createMemberships (&built);
+        for (uint32_t row = 0; row < built.users.count; ++row)
+        {
+            int32_t column = findNumber (&built.groups, primaryGroups[row]);
+            if (column != NO_ENTRY)
+            {
+                addMembership (&built, row, column);
+            }
+        }
+        for (uint32_t column = 0; column < built.groups.count; ++column)
         {
-            return 1;
+            char* saved;
+            for (char* member = strtok_r (memberLists[column], ",", &saved); member != NULL;
+                 member = strtok_r (NULL, ",", &saved))
+            {
+                int32_t row = findNumber (&built.users, findName (&built.users, member));
+                if (row == NO_ENTRY)
+                {
+                    fprintf (stderr, "%s: group %s lists an unknown user %s\n", groupFileName,
+                             built.groups.names[column], member);
+                    result = -1;
+                    break;
+                }
+                addMembership (&built, row, column);
+            }
         }
     }
+
+    for (uint32_t column = 0; memberLists != NULL && column < built.groups.count; ++column)
+    {
+        free (memberLists[column]);
+    }
+    free (memberLists);
+    free (primaryGroups);
+    fclose (passwdFile);
+    fclose (groupFile);
+    if (result < 0)
+    {
+        destroyTables (&built);
+        return -1;
+    }
+    // Make sure the built-in tables are never built over these later.
+    ensureTables ();
+    destroyTables (&tables);
+    tables = built;
     return 0;
-}
\ No newline at end of file
+}
+
+int
+lookUpUserNumber (const char* userName)
+{
+    ensureTables ();
+    return findName (&tables.users, userName);
+}
+
+const char*
+lookUpUserName (int userNumber)
+{
+    ensureTables ();
+    int32_t position = findNumber (&tables.users, userNumber);
+    return (position == NO_ENTRY ? NULL : tables.users.names[position]);
+}
+
+int
+lookUpGroupNumber (const char* groupName)
+{
+    ensureTables ();
+    return findName (&tables.groups, groupName);
+}
+
+const char*
+lookupUpGroupName (int groupNumber)
+{
+    ensureTables ();
+    int32_t position = findNumber (&tables.groups, groupNumber);
+    return (position == NO_ENTRY ? NULL : tables.groups.names[position]);
+}
+
+int
+isUserInGroup (int userNumber, int groupNumber)
+{
+    ensureTables ();
+    int32_t row = findNumber (&tables.users, userNumber);
+    int32_t column = findNumber (&tables.groups, groupNumber);
+    if (row == NO_ENTRY || column == NO_ENTRY)
+    {
+        return 0;
+    }
+    return (tables.memberships[(size_t)row * tables.wordsPerRow + column / 64] >> (column % 64)) & 1;
+}
@@ -10,6 +10,19 @@
 
 #include <stdint.h>
 
+// Until loadUserTables is called, a small built-in set of users and groups is used.
+
+// Replaces the users and groups with those in two files.
+// Must not be called while another thread is looking anything up.
+// Blank lines and lines starting with # are ignored; every other line of passwdFileName is
+//   name:password:number[:group number[:...]], where the group (if any) is the user's
+//   primary group, and every line of groupFileName is name:password:number[:user,user,...].
+// Numbers run from 0 to 65535.
+// Returns 0 on success, or -1 (after printing the problem, and keeping the tables as they
+//   were) if either file cannot be read or holds a bad or duplicated line.
+int
+loadUserTables (const char* passwdFileName, const char* groupFileName);
+
 // Returns the user number of the user whose name matches userName,
 //   or -1 if there is no such user.
 int